@@ -224,6 +224,19 @@ int Context::write(unsigned char *buf, int size)
     return briteblox_write_data(d->briteblox, buf, size);
 }
 
+int Context::writev(const struct briteblox_iovec *iov, int iovcnt)
+{
+    return briteblox_write_datav(d->briteblox, iov, iovcnt);
+}
+
+int Context::writev(const std::vector<struct briteblox_iovec>& iov)
+{
+    if (iov.empty())
+        return 0;
+
+    return briteblox_write_datav(d->briteblox, &iov[0], iov.size());
+}
+
 int Context::set_write_chunk_size(unsigned int chunksize)
 {
     return briteblox_write_data_set_chunksize(d->briteblox, chunksize);
@@ -238,6 +251,16 @@ int Context::write_chunk_size()
     return chunk;
 }
 
+int Context::set_write_coalescing(bool enable, unsigned int deadline_us)
+{
+    return briteblox_write_data_set_coalescing(d->briteblox, enable ? 1 : 0, deadline_us);
+}
+
+int Context::flush_writes()
+{
+    return briteblox_flush(d->briteblox);
+}
+
 int Context::set_flow_control(int flowctrl)
 {
     return briteblox_setflowctrl(d->briteblox, flowctrl);
@@ -30,6 +30,7 @@ on this file might be covered by the GNU General Public License.
 #define __libbriteblox_hpp__
 
 #include <list>
+#include <vector>
 #include <string>
 #include <boost/shared_ptr.hpp>
 #include <briteblox.h>
@@ -101,10 +102,14 @@ public:
     /* I/O */
     int read(unsigned char *buf, int size);
     int write(unsigned char *buf, int size);
+    int writev(const struct briteblox_iovec *iov, int iovcnt);
+    int writev(const std::vector<struct briteblox_iovec>& iov);
     int set_read_chunk_size(unsigned int chunksize);
     int set_write_chunk_size(unsigned int chunksize);
     int read_chunk_size();
     int write_chunk_size();
+    int set_write_coalescing(bool enable, unsigned int deadline_us = 0);
+    int flush_writes();
 
     /* Async IO
     TODO: should wrap?
@@ -0,0 +1,161 @@
+/* strip_bench.c
+ *
+ * Microbenchmark for the removal of the two modem status bytes
+ * libbriteblox does on every bulk IN transfer.
+ *
+ * Compares the single pass kernel used by briteblox_read_data() with
+ * the previous implementation (memmove every packet in place, then
+ * memcpy the result to the caller) for 64 and 512 byte packets.
+ *
+ * options:
+ *  -c <chunksize> size of one simulated USB transfer, default 4096
+ *  -n <iterations> number of transfers per run, default 200000
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <briteblox.h>
+
+extern int strip_status_UT_export(unsigned char *dst, const unsigned char *src,
+                                  int length, int packet_size, int skip, int max);
+
+static double get_prec_time()
+{
+    struct timeval tv;
+    double res;
+
+    gettimeofday(&tv,NULL);
+
+    res=tv.tv_sec;
+    res+=((double)tv.tv_usec/1000000);
+
+    return res;
+}
+
+/* The memmove loop briteblox_read_data() used before the strip kernel */
+static int strip_memmove(unsigned char *readbuffer, unsigned char *buf,
+                         int actual_length, int packet_size)
+{
+    int num_of_chunks = actual_length / packet_size;
+    int chunk_remains = actual_length % packet_size;
+    int readbuffer_offset = 2;
+    int i;
+
+    actual_length -= 2;
+
+    if (actual_length > packet_size - 2)
+    {
+        for (i = 1; i < num_of_chunks; i++)
+            memmove (readbuffer+readbuffer_offset+(packet_size - 2)*i,
+                     readbuffer+readbuffer_offset+packet_size*i,
+                     packet_size - 2);
+        if (chunk_remains > 2)
+        {
+            memmove (readbuffer+readbuffer_offset+(packet_size - 2)*i,
+                     readbuffer+readbuffer_offset+packet_size*i,
+                     chunk_remains-2);
+            actual_length -= 2*num_of_chunks;
+        }
+        else
+            actual_length -= 2*(num_of_chunks-1)+chunk_remains;
+    }
+
+    memcpy (buf, readbuffer+readbuffer_offset, actual_length);
+    return actual_length;
+}
+
+/* Number of transfer buffers cycled through, like the USB stack would */
+#define NUM_BUFFERS 64
+
+int main(int argc, char **argv)
+{
+    const int packet_sizes[] = { 64, 512 };
+    unsigned char *raw, *out, *ref;
+    int chunksize = 4096;
+    long iterations = 200000;
+    int t, i, p;
+
+    while ((t = getopt (argc, argv, "c:n:")) != -1)
+    {
+        switch (t)
+        {
+            case 'c':
+                chunksize = atoi (optarg);
+                break;
+            case 'n':
+                iterations = atol (optarg);
+                break;
+            default:
+                fprintf (stderr, "Usage: %s [-c chunksize] [-n iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    raw = malloc(chunksize * NUM_BUFFERS);
+    out = malloc(chunksize);
+    ref = malloc(chunksize);
+    if (raw == NULL || out == NULL || ref == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("chunksize %d, %ld transfers per run\n", chunksize, iterations);
+
+    for (p = 0; p < 2; p++)
+    {
+        int packet_size = packet_sizes[p];
+        double start, memmove_time, kernel_time;
+        long n;
+        int len1, len2;
+
+        for (i = 0; i < chunksize * NUM_BUFFERS; i++)
+            raw[i] = i;
+
+        /* Check both produce the same payload before timing them */
+        len2 = strip_status_UT_export(out, raw, chunksize, packet_size, 0, INT_MAX);
+        len1 = strip_memmove(raw, ref, chunksize, packet_size);
+        if (len1 != len2 || memcmp(out, ref, len1) != 0)
+        {
+            fprintf(stderr, "Result mismatch for packet size %d\n", packet_size);
+            return EXIT_FAILURE;
+        }
+
+        /* The memmove loop compacts in place. The data gets scrambled
+           by that, but the amount of bytes moved stays the same. */
+        start = get_prec_time();
+        for (n = 0; n < iterations; n++)
+            strip_memmove(raw + (n % NUM_BUFFERS) * chunksize, out, chunksize, packet_size);
+        memmove_time = get_prec_time() - start;
+
+        start = get_prec_time();
+        for (n = 0; n < iterations; n++)
+            strip_status_UT_export(out, raw + (n % NUM_BUFFERS) * chunksize, chunksize, packet_size, 0, INT_MAX);
+        kernel_time = get_prec_time() - start;
+
+        printf("packet size %3d: memmove loop %8.1f MB/s, strip kernel %8.1f MB/s (%.2fx)\n",
+               packet_size,
+               (double)chunksize * iterations / memmove_time / 1e6,
+               (double)chunksize * iterations / kernel_time / 1e6,
+               memmove_time / kernel_time);
+    }
+
+    free(raw);
+    free(out);
+    free(ref);
+    return EXIT_SUCCESS;
+}
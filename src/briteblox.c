@@ -33,25 +33,26 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "briteblox_i.h"
 #include "briteblox.h"
 #include "briteblox_version_i.h"
 
-#define briteblox_error_return(code, str) do {  \
-        if ( briteblox )                        \
-            briteblox->error_str = str;         \
-        else                               \
-            fprintf(stderr, str);          \
-        return code;                       \
-   } while(0);
-
 #define briteblox_error_return_free_device_list(code, str, devs) do {    \
         libusb_free_device_list(devs,1);   \
         briteblox->error_str = str;             \
         return code;                       \
    } while(0);
 
+static void briteblox_readahead_free(struct briteblox_context *briteblox);
+static void briteblox_read_pool_free(struct briteblox_context *briteblox);
+static void briteblox_transfer_pool_free(struct briteblox_context *briteblox);
+static int briteblox_write_coalesce_flush(struct briteblox_context *briteblox);
+static void briteblox_write_coalesce_free(struct briteblox_context *briteblox);
+static struct briteblox_transfer_control *briteblox_tc_get(struct briteblox_context *briteblox);
+static struct libusb_transfer *briteblox_tc_transfer(struct briteblox_transfer_control *tc);
+static void briteblox_tc_put(struct briteblox_transfer_control *tc, struct libusb_transfer *transfer);
 
 /**
     Internal function to close usb device pointer.
@@ -66,6 +67,8 @@ static void briteblox_usb_close_internal (struct briteblox_context *briteblox)
 {
     if (briteblox && briteblox->usb_dev)
     {
+        briteblox_readahead_free(briteblox);
+        briteblox_read_pool_free(briteblox);
         libusb_close (briteblox->usb_dev);
         briteblox->usb_dev = NULL;
         if(briteblox->eeprom)
@@ -74,21 +77,14 @@ static void briteblox_usb_close_internal (struct briteblox_context *briteblox)
 }
 
 /**
-    Initializes a briteblox_context.
-
-    \param briteblox pointer to briteblox_context
-
-    \retval  0: all fine
-    \retval -1: couldn't allocate read buffer
-    \retval -2: couldn't allocate struct  buffer
-    \retval -3: libusb_init() failed
-
-    \remark This should be called before all functions
+    Initializes a briteblox_context on its own or on a shared libusb context.
+    \internal
 */
-int briteblox_init(struct briteblox_context *briteblox)
+static int briteblox_init_internal(struct briteblox_context *briteblox, struct briteblox_library *library)
 {
     struct briteblox_eeprom* eeprom = (struct briteblox_eeprom *)malloc(sizeof(struct briteblox_eeprom));
     briteblox->usb_ctx = NULL;
+    briteblox->library = NULL;
     briteblox->usb_dev = NULL;
     briteblox->usb_read_timeout = 5000;
     briteblox->usb_write_timeout = 5000;
@@ -98,14 +94,29 @@ int briteblox_init(struct briteblox_context *briteblox)
     briteblox->bitbang_enabled = 0;  /* 0: normal mode 1: any of the bitbang modes enabled */
 
     briteblox->readbuffer = NULL;
-    briteblox->readbuffer_offset = 0;
-    briteblox->readbuffer_remaining = 0;
+    briteblox->readring = NULL;
     briteblox->writebuffer_chunksize = 4096;
     briteblox->max_packet_size = 0;
     briteblox->error_str = NULL;
     briteblox->module_detach_mode = AUTO_DETACH_SIO_MODULE;
-
-    if (libusb_init(&briteblox->usb_ctx) < 0)
+    briteblox->open_flags = 0;
+    memset(&briteblox->open_snapshot, 0, sizeof(briteblox->open_snapshot));
+    memset(&briteblox->config, 0, sizeof(briteblox->config));
+    briteblox->shadow_force = 0;
+    briteblox->shadow_checked = 0;
+    briteblox->shadow_skipped = 0;
+    briteblox->readahead = NULL;
+    briteblox->readpool = NULL;
+    briteblox->reads_in_flight = 0;
+    briteblox->transferpool = NULL;
+    briteblox->writecoalesce = NULL;
+
+    if (library != NULL)
+    {
+        briteblox->library = briteblox_library_ref(library);
+        briteblox->usb_ctx = library->usb_ctx;
+    }
+    else if (libusb_init(&briteblox->usb_ctx) < 0)
         briteblox_error_return(-3, "libusb_init() failed");
 
     briteblox_set_interface(briteblox, INTERFACE_ANY);
@@ -116,10 +127,52 @@ int briteblox_init(struct briteblox_context *briteblox)
     memset(eeprom, 0, sizeof(struct briteblox_eeprom));
     briteblox->eeprom = eeprom;
 
+    if (briteblox_transfer_pool_set_size(briteblox, BRITEBLOX_TRANSFER_POOL_SIZE) < 0)
+        briteblox_error_return(-2, "Can't malloc transfer pool");
+
     /* All fine. Now allocate the readbuffer */
     return briteblox_read_data_set_chunksize(briteblox, 4096);
 }
 
+/**
+    Initializes a briteblox_context.
+
+    \param briteblox pointer to briteblox_context
+
+    \retval  0: all fine
+    \retval -1: couldn't allocate read buffer
+    \retval -2: couldn't allocate struct  buffer
+    \retval -3: libusb_init() failed
+
+    \remark This should be called before all functions
+*/
+int briteblox_init(struct briteblox_context *briteblox)
+{
+    return briteblox_init_internal(briteblox, NULL);
+}
+
+/**
+    Initializes a briteblox_context on the libusb context of a shared
+    library context instead of a libusb context of its own. The
+    briteblox_context holds a reference to the library until
+    briteblox_deinit().
+
+    \param briteblox pointer to briteblox_context
+    \param library shared library context, see briteblox_library_new()
+
+    \retval  0: all fine
+    \retval -1: couldn't allocate read buffer
+    \retval -2: couldn't allocate struct  buffer
+    \retval -3: no library context given
+*/
+int briteblox_init_shared(struct briteblox_context *briteblox, struct briteblox_library *library)
+{
+    if (library == NULL)
+        briteblox_error_return(-3, "no library context given");
+
+    return briteblox_init_internal(briteblox, library);
+}
+
 /**
     Allocate and initialize a new briteblox_context
 
@@ -143,6 +196,38 @@ struct briteblox_context *briteblox_new(void)
     return briteblox;
 }
 
+/**
+    Allocate and initialize a new briteblox_context on a shared library
+    context, see briteblox_init_shared()
+
+    \param library shared library context
+
+    \return a pointer to a new briteblox_context, or NULL on failure
+*/
+struct briteblox_context *briteblox_new_shared(struct briteblox_library *library)
+{
+    struct briteblox_context * briteblox;
+
+    if (library == NULL)
+        return NULL;
+
+    // zeroed, so briteblox_deinit() can drop the library reference on failure
+    briteblox = (struct briteblox_context *)calloc(1, sizeof(struct briteblox_context));
+    if (briteblox == NULL)
+    {
+        return NULL;
+    }
+
+    if (briteblox_init_shared(briteblox, library) != 0)
+    {
+        briteblox_deinit(briteblox);
+        free(briteblox);
+        return NULL;
+    }
+
+    return briteblox;
+}
+
 /**
     Open selected channels on a chip, otherwise use first channel.
 
@@ -220,6 +305,16 @@ void briteblox_deinit(struct briteblox_context *briteblox)
         briteblox->readbuffer = NULL;
     }
 
+    briteblox_transfer_pool_free(briteblox);
+    briteblox_write_coalesce_free(briteblox);
+
+    if (briteblox->readring != NULL)
+    {
+        briteblox_ring_free(briteblox->readring);
+        free(briteblox->readring);
+        briteblox->readring = NULL;
+    }
+
     if (briteblox->eeprom != NULL)
     {
         if (briteblox->eeprom->manufacturer != 0)
@@ -241,7 +336,13 @@ void briteblox_deinit(struct briteblox_context *briteblox)
         briteblox->eeprom = NULL;
     }
 
-    if (briteblox->usb_ctx)
+    if (briteblox->library)
+    {
+        briteblox_library_unref(briteblox->library);
+        briteblox->library = NULL;
+        briteblox->usb_ctx = NULL;
+    }
+    else if (briteblox->usb_ctx)
     {
         libusb_exit(briteblox->usb_ctx);
         briteblox->usb_ctx = NULL;
@@ -271,6 +372,7 @@ void briteblox_set_usbdev (struct briteblox_context *briteblox, libusb_device_ha
         return;
 
     briteblox->usb_dev = usb;
+    briteblox_shadow_invalidate(briteblox);
 }
 
 /**
@@ -291,6 +393,42 @@ struct briteblox_version_info briteblox_get_library_version(void)
     return ver;
 }
 
+/**
+    Builds a device list from the registry of the library context.
+    \internal
+
+    \retval >=0: number of devices found
+    \retval  -1: the registry can't answer the query
+    \retval  -3: out of memory
+*/
+static int briteblox_usb_find_all_registry(struct briteblox_context *briteblox, struct briteblox_device_list **devlist,
+                                           int vendor, int product)
+{
+    struct briteblox_device_list **curdev = devlist;
+    libusb_device *dev;
+    int count = 0;
+    int ret;
+
+    *devlist = NULL;
+    while ((ret = briteblox_registry_lookup(briteblox->library, vendor, product, NULL, NULL,
+                                            -1, 0, count, &dev)) == 1)
+    {
+        *curdev = (struct briteblox_device_list*)malloc(sizeof(struct briteblox_device_list));
+        if (!*curdev)
+        {
+            libusb_unref_device(dev);
+            briteblox_list_free(devlist);
+            return -3;
+        }
+
+        (*curdev)->next = NULL;
+        (*curdev)->dev = dev;
+        curdev = &(*curdev)->next;
+        count++;
+    }
+    return ret < 0 ? -1 : count;
+}
+
 /**
     Finds all briteblox devices with given VID:PID on the usb bus. Creates a new
     briteblox_device_list which needs to be deallocated by briteblox_list_free() after
@@ -315,6 +453,18 @@ int briteblox_usb_find_all(struct briteblox_context *briteblox, struct briteblox
     int count = 0;
     int i = 0;
 
+    // the registry of a shared library context answers without a bus scan
+    if (briteblox->library && (vendor != 0) == (product != 0))
+    {
+        count = briteblox_usb_find_all_registry(briteblox, devlist,
+                                                vendor ? vendor : 0x403, product ? product : 0x7AD0);
+        if (count == -3)
+            briteblox_error_return(-3, "out of memory");
+        if (count >= 0)
+            return count;
+        count = 0;
+    }
+
     if (libusb_get_device_list(briteblox->usb_ctx, &devs) < 0)
         briteblox_error_return(-5, "libusb_get_device_list() failed");
 
@@ -408,48 +558,88 @@ int briteblox_usb_get_strings(struct briteblox_context * briteblox, struct libus
                          char * manufacturer, int mnf_len, char * description, int desc_len, char * serial, int serial_len)
 {
     struct libusb_device_descriptor desc;
+    int mask = 0, complete = 0;
+    int ret;
 
     if ((briteblox==NULL) || (dev==NULL))
         return -1;
 
-    if (libusb_open(dev, &briteblox->usb_dev) < 0)
-        briteblox_error_return(-4, "libusb_open() failed");
-
     if (libusb_get_device_descriptor(dev, &desc) < 0)
         briteblox_error_return(-11, "libusb_get_device_descriptor() failed");
 
+    if (manufacturer != NULL)
+        mask |= BRITEBLOX_STRING_MANUFACTURER;
+    if (description != NULL)
+        mask |= BRITEBLOX_STRING_DESCRIPTION;
+    if (serial != NULL)
+        mask |= BRITEBLOX_STRING_SERIAL;
+
+    if (briteblox_string_cache_lookup(briteblox->library, dev, desc.idVendor, desc.idProduct, mask,
+                                      manufacturer, mnf_len, description, desc_len, serial, serial_len) == 1)
+        return 0;
+
+    if (libusb_open(dev, &briteblox->usb_dev) < 0)
+        briteblox_error_return(-4, "libusb_open() failed");
+
+    // a string filling the whole buffer may be cut short, don't cache it
     if (manufacturer != NULL)
     {
-        if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iManufacturer, (unsigned char *)manufacturer, mnf_len) < 0)
+        ret = libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iManufacturer, (unsigned char *)manufacturer, mnf_len);
+        if (ret < 0)
         {
             briteblox_usb_close_internal (briteblox);
             briteblox_error_return(-7, "libusb_get_string_descriptor_ascii() failed");
         }
+        if (ret < mnf_len - 1)
+            complete |= BRITEBLOX_STRING_MANUFACTURER;
     }
 
     if (description != NULL)
     {
-        if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iProduct, (unsigned char *)description, desc_len) < 0)
+        ret = libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iProduct, (unsigned char *)description, desc_len);
+        if (ret < 0)
         {
             briteblox_usb_close_internal (briteblox);
             briteblox_error_return(-8, "libusb_get_string_descriptor_ascii() failed");
         }
+        if (ret < desc_len - 1)
+            complete |= BRITEBLOX_STRING_DESCRIPTION;
     }
 
     if (serial != NULL)
     {
-        if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iSerialNumber, (unsigned char *)serial, serial_len) < 0)
+        ret = libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iSerialNumber, (unsigned char *)serial, serial_len);
+        if (ret < 0)
         {
             briteblox_usb_close_internal (briteblox);
             briteblox_error_return(-9, "libusb_get_string_descriptor_ascii() failed");
         }
+        if (ret < serial_len - 1)
+            complete |= BRITEBLOX_STRING_SERIAL;
     }
 
     briteblox_usb_close_internal (briteblox);
 
+    briteblox_string_cache_store(briteblox->library, dev, desc.idVendor, desc.idProduct, complete,
+                                 manufacturer, description, serial);
     return 0;
 }
 
+/**
+ * Internal function to guess the maximum packet size from the chip type alone.
+ * \param briteblox pointer to briteblox_context
+ * \retval Default packet size for this chip type
+ */
+static unsigned int _briteblox_default_max_packet_size(struct briteblox_context *briteblox)
+{
+    // New hi-speed devices from BRITEBLOX use a packet size of 512 bytes
+    // but could be connected to a normal speed USB hub -> 64 bytes packet size.
+    if (briteblox->type == TYPE_2232H || briteblox->type == TYPE_4232H || briteblox->type == TYPE_232H || briteblox->type == TYPE_230X)
+        return 512;
+    else
+        return 64;
+}
+
 /**
  * Internal function to determine the maximum packet size.
  * \param briteblox pointer to briteblox_context
@@ -467,12 +657,7 @@ static unsigned int _briteblox_determine_max_packet_size(struct briteblox_contex
         return 64;
 
     // Determine maximum packet size. Init with default value.
-    // New hi-speed devices from BRITEBLOX use a packet size of 512 bytes
-    // but could be connected to a normal speed USB hub -> 64 bytes packet size.
-    if (briteblox->type == TYPE_2232H || briteblox->type == TYPE_4232H || briteblox->type == TYPE_232H || briteblox->type == TYPE_230X)
-        packet_size = 512;
-    else
-        packet_size = 64;
+    packet_size = _briteblox_default_max_packet_size(briteblox);
 
     if (libusb_get_device_descriptor(dev, &desc) < 0)
         return packet_size;
@@ -500,6 +685,86 @@ static unsigned int _briteblox_determine_max_packet_size(struct briteblox_contex
     return packet_size;
 }
 
+/**
+    \internal
+    Writes the settings marked valid in a snapshot back to the chip.
+    Baudrate and line property are sent as the raw register values,
+    everything else goes through the regular setters.
+
+    \param briteblox pointer to briteblox_context with an open device
+    \param snapshot settings to apply
+
+    \retval  0: all fine
+    \retval -1: a control transfer failed
+*/
+static int briteblox_config_restore(struct briteblox_context *briteblox,
+                                    const struct briteblox_config_snapshot *snapshot)
+{
+    unsigned valid = snapshot->valid;
+
+    if (valid & BRITEBLOX_CONFIG_BAUDRATE)
+    {
+        if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
+                                    SIO_SET_BAUDRATE_REQUEST, snapshot->baud_value,
+                                    snapshot->baud_index, NULL, 0, briteblox->usb_write_timeout) < 0)
+            briteblox_error_return(-1, "restoring baudrate failed");
+        briteblox->baudrate = snapshot->baudrate;
+        briteblox->config.baudrate = snapshot->baudrate;
+        briteblox->config.baud_value = snapshot->baud_value;
+        briteblox->config.baud_index = snapshot->baud_index;
+        briteblox->config.valid |= BRITEBLOX_CONFIG_BAUDRATE;
+    }
+
+    if (valid & BRITEBLOX_CONFIG_LINE_PROPERTY)
+    {
+        if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
+                                    SIO_SET_DATA_REQUEST, snapshot->line_property,
+                                    briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
+            briteblox_error_return(-1, "restoring line property failed");
+        briteblox->config.line_property = snapshot->line_property;
+        briteblox->config.valid |= BRITEBLOX_CONFIG_LINE_PROPERTY;
+    }
+
+    if ((valid & BRITEBLOX_CONFIG_FLOWCTRL) && briteblox_setflowctrl(briteblox, snapshot->flowctrl) < 0)
+        return -1;
+
+    if ((valid & BRITEBLOX_CONFIG_DTR) && (valid & BRITEBLOX_CONFIG_RTS))
+    {
+        if (briteblox_setdtr_rts(briteblox, snapshot->dtr, snapshot->rts) < 0)
+            return -1;
+    }
+    else if ((valid & BRITEBLOX_CONFIG_DTR) && briteblox_setdtr(briteblox, snapshot->dtr) < 0)
+        return -1;
+    else if ((valid & BRITEBLOX_CONFIG_RTS) && briteblox_setrts(briteblox, snapshot->rts) < 0)
+        return -1;
+
+    if ((valid & BRITEBLOX_CONFIG_LATENCY) && briteblox_set_latency_timer(briteblox, snapshot->latency) < 0)
+        return -1;
+
+    if ((valid & BRITEBLOX_CONFIG_EVENT_CHAR)
+            && briteblox_set_event_char(briteblox, snapshot->event_char & 0xff, (snapshot->event_char >> 8) & 1) < 0)
+        return -1;
+
+    if ((valid & BRITEBLOX_CONFIG_ERROR_CHAR)
+            && briteblox_set_error_char(briteblox, snapshot->error_char & 0xff, (snapshot->error_char >> 8) & 1) < 0)
+        return -1;
+
+    if ((valid & BRITEBLOX_CONFIG_BITMODE) && briteblox_set_bitmode(briteblox, snapshot->bitmask, snapshot->bitmode) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Wrapper function to export briteblox_config_restore() to the unit test
+ * Do not use, it's only for the unit test framework
+ **/
+int config_restore_UT_export(struct briteblox_context *briteblox,
+                             const struct briteblox_config_snapshot *snapshot)
+{
+    return briteblox_config_restore(briteblox, snapshot);
+}
+
 /**
     Opens a briteblox device given by an usb_device.
 
@@ -517,16 +782,24 @@ static unsigned int _briteblox_determine_max_packet_size(struct briteblox_contex
     \retval -10: libusb_get_config_descriptor() failed
     \retval -11: libusb_detach_kernel_driver() failed
     \retval -12: libusb_get_configuration() failed
+    \retval -13: restoring the snapshot set with briteblox_set_open_flags() failed
+
+    \remark The steps taken after claiming the interface can be tuned
+             with briteblox_set_open_flags().
 */
 int briteblox_usb_open_dev(struct briteblox_context *briteblox, libusb_device *dev)
 {
     struct libusb_device_descriptor desc;
     struct libusb_config_descriptor *config0;
     int cfg, cfg0, detach_errno = 0;
+    int flags;
 
     if (briteblox == NULL)
         briteblox_error_return(-8, "briteblox context invalid");
 
+    flags = briteblox->open_flags;
+    memset(&briteblox->config, 0, sizeof(briteblox->config));
+
     if (libusb_open(dev, &briteblox->usb_dev) < 0)
         briteblox_error_return(-4, "libusb_open() failed");
 
@@ -584,7 +857,7 @@ int briteblox_usb_open_dev(struct briteblox_context *briteblox, libusb_device *d
         }
     }
 
-    if (briteblox_usb_reset (briteblox) != 0)
+    if (!(flags & BRITEBLOX_OPEN_NO_RESET) && briteblox_usb_reset (briteblox) != 0)
     {
         briteblox_usb_close_internal (briteblox);
         briteblox_error_return(-6, "briteblox_usb_reset failed");
@@ -610,138 +883,324 @@ int briteblox_usb_open_dev(struct briteblox_context *briteblox, libusb_device *d
     else if (desc.bcdDevice == 0x1000)
         briteblox->type = TYPE_230X;
 
+    if ((flags & BRITEBLOX_OPEN_RESTORE) && briteblox->open_snapshot.type != briteblox->type)
+    {
+        briteblox_usb_close_internal (briteblox);
+        briteblox_error_return(-13, "snapshot was taken from a different chip type");
+    }
+
     // Determine maximum packet size
-    briteblox->max_packet_size = _briteblox_determine_max_packet_size(briteblox, dev);
+    if (!(flags & BRITEBLOX_OPEN_NO_PACKET_PROBE))
+        briteblox->max_packet_size = _briteblox_determine_max_packet_size(briteblox, dev);
+    else if (briteblox->open_snapshot.max_packet_size > 0)
+        briteblox->max_packet_size = briteblox->open_snapshot.max_packet_size;
+    else
+        briteblox->max_packet_size = _briteblox_default_max_packet_size(briteblox);
 
-    if (briteblox_set_baudrate (briteblox, 9600) != 0)
+    briteblox->config.type = briteblox->type;
+    briteblox->config.max_packet_size = briteblox->max_packet_size;
+
+    // A restored baudrate makes the default one redundant
+    if (!(flags & BRITEBLOX_OPEN_NO_BAUDRATE)
+            && !((flags & BRITEBLOX_OPEN_RESTORE) && (briteblox->open_snapshot.valid & BRITEBLOX_CONFIG_BAUDRATE))
+            && briteblox_set_baudrate (briteblox, 9600) != 0)
     {
         briteblox_usb_close_internal (briteblox);
         briteblox_error_return(-7, "set baudrate failed");
     }
 
+    if ((flags & BRITEBLOX_OPEN_RESTORE) && briteblox_config_restore(briteblox, &briteblox->open_snapshot) != 0)
+    {
+        briteblox_usb_close_internal (briteblox);
+        briteblox_error_return(-13, "restoring configuration snapshot failed");
+    }
+
     briteblox_error_return(0, "all fine");
 }
 
 /**
-    Opens the first device with a given vendor and product ids.
+    Chooses which setup steps the open functions perform after claiming
+    the interface. Applies to every later open on this context.
+
+    Skipping the reset, the default baudrate and the packet size probe
+    saves round trips when re-opening a device whose state is known,
+    e.g. in a short-lived tool started many times in a row.
 
     \param briteblox pointer to briteblox_context
-    \param vendor Vendor ID
-    \param product Product ID
+    \param flags bitwise OR of enum briteblox_open_flags, 0 restores the default behaviour
+    \param snapshot settings from briteblox_get_config_snapshot() to
+           write back with BRITEBLOX_OPEN_RESTORE, also supplies the packet
+           size for BRITEBLOX_OPEN_NO_PACKET_PROBE. May be NULL.
 
-    \retval same as briteblox_usb_open_desc()
+    \retval  0: all fine
+    \retval -1: briteblox context invalid or BRITEBLOX_OPEN_RESTORE without a snapshot
 */
-int briteblox_usb_open(struct briteblox_context *briteblox, int vendor, int product)
+int briteblox_set_open_flags(struct briteblox_context *briteblox, int flags,
+                             const struct briteblox_config_snapshot *snapshot)
 {
-    return briteblox_usb_open_desc(briteblox, vendor, product, NULL, NULL);
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    if ((flags & BRITEBLOX_OPEN_RESTORE) && snapshot == NULL)
+        briteblox_error_return(-1, "BRITEBLOX_OPEN_RESTORE needs a snapshot");
+
+    briteblox->open_flags = flags;
+    if (snapshot != NULL)
+        briteblox->open_snapshot = *snapshot;
+    else
+        memset(&briteblox->open_snapshot, 0, sizeof(briteblox->open_snapshot));
+
+    return 0;
 }
 
 /**
-    Opens the first device with a given, vendor id, product id,
-    description and serial.
+    Returns the chip settings made through this context since the device
+    was opened. Only fields whose bit is set in snapshot->valid hold a value.
+    The result can be handed to briteblox_set_open_flags() to restore them
+    on the next open.
 
     \param briteblox pointer to briteblox_context
-    \param vendor Vendor ID
-    \param product Product ID
-    \param description Description to search for. Use NULL if not needed.
-    \param serial Serial to search for. Use NULL if not needed.
+    \param snapshot receives the settings
 
     \retval  0: all fine
-    \retval -3: usb device not found
-    \retval -4: unable to open device
-    \retval -5: unable to claim device
-    \retval -6: reset failed
-    \retval -7: set baudrate failed
-    \retval -8: get product description failed
-    \retval -9: get serial number failed
-    \retval -12: libusb_get_device_list() failed
-    \retval -13: libusb_get_device_descriptor() failed
+    \retval -1: invalid argument
 */
-int briteblox_usb_open_desc(struct briteblox_context *briteblox, int vendor, int product,
-                       const char* description, const char* serial)
+int briteblox_get_config_snapshot(struct briteblox_context *briteblox,
+                                  struct briteblox_config_snapshot *snapshot)
 {
-    return briteblox_usb_open_desc_index(briteblox,vendor,product,description,serial,0);
+    if (briteblox == NULL || snapshot == NULL)
+        briteblox_error_return(-1, "invalid argument");
+
+    *snapshot = briteblox->config;
+    return 0;
 }
 
 /**
-    Opens the index-th device with a given, vendor id, product id,
-    description and serial.
+    \internal
+    Decides whether a setter can skip its control transfer because the
+    chip already holds the value. The settings programmed since open in
+    briteblox->config double as the shadow of the chip registers.
 
     \param briteblox pointer to briteblox_context
-    \param vendor Vendor ID
-    \param product Product ID
-    \param description Description to search for. Use NULL if not needed.
-    \param serial Serial to search for. Use NULL if not needed.
-    \param index Number of matching device to open if there are more than one, starts with 0.
+    \param fields BRITEBLOX_CONFIG_* bits the transfer would write
+    \param same non-zero if the new value equals the recorded one
 
-    \retval  0: all fine
-    \retval -1: usb_find_busses() failed
-    \retval -2: usb_find_devices() failed
-    \retval -3: usb device not found
-    \retval -4: unable to open device
-    \retval -5: unable to claim device
-    \retval -6: reset failed
-    \retval -7: set baudrate failed
-    \retval -8: get product description failed
-    \retval -9: get serial number failed
-    \retval -10: unable to close device
-    \retval -11: briteblox context invalid
+    \retval 1: value unchanged, skip the transfer
+    \retval 0: transfer needed
 */
-int briteblox_usb_open_desc_index(struct briteblox_context *briteblox, int vendor, int product,
-                             const char* description, const char* serial, unsigned int index)
+static int briteblox_shadow_unchanged(struct briteblox_context *briteblox, unsigned fields, int same)
 {
-    libusb_device *dev;
-    libusb_device **devs;
-    char string[256];
-    int i = 0;
+    briteblox->shadow_checked++;
+    if (briteblox->shadow_force || (briteblox->config.valid & fields) != fields || !same)
+        return 0;
 
-    if (briteblox == NULL)
-        briteblox_error_return(-11, "briteblox context invalid");
+    briteblox->shadow_skipped++;
+    return 1;
+}
 
-    if (libusb_get_device_list(briteblox->usb_ctx, &devs) < 0)
-        briteblox_error_return(-12, "libusb_get_device_list() failed");
+/**
+    Makes the setters write to the chip even if the value did not change.
 
-    while ((dev = devs[i++]) != NULL)
-    {
-        struct libusb_device_descriptor desc;
-        int res;
+    By default briteblox_set_baudrate(), briteblox_set_line_property2(),
+    briteblox_setflowctrl(), the DTR/RTS functions, briteblox_set_latency_timer(),
+    briteblox_set_event_char(), briteblox_set_error_char() and
+    briteblox_set_bitmode() return right away when asked to program the
+    value they programmed last.
 
-        if (libusb_get_device_descriptor(dev, &desc) < 0)
-            briteblox_error_return_free_device_list(-13, "libusb_get_device_descriptor() failed", devs);
+    \param briteblox pointer to briteblox_context
+    \param force 1 to always send the control transfer, 0 to skip unchanged values
 
-        if (desc.idVendor == vendor && desc.idProduct == product)
-        {
-            if (libusb_open(dev, &briteblox->usb_dev) < 0)
-                briteblox_error_return_free_device_list(-4, "usb_open() failed", devs);
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_shadow_set_force(struct briteblox_context *briteblox, int force)
+{
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
 
-            if (description != NULL)
-            {
-                if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iProduct, (unsigned char *)string, sizeof(string)) < 0)
-                {
-                    briteblox_usb_close_internal (briteblox);
-                    briteblox_error_return_free_device_list(-8, "unable to fetch product description", devs);
-                }
-                if (strncmp(string, description, sizeof(string)) != 0)
-                {
-                    briteblox_usb_close_internal (briteblox);
-                    continue;
-                }
-            }
-            if (serial != NULL)
+    briteblox->shadow_force = force ? 1 : 0;
+    return 0;
+}
+
+/**
+    Forgets the values last programmed, so the next call of each setter
+    goes to the chip. Use this when the chip state may have changed behind
+    the back of this context. briteblox_usb_reset() calls it as well.
+
+    \param briteblox pointer to briteblox_context
+*/
+void briteblox_shadow_invalidate(struct briteblox_context *briteblox)
+{
+    if (briteblox == NULL)
+        return;
+
+    briteblox->config.valid = 0;
+}
+
+/**
+    Returns how many setter calls were checked against the last programmed
+    values and how many of them skipped their control transfer.
+
+    \param briteblox pointer to briteblox_context
+    \param checked receives the number of setter calls, may be NULL
+    \param skipped receives the number of transfers saved, may be NULL
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_shadow_get_stats(struct briteblox_context *briteblox, unsigned int *checked, unsigned int *skipped)
+{
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    if (checked != NULL)
+        *checked = briteblox->shadow_checked;
+    if (skipped != NULL)
+        *skipped = briteblox->shadow_skipped;
+    return 0;
+}
+
+/**
+    Opens the first device with a given vendor and product ids.
+
+    \param briteblox pointer to briteblox_context
+    \param vendor Vendor ID
+    \param product Product ID
+
+    \retval same as briteblox_usb_open_desc()
+*/
+int briteblox_usb_open(struct briteblox_context *briteblox, int vendor, int product)
+{
+    return briteblox_usb_open_desc(briteblox, vendor, product, NULL, NULL);
+}
+
+/**
+    Opens the first device with a given, vendor id, product id,
+    description and serial.
+
+    \param briteblox pointer to briteblox_context
+    \param vendor Vendor ID
+    \param product Product ID
+    \param description Description to search for. Use NULL if not needed.
+    \param serial Serial to search for. Use NULL if not needed.
+
+    \retval  0: all fine
+    \retval -3: usb device not found
+    \retval -4: unable to open device
+    \retval -5: unable to claim device
+    \retval -6: reset failed
+    \retval -7: set baudrate failed
+    \retval -8: get product description failed
+    \retval -9: get serial number failed
+    \retval -12: libusb_get_device_list() failed
+    \retval -13: libusb_get_device_descriptor() failed
+*/
+int briteblox_usb_open_desc(struct briteblox_context *briteblox, int vendor, int product,
+                       const char* description, const char* serial)
+{
+    return briteblox_usb_open_desc_index(briteblox,vendor,product,description,serial,0);
+}
+
+/**
+    Opens the index-th device with a given, vendor id, product id,
+    description and serial.
+
+    \param briteblox pointer to briteblox_context
+    \param vendor Vendor ID
+    \param product Product ID
+    \param description Description to search for. Use NULL if not needed.
+    \param serial Serial to search for. Use NULL if not needed.
+    \param index Number of matching device to open if there are more than one, starts with 0.
+
+    \retval  0: all fine
+    \retval -1: usb_find_busses() failed
+    \retval -2: usb_find_devices() failed
+    \retval -3: usb device not found
+    \retval -4: unable to open device
+    \retval -5: unable to claim device
+    \retval -6: reset failed
+    \retval -7: set baudrate failed
+    \retval -8: get product description failed
+    \retval -9: get serial number failed
+    \retval -10: unable to close device
+    \retval -11: briteblox context invalid
+*/
+int briteblox_usb_open_desc_index(struct briteblox_context *briteblox, int vendor, int product,
+                             const char* description, const char* serial, unsigned int index)
+{
+    libusb_device *dev;
+    libusb_device **devs;
+    char string[256];
+    char serial_string[256];
+    int i = 0;
+
+    if (briteblox == NULL)
+        briteblox_error_return(-11, "briteblox context invalid");
+
+    // the registry of a shared library context has the strings cached
+    if (briteblox->library && vendor != 0 && product != 0)
+    {
+        int res = briteblox_registry_lookup(briteblox->library, vendor, product, description, serial,
+                                            -1, 0, index, &dev);
+        if (res == 0)
+            briteblox_error_return(-3, "device not found");
+        if (res == 1)
+        {
+            res = briteblox_usb_open_dev(briteblox, dev);
+            libusb_unref_device(dev);
+            return res;
+        }
+    }
+
+    if (libusb_get_device_list(briteblox->usb_ctx, &devs) < 0)
+        briteblox_error_return(-12, "libusb_get_device_list() failed");
+
+    while ((dev = devs[i++]) != NULL)
+    {
+        struct libusb_device_descriptor desc;
+        int res;
+
+        if (libusb_get_device_descriptor(dev, &desc) < 0)
+            briteblox_error_return_free_device_list(-13, "libusb_get_device_descriptor() failed", devs);
+
+        if (desc.idVendor == vendor && desc.idProduct == product)
+        {
+            int mask = (description != NULL ? BRITEBLOX_STRING_DESCRIPTION : 0) |
+                       (serial != NULL ? BRITEBLOX_STRING_SERIAL : 0);
+
+            if (briteblox_string_cache_lookup(briteblox->library, dev, vendor, product, mask,
+                                              NULL, 0, string, sizeof(string),
+                                              serial_string, sizeof(serial_string)) != 1)
             {
-                if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iSerialNumber, (unsigned char *)string, sizeof(string)) < 0)
+                if (libusb_open(dev, &briteblox->usb_dev) < 0)
+                    briteblox_error_return_free_device_list(-4, "usb_open() failed", devs);
+
+                if (description != NULL)
                 {
-                    briteblox_usb_close_internal (briteblox);
-                    briteblox_error_return_free_device_list(-9, "unable to fetch serial number", devs);
+                    if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iProduct, (unsigned char *)string, sizeof(string)) < 0)
+                    {
+                        briteblox_usb_close_internal (briteblox);
+                        briteblox_error_return_free_device_list(-8, "unable to fetch product description", devs);
+                    }
                 }
-                if (strncmp(string, serial, sizeof(string)) != 0)
+                if (serial != NULL)
                 {
-                    briteblox_usb_close_internal (briteblox);
-                    continue;
+                    if (libusb_get_string_descriptor_ascii(briteblox->usb_dev, desc.iSerialNumber, (unsigned char *)serial_string, sizeof(serial_string)) < 0)
+                    {
+                        briteblox_usb_close_internal (briteblox);
+                        briteblox_error_return_free_device_list(-9, "unable to fetch serial number", devs);
+                    }
                 }
+
+                briteblox_usb_close_internal (briteblox);
+                briteblox_string_cache_store(briteblox->library, dev, vendor, product, mask,
+                                             NULL, string, serial_string);
             }
 
-            briteblox_usb_close_internal (briteblox);
+            if (description != NULL && strncmp(string, description, sizeof(string)) != 0)
+                continue;
+            if (serial != NULL && strncmp(serial_string, serial, sizeof(serial_string)) != 0)
+                continue;
 
             if (index > 0)
             {
@@ -800,12 +1259,26 @@ int briteblox_usb_open_string(struct briteblox_context *briteblox, const char* d
         unsigned int bus_number, device_address;
         int i = 0;
 
-        if (libusb_get_device_list(briteblox->usb_ctx, &devs) < 0)
-            briteblox_error_return(-2, "libusb_get_device_list() failed");
-
         /* XXX: This doesn't handle symlinks/odd paths/etc... */
         if (sscanf (description + 2, "%u/%u", &bus_number, &device_address) != 2)
-            briteblox_error_return_free_device_list(-11, "illegal description format", devs);
+            briteblox_error_return(-11, "illegal description format");
+
+        if (briteblox->library)
+        {
+            int ret = briteblox_registry_lookup(briteblox->library, 0, 0, NULL, NULL,
+                                                bus_number, device_address, 0, &dev);
+            if (ret == 0)
+                briteblox_error_return(-3, "device not found");
+            if (ret == 1)
+            {
+                ret = briteblox_usb_open_dev(briteblox, dev);
+                libusb_unref_device(dev);
+                return ret;
+            }
+        }
+
+        if (libusb_get_device_list(briteblox->usb_ctx, &devs) < 0)
+            briteblox_error_return(-2, "libusb_get_device_list() failed");
 
         while ((dev = devs[i++]) != NULL)
         {
@@ -883,14 +1356,18 @@ int briteblox_usb_reset(struct briteblox_context *briteblox)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_RESET_SIO,
                                 briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1,"BRITEBLOX reset failed");
 
     // Invalidate data in the readbuffer
-    briteblox->readbuffer_offset = 0;
-    briteblox->readbuffer_remaining = 0;
+    briteblox_ring_discard(briteblox->readring);
+    // and the settings known to be programmed
+    briteblox_shadow_invalidate(briteblox);
 
     return 0;
 }
@@ -915,8 +1392,7 @@ int briteblox_usb_purge_rx_buffer(struct briteblox_context *briteblox)
         briteblox_error_return(-1, "BRITEBLOX purge of RX buffer failed");
 
     // Invalidate data in the readbuffer
-    briteblox->readbuffer_offset = 0;
-    briteblox->readbuffer_remaining = 0;
+    briteblox_ring_discard(briteblox->readring);
 
     return 0;
 }
@@ -935,6 +1411,10 @@ int briteblox_usb_purge_tx_buffer(struct briteblox_context *briteblox)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    // bytes still in the coalescing buffer never reached the chip
+    if (briteblox->writecoalesce != NULL)
+        briteblox->writecoalesce->fill = 0;
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
                                 SIO_RESET_REQUEST, SIO_RESET_PURGE_TX,
                                 briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
@@ -989,6 +1469,9 @@ int briteblox_usb_close(struct briteblox_context *briteblox)
     if (briteblox == NULL)
         briteblox_error_return(-3, "briteblox context invalid");
 
+    if (briteblox->usb_dev != NULL)
+        briteblox_write_coalesce_flush(briteblox);
+
     if (briteblox->usb_dev != NULL)
         if (libusb_release_interface(briteblox->usb_dev, briteblox->interface) < 0)
             rtn = -1;
@@ -1222,6 +1705,19 @@ int convert_baudrate_UT_export(int baudrate, struct briteblox_context *briteblox
     return briteblox_convert_baudrate(baudrate, briteblox, value, index);
 }
 
+/**
+    \internal
+    Remembers the divisor registers last written, for briteblox_get_config_snapshot().
+*/
+static void briteblox_config_record_baudrate(struct briteblox_context *briteblox,
+                                             unsigned short value, unsigned short index)
+{
+    briteblox->config.baudrate = briteblox->baudrate;
+    briteblox->config.baud_value = value;
+    briteblox->config.baud_index = index;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_BAUDRATE;
+}
+
 /**
     Sets the chip baud rate
 
@@ -1241,6 +1737,9 @@ int briteblox_set_baudrate(struct briteblox_context *briteblox, int baudrate)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-3, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-2, "flushing the write buffer failed");
+
     if (briteblox->bitbang_enabled)
     {
         baudrate = baudrate*4;
@@ -1257,15 +1756,68 @@ int briteblox_set_baudrate(struct briteblox_context *briteblox, int baudrate)
                 : (baudrate * 21 < actual_baudrate * 20)))
         briteblox_error_return (-1, "Unsupported baudrate. Note: bitbang baudrates are automatically multiplied by 4");
 
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_BAUDRATE,
+                                   briteblox->config.baud_value == value && briteblox->config.baud_index == index))
+    {
+        briteblox->baudrate = baudrate;
+        briteblox->config.baudrate = baudrate;
+        return 0;
+    }
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
                                 SIO_SET_BAUDRATE_REQUEST, value,
                                 index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return (-2, "Setting new baudrate failed");
 
     briteblox->baudrate = baudrate;
+    briteblox_config_record_baudrate(briteblox, value, index);
     return 0;
 }
 
+/**
+    Sets the rate at which the bitbang modes output samples.
+
+    In the bitbang modes the chip moves one byte to or from the pins at
+    16 times the baud rate its divisor is set to. This picks the divisor
+    for the nearest supported sample rate, unlike
+    briteblox_set_baudrate() it does not apply the factor 4 for old code.
+
+    \param briteblox pointer to briteblox_context
+    \param rate samples per second
+
+    \retval >0: actual samples per second
+    \retval -1: invalid rate
+    \retval -2: setting the rate failed
+    \retval -3: USB device unavailable
+*/
+int briteblox_set_bitbang_rate(struct briteblox_context *briteblox, int rate)
+{
+    unsigned short value, index;
+    int actual_baudrate;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-3, "USB device unavailable");
+
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-2, "flushing the write buffer failed");
+
+    if (rate < 16)
+        briteblox_error_return(-1, "Silly bitbang rate < 16.");
+
+    actual_baudrate = briteblox_convert_baudrate((rate + 8) / 16, briteblox, &value, &index);
+    if (actual_baudrate <= 0)
+        briteblox_error_return(-1, "Unsupported bitbang rate");
+
+    if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
+                                SIO_SET_BAUDRATE_REQUEST, value,
+                                index, NULL, 0, briteblox->usb_write_timeout) < 0)
+        briteblox_error_return(-2, "Setting new bitbang rate failed");
+
+    briteblox->baudrate = actual_baudrate;
+    briteblox_config_record_baudrate(briteblox, value, index);
+    return actual_baudrate * 16;
+}
+
 /**
     Set (RS232) line characteristics.
     The break type can only be set via briteblox_set_line_property2()
@@ -1307,6 +1859,9 @@ int briteblox_set_line_property2(struct briteblox_context *briteblox, enum brite
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
     switch (parity)
     {
         case NONE:
@@ -1349,33 +1904,29 @@ int briteblox_set_line_property2(struct briteblox_context *briteblox, enum brite
             break;
     }
 
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_LINE_PROPERTY,
+                                   briteblox->config.line_property == value))
+        return 0;
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
                                 SIO_SET_DATA_REQUEST, value,
                                 briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return (-1, "Setting new line property failed");
 
+    briteblox->config.line_property = value;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_LINE_PROPERTY;
     return 0;
 }
 
 /**
-    Writes data in chunks (see briteblox_write_data_set_chunksize()) to the chip
-
-    \param briteblox pointer to briteblox_context
-    \param buf Buffer with the data
-    \param size Size of the buffer
-
-    \retval -666: USB device unavailable
-    \retval <0: error code from usb_bulk_write()
-    \retval >0: number of bytes written
+    Writes data in chunks to the chip, bypassing the coalescing buffer.
+    \internal
 */
-int briteblox_write_data(struct briteblox_context *briteblox, const unsigned char *buf, int size)
+static int briteblox_write_data_raw(struct briteblox_context *briteblox, const unsigned char *buf, int size)
 {
     int offset = 0;
     int actual_length;
 
-    if (briteblox == NULL || briteblox->usb_dev == NULL)
-        briteblox_error_return(-666, "USB device unavailable");
-
     while (offset < size)
     {
         int write_size = briteblox->writebuffer_chunksize;
@@ -1392,95 +1943,401 @@ int briteblox_write_data(struct briteblox_context *briteblox, const unsigned cha
     return offset;
 }
 
-static void briteblox_read_data_cb(struct libusb_transfer *transfer)
+/**
+    Sends the content of the coalescing write buffer, if any.
+    The buffer is empty afterwards, even if the write failed.
+    \internal
+
+    \retval  0: all fine
+    \retval <0: error code from briteblox_write_data_raw()
+*/
+static int briteblox_write_coalesce_flush(struct briteblox_context *briteblox)
 {
-    struct briteblox_transfer_control *tc = (struct briteblox_transfer_control *) transfer->user_data;
-    struct briteblox_context *briteblox = tc->briteblox;
-    int packet_size, actual_length, num_of_chunks, chunk_remains, i, ret;
+    struct briteblox_write_coalesce *wc = briteblox->writecoalesce;
+    int ret;
 
-    packet_size = briteblox->max_packet_size;
+    if (wc == NULL || wc->fill == 0)
+        return 0;
 
-    actual_length = transfer->actual_length;
+    ret = briteblox_write_data_raw(briteblox, wc->data, wc->fill);
+    wc->fill = 0;
+    wc->flushes++;
+    return ret < 0 ? ret : 0;
+}
 
-    if (actual_length > 2)
-    {
-        // skip BRITEBLOX status bytes.
-        // Maybe stored in the future to enable modem use
-        num_of_chunks = actual_length / packet_size;
-        chunk_remains = actual_length % packet_size;
-        //printf("actual_length = %X, num_of_chunks = %X, chunk_remains = %X, readbuffer_offset = %X\n", actual_length, num_of_chunks, chunk_remains, briteblox->readbuffer_offset);
+/**
+    Checks whether the flush deadline of the coalescing buffer passed.
+    \internal
 
-        briteblox->readbuffer_offset += 2;
-        actual_length -= 2;
+    \param wc coalescing buffer
+    \param remaining if not NULL, receives the time left until the deadline
 
-        if (actual_length > packet_size - 2)
-        {
-            for (i = 1; i < num_of_chunks; i++)
-                memmove (briteblox->readbuffer+briteblox->readbuffer_offset+(packet_size - 2)*i,
-                         briteblox->readbuffer+briteblox->readbuffer_offset+packet_size*i,
-                         packet_size - 2);
-            if (chunk_remains > 2)
-            {
-                memmove (briteblox->readbuffer+briteblox->readbuffer_offset+(packet_size - 2)*i,
-                         briteblox->readbuffer+briteblox->readbuffer_offset+packet_size*i,
-                         chunk_remains-2);
-                actual_length -= 2*num_of_chunks;
-            }
-            else
-                actual_length -= 2*(num_of_chunks-1)+chunk_remains;
-        }
+    \retval 1: buffer holds data and the deadline passed
+    \retval 0: nothing due (yet)
+*/
+static int briteblox_write_coalesce_due(struct briteblox_write_coalesce *wc, struct timeval *remaining)
+{
+    struct timeval now;
+    long elapsed_us;
 
-        if (actual_length > 0)
-        {
-            // data still fits in buf?
-            if (tc->offset + actual_length <= tc->size)
-            {
-                memcpy (tc->buf + tc->offset, briteblox->readbuffer + briteblox->readbuffer_offset, actual_length);
-                //printf("buf[0] = %X, buf[1] = %X\n", buf[0], buf[1]);
-                tc->offset += actual_length;
+    if (wc->fill == 0 || wc->deadline_us == 0)
+        return 0;
 
-                briteblox->readbuffer_offset = 0;
-                briteblox->readbuffer_remaining = 0;
+    gettimeofday(&now, NULL);
+    elapsed_us = (now.tv_sec - wc->first.tv_sec) * 1000000L + (now.tv_usec - wc->first.tv_usec);
+    if (elapsed_us >= (long)wc->deadline_us)
+        return 1;
 
-                /* Did we read exactly the right amount of bytes? */
-                if (tc->offset == tc->size)
-                {
-                    //printf("read_data exact rem %d offset %d\n",
-                    //briteblox->readbuffer_remaining, offset);
-                    tc->completed = 1;
-                    return;
-                }
-            }
-            else
-            {
-                // only copy part of the data or size <= readbuffer_chunksize
-                int part_size = tc->size - tc->offset;
-                memcpy (tc->buf + tc->offset, briteblox->readbuffer + briteblox->readbuffer_offset, part_size);
-                tc->offset += part_size;
-
-                briteblox->readbuffer_offset += part_size;
-                briteblox->readbuffer_remaining = actual_length - part_size;
-
-                /* printf("Returning part: %d - size: %d - offset: %d - actual_length: %d - remaining: %d\n",
-                part_size, size, offset, actual_length, briteblox->readbuffer_remaining); */
-                tc->completed = 1;
-                return;
-            }
-        }
+    if (remaining != NULL)
+    {
+        remaining->tv_sec = (wc->deadline_us - elapsed_us) / 1000000L;
+        remaining->tv_usec = (wc->deadline_us - elapsed_us) % 1000000L;
     }
-    ret = libusb_submit_transfer (transfer);
-    if (ret < 0)
-        tc->completed = 1;
+    return 0;
 }
 
-
-static void briteblox_write_data_cb(struct libusb_transfer *transfer)
+/**
+    Frees the coalescing write buffer without sending its content.
+    \internal
+*/
+static void briteblox_write_coalesce_free(struct briteblox_context *briteblox)
+{
+    if (briteblox->writecoalesce == NULL)
+        return;
+
+    free(briteblox->writecoalesce->data);
+    free(briteblox->writecoalesce);
+    briteblox->writecoalesce = NULL;
+}
+
+/**
+    Writes data in chunks (see briteblox_write_data_set_chunksize()) to the chip
+
+    With coalescing enabled (see briteblox_write_data_set_coalescing())
+    small writes are only copied to the buffer and size is returned right
+    away. An error of a flush triggered by this call is returned instead.
+
+    \param briteblox pointer to briteblox_context
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    \retval -666: USB device unavailable
+    \retval <0: error code from usb_bulk_write()
+    \retval >0: number of bytes written
+*/
+int briteblox_write_data(struct briteblox_context *briteblox, const unsigned char *buf, int size)
+{
+    struct briteblox_write_coalesce *wc;
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-666, "USB device unavailable");
+
+    wc = briteblox->writecoalesce;
+    if (wc == NULL)
+        return briteblox_write_data_raw(briteblox, buf, size);
+
+    // would overflow the buffer: send what is there, keep the order
+    if (wc->fill + size > wc->size)
+    {
+        ret = briteblox_write_coalesce_flush(briteblox);
+        if (ret < 0)
+            return ret;
+    }
+
+    // too big to gain anything from coalescing
+    if ((unsigned int)size >= wc->size)
+        return briteblox_write_data_raw(briteblox, buf, size);
+
+    if (wc->fill == 0)
+        gettimeofday(&wc->first, NULL);
+    memcpy(wc->data + wc->fill, buf, size);
+    wc->fill += size;
+    wc->writes++;
+
+    if (wc->fill == wc->size || briteblox_write_coalesce_due(wc, NULL))
+    {
+        ret = briteblox_write_coalesce_flush(briteblox);
+        if (ret < 0)
+            return ret;
+    }
+
+    return size;
+}
+
+/**
+    \internal
+    Cuts the next bulk transfer out of an iovec array. Pieces of a buffer
+    that fill a whole chunk are sent from the caller's memory, shorter
+    ones are copied to the staging buffer until it holds a chunk or a
+    zero-copy piece has to follow. Concatenating the pieces in the order
+    returned gives the bytes in iov order.
+
+    \param iov Array of buffers
+    \param iovcnt Number of entries in iov
+    \param i index of the current buffer, advanced by the call
+    \param pos offset into the current buffer, advanced by the call
+    \param chunk maximum size of one transfer
+    \param staging buffer of chunk bytes for the copied pieces
+    \param data receives the start of the piece, staging or inside iov
+
+    \retval >0: length of the piece
+    \retval  0: all buffers consumed
+*/
+static int briteblox_writev_next(const struct briteblox_iovec *iov, int iovcnt, int *i, int *pos,
+                                 int chunk, unsigned char *staging, unsigned char **data)
+{
+    int fill = 0;
+
+    while (*i < iovcnt)
+    {
+        int remaining = iov[*i].len - *pos;
+        int n;
+
+        if (remaining <= 0)
+        {
+            (*i)++;
+            *pos = 0;
+            continue;
+        }
+
+        if (remaining >= chunk)
+        {
+            // send what is staged first to keep the order
+            if (fill > 0)
+                break;
+            *data = iov[*i].base + *pos;
+            *pos += chunk;
+            return chunk;
+        }
+
+        n = chunk - fill;
+        if (n > remaining)
+            n = remaining;
+        memcpy(staging + fill, iov[*i].base + *pos, n);
+        fill += n;
+        *pos += n;
+        if (fill == chunk)
+            break;
+    }
+
+    *data = staging;
+    return fill;
+}
+
+/**
+ * @brief Wrapper function to export briteblox_writev_next() to the unit test
+ * Do not use, it's only for the unit test framework
+ **/
+int writev_next_UT_export(const struct briteblox_iovec *iov, int iovcnt, int *i, int *pos,
+                          int chunk, unsigned char *staging, unsigned char **data)
+{
+    return briteblox_writev_next(iov, iovcnt, i, pos, chunk, staging, data);
+}
+
+static void briteblox_writev_cb(struct libusb_transfer *transfer)
+{
+    struct briteblox_transfer_control *tc = (struct briteblox_transfer_control *) transfer->user_data;
+
+    // one chunk per transfer: resubmitting a rest would overtake later pieces
+    tc->offset = transfer->actual_length;
+    tc->completed = 1;
+}
+
+/**
+    Writes several buffers to the chip as one stream (scatter-gather)
+
+    The buffers are cut into bulk transfers of at most the write chunk
+    size. Whole chunks are sent straight from the caller's memory, small
+    buffers and the tails of large ones are packed into shared chunks,
+    so a header, payload and CRC do not cost a transaction each. Up to
+    BRITEBLOX_TRANSFER_POOL_SIZE transfers are kept in flight. Each of
+    them is a single chunk, so the chip sees the bytes in iov order.
+
+    \param briteblox pointer to briteblox_context
+    \param iov Array of buffers
+    \param iovcnt Number of entries in iov
+
+    \retval -666: USB device unavailable
+    \retval -1: usb bulk write failed
+    \retval -2: out of memory
+    \retval >=0: number of bytes written
+*/
+int briteblox_write_datav(struct briteblox_context *briteblox, const struct briteblox_iovec *iov, int iovcnt)
+{
+    struct briteblox_transfer_control *window[BRITEBLOX_TRANSFER_POOL_SIZE];
+    unsigned char *staging[BRITEBLOX_TRANSFER_POOL_SIZE];
+    int submitted = 0, waited = 0, offset = 0, failed = 0, oom = 0;
+    int i = 0, pos = 0, chunk, ret, k;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-666, "USB device unavailable");
+
+    // buffered bytes go out before these
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "usb bulk write failed");
+
+    chunk = briteblox->writebuffer_chunksize;
+    memset(staging, 0, sizeof(staging));
+
+    while (!failed)
+    {
+        struct briteblox_transfer_control *tc;
+        struct libusb_transfer *transfer;
+        unsigned char *data;
+        int slot = submitted % BRITEBLOX_TRANSFER_POOL_SIZE;
+        int length;
+
+        // the slot and its staging buffer are free once the oldest transfer is done
+        if (submitted - waited == BRITEBLOX_TRANSFER_POOL_SIZE)
+        {
+            tc = window[waited++ % BRITEBLOX_TRANSFER_POOL_SIZE];
+            length = tc->size;
+            ret = briteblox_transfer_data_done(tc);
+            if (ret != length)
+                failed = 1;
+            else
+                offset += ret;
+            continue;
+        }
+
+        if (staging[slot] == NULL)
+        {
+            staging[slot] = (unsigned char *)malloc(chunk);
+            if (staging[slot] == NULL)
+            {
+                failed = oom = 1;
+                break;
+            }
+        }
+
+        length = briteblox_writev_next(iov, iovcnt, &i, &pos, chunk, staging[slot], &data);
+        if (length == 0)
+            break;
+
+        tc = briteblox_tc_get(briteblox);
+        if (tc == NULL)
+        {
+            failed = oom = 1;
+            break;
+        }
+        transfer = briteblox_tc_transfer(tc);
+        if (transfer == NULL)
+        {
+            briteblox_tc_put(tc, NULL);
+            failed = oom = 1;
+            break;
+        }
+
+        tc->buf = data;
+        tc->size = length;
+        libusb_fill_bulk_transfer(transfer, briteblox->usb_dev, briteblox->in_ep, data,
+                                  length, briteblox_writev_cb, tc,
+                                  briteblox->usb_write_timeout);
+        if (libusb_submit_transfer(transfer) < 0)
+        {
+            briteblox_tc_put(tc, transfer);
+            failed = 1;
+            break;
+        }
+        tc->transfer = transfer;
+        window[slot] = tc;
+        submitted++;
+    }
+
+    // after a failure the rest must not reach the chip with a gap before it
+    if (failed)
+        for (k = waited; k < submitted; k++)
+            libusb_cancel_transfer(window[k % BRITEBLOX_TRANSFER_POOL_SIZE]->transfer);
+
+    while (waited < submitted)
+    {
+        struct briteblox_transfer_control *tc = window[waited++ % BRITEBLOX_TRANSFER_POOL_SIZE];
+        int length = tc->size;
+
+        ret = briteblox_transfer_data_done(tc);
+        if (ret != length)
+            failed = 1;
+        else if (!failed)
+            offset += ret;
+    }
+
+    for (k = 0; k < BRITEBLOX_TRANSFER_POOL_SIZE; k++)
+        free(staging[k]);
+
+    if (oom)
+        briteblox_error_return(-2, "out of memory");
+    if (failed)
+        briteblox_error_return(-1, "usb bulk write failed");
+
+    return offset;
+}
+
+/* The transfer of a briteblox_read_data_submit() is done with readbuffer */
+static void briteblox_read_data_complete(struct briteblox_transfer_control *tc)
+{
+    briteblox_atomic_add(&tc->briteblox->reads_in_flight, -1);
+    tc->completed = 1;
+}
+
+static void briteblox_read_data_cb(struct libusb_transfer *transfer)
+{
+    struct briteblox_transfer_control *tc = (struct briteblox_transfer_control *) transfer->user_data;
+    struct briteblox_context *briteblox = tc->briteblox;
+    int packet_size, actual_length, payload_len, ret;
+
+    packet_size = briteblox->max_packet_size;
+
+    actual_length = transfer->actual_length;
+
+    // cancelled or failed: resubmitting would keep the transfer alive,
+    // on a stalled endpoint forever. briteblox_transfer_data_done()
+    // reports the status.
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        briteblox_read_data_complete(tc);
+        return;
+    }
+
+    if (actual_length > 2)
+    {
+        // skip BRITEBLOX status bytes while copying straight into the user buffer.
+        // Maybe stored in the future to enable modem use
+        payload_len = briteblox_strip_status(tc->buf + tc->offset, briteblox->readbuffer,
+                                             actual_length, packet_size,
+                                             0, tc->size - tc->offset);
+        tc->offset += payload_len;
+
+        if (tc->offset == tc->size)
+        {
+            // keep what did not fit for the next read
+            briteblox_ring_push_stripped(briteblox->readring, briteblox->readbuffer,
+                                         actual_length, packet_size, payload_len);
+            briteblox_read_data_complete(tc);
+            return;
+        }
+    }
+    ret = libusb_submit_transfer (transfer);
+    if (ret < 0)
+        briteblox_read_data_complete(tc);
+}
+
+
+static void briteblox_write_data_cb(struct libusb_transfer *transfer)
 {
     struct briteblox_transfer_control *tc = (struct briteblox_transfer_control *) transfer->user_data;
     struct briteblox_context *briteblox = tc->briteblox;
 
     tc->offset += transfer->actual_length;
 
+    // as for reads: a cancelled or failed write must not be resubmitted.
+    // briteblox_transfer_data_done() reports the status.
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        tc->completed = 1;
+        return;
+    }
+
     if (tc->offset == tc->size)
     {
         tc->completed = 1;
@@ -1501,6 +2358,113 @@ static void briteblox_write_data_cb(struct libusb_transfer *transfer)
     }
 }
 
+/**
+ * @brief Wrapper function to export briteblox_write_data_cb() to the unit test
+ * Runs the callback for a transfer that ended after actual_length bytes,
+ * cancelled or completed. Returns 1 if the callback resubmitted it.
+ * Do not use, it's only for the unit test framework
+ **/
+int write_data_cb_UT_export(struct briteblox_transfer_control *tc, int cancelled, int actual_length)
+{
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    unsigned char *buffer = tc->buf + tc->offset;
+    int resubmitted;
+
+    if (transfer == NULL)
+        return -1;
+    transfer->status = cancelled ? LIBUSB_TRANSFER_CANCELLED : LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = actual_length;
+    transfer->buffer = buffer;
+    transfer->user_data = tc;
+    briteblox_write_data_cb(transfer);
+    resubmitted = transfer->buffer != buffer;
+    libusb_free_transfer(transfer);
+    return resubmitted;
+}
+
+
+/**
+    Takes a transfer control out of the pool. Falls back to malloc()
+    and counts that if the pool is empty.
+    \internal
+
+    \retval NULL: out of memory
+*/
+static struct briteblox_transfer_control *briteblox_tc_get(struct briteblox_context *briteblox)
+{
+    struct briteblox_transfer_pool *pool = briteblox->transferpool;
+    struct briteblox_transfer_control *tc;
+
+    if (pool != NULL && pool->num_unused > 0)
+        tc = &pool->tcs[pool->unused[--pool->num_unused]];
+    else
+    {
+        if (pool != NULL)
+            pool->exhausted++;
+        tc = (struct briteblox_transfer_control *) malloc (sizeof (*tc));
+        if (!tc)
+            return NULL;
+    }
+
+    tc->briteblox = briteblox;
+    tc->completed = 0;
+    tc->offset = 0;
+    tc->transfer = NULL;
+    tc->error = 0;
+    tc->next = NULL;
+    return tc;
+}
+
+/**
+    Index of a transfer control in the pool, -1 if it was malloc()ed.
+    \internal
+*/
+static int briteblox_tc_index(struct briteblox_transfer_control *tc)
+{
+    struct briteblox_transfer_pool *pool = tc->briteblox->transferpool;
+
+    if (pool == NULL || tc < pool->tcs || tc >= pool->tcs + pool->size)
+        return -1;
+    return tc - pool->tcs;
+}
+
+/**
+    libusb transfer to use with a transfer control. Pool entries
+    bring their own, otherwise one is allocated.
+    \internal
+
+    \retval NULL: out of memory
+*/
+static struct libusb_transfer *briteblox_tc_transfer(struct briteblox_transfer_control *tc)
+{
+    int index = briteblox_tc_index(tc);
+
+    if (index >= 0)
+        return tc->briteblox->transferpool->transfers[index];
+    return libusb_alloc_transfer(0);
+}
+
+/**
+    Returns a transfer control and its libusb transfer to the pool or
+    frees them.
+    \internal
+
+    \param tc transfer control
+    \param transfer libusb transfer from briteblox_tc_transfer(), may be NULL
+*/
+static void briteblox_tc_put(struct briteblox_transfer_control *tc, struct libusb_transfer *transfer)
+{
+    struct briteblox_transfer_pool *pool = tc->briteblox->transferpool;
+    int index = briteblox_tc_index(tc);
+
+    if (index >= 0)
+        pool->unused[pool->num_unused++] = index;
+    else
+    {
+        libusb_free_transfer(transfer);
+        free(tc);
+    }
+}
 
 /**
     Writes data to the chip. Does not wait for completion of the transfer
@@ -1525,22 +2489,23 @@ struct briteblox_transfer_control *briteblox_write_data_submit(struct briteblox_
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         return NULL;
 
-    tc = (struct briteblox_transfer_control *) malloc (sizeof (*tc));
+    // buffered bytes go out before this transfer
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        return NULL;
+
+    tc = briteblox_tc_get(briteblox);
     if (!tc)
         return NULL;
 
-    transfer = libusb_alloc_transfer(0);
+    transfer = briteblox_tc_transfer(tc);
     if (!transfer)
     {
-        free(tc);
+        briteblox_tc_put(tc, NULL);
         return NULL;
     }
 
-    tc->briteblox = briteblox;
-    tc->completed = 0;
     tc->buf = buf;
     tc->size = size;
-    tc->offset = 0;
 
     if (size < (int)briteblox->writebuffer_chunksize)
         write_size = size;
@@ -1555,8 +2520,7 @@ struct briteblox_transfer_control *briteblox_write_data_submit(struct briteblox_
     ret = libusb_submit_transfer(transfer);
     if (ret < 0)
     {
-        libusb_free_transfer(transfer);
-        free(tc);
+        briteblox_tc_put(tc, transfer);
         return NULL;
     }
     tc->transfer = transfer;
@@ -1565,80 +2529,333 @@ struct briteblox_transfer_control *briteblox_write_data_submit(struct briteblox_
 }
 
 /**
-    Reads data from the chip. Does not wait for completion of the transfer
-    nor does it make sure that the transfer was successful.
-
-    Use libusb 1.0 asynchronous API.
+    Tells whether the event thread of the shared library handles the
+    completions of this context. The submit pool and read-ahead share
+    their state with the completions without a lock and refuse to run then.
+    \internal
+*/
+static int briteblox_event_thread_active(struct briteblox_context *briteblox)
+{
+    return briteblox->library != NULL && briteblox->library->thread_running;
+}
 
-    \param briteblox pointer to briteblox_context
-    \param buf Buffer with the data
-    \param size Size of the buffer
+/**
+    Starts idle pool transfers until the transfers in flight can deliver
+    all bytes the pending reads still miss.
+    \internal
 
-    \retval NULL: Some error happens when submit transfer
-    \retval !NULL: Pointer to a briteblox_transfer_control
+    \retval  0: all fine
+    \retval <0: libusb error code
 */
-
-struct briteblox_transfer_control *briteblox_read_data_submit(struct briteblox_context *briteblox, unsigned char *buf, int size)
+static int briteblox_read_pool_fill(struct briteblox_context *briteblox)
 {
-    struct briteblox_transfer_control *tc;
-    struct libusb_transfer *transfer;
+    struct briteblox_read_pool *pool = briteblox->readpool;
     int ret;
 
-    if (briteblox == NULL || briteblox->usb_dev == NULL)
-        return NULL;
+    while (pool->num_idle > 0 && pool->in_flight * pool->payload_size < pool->pending_bytes)
+    {
+        struct libusb_transfer *transfer = pool->idle[--pool->num_idle];
 
-    tc = (struct briteblox_transfer_control *) malloc (sizeof (*tc));
-    if (!tc)
-        return NULL;
+        ret = libusb_submit_transfer(transfer);
+        if (ret < 0)
+        {
+            pool->idle[pool->num_idle++] = transfer;
+            return ret;
+        }
+        pool->in_flight++;
+    }
+    return 0;
+}
 
-    tc->briteblox = briteblox;
-    tc->buf = buf;
-    tc->size = size;
+/**
+    Completes the oldest pending pool read.
+    \internal
+*/
+static void briteblox_read_pool_complete(struct briteblox_read_pool *pool, int error)
+{
+    struct briteblox_transfer_control *tc = pool->head;
 
-    if (size <= (int)briteblox->readbuffer_remaining)
-    {
-        memcpy (buf, briteblox->readbuffer+briteblox->readbuffer_offset, size);
+    pool->head = tc->next;
+    if (pool->head == NULL)
+        pool->tail = NULL;
+    pool->pending_bytes -= tc->size - tc->offset;
 
-        // Fix offsets
-        briteblox->readbuffer_remaining -= size;
-        briteblox->readbuffer_offset += size;
+    tc->next = NULL;
+    tc->error = error;
+    tc->completed = 1;
+}
 
-        /* printf("Returning bytes from buffer: %d - remaining: %d\n", size, briteblox->readbuffer_remaining); */
+static void briteblox_read_pool_cb(struct libusb_transfer *transfer)
+{
+    struct briteblox_context *briteblox = (struct briteblox_context *) transfer->user_data;
+    struct briteblox_read_pool *pool = briteblox->readpool;
+    int packet_size = briteblox->max_packet_size;
+    int skip = 0, error = 0, ret;
 
+    pool->in_flight--;
+
+    // the bus delivers in submit order, hand the payload to the
+    // pending reads oldest first
+    if (transfer->actual_length > 2)
+    {
+        while (pool->head != NULL)
+        {
+            struct briteblox_transfer_control *tc = pool->head;
+            int n = briteblox_strip_status(tc->buf + tc->offset, transfer->buffer,
+                                           transfer->actual_length, packet_size,
+                                           skip, tc->size - tc->offset);
+            tc->offset += n;
+            pool->pending_bytes -= n;
+            skip += n;
+
+            if (tc->offset < tc->size)
+                break;
+            briteblox_read_pool_complete(pool, 0);
+        }
+
+        // keep what no read asked for yet
+        if (pool->head == NULL)
+            briteblox_ring_push_stripped(briteblox->readring, transfer->buffer,
+                                         transfer->actual_length, packet_size, skip);
+    }
+
+    pool->idle[pool->num_idle++] = transfer;
+
+    switch (transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            while (pool->head != NULL)
+                briteblox_read_pool_complete(pool, LIBUSB_ERROR_NO_DEVICE);
+            return;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            error = LIBUSB_ERROR_TIMEOUT;
+            break;
+        default:
+            error = LIBUSB_ERROR_IO;
+            break;
+    }
+
+    if (error && pool->head != NULL)
+        briteblox_read_pool_complete(pool, error);
+
+    ret = briteblox_read_pool_fill(briteblox);
+    // nothing left that could finish the pending reads
+    if (ret < 0 && pool->in_flight == 0)
+        while (pool->head != NULL)
+            briteblox_read_pool_complete(pool, ret);
+}
+
+/**
+    Computes the absolute deadline timeout from now.
+    \internal
+*/
+static void briteblox_deadline(struct timeval *deadline, const struct timeval *timeout)
+{
+    gettimeofday(deadline, NULL);
+    deadline->tv_sec += timeout->tv_sec + (deadline->tv_usec + timeout->tv_usec) / 1000000L;
+    deadline->tv_usec = (deadline->tv_usec + timeout->tv_usec) % 1000000L;
+}
+
+/**
+    Computes the time left until deadline.
+    \internal
+
+    \retval 1: tv holds the time left
+    \retval 0: the deadline passed
+*/
+static int briteblox_time_left(const struct timeval *deadline, struct timeval *tv)
+{
+    struct timeval now;
+    long sec, usec;
+
+    gettimeofday(&now, NULL);
+    sec = deadline->tv_sec - now.tv_sec;
+    usec = deadline->tv_usec - now.tv_usec;
+    if (usec < 0)
+    {
+        sec--;
+        usec += 1000000L;
+    }
+    if (sec < 0 || (sec == 0 && usec == 0))
+        return 0;
+
+    tv->tv_sec = sec;
+    tv->tv_usec = usec;
+    return 1;
+}
+
+/**
+    Cancels all pool transfers in flight and fails the pending reads.
+    The reads are failed even if libusb does not return the transfers
+    in time, the pool transfers only write to their own buffers.
+    \internal
+
+    \param briteblox pointer to briteblox_context
+    \param error error code for the pending reads
+    \param timeout maximum time to wait for the transfers, NULL for no limit
+
+    \retval  0: all pool transfers returned
+    \retval LIBUSB_ERROR_TIMEOUT: some are still in flight after timeout
+    \retval <0: libusb error while handling events
+*/
+static int briteblox_read_pool_cancel(struct briteblox_context *briteblox, int error,
+                                      const struct timeval *timeout)
+{
+    struct briteblox_read_pool *pool = briteblox->readpool;
+    struct timeval deadline, tv;
+    int i, ret = 0;
+
+    for (i = 0; i < pool->num_transfers; i++)
+        if (pool->transfers[i])
+            libusb_cancel_transfer(pool->transfers[i]);
+
+    if (timeout != NULL)
+        briteblox_deadline(&deadline, timeout);
+
+    while (pool->in_flight > 0)
+    {
+        if (timeout == NULL)
+            ret = libusb_handle_events_completed(briteblox->usb_ctx, NULL);
+        else if (briteblox_time_left(&deadline, &tv))
+            ret = libusb_handle_events_timeout_completed(briteblox->usb_ctx, &tv, NULL);
+        else
+        {
+            ret = LIBUSB_ERROR_TIMEOUT;
+            break;
+        }
+        if (ret == LIBUSB_ERROR_INTERRUPTED)
+            ret = 0;
+        else if (ret < 0)
+            break;
+    }
+
+    while (pool->head != NULL)
+        briteblox_read_pool_complete(pool, error);
+
+    return pool->in_flight > 0 ? ret : 0;
+}
+
+/**
+    Cancels all pool transfers and frees the pool.
+    Pending reads complete with LIBUSB_ERROR_NO_DEVICE.
+    \internal
+*/
+static void briteblox_read_pool_free(struct briteblox_context *briteblox)
+{
+    struct briteblox_read_pool *pool = briteblox->readpool;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    briteblox_read_pool_cancel(briteblox, LIBUSB_ERROR_NO_DEVICE, NULL);
+
+    for (i = 0; i < pool->num_transfers; i++)
+    {
+        if (pool->transfers[i])
+        {
+            free(pool->transfers[i]->buffer);
+            libusb_free_transfer(pool->transfers[i]);
+        }
+    }
+
+    free(pool->transfers);
+    free(pool->idle);
+    free(pool);
+    briteblox->readpool = NULL;
+}
+
+/**
+    Reads data from the chip. Does not wait for completion of the transfer
+    nor does it make sure that the transfer was successful.
+
+    Use libusb 1.0 asynchronous API.
+
+    \param briteblox pointer to briteblox_context
+    \param buf Buffer with the data
+    \param size Size of the buffer
+
+    With a submit pool (see briteblox_read_data_set_submit_pool()) any
+    number of reads can be pending at once. They are filled in the order
+    they were submitted from the shared pool transfers. Errors of pool
+    transfers are reported by briteblox_transfer_data_done(). The pool
+    fails all submits while the library event thread runs.
+
+    \retval NULL: Some error happens when submit transfer
+    \retval !NULL: Pointer to a briteblox_transfer_control
+*/
+
+struct briteblox_transfer_control *briteblox_read_data_submit(struct briteblox_context *briteblox, unsigned char *buf, int size)
+{
+    struct briteblox_transfer_control *tc;
+    struct libusb_transfer *transfer;
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        return NULL;
+
+    if (briteblox->readpool != NULL && briteblox_event_thread_active(briteblox))
+        return NULL;
+
+    // the chip may only answer once it got the buffered commands
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        return NULL;
+
+    tc = briteblox_tc_get(briteblox);
+    if (!tc)
+        return NULL;
+
+    tc->buf = buf;
+    tc->size = size;
+
+    // serve what is already buffered first
+    tc->offset = briteblox_ring_pop(briteblox->readring, buf, size);
+    if (tc->offset == size)
+    {
         tc->completed = 1;
-        tc->offset = size;
-        tc->transfer = NULL;
         return tc;
     }
 
     tc->completed = 0;
-    if (briteblox->readbuffer_remaining != 0)
+    if (briteblox->readpool != NULL)
     {
-        memcpy (buf, briteblox->readbuffer+briteblox->readbuffer_offset, briteblox->readbuffer_remaining);
+        struct briteblox_read_pool *pool = briteblox->readpool;
 
-        tc->offset = briteblox->readbuffer_remaining;
+        if (pool->tail != NULL)
+            pool->tail->next = tc;
+        else
+            pool->head = tc;
+        pool->tail = tc;
+        pool->pending_bytes += size - tc->offset;
+
+        ret = briteblox_read_pool_fill(briteblox);
+        if (ret < 0 && pool->in_flight == 0)
+            while (pool->head != NULL)
+                briteblox_read_pool_complete(pool, ret);
+        return tc;
     }
-    else
-        tc->offset = 0;
 
-    transfer = libusb_alloc_transfer(0);
+    transfer = briteblox_tc_transfer(tc);
     if (!transfer)
     {
-        free (tc);
+        briteblox_tc_put(tc, NULL);
         return NULL;
     }
 
-    briteblox->readbuffer_remaining = 0;
-    briteblox->readbuffer_offset = 0;
-
     libusb_fill_bulk_transfer(transfer, briteblox->usb_dev, briteblox->out_ep, briteblox->readbuffer, briteblox->readbuffer_chunksize, briteblox_read_data_cb, tc, briteblox->usb_read_timeout);
     transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
 
+    // counted before the callback can run in the event thread
+    briteblox_atomic_add(&briteblox->reads_in_flight, 1);
     ret = libusb_submit_transfer(transfer);
     if (ret < 0)
     {
-        libusb_free_transfer(transfer);
-        free (tc);
+        briteblox_atomic_add(&briteblox->reads_in_flight, -1);
+        briteblox_tc_put(tc, transfer);
         return NULL;
     }
     tc->transfer = transfer;
@@ -1668,28 +2885,507 @@ int briteblox_transfer_data_done(struct briteblox_transfer_control *tc)
         {
             if (ret == LIBUSB_ERROR_INTERRUPTED)
                 continue;
+            if (tc->transfer == NULL)
+            {
+                // pending read of the submit pool
+                briteblox_read_pool_cancel(tc->briteblox, ret, NULL);
+                briteblox_tc_put(tc, NULL);
+                return ret;
+            }
             libusb_cancel_transfer(tc->transfer);
             while (!tc->completed)
                 if (libusb_handle_events(tc->briteblox->usb_ctx) < 0)
                     break;
-            libusb_free_transfer(tc->transfer);
-            free (tc);
+            briteblox_tc_put(tc, tc->transfer);
             return ret;
         }
     }
 
-    ret = tc->offset;
+    ret = tc->error ? tc->error : tc->offset;
     /**
-     * tc->transfer could be NULL if "(size <= briteblox->readbuffer_remaining)"
-     * at briteblox_read_data_submit(). Therefore, we need to check it here.
+     * tc->transfer could be NULL if the read ring already held "size" bytes
+     * at briteblox_read_data_submit() or the read was served by the submit
+     * pool. Therefore, we need to check it here.
      **/
-    if (tc->transfer)
+    if (tc->transfer && tc->transfer->status != LIBUSB_TRANSFER_COMPLETED)
+        ret = -1;
+    briteblox_tc_put(tc, tc->transfer);
+    return ret;
+}
+
+/**
+    Handles USB events for the given transfers once, blocking until
+    something happened or the deadline passed.
+
+    Transfers of one libusb context are waited for with a single blocking
+    call. Transfers spread over several contexts are served in turn with
+    slices of BRITEBLOX_WAIT_SLICE_US, as each context has its own event
+    loop.
+    \internal
+
+    \param tcs transfer controls, NULL entries are skipped
+    \param count number of entries in tcs
+    \param deadline absolute deadline, NULL to wait without limit
+
+    \retval  0: events handled
+    \retval LIBUSB_ERROR_TIMEOUT: the deadline passed
+    \retval <0: libusb error
+*/
+static int briteblox_tc_handle_events(struct briteblox_transfer_control **tcs, int count,
+                                      const struct timeval *deadline)
+{
+    libusb_context *ctx = NULL;
+    struct timeval tv = { 60, 0 };
+    int i, j, ret, shared = 1;
+
+    for (i = 0; i < count; i++)
+    {
+        if (tcs[i] == NULL)
+            continue;
+        if (ctx == NULL)
+            ctx = tcs[i]->briteblox->usb_ctx;
+        else if (ctx != tcs[i]->briteblox->usb_ctx)
+            shared = 0;
+    }
+
+    if (deadline != NULL && !briteblox_time_left(deadline, &tv))
+        return LIBUSB_ERROR_TIMEOUT;
+
+    if (shared)
+    {
+        ret = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+        return ret == LIBUSB_ERROR_INTERRUPTED ? 0 : ret;
+    }
+
+    if (tv.tv_sec > 0 || tv.tv_usec > BRITEBLOX_WAIT_SLICE_US)
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = BRITEBLOX_WAIT_SLICE_US;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        struct timeval slice = tv;
+
+        if (tcs[i] == NULL)
+            continue;
+        if (tcs[i]->completed)
+            return 0;
+
+        // each context once
+        ctx = tcs[i]->briteblox->usb_ctx;
+        for (j = 0; j < i; j++)
+            if (tcs[j] != NULL && tcs[j]->briteblox->usb_ctx == ctx)
+                break;
+        if (j < i)
+            continue;
+
+        ret = libusb_handle_events_timeout_completed(ctx, &slice, NULL);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+    Wait for the completion of any of several transfers.
+
+    The transfers may belong to different contexts. The first transfer
+    found complete is finished like briteblox_transfer_data_done() would
+    do, its entry in tcs is set to NULL. The other transfers stay pending,
+    so the same array can be passed again to wait for the next one.
+
+    \param tcs transfer controls, NULL entries are skipped
+    \param count number of entries in tcs
+    \param timeout maximum time to wait, NULL to wait without limit
+    \param result receives the return value of briteblox_transfer_data_done()
+           for the finished transfer, may be NULL
+
+    \retval >=0: index of the finished transfer
+    \retval LIBUSB_ERROR_TIMEOUT: nothing finished in time
+    \retval LIBUSB_ERROR_NOT_FOUND: no transfer in tcs
+    \retval LIBUSB_ERROR_INVALID_PARAM: tcs is NULL or count not positive
+    \retval <0: libusb error while handling events
+*/
+int briteblox_transfer_data_done_any(struct briteblox_transfer_control **tcs, int count,
+                                     struct timeval *timeout, int *result)
+{
+    struct timeval deadline;
+    int i, ret, pending;
+
+    if (tcs == NULL || count <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    if (timeout != NULL)
+        briteblox_deadline(&deadline, timeout);
+
+    while (1)
+    {
+        pending = 0;
+        for (i = 0; i < count; i++)
+        {
+            if (tcs[i] == NULL)
+                continue;
+            pending = 1;
+            if (tcs[i]->completed)
+            {
+                ret = briteblox_transfer_data_done(tcs[i]);
+                tcs[i] = NULL;
+                if (result)
+                    *result = ret;
+                return i;
+            }
+        }
+
+        if (!pending)
+            return LIBUSB_ERROR_NOT_FOUND;
+
+        ret = briteblox_tc_handle_events(tcs, count, timeout ? &deadline : NULL);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+/**
+    Wait for the completion of all of several transfers.
+
+    Finished transfers are handled as by briteblox_transfer_data_done_any().
+    On a timeout the unfinished transfers are still in tcs, they can be
+    waited for again or given up with briteblox_transfer_data_cancel().
+
+    \param tcs transfer controls, NULL entries are skipped
+    \param count number of entries in tcs
+    \param timeout maximum time to wait for all of them, NULL to wait without limit
+    \param results receives the return value of briteblox_transfer_data_done()
+           of each finished transfer at its index, may be NULL
+
+    \retval  0: all transfers finished
+    \retval LIBUSB_ERROR_TIMEOUT: some transfers did not finish in time
+    \retval LIBUSB_ERROR_INVALID_PARAM: tcs is NULL or count not positive
+    \retval <0: libusb error while handling events
+*/
+int briteblox_transfer_data_done_all(struct briteblox_transfer_control **tcs, int count,
+                                     struct timeval *timeout, int *results)
+{
+    struct timeval deadline, left;
+    int index, ret;
+
+    if (tcs == NULL || count <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    if (timeout != NULL)
+        briteblox_deadline(&deadline, timeout);
+
+    while (1)
     {
-        if (tc->transfer->status != LIBUSB_TRANSFER_COMPLETED)
-            ret = -1;
-        libusb_free_transfer(tc->transfer);
+        if (timeout != NULL && !briteblox_time_left(&deadline, &left))
+            left.tv_sec = left.tv_usec = 0;
+
+        index = briteblox_transfer_data_done_any(tcs, count, timeout ? &left : NULL, &ret);
+        if (index == LIBUSB_ERROR_NOT_FOUND)
+            return 0;
+        if (index < 0)
+            return index;
+        if (results)
+            results[index] = ret;
     }
-    free(tc);
+}
+
+/**
+    Cancel a submitted transfer and release its transfer control.
+
+    Cancelling a read of the submit pool (see
+    briteblox_read_data_set_submit_pool()) fails all pending reads of
+    the pool.
+
+    \param tc pointer to briteblox_transfer_control
+    \param timeout maximum time to wait for libusb to confirm the
+           cancellation, NULL to wait without limit
+
+    \retval  0: transfer cancelled (or already finished), tc is released
+    \retval LIBUSB_ERROR_TIMEOUT: not confirmed in time, tc is still valid
+    \retval <0: libusb error while handling events, tc is still valid
+*/
+int briteblox_transfer_data_cancel(struct briteblox_transfer_control *tc, struct timeval *timeout)
+{
+    struct briteblox_transfer_control *tcs[1];
+    int ret;
+
+    if (!tc->completed)
+    {
+        if (tc->transfer == NULL)
+        {
+            // fails the read right away, the pool transfers may take longer
+            ret = briteblox_read_pool_cancel(tc->briteblox, LIBUSB_ERROR_INTERRUPTED, timeout);
+            if (ret < 0)
+                return ret;
+        }
+        else
+            libusb_cancel_transfer(tc->transfer);
+    }
+
+    tcs[0] = tc;
+    ret = briteblox_transfer_data_done_any(tcs, 1, timeout, NULL);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+    Frees the transfer pool.
+    \internal
+*/
+static void briteblox_transfer_pool_free(struct briteblox_context *briteblox)
+{
+    struct briteblox_transfer_pool *pool = briteblox->transferpool;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    if (pool->transfers != NULL)
+        for (i = 0; i < pool->size; i++)
+            libusb_free_transfer(pool->transfers[i]);
+
+    free(pool->transfers);
+    free(pool->tcs);
+    free(pool->unused);
+    free(pool);
+    briteblox->transferpool = NULL;
+}
+
+/**
+    Set the number of preallocated transfer controls.
+
+    briteblox_write_data_submit() and briteblox_read_data_submit() take
+    their briteblox_transfer_control and libusb transfer from this pool and
+    briteblox_transfer_data_done() puts them back, so no heap allocation
+    happens as long as no more than size transfers are pending. If the
+    pool runs empty they fall back to malloc() and count that, see
+    briteblox_transfer_pool_get_stats().
+
+    briteblox_init() sets up a pool of 32 entries.
+
+    \param briteblox pointer to briteblox_context
+    \param size Number of entries, 0 disables the pool
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid or size negative
+    \retval -2: transfers of the pool still pending
+    \retval -3: out of memory
+*/
+int briteblox_transfer_pool_set_size(struct briteblox_context *briteblox, int size)
+{
+    struct briteblox_transfer_pool *pool;
+    int i;
+
+    if (briteblox == NULL || size < 0)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    pool = briteblox->transferpool;
+    if (pool != NULL && pool->num_unused != pool->size)
+        briteblox_error_return(-2, "transfers of the pool still pending");
+
+    briteblox_transfer_pool_free(briteblox);
+    if (size == 0)
+        return 0;
+
+    pool = (struct briteblox_transfer_pool *)calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        briteblox_error_return(-3, "out of memory for transfer pool");
+    briteblox->transferpool = pool;
+
+    pool->tcs = (struct briteblox_transfer_control *)calloc(size, sizeof(*pool->tcs));
+    pool->transfers = (struct libusb_transfer **)calloc(size, sizeof(*pool->transfers));
+    pool->unused = (int *)calloc(size, sizeof(*pool->unused));
+    if (pool->tcs == NULL || pool->transfers == NULL || pool->unused == NULL)
+    {
+        briteblox_transfer_pool_free(briteblox);
+        briteblox_error_return(-3, "out of memory for transfer pool");
+    }
+
+    for (i = 0; i < size; i++)
+    {
+        pool->transfers[i] = libusb_alloc_transfer(0);
+        if (pool->transfers[i] == NULL)
+        {
+            pool->size = i;
+            briteblox_transfer_pool_free(briteblox);
+            briteblox_error_return(-3, "out of memory for transfer pool");
+        }
+        // hand out the low indices first
+        pool->unused[i] = size - 1 - i;
+    }
+    pool->size = size;
+    pool->num_unused = size;
+
+    return 0;
+}
+
+/**
+    Get transfer pool statistics.
+
+    \param briteblox pointer to briteblox_context
+    \param size Pointer to store the number of entries in, may be NULL
+    \param in_use Pointer to store the number of entries handed out in, may be NULL
+    \param exhausted Pointer to store how often the pool was empty in, may be NULL
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_transfer_pool_get_stats(struct briteblox_context *briteblox, unsigned int *size,
+                                      unsigned int *in_use, unsigned int *exhausted)
+{
+    struct briteblox_transfer_pool *pool;
+
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    pool = briteblox->transferpool;
+    if (size)
+        *size = pool ? pool->size : 0;
+    if (in_use)
+        *in_use = pool ? pool->size - pool->num_unused : 0;
+    if (exhausted)
+        *exhausted = pool ? pool->exhausted : 0;
+    return 0;
+}
+
+/**
+    Get the file descriptors libusb needs to be polled for this context.
+
+    Lets an application drive libbriteblox from its own poll()/epoll
+    loop: wait for the descriptors and the timeout from
+    briteblox_get_next_timeout(), then call briteblox_stream_step() or
+    briteblox_handle_events_nonblocking(). Watch for changes with
+    briteblox_set_pollfd_notifiers().
+
+    Not available on Windows.
+
+    \param briteblox pointer to briteblox_context
+    \param fds Array to store the descriptors in
+    \param max Number of entries in fds
+
+    \retval >=0: total number of descriptors, may be larger than max
+    \retval -1: briteblox context invalid
+    \retval -2: not supported on this platform
+*/
+int briteblox_get_pollfds(struct briteblox_context *briteblox, struct briteblox_pollfd *fds, int max)
+{
+    const struct libusb_pollfd **pollfds;
+    int i;
+
+    if (briteblox == NULL || briteblox->usb_ctx == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    pollfds = libusb_get_pollfds(briteblox->usb_ctx);
+    if (pollfds == NULL)
+        briteblox_error_return(-2, "libusb_get_pollfds() not supported");
+
+    for (i = 0; pollfds[i] != NULL; i++)
+    {
+        if (i < max)
+        {
+            fds[i].fd = pollfds[i]->fd;
+            fds[i].events = pollfds[i]->events;
+        }
+    }
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+    libusb_free_pollfds(pollfds);
+#else
+    free(pollfds);
+#endif
+    return i;
+}
+
+/**
+    Get notified when libusb adds or removes a descriptor to poll.
+
+    \param briteblox pointer to briteblox_context
+    \param added_cb Called with the descriptor and poll events to watch, may be NULL
+    \param removed_cb Called with the descriptor to stop watching, may be NULL
+    \param user_data Passed to the callbacks
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_set_pollfd_notifiers(struct briteblox_context *briteblox,
+                                   briteblox_pollfd_added_cb *added_cb,
+                                   briteblox_pollfd_removed_cb *removed_cb,
+                                   void *user_data)
+{
+    if (briteblox == NULL || briteblox->usb_ctx == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    libusb_set_pollfd_notifiers(briteblox->usb_ctx, added_cb, removed_cb, user_data);
+    return 0;
+}
+
+/**
+    Get the time until libusb needs to handle a timeout.
+
+    Also covers the flush deadline of the coalescing write buffer, see
+    briteblox_write_data_set_coalescing().
+
+    \param briteblox pointer to briteblox_context
+    \param tv Time left until the next timeout, zero if already expired
+
+    \retval  1: tv holds the time left
+    \retval  0: no timeout pending, wait for the descriptors only
+    \retval <0: briteblox context invalid or libusb error
+*/
+int briteblox_get_next_timeout(struct briteblox_context *briteblox, struct timeval *tv)
+{
+    struct timeval flush_tv;
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_ctx == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    ret = libusb_get_next_timeout(briteblox->usb_ctx, tv);
+    if (ret < 0 || briteblox->writecoalesce == NULL ||
+        briteblox->writecoalesce->fill == 0 || briteblox->writecoalesce->deadline_us == 0)
+        return ret;
+
+    // the coalescing buffer is due earlier than libusb
+    if (briteblox_write_coalesce_due(briteblox->writecoalesce, &flush_tv))
+        flush_tv.tv_sec = flush_tv.tv_usec = 0;
+    if (ret == 0 || timercmp(&flush_tv, tv, <))
+        *tv = flush_tv;
+    return 1;
+}
+
+/**
+    Handle pending libusb events without blocking.
+
+    Runs the completion callbacks of all transfers that finished, e.g.
+    after one of the descriptors from briteblox_get_pollfds() became
+    ready or the timeout from briteblox_get_next_timeout() expired.
+    Flushes the coalescing write buffer if its deadline passed.
+
+    \param briteblox pointer to briteblox_context
+
+    \retval  0: all fine
+    \retval <0: briteblox context invalid or libusb error
+*/
+int briteblox_handle_events_nonblocking(struct briteblox_context *briteblox)
+{
+    struct timeval zero = { 0, 0 };
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_ctx == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    if (briteblox->writecoalesce != NULL && briteblox->usb_dev != NULL &&
+        briteblox_write_coalesce_due(briteblox->writecoalesce, NULL))
+    {
+        ret = briteblox_write_coalesce_flush(briteblox);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = libusb_handle_events_timeout_completed(briteblox->usb_ctx, &zero, NULL);
+    if (ret == LIBUSB_ERROR_INTERRUPTED)
+        ret = 0;
     return ret;
 }
 
@@ -1702,6 +3398,7 @@ int briteblox_transfer_data_done(struct briteblox_transfer_control *tc)
 
     \retval 0: all fine
     \retval -1: briteblox context invalid
+    \retval <0: resizing the coalescing write buffer failed
 */
 int briteblox_write_data_set_chunksize(struct briteblox_context *briteblox, unsigned int chunksize)
 {
@@ -1709,6 +3406,10 @@ int briteblox_write_data_set_chunksize(struct briteblox_context *briteblox, unsi
         briteblox_error_return(-1, "briteblox context invalid");
 
     briteblox->writebuffer_chunksize = chunksize;
+
+    // resize the coalescing buffer along
+    if (briteblox->writecoalesce != NULL)
+        return briteblox_write_data_set_coalescing(briteblox, 1, briteblox->writecoalesce->deadline_us);
     return 0;
 }
 
@@ -1716,18 +3417,376 @@ int briteblox_write_data_set_chunksize(struct briteblox_context *briteblox, unsi
     Get write buffer chunk size.
 
     \param briteblox pointer to briteblox_context
-    \param chunksize Pointer to store chunk size in
+    \param chunksize Pointer to store chunk size in
+
+    \retval 0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_write_data_get_chunksize(struct briteblox_context *briteblox, unsigned int *chunksize)
+{
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    *chunksize = briteblox->writebuffer_chunksize;
+    return 0;
+}
+
+/**
+    Enable or disable the coalescing write buffer.
+
+    While enabled, briteblox_write_data() collects small writes in a
+    buffer of the write chunk size instead of sending each one on its
+    own. The buffer is sent when it is full, on briteblox_flush(), before
+    any read or asynchronous transfer, before every function that changes
+    a chip setting (baudrate, line property, flow control, DTR/RTS,
+    latency timer, event/error character, bitmode, reset), and once
+    deadline_us passed since the first buffered byte. Buffered bitbang or
+    MPSSE data is thus never clocked out in a mode set after it. The deadline is checked by briteblox_write_data()
+    and briteblox_handle_events_nonblocking(), there is no timer thread.
+    Disabling flushes the buffer.
+
+    \param briteblox pointer to briteblox_context
+    \param enable 1 to enable, 0 to disable
+    \param deadline_us Maximum time bytes may wait in the buffer, 0 for no deadline
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+    \retval -2: out of memory
+    \retval <0: error code from flushing the buffer
+*/
+int briteblox_write_data_set_coalescing(struct briteblox_context *briteblox, int enable, unsigned int deadline_us)
+{
+    struct briteblox_write_coalesce *wc;
+    int ret;
+
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    wc = briteblox->writecoalesce;
+    if (!enable)
+    {
+        ret = briteblox_flush(briteblox);
+        briteblox_write_coalesce_free(briteblox);
+        return ret;
+    }
+
+    if (wc == NULL)
+    {
+        wc = (struct briteblox_write_coalesce *)calloc(1, sizeof(struct briteblox_write_coalesce));
+        if (wc == NULL)
+            briteblox_error_return(-2, "out of memory for write buffer");
+        briteblox->writecoalesce = wc;
+    }
+
+    if (wc->size != briteblox->writebuffer_chunksize)
+    {
+        unsigned char *data;
+
+        ret = briteblox_flush(briteblox);
+        if (ret < 0)
+            return ret;
+
+        data = (unsigned char *)realloc(wc->data, briteblox->writebuffer_chunksize);
+        if (data == NULL)
+            briteblox_error_return(-2, "out of memory for write buffer");
+        wc->data = data;
+        wc->size = briteblox->writebuffer_chunksize;
+    }
+
+    wc->deadline_us = deadline_us;
+    return 0;
+}
+
+/**
+    Get the counters of the coalescing write buffer.
+
+    The ratio of writes to flushes is the number of round trips saved.
+
+    \param briteblox pointer to briteblox_context
+    \param writes Number of briteblox_write_data() calls buffered, may be NULL
+    \param flushes Number of USB writes of buffered data, may be NULL
+    \param pending Number of bytes waiting in the buffer, may be NULL
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid or coalescing disabled
+*/
+int briteblox_write_data_get_coalescing_stats(struct briteblox_context *briteblox, unsigned int *writes,
+                                              unsigned int *flushes, unsigned int *pending)
+{
+    if (briteblox == NULL || briteblox->writecoalesce == NULL)
+        briteblox_error_return(-1, "write coalescing not enabled");
+
+    if (writes)
+        *writes = briteblox->writecoalesce->writes;
+    if (flushes)
+        *flushes = briteblox->writecoalesce->flushes;
+    if (pending)
+        *pending = briteblox->writecoalesce->fill;
+    return 0;
+}
+
+/**
+    Send the content of the coalescing write buffer to the chip.
+
+    Does nothing if coalescing is disabled or the buffer is empty.
+
+    \param briteblox pointer to briteblox_context
+
+    \retval    0: all fine
+    \retval   -1: usb bulk write failed, the buffered bytes are lost
+    \retval -666: USB device unavailable
+*/
+int briteblox_flush(struct briteblox_context *briteblox)
+{
+    if (briteblox == NULL)
+        briteblox_error_return(-666, "USB device unavailable");
+
+    if (briteblox->writecoalesce == NULL || briteblox->writecoalesce->fill == 0)
+        return 0;
+
+    if (briteblox->usb_dev == NULL)
+        briteblox_error_return(-666, "USB device unavailable");
+
+    return briteblox_write_coalesce_flush(briteblox);
+}
+
+/**
+    Marks a read-ahead transfer as waiting for room in the read ring.
+    \internal
+*/
+static void briteblox_readahead_park(struct briteblox_readahead *ra, struct libusb_transfer *transfer)
+{
+    int i;
+
+    for (i = 0; i < ra->num_transfers; i++)
+    {
+        if (ra->transfers[i] == transfer)
+        {
+            briteblox_atomic_store(&ra->parked[i], 1);
+            briteblox_atomic_add(&ra->num_parked, 1);
+            return;
+        }
+    }
+}
+
+/**
+    Submits a read-ahead transfer if the read ring can take its payload
+    in addition to the payload of all transfers still in flight.
+    Otherwise the transfer is parked until the reader made room.
+
+    Called from the completion callback and from the reader, the
+    reservation in in_flight is taken atomically.
+    \internal
+
+    \retval  0: submitted or parked
+    \retval <0: libusb error code
+*/
+static int briteblox_readahead_submit(struct briteblox_context *briteblox, struct libusb_transfer *transfer)
+{
+    struct briteblox_readahead *ra = briteblox->readahead;
+    unsigned int in_flight;
+    int ret;
+
+    do
+    {
+        in_flight = briteblox_atomic_load(&ra->in_flight);
+        if (briteblox_ring_space(briteblox->readring) < (in_flight + 1) * ra->payload_size)
+        {
+            briteblox_readahead_park(ra, transfer);
+            return 0;
+        }
+    }
+    while (!briteblox_atomic_cas(&ra->in_flight, in_flight, in_flight + 1));
+
+    ret = libusb_submit_transfer(transfer);
+    if (ret < 0)
+    {
+        briteblox_atomic_add(&ra->in_flight, -1);
+        briteblox_readahead_park(ra, transfer);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+    Resubmits parked read-ahead transfers after the reader made room.
+    \internal
+*/
+static void briteblox_readahead_unpark(struct briteblox_context *briteblox)
+{
+    struct briteblox_readahead *ra = briteblox->readahead;
+    int i, ret;
+
+    for (i = 0; i < ra->num_transfers && briteblox_atomic_load(&ra->num_parked) > 0; i++)
+    {
+        if (!briteblox_atomic_cas(&ra->parked[i], 1, 0))
+            continue;
+        briteblox_atomic_add(&ra->num_parked, -1);
+
+        ret = briteblox_readahead_submit(briteblox, ra->transfers[i]);
+        if (ret < 0)
+            briteblox_atomic_cas(&ra->error, 0, ret);
+        // parked again, no more room
+        if (briteblox_atomic_load(&ra->parked[i]))
+            break;
+    }
+}
+
+static void briteblox_readahead_cb(struct libusb_transfer *transfer)
+{
+    struct briteblox_context *briteblox = (struct briteblox_context *) transfer->user_data;
+    struct briteblox_readahead *ra = briteblox->readahead;
+    int ret;
+
+    briteblox_atomic_add(&ra->completions, 1);
+
+    switch (transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            // skip BRITEBLOX status bytes. The space was reserved on submit,
+            // so the payload goes in before the reservation is released.
+            if (transfer->actual_length > 2)
+                briteblox_ring_push_stripped(briteblox->readring, transfer->buffer,
+                                             transfer->actual_length,
+                                             briteblox->max_packet_size, 0);
+            else
+                briteblox_atomic_add(&ra->idle_completions, 1);
+            briteblox_atomic_add(&ra->in_flight, -1);
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            // read-ahead gets stopped
+            briteblox_atomic_add(&ra->in_flight, -1);
+            return;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            briteblox_atomic_cas(&ra->error, 0, LIBUSB_ERROR_NO_DEVICE);
+            briteblox_atomic_add(&ra->in_flight, -1);
+            briteblox_readahead_park(ra, transfer);
+            return;
+        default:
+            briteblox_atomic_cas(&ra->error, 0, LIBUSB_ERROR_IO);
+            briteblox_atomic_add(&ra->in_flight, -1);
+            briteblox_readahead_park(ra, transfer);
+            return;
+    }
+
+    ret = briteblox_readahead_submit(briteblox, transfer);
+    if (ret < 0)
+        briteblox_atomic_cas(&ra->error, 0, ret);
+}
+
+/**
+    Cancels all read-ahead transfers and frees the read-ahead state.
+    Payload already in the read ring stays there.
+    \internal
+*/
+static void briteblox_readahead_free(struct briteblox_context *briteblox)
+{
+    struct briteblox_readahead *ra = briteblox->readahead;
+    int i;
+
+    if (ra == NULL)
+        return;
+
+    for (i = 0; i < ra->num_transfers; i++)
+        if (ra->transfers[i])
+            libusb_cancel_transfer(ra->transfers[i]);
+
+    while (briteblox_atomic_load(&ra->in_flight) > 0)
+    {
+        int ret = libusb_handle_events(briteblox->usb_ctx);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            break;
+    }
+
+    for (i = 0; i < ra->num_transfers; i++)
+    {
+        if (ra->transfers[i])
+        {
+            free(ra->transfers[i]->buffer);
+            libusb_free_transfer(ra->transfers[i]);
+        }
+    }
+
+    free(ra->transfers);
+    free(ra->parked);
+    free(ra);
+    briteblox->readahead = NULL;
+}
+
+/**
+    briteblox_read_data() with read-ahead enabled. Serves the read from
+    the ring and only waits for the bus if the ring runs dry.
+    \internal
+
+    \param briteblox pointer to briteblox_context
+    \param buf Buffer to store data in
+    \param offset Bytes already stored in buf
+    \param size Size of the buffer
 
-    \retval 0: all fine
-    \retval -1: briteblox context invalid
+    \retval <0: error code from libusb
+    \retval  0: no data was available
+    \retval >0: number of bytes read
 */
-int briteblox_write_data_get_chunksize(struct briteblox_context *briteblox, unsigned int *chunksize)
+static int briteblox_read_data_readahead(struct briteblox_context *briteblox, unsigned char *buf,
+                                         int offset, int size)
 {
-    if (briteblox == NULL)
-        briteblox_error_return(-1, "briteblox context invalid");
+    struct briteblox_readahead *ra = briteblox->readahead;
+    unsigned int idle_completions = briteblox_atomic_load(&ra->idle_completions);
+    struct timeval start, now;
+    int ret;
 
-    *chunksize = briteblox->writebuffer_chunksize;
-    return 0;
+    gettimeofday(&start, NULL);
+
+    while (1)
+    {
+        long elapsed_ms;
+
+        offset += briteblox_ring_pop(briteblox->readring, buf + offset, size - offset);
+
+        // the reader made room, hand parked transfers back to libusb
+        if (briteblox_atomic_load(&ra->num_parked) > 0)
+            briteblox_readahead_unpark(briteblox);
+
+        if (offset == size)
+            return offset;
+
+        ret = briteblox_atomic_load(&ra->error);
+        if (ret)
+        {
+            briteblox_atomic_store(&ra->error, 0);
+            if (offset > 0)
+                return offset;
+            briteblox_error_return(ret, "usb bulk read failed");
+        }
+
+        // no more data to read?
+        if (briteblox_atomic_load(&ra->idle_completions) != idle_completions ||
+            briteblox_atomic_load(&ra->in_flight) == 0)
+        {
+            // a completion may have raced with the check above
+            offset += briteblox_ring_pop(briteblox->readring, buf + offset, size - offset);
+            return offset;
+        }
+
+        gettimeofday(&now, NULL);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+        if (elapsed_ms >= briteblox->usb_read_timeout)
+        {
+            if (offset > 0)
+                return offset;
+            briteblox_error_return(LIBUSB_ERROR_TIMEOUT, "usb bulk read timed out");
+        }
+        else
+        {
+            long remaining_ms = briteblox->usb_read_timeout - elapsed_ms;
+            struct timeval timeout = { remaining_ms / 1000, (remaining_ms % 1000) * 1000 };
+
+            ret = libusb_handle_events_timeout(briteblox->usb_ctx, &timeout);
+            if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+                briteblox_error_return(ret, "libusb_handle_events_timeout() failed");
+        }
+    }
 }
 
 /**
@@ -1747,7 +3806,7 @@ int briteblox_write_data_get_chunksize(struct briteblox_context *briteblox, unsi
 */
 int briteblox_read_data(struct briteblox_context *briteblox, unsigned char *buf, int size)
 {
-    int offset = 0, ret, i, num_of_chunks, chunk_remains;
+    int offset = 0, ret, payload_len;
     int packet_size = briteblox->max_packet_size;
     int actual_length = 1;
 
@@ -1758,100 +3817,51 @@ int briteblox_read_data(struct briteblox_context *briteblox, unsigned char *buf,
     if (packet_size == 0)
         briteblox_error_return(-1, "max_packet_size is bogus (zero)");
 
-    // everything we want is still in the readbuffer?
-    if (size <= (int)briteblox->readbuffer_remaining)
-    {
-        memcpy (buf, briteblox->readbuffer+briteblox->readbuffer_offset, size);
-
-        // Fix offsets
-        briteblox->readbuffer_remaining -= size;
-        briteblox->readbuffer_offset += size;
+    if (briteblox->readahead != NULL && briteblox_event_thread_active(briteblox))
+        briteblox_error_return(-1, "read-ahead does not work with the library event thread");
 
-        /* printf("Returning bytes from buffer: %d - remaining: %d\n", size, briteblox->readbuffer_remaining); */
+    // the chip may only answer once it got the buffered commands
+    ret = briteblox_write_coalesce_flush(briteblox);
+    if (ret < 0)
+        return ret;
 
+    // serve what is already in the read ring first
+    offset = briteblox_ring_pop(briteblox->readring, buf, size);
+    if (offset == size)
         return size;
-    }
-    // something still in the readbuffer, but not enough to satisfy 'size'?
-    if (briteblox->readbuffer_remaining != 0)
-    {
-        memcpy (buf, briteblox->readbuffer+briteblox->readbuffer_offset, briteblox->readbuffer_remaining);
 
-        // Fix offset
-        offset += briteblox->readbuffer_remaining;
-    }
+    // read-ahead transfers already in flight?
+    if (briteblox->readahead != NULL)
+        return briteblox_read_data_readahead(briteblox, buf, offset, size);
+
     // do the actual USB read
     while (offset < size && actual_length > 0)
     {
-        briteblox->readbuffer_remaining = 0;
-        briteblox->readbuffer_offset = 0;
         /* returns how much received */
         ret = libusb_bulk_transfer (briteblox->usb_dev, briteblox->out_ep, briteblox->readbuffer, briteblox->readbuffer_chunksize, &actual_length, briteblox->usb_read_timeout);
         if (ret < 0)
             briteblox_error_return(ret, "usb bulk read failed");
 
-        if (actual_length > 2)
-        {
-            // skip BRITEBLOX status bytes.
-            // Maybe stored in the future to enable modem use
-            num_of_chunks = actual_length / packet_size;
-            chunk_remains = actual_length % packet_size;
-            //printf("actual_length = %X, num_of_chunks = %X, chunk_remains = %X, readbuffer_offset = %X\n", actual_length, num_of_chunks, chunk_remains, briteblox->readbuffer_offset);
-
-            briteblox->readbuffer_offset += 2;
-            actual_length -= 2;
-
-            if (actual_length > packet_size - 2)
-            {
-                for (i = 1; i < num_of_chunks; i++)
-                    memmove (briteblox->readbuffer+briteblox->readbuffer_offset+(packet_size - 2)*i,
-                             briteblox->readbuffer+briteblox->readbuffer_offset+packet_size*i,
-                             packet_size - 2);
-                if (chunk_remains > 2)
-                {
-                    memmove (briteblox->readbuffer+briteblox->readbuffer_offset+(packet_size - 2)*i,
-                             briteblox->readbuffer+briteblox->readbuffer_offset+packet_size*i,
-                             chunk_remains-2);
-                    actual_length -= 2*num_of_chunks;
-                }
-                else
-                    actual_length -= 2*(num_of_chunks-1)+chunk_remains;
-            }
-        }
-        else if (actual_length <= 2)
+        if (actual_length <= 2)
         {
             // no more data to read?
             return offset;
         }
-        if (actual_length > 0)
-        {
-            // data still fits in buf?
-            if (offset+actual_length <= size)
-            {
-                memcpy (buf+offset, briteblox->readbuffer+briteblox->readbuffer_offset, actual_length);
-                //printf("buf[0] = %X, buf[1] = %X\n", buf[0], buf[1]);
-                offset += actual_length;
-
-                /* Did we read exactly the right amount of bytes? */
-                if (offset == size)
-                    //printf("read_data exact rem %d offset %d\n",
-                    //briteblox->readbuffer_remaining, offset);
-                    return offset;
-            }
-            else
-            {
-                // only copy part of the data or size <= readbuffer_chunksize
-                int part_size = size-offset;
-                memcpy (buf+offset, briteblox->readbuffer+briteblox->readbuffer_offset, part_size);
 
-                briteblox->readbuffer_offset += part_size;
-                briteblox->readbuffer_remaining = actual_length-part_size;
-                offset += part_size;
+        // skip BRITEBLOX status bytes while copying straight into buf.
+        // Maybe stored in the future to enable modem use
+        payload_len = briteblox_strip_status(buf + offset, briteblox->readbuffer,
+                                             actual_length, packet_size,
+                                             0, size - offset);
+        offset += payload_len;
 
-                /* printf("Returning part: %d - size: %d - offset: %d - actual_length: %d - remaining: %d\n",
-                part_size, size, offset, actual_length, briteblox->readbuffer_remaining); */
+        if (offset == size)
+        {
+            // keep the part that did not fit in the read ring
+            briteblox_ring_push_stripped(briteblox->readring, briteblox->readbuffer,
+                                         actual_length, packet_size, payload_len);
 
-                return offset;
-            }
+            return offset;
         }
     }
     // never reached
@@ -1862,24 +3872,35 @@ int briteblox_read_data(struct briteblox_context *briteblox, unsigned char *buf,
     Configure read buffer chunk size.
     Default is 4096.
 
-    Automatically reallocates the buffer.
+    Automatically reallocates the buffer. Data still buffered from
+    earlier reads is discarded, the read ring grows to at least twice
+    the chunk size.
+
+    Refused while read-ahead is enabled or transfers of
+    briteblox_read_data_submit() are in flight, with or without the
+    submit pool, as they read into the buffer or write to the ring.
+    Disable read-ahead with briteblox_read_data_set_readahead() first,
+    change the chunk size and enable it again.
 
     \param briteblox pointer to briteblox_context
     \param chunksize Chunk size
 
-    \retval 0: all fine
+    \retval  0: all fine
     \retval -1: briteblox context invalid
+    \retval -2: read-ahead enabled or submitted reads pending
 */
 int briteblox_read_data_set_chunksize(struct briteblox_context *briteblox, unsigned int chunksize)
 {
     unsigned char *new_buf;
+    unsigned int ring_size;
 
     if (briteblox == NULL)
         briteblox_error_return(-1, "briteblox context invalid");
 
-    // Invalidate all remaining data
-    briteblox->readbuffer_offset = 0;
-    briteblox->readbuffer_remaining = 0;
+    if (briteblox->readahead != NULL || briteblox_atomic_load(&briteblox->reads_in_flight) > 0 ||
+        (briteblox->readpool != NULL && briteblox->readpool->in_flight > 0))
+        briteblox_error_return(-2, "read transfers in flight, disable read-ahead first");
+
 #ifdef __linux__
     /* We can't set readbuffer_chunksize larger than MAX_BULK_BUFFER_LENGTH,
        which is defined in libusb-1.0.  Otherwise, each USB read request will
@@ -1895,6 +3916,38 @@ int briteblox_read_data_set_chunksize(struct briteblox_context *briteblox, unsig
     briteblox->readbuffer = new_buf;
     briteblox->readbuffer_chunksize = chunksize;
 
+    if (briteblox->readring == NULL)
+    {
+        briteblox->readring = (struct briteblox_ring *)calloc(1, sizeof(struct briteblox_ring));
+        if (briteblox->readring == NULL)
+            briteblox_error_return(-1, "out of memory for read ring");
+    }
+
+    // Invalidate all remaining data. The ring has to hold what is left
+    // of a full chunk after a short read plus the payload of read-ahead
+    // and submit pool transfers.
+    ring_size = 2 * chunksize;
+    if (briteblox->readahead != NULL)
+    {
+        unsigned int readahead_size = (briteblox->readahead->num_transfers + 1) * briteblox->readahead->payload_size;
+        if (ring_size < readahead_size)
+            ring_size = readahead_size;
+    }
+    if (briteblox->readpool != NULL)
+    {
+        unsigned int pool_size = (briteblox->readpool->num_transfers + 1) * briteblox->readpool->payload_size;
+        if (ring_size < pool_size)
+            ring_size = pool_size;
+    }
+
+    if (briteblox->readring->size < ring_size)
+    {
+        if (briteblox_ring_alloc(briteblox->readring, ring_size) < 0)
+            briteblox_error_return(-1, "out of memory for read ring");
+    }
+    else
+        briteblox_ring_discard(briteblox->readring);
+
     return 0;
 }
 
@@ -1916,6 +3969,317 @@ int briteblox_read_data_get_chunksize(struct briteblox_context *briteblox, unsig
     return 0;
 }
 
+/**
+    Keep bulk IN transfers in flight in the background to read ahead.
+
+    While enabled, num_transfers transfers of transfer_size bytes
+    are always queued at libusb. Their payload is collected in the read
+    ring and briteblox_read_data() is mostly served from memory. The bus
+    only has to be polled when the ring runs dry, so there is no gap
+    between two USB reads anymore.
+
+    The transfers complete while libusb events are handled, i.e. inside
+    briteblox_read_data() or any other libbriteblox call that waits for
+    the bus.
+
+    Do not mix with briteblox_read_data_submit().
+
+    \param briteblox pointer to briteblox_context
+    \param num_transfers Number of transfers kept in flight. 0 disables read-ahead
+    \param transfer_size Size of a transfer. Rounded up to a multiple of
+           the packet size. 0 uses the read chunk size
+
+    \retval  0: all fine
+    \retval -1: invalid arguments or packet size
+    \retval -2: USB device unavailable
+    \retval -3: out of memory
+    \retval -4: libusb_submit_transfer() failed
+    \retval -5: the library event thread runs, see briteblox_library_start_event_thread()
+*/
+int briteblox_read_data_set_readahead(struct briteblox_context *briteblox, int num_transfers, int transfer_size)
+{
+    struct briteblox_readahead *ra;
+    int packet_size, i;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-2, "USB device unavailable");
+
+    if (num_transfers > 0 && briteblox_event_thread_active(briteblox))
+        briteblox_error_return(-5, "read-ahead does not work with the library event thread");
+
+    if (num_transfers < 0 || transfer_size < 0)
+        briteblox_error_return(-1, "invalid read-ahead parameters");
+
+    packet_size = briteblox->max_packet_size;
+    if (packet_size <= 2)
+        briteblox_error_return(-1, "max_packet_size is bogus");
+
+    briteblox_readahead_free(briteblox);
+    if (num_transfers == 0)
+        return 0;
+
+    if (transfer_size == 0)
+        transfer_size = briteblox->readbuffer_chunksize;
+    transfer_size = (transfer_size + packet_size - 1) / packet_size * packet_size;
+
+    ra = (struct briteblox_readahead *)calloc(1, sizeof(*ra));
+    if (ra == NULL)
+        briteblox_error_return(-3, "out of memory for read-ahead");
+
+    ra->num_transfers = num_transfers;
+    ra->transfer_size = transfer_size;
+    ra->payload_size = transfer_size / packet_size * (packet_size - 2);
+    ra->transfers = (struct libusb_transfer **)calloc(num_transfers, sizeof(*ra->transfers));
+    ra->parked = (unsigned int *)calloc(num_transfers, sizeof(*ra->parked));
+    briteblox->readahead = ra;
+
+    if (ra->transfers == NULL || ra->parked == NULL ||
+        briteblox_ring_grow(briteblox->readring, (num_transfers + 1) * ra->payload_size) < 0)
+    {
+        briteblox_readahead_free(briteblox);
+        briteblox_error_return(-3, "out of memory for read-ahead");
+    }
+
+    for (i = 0; i < num_transfers; i++)
+    {
+        struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+        unsigned char *buffer = (unsigned char *)malloc(transfer_size);
+
+        if (transfer == NULL || buffer == NULL)
+        {
+            libusb_free_transfer(transfer);
+            free(buffer);
+            briteblox_readahead_free(briteblox);
+            briteblox_error_return(-3, "out of memory for read-ahead");
+        }
+
+        libusb_fill_bulk_transfer(transfer, briteblox->usb_dev, briteblox->out_ep, buffer,
+                                  transfer_size, briteblox_readahead_cb, briteblox, 0);
+        ra->transfers[i] = transfer;
+    }
+
+    for (i = 0; i < num_transfers; i++)
+    {
+        if (briteblox_readahead_submit(briteblox, ra->transfers[i]) < 0)
+        {
+            briteblox_readahead_free(briteblox);
+            briteblox_error_return(-4, "libusb_submit_transfer() failed");
+        }
+    }
+
+    return 0;
+}
+
+/**
+    Get read-ahead configuration.
+
+    \param briteblox pointer to briteblox_context
+    \param num_transfers Pointer to store number of transfers in, 0 if disabled
+    \param transfer_size Pointer to store transfer size in
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_read_data_get_readahead(struct briteblox_context *briteblox, int *num_transfers, int *transfer_size)
+{
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    *num_transfers = briteblox->readahead ? briteblox->readahead->num_transfers : 0;
+    *transfer_size = briteblox->readahead ? briteblox->readahead->transfer_size : 0;
+    return 0;
+}
+
+/**
+    Serve briteblox_read_data_submit() from a pool of preallocated transfers.
+
+    Without a pool every submitted read uses the context's single read
+    buffer, so only one read may be pending at a time. With a pool any
+    number of reads can be submitted. Up to num_transfers bulk IN
+    transfers are kept in flight while reads are pending, each with its
+    own buffer, and the reads complete in the order they were submitted.
+
+    Do not mix with read-ahead, see briteblox_read_data_set_readahead().
+
+    \param briteblox pointer to briteblox_context
+    \param num_transfers Number of transfers in the pool. 0 disables the pool
+    \param transfer_size Size of a transfer. Rounded up to a multiple of
+           the packet size. 0 uses the read chunk size
+
+    \retval  0: all fine
+    \retval -1: invalid arguments or packet size
+    \retval -2: USB device unavailable
+    \retval -3: out of memory
+    \retval -4: reads still pending
+    \retval -5: the library event thread runs, see briteblox_library_start_event_thread()
+*/
+int briteblox_read_data_set_submit_pool(struct briteblox_context *briteblox, int num_transfers, int transfer_size)
+{
+    struct briteblox_read_pool *pool;
+    int packet_size, i;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-2, "USB device unavailable");
+
+    if (num_transfers > 0 && briteblox_event_thread_active(briteblox))
+        briteblox_error_return(-5, "submit pool does not work with the library event thread");
+
+    if (num_transfers < 0 || transfer_size < 0)
+        briteblox_error_return(-1, "invalid submit pool parameters");
+
+    packet_size = briteblox->max_packet_size;
+    if (packet_size <= 2)
+        briteblox_error_return(-1, "max_packet_size is bogus");
+
+    if (briteblox->readpool != NULL && briteblox->readpool->head != NULL)
+        briteblox_error_return(-4, "reads still pending");
+
+    briteblox_read_pool_free(briteblox);
+    if (num_transfers == 0)
+        return 0;
+
+    if (transfer_size == 0)
+        transfer_size = briteblox->readbuffer_chunksize;
+    transfer_size = (transfer_size + packet_size - 1) / packet_size * packet_size;
+
+    pool = (struct briteblox_read_pool *)calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        briteblox_error_return(-3, "out of memory for submit pool");
+
+    pool->num_transfers = num_transfers;
+    pool->transfer_size = transfer_size;
+    pool->payload_size = transfer_size / packet_size * (packet_size - 2);
+    pool->transfers = (struct libusb_transfer **)calloc(num_transfers, sizeof(*pool->transfers));
+    pool->idle = (struct libusb_transfer **)calloc(num_transfers, sizeof(*pool->idle));
+    briteblox->readpool = pool;
+
+    // payload nobody asked for yet ends up in the read ring
+    if (pool->transfers == NULL || pool->idle == NULL ||
+        briteblox_ring_grow(briteblox->readring, (num_transfers + 1) * pool->payload_size) < 0)
+    {
+        briteblox_read_pool_free(briteblox);
+        briteblox_error_return(-3, "out of memory for submit pool");
+    }
+
+    for (i = 0; i < num_transfers; i++)
+    {
+        struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+        unsigned char *buffer = (unsigned char *)malloc(transfer_size);
+
+        if (transfer == NULL || buffer == NULL)
+        {
+            libusb_free_transfer(transfer);
+            free(buffer);
+            briteblox_read_pool_free(briteblox);
+            briteblox_error_return(-3, "out of memory for submit pool");
+        }
+
+        libusb_fill_bulk_transfer(transfer, briteblox->usb_dev, briteblox->out_ep, buffer,
+                                  transfer_size, briteblox_read_pool_cb, briteblox,
+                                  briteblox->usb_read_timeout);
+        pool->transfers[i] = transfer;
+        pool->idle[pool->num_idle++] = transfer;
+    }
+
+    return 0;
+}
+
+/**
+    Get submit pool configuration.
+
+    \param briteblox pointer to briteblox_context
+    \param num_transfers Pointer to store number of transfers in, 0 if disabled
+    \param transfer_size Pointer to store transfer size in
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_read_data_get_submit_pool(struct briteblox_context *briteblox, int *num_transfers, int *transfer_size)
+{
+    if (briteblox == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    *num_transfers = briteblox->readpool ? briteblox->readpool->num_transfers : 0;
+    *transfer_size = briteblox->readpool ? briteblox->readpool->transfer_size : 0;
+    return 0;
+}
+
+/**
+    Get fill level statistics of the read ring.
+
+    All received payload not yet returned by briteblox_read_data() is
+    held in the read ring. A high water mark close to the size means
+    the application does not keep up and read-ahead transfers had to
+    wait, see briteblox_read_data_set_ringsize().
+
+    \param briteblox pointer to briteblox_context
+    \param fill Pointer to store the number of buffered bytes in, may be NULL
+    \param high_water Pointer to store the highest fill level since the
+           last briteblox_read_data_reset_high_water() in, may be NULL
+    \param size Pointer to store the ring size in, may be NULL
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_read_data_get_ring_stats(struct briteblox_context *briteblox, unsigned int *fill,
+                                       unsigned int *high_water, unsigned int *size)
+{
+    if (briteblox == NULL || briteblox->readring == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    if (fill)
+        *fill = briteblox_ring_fill(briteblox->readring);
+    if (high_water)
+        *high_water = briteblox_atomic_load(&briteblox->readring->high_water);
+    if (size)
+        *size = briteblox->readring->size;
+    return 0;
+}
+
+/**
+    Reset the high water mark of the read ring to the current fill level.
+
+    \param briteblox pointer to briteblox_context
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+*/
+int briteblox_read_data_reset_high_water(struct briteblox_context *briteblox)
+{
+    if (briteblox == NULL || briteblox->readring == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    briteblox_atomic_store(&briteblox->readring->high_water,
+                           briteblox_ring_fill(briteblox->readring));
+    return 0;
+}
+
+/**
+    Grow the read ring.
+
+    The size is rounded up to a power of two. Buffered data is kept.
+    The ring never shrinks, it is at least twice the read chunk size
+    and large enough for the read-ahead transfers.
+
+    Do not call while another thread reads from or fills the ring.
+
+    \param briteblox pointer to briteblox_context
+    \param size Minimum ring size in bytes
+
+    \retval  0: all fine
+    \retval -1: briteblox context invalid
+    \retval -2: out of memory
+*/
+int briteblox_read_data_set_ringsize(struct briteblox_context *briteblox, unsigned int size)
+{
+    if (briteblox == NULL || briteblox->readring == NULL)
+        briteblox_error_return(-1, "briteblox context invalid");
+
+    if (briteblox_ring_grow(briteblox->readring, size) < 0)
+        briteblox_error_return(-2, "out of memory for read ring");
+    return 0;
+}
+
 /**
     Enable/disable bitbang modes.
 
@@ -1935,6 +4299,13 @@ int briteblox_set_bitmode(struct briteblox_context *briteblox, unsigned char bit
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_BITMODE,
+                                   briteblox->config.bitmask == bitmask && briteblox->config.bitmode == mode))
+        return 0;
+
     usb_val = bitmask; // low byte: bitmask
     usb_val |= (mode << 8);
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE, SIO_SET_BITMODE_REQUEST, usb_val, briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
@@ -1942,6 +4313,9 @@ int briteblox_set_bitmode(struct briteblox_context *briteblox, unsigned char bit
 
     briteblox->bitbang_mode = mode;
     briteblox->bitbang_enabled = (mode == BITMODE_RESET) ? 0 : 1;
+    briteblox->config.bitmask = bitmask;
+    briteblox->config.bitmode = mode;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_BITMODE;
     return 0;
 }
 
@@ -1959,10 +4333,16 @@ int briteblox_disable_bitbang(struct briteblox_context *briteblox)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE, SIO_SET_BITMODE_REQUEST, 0, briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "unable to leave bitbang mode. Perhaps not a BM type chip?");
 
     briteblox->bitbang_enabled = 0;
+    briteblox->config.bitmask = 0;
+    briteblox->config.bitmode = BITMODE_RESET;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_BITMODE;
     return 0;
 }
 
@@ -2013,10 +4393,18 @@ int briteblox_set_latency_timer(struct briteblox_context *briteblox, unsigned ch
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-3, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-2, "flushing the write buffer failed");
+
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_LATENCY, briteblox->config.latency == latency))
+        return 0;
+
     usb_val = latency;
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE, SIO_SET_LATENCY_TIMER_REQUEST, usb_val, briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-2, "unable to set latency timer");
 
+    briteblox->config.latency = latency;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_LATENCY;
     return 0;
 }
 
@@ -2115,11 +4503,19 @@ int briteblox_setflowctrl(struct briteblox_context *briteblox, int flowctrl)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_FLOWCTRL, briteblox->config.flowctrl == flowctrl))
+        return 0;
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE,
                                 SIO_SET_FLOW_CTRL_REQUEST, 0, (flowctrl | briteblox->index),
                                 NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "set flow control failed");
 
+    briteblox->config.flowctrl = flowctrl;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_FLOWCTRL;
     return 0;
 }
 
@@ -2140,6 +4536,12 @@ int briteblox_setdtr(struct briteblox_context *briteblox, int state)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_DTR, briteblox->config.dtr == (state ? 1 : 0)))
+        return 0;
+
     if (state)
         usb_val = SIO_SET_DTR_HIGH;
     else
@@ -2150,6 +4552,8 @@ int briteblox_setdtr(struct briteblox_context *briteblox, int state)
                                 NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "set dtr failed");
 
+    briteblox->config.dtr = state ? 1 : 0;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_DTR;
     return 0;
 }
 
@@ -2170,6 +4574,12 @@ int briteblox_setrts(struct briteblox_context *briteblox, int state)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_RTS, briteblox->config.rts == (state ? 1 : 0)))
+        return 0;
+
     if (state)
         usb_val = SIO_SET_RTS_HIGH;
     else
@@ -2180,6 +4590,8 @@ int briteblox_setrts(struct briteblox_context *briteblox, int state)
                                 NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "set of rts failed");
 
+    briteblox->config.rts = state ? 1 : 0;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_RTS;
     return 0;
 }
 
@@ -2201,6 +4613,13 @@ int briteblox_setdtr_rts(struct briteblox_context *briteblox, int dtr, int rts)
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_DTR | BRITEBLOX_CONFIG_RTS,
+                                   briteblox->config.dtr == (dtr ? 1 : 0) && briteblox->config.rts == (rts ? 1 : 0)))
+        return 0;
+
     if (dtr)
         usb_val = SIO_SET_DTR_HIGH;
     else
@@ -2216,6 +4635,9 @@ int briteblox_setdtr_rts(struct briteblox_context *briteblox, int dtr, int rts)
                                 NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "set of rts/dtr failed");
 
+    briteblox->config.dtr = dtr ? 1 : 0;
+    briteblox->config.rts = rts ? 1 : 0;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_DTR | BRITEBLOX_CONFIG_RTS;
     return 0;
 }
 
@@ -2238,13 +4660,21 @@ int briteblox_set_event_char(struct briteblox_context *briteblox,
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
     usb_val = eventch;
     if (enable)
         usb_val |= 1 << 8;
 
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_EVENT_CHAR, briteblox->config.event_char == usb_val))
+        return 0;
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE, SIO_SET_EVENT_CHAR_REQUEST, usb_val, briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "setting event character failed");
 
+    briteblox->config.event_char = usb_val;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_EVENT_CHAR;
     return 0;
 }
 
@@ -2267,13 +4697,21 @@ int briteblox_set_error_char(struct briteblox_context *briteblox,
     if (briteblox == NULL || briteblox->usb_dev == NULL)
         briteblox_error_return(-2, "USB device unavailable");
 
+    if (briteblox_write_coalesce_flush(briteblox) < 0)
+        briteblox_error_return(-1, "flushing the write buffer failed");
+
     usb_val = errorch;
     if (enable)
         usb_val |= 1 << 8;
 
+    if (briteblox_shadow_unchanged(briteblox, BRITEBLOX_CONFIG_ERROR_CHAR, briteblox->config.error_char == usb_val))
+        return 0;
+
     if (libusb_control_transfer(briteblox->usb_dev, BRITEBLOX_DEVICE_OUT_REQTYPE, SIO_SET_ERROR_CHAR_REQUEST, usb_val, briteblox->index, NULL, 0, briteblox->usb_write_timeout) < 0)
         briteblox_error_return(-1, "setting error character failed");
 
+    briteblox->config.error_char = usb_val;
+    briteblox->config.valid |= BRITEBLOX_CONFIG_ERROR_CHAR;
     return 0;
 }
 
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <stdio.h>
 
 /* 'interface' might be defined as a macro on Windows, so we need to
  * undefine it so as not to break the current libbriteblox API, because
@@ -85,6 +86,67 @@ enum briteblox_module_detach_mode
     DONT_DETACH_SIO_MODULE = 1
 };
 
+/** Steps of briteblox_usb_open_dev() to leave out, see briteblox_set_open_flags() */
+enum briteblox_open_flags
+{
+    /** no SIO reset, the chip keeps its settings and buffer content */
+    BRITEBLOX_OPEN_NO_RESET = 0x01,
+    /** don't program the default baud rate of 9600 */
+    BRITEBLOX_OPEN_NO_BAUDRATE = 0x02,
+    /** take the packet size from the snapshot or the chip type */
+    BRITEBLOX_OPEN_NO_PACKET_PROBE = 0x04,
+    /** program the settings of the snapshot */
+    BRITEBLOX_OPEN_RESTORE = 0x08
+};
+
+/** Settings held by a briteblox_config_snapshot */
+enum briteblox_config_field
+{
+    BRITEBLOX_CONFIG_BAUDRATE = 0x001,
+    BRITEBLOX_CONFIG_LINE_PROPERTY = 0x002,
+    BRITEBLOX_CONFIG_FLOWCTRL = 0x004,
+    BRITEBLOX_CONFIG_DTR = 0x008,
+    BRITEBLOX_CONFIG_RTS = 0x010,
+    BRITEBLOX_CONFIG_LATENCY = 0x020,
+    BRITEBLOX_CONFIG_BITMODE = 0x040,
+    BRITEBLOX_CONFIG_EVENT_CHAR = 0x080,
+    BRITEBLOX_CONFIG_ERROR_CHAR = 0x100
+};
+
+/**
+    \brief Settings programmed into an open channel
+
+    The values are the ones sent to the chip, see
+    briteblox_get_config_snapshot() and briteblox_set_open_flags().
+*/
+struct briteblox_config_snapshot
+{
+    /** BRITEBLOX_CONFIG_* bits of the settings programmed since open */
+    unsigned int valid;
+    /** chip type the settings belong to */
+    enum briteblox_chip_type type;
+    /** packet size of the IN endpoint, 0 if unknown */
+    unsigned int max_packet_size;
+    /** baudrate as kept in briteblox_context */
+    int baudrate;
+    /** value and index of the baudrate divisor */
+    unsigned short baud_value;
+    unsigned short baud_index;
+    /** data bits, parity, stop bits and break */
+    unsigned short line_property;
+    /** SIO_DISABLE_FLOW_CTRL, SIO_RTS_CTS_HS, SIO_DTR_DSR_HS or SIO_XON_XOFF_HS */
+    unsigned short flowctrl;
+    unsigned char dtr;
+    unsigned char rts;
+    unsigned char latency;
+    unsigned char bitmask;
+    /** BITMODE_RESET if bitbang is off */
+    unsigned char bitmode;
+    /** character in the low byte, enable in bit 8 */
+    unsigned short event_char;
+    unsigned short error_char;
+};
+
 /* Shifting commands IN MPSSE Mode*/
 #define MPSSE_WRITE_NEG 0x01   /* Write TDI/DO on negative TCK/SK edge*/
 #define MPSSE_BITMODE   0x02   /* Write bits, not bytes */
@@ -209,6 +271,10 @@ struct briteblox_transfer_control
     int offset;
     struct briteblox_context *briteblox;
     struct libusb_transfer *transfer;
+    /** error of a read served by the submit pool, 0 if none */
+    int error;
+    /** next pending read of the submit pool */
+    struct briteblox_transfer_control *next;
 };
 
 /**
@@ -235,12 +301,10 @@ struct briteblox_context
     int baudrate;
     /** bitbang mode state */
     unsigned char bitbang_enabled;
-    /** pointer to read buffer for briteblox_read_data */
+    /** pointer to read buffer for briteblox_read_data, raw USB data lands here */
     unsigned char *readbuffer;
-    /** read buffer offset */
-    unsigned int readbuffer_offset;
-    /** number of remaining data in internal read buffer */
-    unsigned int readbuffer_remaining;
+    /** received payload not yet handed to the application */
+    struct briteblox_ring *readring;
     /** read buffer chunk size */
     unsigned int readbuffer_chunksize;
     /** write buffer chunk size */
@@ -269,6 +333,33 @@ struct briteblox_context
 
     /** Defines behavior in case a kernel module is already attached to the device */
     enum briteblox_module_detach_mode module_detach_mode;
+
+    /** Read-ahead state, NULL if disabled. See briteblox_read_data_set_readahead() */
+    struct briteblox_readahead *readahead;
+    /** Transfer pool for briteblox_read_data_submit(), NULL if disabled */
+    struct briteblox_read_pool *readpool;
+    /** briteblox_read_data_submit() transfers outside the pool still
+        reading into readbuffer */
+    unsigned int reads_in_flight;
+    /** Preallocated transfer controls for the async submit functions */
+    struct briteblox_transfer_pool *transferpool;
+    /** Coalescing write buffer, NULL if disabled */
+    struct briteblox_write_coalesce *writecoalesce;
+    /** Shared library context owning usb_ctx, NULL if usb_ctx is our own */
+    struct briteblox_library *library;
+
+    /** BRITEBLOX_OPEN_* steps briteblox_usb_open_dev() leaves out */
+    int open_flags;
+    /** settings for BRITEBLOX_OPEN_RESTORE and BRITEBLOX_OPEN_NO_PACKET_PROBE */
+    struct briteblox_config_snapshot open_snapshot;
+    /** settings programmed since the device was opened, also the shadow of the chip registers */
+    struct briteblox_config_snapshot config;
+    /** non-zero: setters always send their control transfer */
+    int shadow_force;
+    /** setter calls compared against the shadow */
+    unsigned int shadow_checked;
+    /** control transfers skipped because the value was unchanged */
+    unsigned int shadow_skipped;
 };
 
 /**
@@ -433,6 +524,172 @@ typedef struct
 typedef int (BRITEBLOXStreamCallback)(uint8_t *buffer, int length,
                                  BRITEBLOXProgressInfo *progress, void *userdata);
 
+/** One contiguous block of payload for BRITEBLOXStreamBatchCallback */
+struct briteblox_iovec
+{
+    uint8_t *base;
+    int len;
+};
+
+/** Flags for briteblox_readstream_batch() */
+enum briteblox_stream_flags
+{
+    /** Hand out the payload of every packet as its own iovec entry
+        instead of compacting the transfer into one block */
+    BRITEBLOX_STREAM_IOVEC = 0x01,
+};
+
+typedef int (BRITEBLOXStreamBatchCallback)(const struct briteblox_iovec *iov, int iovcnt,
+                                           BRITEBLOXProgressInfo *progress, void *userdata);
+
+typedef int (BRITEBLOXWriteStreamCallback)(uint8_t *buffer, int length,
+                                           BRITEBLOXProgressInfo *progress, void *userdata);
+
+/** Streaming session, see briteblox_stream_new() */
+struct briteblox_stream;
+
+/** MPSSE command queue, see briteblox_mpsse_queue_new() */
+struct briteblox_mpsse_queue;
+
+/** SPI master engine, see briteblox_spi_new() */
+struct briteblox_spi;
+
+/** Flags for briteblox_spi_new() */
+enum briteblox_spi_flags
+{
+    /** Shift the LSB of every byte first */
+    BRITEBLOX_SPI_LSB_FIRST = 0x01,
+    /** Chip selects are active high */
+    BRITEBLOX_SPI_CS_ACTIVE_HIGH = 0x02,
+};
+
+/** Flags for struct briteblox_spi_transfer */
+enum briteblox_spi_transfer_flags
+{
+    /** Keep the chip selected after this transfer */
+    BRITEBLOX_SPI_CS_HOLD = 0x01,
+};
+
+/** One entry of the list for briteblox_spi_transfer() */
+struct briteblox_spi_transfer
+{
+    /** bytes to send, NULL to only read */
+    const unsigned char *tx;
+    /** buffer for received bytes, NULL to only write */
+    unsigned char *rx;
+    /** number of bytes */
+    int length;
+    /** ADBUS pin number of the chip select, 3 to 7 */
+    int cs;
+    /** combination of enum briteblox_spi_transfer_flags */
+    int flags;
+};
+
+/** I2C master engine, see briteblox_i2c_new() */
+struct briteblox_i2c;
+
+/** Flags for struct briteblox_i2c_msg */
+enum briteblox_i2c_msg_flags
+{
+    /** Read from the slave instead of writing */
+    BRITEBLOX_I2C_READ = 0x01,
+    /** End the transaction with a stop condition after this message */
+    BRITEBLOX_I2C_STOP = 0x02,
+};
+
+/** One entry of the list for briteblox_i2c_transfer() */
+struct briteblox_i2c_msg
+{
+    /** 7 bit slave address */
+    unsigned char addr;
+    /** combination of enum briteblox_i2c_msg_flags */
+    int flags;
+    /** data to write or buffer for the data read */
+    unsigned char *buf;
+    /** number of bytes */
+    int length;
+};
+
+/** JTAG TAP engine, see briteblox_jtag_new() */
+struct briteblox_jtag;
+
+/** TAP controller states */
+enum briteblox_jtag_state
+{
+    JTAG_TEST_LOGIC_RESET = 0,
+    JTAG_RUN_TEST_IDLE = 1,
+    JTAG_SELECT_DR_SCAN = 2,
+    JTAG_CAPTURE_DR = 3,
+    JTAG_SHIFT_DR = 4,
+    JTAG_EXIT1_DR = 5,
+    JTAG_PAUSE_DR = 6,
+    JTAG_EXIT2_DR = 7,
+    JTAG_UPDATE_DR = 8,
+    JTAG_SELECT_IR_SCAN = 9,
+    JTAG_CAPTURE_IR = 10,
+    JTAG_SHIFT_IR = 11,
+    JTAG_EXIT1_IR = 12,
+    JTAG_PAUSE_IR = 13,
+    JTAG_EXIT2_IR = 14,
+    JTAG_UPDATE_IR = 15
+};
+
+/** SWD host engine, see briteblox_swd_new() */
+struct briteblox_swd;
+
+/** Bitbang waveform, see briteblox_wave_new() */
+struct briteblox_wave;
+
+/** Shared libusb context of several briteblox_contexts, see briteblox_library_new() */
+struct briteblox_library;
+
+/** Chip known to the device registry, see briteblox_registry_start() */
+struct briteblox_registry_device
+{
+    /** libusb device */
+    struct libusb_device *dev;
+    int vendor;
+    int product;
+    int bus;
+    int address;
+    /** port numbers from the root hub, see libusb_get_port_numbers() */
+    uint8_t ports[7];
+    int num_ports;
+    /** string descriptors, empty if they couldn't be read */
+    char manufacturer[128];
+    char description[128];
+    char serial[128];
+    /** strings not read yet: 1 manufacturer, 2 description, 4 serial.
+        Lookups by description or serial retry them. */
+    int strings_missing;
+};
+
+enum briteblox_registry_event
+{
+    BRITEBLOX_DEVICE_ARRIVED = 1,
+    BRITEBLOX_DEVICE_LEFT = 2
+};
+
+typedef void (BRITEBLOXRegistryCallback)(const struct briteblox_registry_device *device,
+                                         enum briteblox_registry_event event, void *userdata);
+
+/** Run-length encoder for pin samples, see briteblox_rle_new() */
+struct briteblox_rle;
+
+typedef int (BRITEBLOXCaptureCallback)(const unsigned char *rle, int length,
+                                       BRITEBLOXProgressInfo *progress, void *userdata);
+
+/** File descriptor to poll, see briteblox_get_pollfds() */
+struct briteblox_pollfd
+{
+    int fd;
+    /** poll() events, POLLIN and/or POLLOUT */
+    short events;
+};
+
+typedef void (briteblox_pollfd_added_cb)(int fd, short events, void *user_data);
+typedef void (briteblox_pollfd_removed_cb)(int fd, void *user_data);
+
 /**
  * Provide libbriteblox version information
  * major: Library major version
@@ -458,12 +715,35 @@ extern "C"
 
     int briteblox_init(struct briteblox_context *briteblox);
     struct briteblox_context *briteblox_new(void);
+    int briteblox_init_shared(struct briteblox_context *briteblox, struct briteblox_library *library);
+    struct briteblox_context *briteblox_new_shared(struct briteblox_library *library);
     int briteblox_set_interface(struct briteblox_context *briteblox, enum briteblox_interface interface);
 
     void briteblox_deinit(struct briteblox_context *briteblox);
     void briteblox_free(struct briteblox_context *briteblox);
     void briteblox_set_usbdev (struct briteblox_context *briteblox, struct libusb_device_handle *usbdev);
 
+    struct briteblox_library *briteblox_library_new(void);
+    struct briteblox_library *briteblox_library_ref(struct briteblox_library *library);
+    void briteblox_library_unref(struct briteblox_library *library);
+    int briteblox_library_start_event_thread(struct briteblox_library *library);
+    int briteblox_library_stop_event_thread(struct briteblox_library *library);
+    struct libusb_context *briteblox_library_get_usb_context(struct briteblox_library *library);
+
+    int briteblox_registry_start(struct briteblox_library *library, int vendor, int product,
+                                 BRITEBLOXRegistryCallback *callback, void *userdata);
+    void briteblox_registry_stop(struct briteblox_library *library);
+    int briteblox_registry_poll(struct briteblox_library *library);
+    int briteblox_registry_get_devices(struct briteblox_library *library,
+                                       struct briteblox_registry_device *devices, int max);
+    unsigned int briteblox_registry_get_lost(struct briteblox_library *library);
+
+    int briteblox_string_cache_enable(struct briteblox_library *library, const char *path);
+    int briteblox_string_cache_save(struct briteblox_library *library);
+    void briteblox_string_cache_clear(struct briteblox_library *library);
+    int briteblox_string_cache_get_stats(struct briteblox_library *library,
+                                         unsigned int *hits, unsigned int *misses);
+
     struct briteblox_version_info briteblox_get_library_version(void);
 
     int briteblox_usb_find_all(struct briteblox_context *briteblox, struct briteblox_device_list **devlist,
@@ -483,6 +763,13 @@ extern "C"
     int briteblox_usb_open_desc_index(struct briteblox_context *briteblox, int vendor, int product,
                                  const char* description, const char* serial, unsigned int index);
     int briteblox_usb_open_dev(struct briteblox_context *briteblox, struct libusb_device *dev);
+    int briteblox_set_open_flags(struct briteblox_context *briteblox, int flags,
+                                 const struct briteblox_config_snapshot *snapshot);
+    int briteblox_get_config_snapshot(struct briteblox_context *briteblox,
+                                      struct briteblox_config_snapshot *snapshot);
+    int briteblox_shadow_set_force(struct briteblox_context *briteblox, int force);
+    void briteblox_shadow_invalidate(struct briteblox_context *briteblox);
+    int briteblox_shadow_get_stats(struct briteblox_context *briteblox, unsigned int *checked, unsigned int *skipped);
     int briteblox_usb_open_string(struct briteblox_context *briteblox, const char* description);
 
     int briteblox_usb_close(struct briteblox_context *briteblox);
@@ -492,6 +779,7 @@ extern "C"
     int briteblox_usb_purge_buffers(struct briteblox_context *briteblox);
 
     int briteblox_set_baudrate(struct briteblox_context *briteblox, int baudrate);
+    int briteblox_set_bitbang_rate(struct briteblox_context *briteblox, int rate);
     int briteblox_set_line_property(struct briteblox_context *briteblox, enum briteblox_bits_type bits,
                                enum briteblox_stopbits_type sbit, enum briteblox_parity_type parity);
     int briteblox_set_line_property2(struct briteblox_context *briteblox, enum briteblox_bits_type bits,
@@ -501,17 +789,152 @@ extern "C"
     int briteblox_read_data(struct briteblox_context *briteblox, unsigned char *buf, int size);
     int briteblox_read_data_set_chunksize(struct briteblox_context *briteblox, unsigned int chunksize);
     int briteblox_read_data_get_chunksize(struct briteblox_context *briteblox, unsigned int *chunksize);
+    int briteblox_read_data_set_readahead(struct briteblox_context *briteblox, int num_transfers, int transfer_size);
+    int briteblox_read_data_get_readahead(struct briteblox_context *briteblox, int *num_transfers, int *transfer_size);
+    int briteblox_read_data_set_submit_pool(struct briteblox_context *briteblox, int num_transfers, int transfer_size);
+    int briteblox_read_data_get_submit_pool(struct briteblox_context *briteblox, int *num_transfers, int *transfer_size);
+    int briteblox_read_data_get_ring_stats(struct briteblox_context *briteblox, unsigned int *fill,
+                                           unsigned int *high_water, unsigned int *size);
+    int briteblox_read_data_reset_high_water(struct briteblox_context *briteblox);
+    int briteblox_read_data_set_ringsize(struct briteblox_context *briteblox, unsigned int size);
 
     int briteblox_write_data(struct briteblox_context *briteblox, const unsigned char *buf, int size);
+    int briteblox_write_datav(struct briteblox_context *briteblox, const struct briteblox_iovec *iov, int iovcnt);
     int briteblox_write_data_set_chunksize(struct briteblox_context *briteblox, unsigned int chunksize);
+    int briteblox_write_data_set_coalescing(struct briteblox_context *briteblox, int enable, unsigned int deadline_us);
+    int briteblox_write_data_get_coalescing_stats(struct briteblox_context *briteblox, unsigned int *writes,
+                                                  unsigned int *flushes, unsigned int *pending);
+    int briteblox_flush(struct briteblox_context *briteblox);
     int briteblox_write_data_get_chunksize(struct briteblox_context *briteblox, unsigned int *chunksize);
 
     int briteblox_readstream(struct briteblox_context *briteblox, BRITEBLOXStreamCallback *callback,
                         void *userdata, int packetsPerTransfer, int numTransfers);
+    int briteblox_readstream_batch(struct briteblox_context *briteblox, BRITEBLOXStreamBatchCallback *callback,
+                                   void *userdata, int packetsPerTransfer, int numTransfers, int flags);
+
+    int briteblox_writestream(struct briteblox_context *briteblox, BRITEBLOXWriteStreamCallback *callback,
+                              void *userdata, int transferSize, int numTransfers);
+
+    struct briteblox_stream *briteblox_stream_new(struct briteblox_context *briteblox,
+                                                  int packetsPerTransfer, int numTransfers);
+    int briteblox_stream_start(struct briteblox_stream *stream, BRITEBLOXStreamBatchCallback *callback,
+                               void *userdata, int flags);
+    int briteblox_stream_pause(struct briteblox_stream *stream);
+    int briteblox_stream_resume(struct briteblox_stream *stream);
+    int briteblox_stream_stop(struct briteblox_stream *stream);
+    int briteblox_stream_run(struct briteblox_stream *stream);
+    int briteblox_stream_step(struct briteblox_stream *stream);
+    int briteblox_stream_get_progress(struct briteblox_stream *stream, BRITEBLOXProgressInfo *progress);
+    int briteblox_stream_set_mode(struct briteblox_stream *stream, unsigned char mode);
+    int briteblox_stream_set_consumer_thread(struct briteblox_stream *stream, int queue_depth);
+    int briteblox_stream_get_consumer_stats(struct briteblox_stream *stream, unsigned int *queued,
+                                            unsigned int *backpressure, unsigned int *drops,
+                                            uint64_t *dropped_bytes);
+    void briteblox_stream_destroy(struct briteblox_stream *stream);
     struct briteblox_transfer_control *briteblox_write_data_submit(struct briteblox_context *briteblox, unsigned char *buf, int size);
 
     struct briteblox_transfer_control *briteblox_read_data_submit(struct briteblox_context *briteblox, unsigned char *buf, int size);
     int briteblox_transfer_data_done(struct briteblox_transfer_control *tc);
+    int briteblox_transfer_data_done_any(struct briteblox_transfer_control **tcs, int count,
+                                         struct timeval *timeout, int *result);
+    int briteblox_transfer_data_done_all(struct briteblox_transfer_control **tcs, int count,
+                                         struct timeval *timeout, int *results);
+    int briteblox_transfer_data_cancel(struct briteblox_transfer_control *tc, struct timeval *timeout);
+    int briteblox_transfer_pool_set_size(struct briteblox_context *briteblox, int size);
+    int briteblox_transfer_pool_get_stats(struct briteblox_context *briteblox, unsigned int *size,
+                                          unsigned int *in_use, unsigned int *exhausted);
+
+    int briteblox_get_pollfds(struct briteblox_context *briteblox, struct briteblox_pollfd *fds, int max);
+    int briteblox_set_pollfd_notifiers(struct briteblox_context *briteblox,
+                                       briteblox_pollfd_added_cb *added_cb,
+                                       briteblox_pollfd_removed_cb *removed_cb,
+                                       void *user_data);
+    int briteblox_get_next_timeout(struct briteblox_context *briteblox, struct timeval *tv);
+    int briteblox_handle_events_nonblocking(struct briteblox_context *briteblox);
+
+    struct briteblox_mpsse_queue *briteblox_mpsse_queue_new(struct briteblox_context *briteblox);
+    void briteblox_mpsse_queue_free(struct briteblox_mpsse_queue *q);
+    void briteblox_mpsse_queue_reset(struct briteblox_mpsse_queue *q);
+    int briteblox_mpsse_queue_get_size(struct briteblox_mpsse_queue *q, int *cmd_bytes, int *response_bytes);
+    int briteblox_mpsse_queue_execute(struct briteblox_mpsse_queue *q);
+    int briteblox_mpsse_command(struct briteblox_mpsse_queue *q, const unsigned char *cmd, int length,
+                                unsigned char *result, int result_length);
+    int briteblox_mpsse_clock_out(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                  const unsigned char *data, int length);
+    int briteblox_mpsse_clock_in(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                 unsigned char *result, int length);
+    int briteblox_mpsse_clock_inout(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                    const unsigned char *data, unsigned char *result, int length);
+    int briteblox_mpsse_clock_bits_out(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                       unsigned char data, int bits);
+    int briteblox_mpsse_clock_bits_in(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                      unsigned char *result, int bits);
+    int briteblox_mpsse_clock_bits_inout(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                         unsigned char data, unsigned char *result, int bits);
+    int briteblox_mpsse_clock_tms(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                  unsigned char tms, int bits, int tdi, unsigned char *result);
+    int briteblox_mpsse_set_gpio(struct briteblox_mpsse_queue *q, int high,
+                                 unsigned char value, unsigned char direction);
+    int briteblox_mpsse_get_gpio(struct briteblox_mpsse_queue *q, int high, unsigned char *result);
+    int briteblox_mpsse_wait_on(struct briteblox_mpsse_queue *q, int level);
+    int briteblox_mpsse_set_divisor(struct briteblox_mpsse_queue *q, unsigned short divisor);
+    int briteblox_mpsse_set_clock(struct briteblox_mpsse_queue *q, unsigned int frequency);
+    int briteblox_mpsse_enable(struct briteblox_context *briteblox);
+
+    struct briteblox_spi *briteblox_spi_new(struct briteblox_context *briteblox, int mode,
+                                            unsigned int frequency, unsigned char cs_mask, int flags);
+    void briteblox_spi_free(struct briteblox_spi *spi);
+    int briteblox_spi_get_frequency(struct briteblox_spi *spi);
+    int briteblox_spi_transfer(struct briteblox_spi *spi, const struct briteblox_spi_transfer *xfers, int count);
+
+    struct briteblox_i2c *briteblox_i2c_new(struct briteblox_context *briteblox, unsigned int frequency);
+    void briteblox_i2c_free(struct briteblox_i2c *i2c);
+    int briteblox_i2c_get_frequency(struct briteblox_i2c *i2c);
+    int briteblox_i2c_transfer(struct briteblox_i2c *i2c, const struct briteblox_i2c_msg *msgs, int count);
+
+    struct briteblox_jtag *briteblox_jtag_new(struct briteblox_context *briteblox, unsigned int frequency);
+    void briteblox_jtag_free(struct briteblox_jtag *jtag);
+    int briteblox_jtag_set_frequency(struct briteblox_jtag *jtag, unsigned int frequency);
+    int briteblox_jtag_get_frequency(struct briteblox_jtag *jtag);
+    enum briteblox_jtag_state briteblox_jtag_get_state(struct briteblox_jtag *jtag);
+    int briteblox_jtag_get_pending(struct briteblox_jtag *jtag);
+    int briteblox_jtag_reset(struct briteblox_jtag *jtag);
+    int briteblox_jtag_goto_state(struct briteblox_jtag *jtag, enum briteblox_jtag_state state);
+    int briteblox_jtag_run_test(struct briteblox_jtag *jtag, unsigned int cycles);
+    int briteblox_jtag_scan(struct briteblox_jtag *jtag, int ir, const unsigned char *tdi, unsigned char *tdo,
+                            int nbits, enum briteblox_jtag_state end_state);
+    int briteblox_jtag_execute(struct briteblox_jtag *jtag);
+    int briteblox_jtag_play_svf(struct briteblox_jtag *jtag, FILE *svf, int *line);
+
+    struct briteblox_swd *briteblox_swd_new(struct briteblox_context *briteblox, unsigned int frequency);
+    void briteblox_swd_free(struct briteblox_swd *swd);
+    int briteblox_swd_get_frequency(struct briteblox_swd *swd);
+    int briteblox_swd_line_reset(struct briteblox_swd *swd);
+    int briteblox_swd_jtag_to_swd(struct briteblox_swd *swd);
+    int briteblox_swd_read(struct briteblox_swd *swd, int ap, unsigned char reg, uint32_t *value);
+    int briteblox_swd_write(struct briteblox_swd *swd, int ap, unsigned char reg, uint32_t value);
+    int briteblox_swd_execute(struct briteblox_swd *swd, int *failed);
+
+    struct briteblox_wave *briteblox_wave_new(unsigned char initial);
+    void briteblox_wave_free(struct briteblox_wave *wave);
+    int briteblox_wave_add_edge(struct briteblox_wave *wave, int pin, int level, uint64_t time_ns);
+    int briteblox_wave_compile(struct briteblox_wave *wave, unsigned int rate);
+    const unsigned char *briteblox_wave_get_samples(struct briteblox_wave *wave, int *length);
+    int briteblox_wave_play(struct briteblox_context *briteblox, struct briteblox_wave *wave,
+                            unsigned int rate, unsigned char *capture);
+
+    struct briteblox_rle *briteblox_rle_new(int width);
+    void briteblox_rle_free(struct briteblox_rle *rle);
+    int briteblox_rle_encode(struct briteblox_rle *rle, const unsigned char *samples, int length);
+    int briteblox_rle_flush(struct briteblox_rle *rle);
+    const unsigned char *briteblox_rle_get_output(struct briteblox_rle *rle, int *length);
+    void briteblox_rle_clear_output(struct briteblox_rle *rle);
+    int briteblox_rle_get_stats(struct briteblox_rle *rle, uint64_t *samples, uint64_t *runs);
+    int briteblox_rle_decode(const unsigned char *data, int length, int width,
+                             unsigned int *value, uint64_t *count);
+    int briteblox_capture(struct briteblox_context *briteblox, int width, unsigned int rate,
+                          BRITEBLOXCaptureCallback *callback, void *userdata,
+                          int packetsPerTransfer, int numTransfers);
 
     int briteblox_set_bitmode(struct briteblox_context *briteblox, unsigned char bitmask, unsigned char mode);
     int briteblox_disable_bitbang(struct briteblox_context *briteblox);
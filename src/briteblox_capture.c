@@ -0,0 +1,559 @@
+/***************************************************************************
+                          briteblox_capture.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Logic analyzer capture with run-length encoding.
+ *
+ * Samples are 8 or 16 bit, 16 bit samples arrive as two bytes, low byte
+ * first. The encoder writes one record per run of equal samples: the
+ * sample (1 or 2 bytes, low byte first) followed by the run length as
+ * unsigned LEB128, 7 bits per byte, lowest group first, bit 7 set on
+ * all but the last byte.
+ *
+ * Finding the end of a run is the hot loop of a mostly idle capture. It
+ * compares 16 or 32 bytes at a time against the repeated sample, the
+ * kernel is chosen at run time like the one of briteblox_strip.c.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BRITEBLOX_RLE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BRITEBLOX_RLE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Longest record: 2 sample bytes and a 64 bit LEB128 count */
+#define RLE_MAX_RECORD 12
+
+/* Encoded bytes collected before they go to the capture callback */
+#define CAPTURE_FLUSH_BYTES 65536
+
+/* Returns the number of leading bytes of p that match the sample
+   value repeated, rounded down to whole samples */
+typedef int (briteblox_rle_span_func)(const unsigned char *p, int length,
+                                      unsigned int value, int width);
+
+struct briteblox_rle
+{
+    /** bytes per sample, 1 or 2 */
+    int width;
+    /** sample of the open run */
+    unsigned int value;
+    /** length of the open run, 0 if none */
+    uint64_t count;
+    /** first byte of a 16 bit sample split between two buffers */
+    unsigned char partial;
+    int have_partial;
+
+    unsigned char *out;
+    int out_len;
+    int out_size;
+
+    uint64_t samples;
+    uint64_t runs;
+
+    /** kernel for the CPU, see span_select() */
+    briteblox_rle_span_func *span;
+};
+
+static int span_scalar(const unsigned char *p, int length, unsigned int value, int width)
+{
+    int i = 0;
+
+    if (width == 1)
+    {
+        while (i < length && p[i] == (unsigned char)value)
+            i++;
+    }
+    else
+    {
+        while (i + 1 < length && p[i] == (value & 0xff) && p[i + 1] == (value >> 8))
+            i += 2;
+    }
+    return i;
+}
+
+#ifdef BRITEBLOX_RLE_X86
+__attribute__((target("sse2")))
+static int span_sse2(const unsigned char *p, int length, unsigned int value, int width)
+{
+    __m128i pattern = (width == 1) ? _mm_set1_epi8((char)value) : _mm_set1_epi16((short)value);
+    int i = 0;
+
+    while (i + 16 <= length)
+    {
+        unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)),
+                                                              pattern));
+        if (equal != 0xffff)
+            return i + (__builtin_ctz(~equal) / width) * width;
+        i += 16;
+    }
+    return i + span_scalar(p + i, length - i, value, width);
+}
+
+__attribute__((target("avx2")))
+static int span_avx2(const unsigned char *p, int length, unsigned int value, int width)
+{
+    __m256i pattern = (width == 1) ? _mm256_set1_epi8((char)value) : _mm256_set1_epi16((short)value);
+    int i = 0;
+
+    while (i + 32 <= length)
+    {
+        unsigned int equal = (unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), pattern));
+        if (equal != 0xffffffffU)
+            return i + (__builtin_ctz(~equal) / width) * width;
+        i += 32;
+    }
+    return i + span_sse2(p + i, length - i, value, width);
+}
+#endif /* BRITEBLOX_RLE_X86 */
+
+#ifdef BRITEBLOX_RLE_NEON
+static int span_neon(const unsigned char *p, int length, unsigned int value, int width)
+{
+    uint8x16_t pattern = (width == 1) ? vdupq_n_u8(value)
+                                      : vreinterpretq_u8_u16(vdupq_n_u16(value));
+    int i = 0;
+
+    while (i + 16 <= length)
+    {
+        uint8x16_t equal = vceqq_u8(vld1q_u8(p + i), pattern);
+        uint64x2_t halves = vreinterpretq_u64_u8(equal);
+
+        if ((vgetq_lane_u64(halves, 0) & vgetq_lane_u64(halves, 1)) != ~0ULL)
+            break;
+        i += 16;
+    }
+    return i + span_scalar(p + i, length - i, value, width);
+}
+#endif /* BRITEBLOX_RLE_NEON */
+
+static briteblox_rle_span_func *span_select(void)
+{
+    switch (briteblox_cpu_level())
+    {
+#ifdef BRITEBLOX_RLE_X86
+        case BRITEBLOX_CPU_AVX2:
+            return span_avx2;
+        case BRITEBLOX_CPU_SSE2:
+            return span_sse2;
+#elif defined(BRITEBLOX_RLE_NEON)
+        case BRITEBLOX_CPU_NEON:
+            return span_neon;
+#endif
+        default:
+            return span_scalar;
+    }
+}
+
+/**
+    Appends the record of the open run to the output.
+    \internal
+*/
+static int briteblox_rle_emit(struct briteblox_rle *rle)
+{
+    uint64_t count = rle->count;
+    unsigned char *out;
+
+    if (rle->out_len + RLE_MAX_RECORD > rle->out_size)
+    {
+        int size = rle->out_size ? rle->out_size * 2 : 4096;
+        unsigned char *buf = (unsigned char *)realloc(rle->out, size);
+        if (buf == NULL)
+            return -1;
+        rle->out = buf;
+        rle->out_size = size;
+    }
+
+    out = rle->out + rle->out_len;
+    *out++ = rle->value & 0xff;
+    if (rle->width == 2)
+        *out++ = rle->value >> 8;
+    while (count >= 0x80)
+    {
+        *out++ = (count & 0x7f) | 0x80;
+        count >>= 7;
+    }
+    *out++ = (unsigned char)count;
+
+    rle->out_len = out - rle->out;
+    rle->runs++;
+    rle->count = 0;
+    return 0;
+}
+
+/**
+    Adds samples that all belong to whole samples of the stream.
+    \internal
+*/
+static int briteblox_rle_add(struct briteblox_rle *rle, const unsigned char *p, int length)
+{
+    int width = rle->width;
+
+    while (length >= width)
+    {
+        int n;
+
+        if (rle->count == 0)
+            rle->value = (width == 1) ? p[0] : (unsigned int)(p[0] | (p[1] << 8));
+
+        n = rle->span(p, length, rle->value, width);
+        rle->count += n / width;
+        rle->samples += n / width;
+        p += n;
+        length -= n;
+
+        // a different sample ends the run
+        if (length >= width && briteblox_rle_emit(rle) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+    Create a run-length encoder.
+
+    \param width Bytes per sample, 1 for 8 pins or 2 for 16 pins
+
+    \retval NULL: invalid width or out of memory
+    \retval !NULL: the encoder
+*/
+struct briteblox_rle *briteblox_rle_new(int width)
+{
+    struct briteblox_rle *rle;
+
+    if (width != 1 && width != 2)
+        return NULL;
+
+    rle = (struct briteblox_rle *)calloc(1, sizeof(*rle));
+    if (rle == NULL)
+        return NULL;
+    rle->width = width;
+    rle->span = span_select();
+    return rle;
+}
+
+/**
+    Free a run-length encoder.
+
+    \param rle encoder, may be NULL
+*/
+void briteblox_rle_free(struct briteblox_rle *rle)
+{
+    if (rle == NULL)
+        return;
+
+    free(rle->out);
+    free(rle);
+}
+
+/**
+    Encode samples.
+
+    The records of finished runs are appended to the output, see
+    briteblox_rle_get_output(). The last run stays open for the next
+    call, so runs continue across buffers. 16 bit samples may be split
+    between two calls.
+
+    \param rle encoder
+    \param samples Sample bytes
+    \param length Number of bytes
+
+    \retval >=0: number of bytes in the output
+    \retval  -1: out of memory
+*/
+int briteblox_rle_encode(struct briteblox_rle *rle, const unsigned char *samples, int length)
+{
+    if (length <= 0)
+        return rle->out_len;
+
+    if (rle->have_partial)
+    {
+        unsigned char sample[2];
+
+        sample[0] = rle->partial;
+        sample[1] = samples[0];
+        rle->have_partial = 0;
+        if (briteblox_rle_add(rle, sample, 2) < 0)
+            return -1;
+        samples++;
+        length--;
+    }
+
+    if (briteblox_rle_add(rle, samples, length - length % rle->width) < 0)
+        return -1;
+
+    if (length % rle->width)
+    {
+        rle->partial = samples[length - 1];
+        rle->have_partial = 1;
+    }
+    return rle->out_len;
+}
+
+/**
+    Close the open run and append its record to the output. A split
+    16 bit sample is dropped.
+
+    \param rle encoder
+
+    \retval >=0: number of bytes in the output
+    \retval  -1: out of memory
+*/
+int briteblox_rle_flush(struct briteblox_rle *rle)
+{
+    rle->have_partial = 0;
+    if (rle->count > 0 && briteblox_rle_emit(rle) < 0)
+        return -1;
+    return rle->out_len;
+}
+
+/**
+    Get the encoded output. It stays valid until the next call of
+    briteblox_rle_encode(), briteblox_rle_flush() or
+    briteblox_rle_clear_output().
+
+    \param rle encoder
+    \param length Receives the number of bytes
+
+    \retval the encoded records
+*/
+const unsigned char *briteblox_rle_get_output(struct briteblox_rle *rle, int *length)
+{
+    *length = rle->out_len;
+    return rle->out;
+}
+
+/**
+    Empty the output after it was consumed.
+
+    \param rle encoder
+*/
+void briteblox_rle_clear_output(struct briteblox_rle *rle)
+{
+    rle->out_len = 0;
+}
+
+/**
+    Get the encoder statistics.
+
+    \param rle encoder
+    \param samples Receives the number of samples encoded, may be NULL
+    \param runs Receives the number of records written, may be NULL
+
+    \retval 0: all fine
+*/
+int briteblox_rle_get_stats(struct briteblox_rle *rle, uint64_t *samples, uint64_t *runs)
+{
+    if (samples)
+        *samples = rle->samples;
+    if (runs)
+        *runs = rle->runs;
+    return 0;
+}
+
+/**
+    Decode one record.
+
+    \param data Encoded records
+    \param length Number of bytes in data
+    \param width Bytes per sample the records were encoded with
+    \param value Receives the sample
+    \param count Receives the run length
+
+    \retval >0: number of bytes of the record
+    \retval  0: record incomplete, more data needed
+    \retval -1: invalid record
+*/
+int briteblox_rle_decode(const unsigned char *data, int length, int width,
+                         unsigned int *value, uint64_t *count)
+{
+    uint64_t n = 0;
+    int pos, shift;
+
+    if (width != 1 && width != 2)
+        return -1;
+    if (length < width + 1)
+        return 0;
+
+    *value = (width == 1) ? data[0] : (unsigned int)(data[0] | (data[1] << 8));
+    for (pos = width, shift = 0; pos < length; pos++, shift += 7)
+    {
+        if (shift > 63)
+            return -1;
+        n |= (uint64_t)(data[pos] & 0x7f) << shift;
+        if (!(data[pos] & 0x80))
+        {
+            if (n == 0)
+                return -1;
+            *count = n;
+            return pos + 1;
+        }
+    }
+    return 0;
+}
+
+/* State of briteblox_capture() */
+struct briteblox_capture_state
+{
+    struct briteblox_rle *rle;
+    BRITEBLOXCaptureCallback *callback;
+    void *userdata;
+    /** callback result of a progress report, the stream ignores it */
+    int stop;
+    int error;
+};
+
+/* Hands the output to the user callback, returns its value */
+static int briteblox_capture_deliver(struct briteblox_capture_state *state, BRITEBLOXProgressInfo *progress)
+{
+    int length, res;
+    const unsigned char *out = briteblox_rle_get_output(state->rle, &length);
+
+    if (length == 0 && progress == NULL)
+        return 0;
+    res = state->callback(out, length, progress, state->userdata);
+    briteblox_rle_clear_output(state->rle);
+    return res;
+}
+
+static int briteblox_capture_cb(const struct briteblox_iovec *iov, int iovcnt,
+                                BRITEBLOXProgressInfo *progress, void *userdata)
+{
+    struct briteblox_capture_state *state = (struct briteblox_capture_state *)userdata;
+    int i;
+
+    // progress reports also push out what piled up, the stream only
+    // listens to the callback result of the next data batch
+    if (iov == NULL)
+    {
+        state->stop = briteblox_capture_deliver(state, progress);
+        return 0;
+    }
+    if (state->stop)
+        return state->stop;
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (briteblox_rle_encode(state->rle, iov[i].base, iov[i].len) < 0)
+        {
+            state->error = 1;
+            return 1;
+        }
+    }
+
+    if (state->rle->out_len >= CAPTURE_FLUSH_BYTES)
+        return briteblox_capture_deliver(state, NULL);
+    return 0;
+}
+
+/**
+    Capture pin samples with run-length encoding
+
+    Streams samples like briteblox_readstream_batch() and encodes them
+    on the fly, see briteblox_rle_encode() for the format. The callback
+    gets the encoded records every 64 KiB and with every progress
+    report once a second, a nonzero return value stops the capture. When
+    the capture ends the last run is closed and handed to the callback
+    with progress NULL, its return value is ignored then. A capture
+    stopped from a progress report ends with the next sample batch.
+
+    With rate 0 the chip runs in synchronous FIFO mode (FT2232H and
+    FT232H) and the external logic sets the pace. Otherwise all pins
+    are inputs in bitbang mode and sampled at the rate, see
+    briteblox_set_bitbang_rate(). Bitbang mode delivers 8 pins, 16 bit
+    samples need a synchronous FIFO source sending two bytes per sample.
+
+    \param  briteblox pointer to briteblox_context
+    \param  width Bytes per sample, 1 or 2
+    \param  rate Samples per second, 0 for synchronous FIFO mode
+    \param  callback to user supplied function for the encoded records
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers number of transfers kept in flight
+
+    \retval    0: capture stopped
+    \retval   >0: return value of the callback that stopped the capture
+    \retval   -1: invalid width or no usable device
+    \retval   -2: setting the bitbang rate failed
+    \retval   -3: out of memory
+    \retval   -4: starting the capture failed
+    \retval   -5: USB transfer failed
+*/
+int briteblox_capture(struct briteblox_context *briteblox, int width, unsigned int rate,
+                      BRITEBLOXCaptureCallback *callback, void *userdata,
+                      int packetsPerTransfer, int numTransfers)
+{
+    struct briteblox_capture_state state;
+    struct briteblox_stream *stream;
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL || (width != 1 && width != 2) ||
+        (rate > 0 && width != 1))
+        briteblox_error_return(-1, "invalid capture width or USB device unavailable");
+
+    if (rate > 0 && briteblox_set_bitbang_rate(briteblox, rate > INT_MAX ? INT_MAX : (int)rate) < 0)
+        return -2;
+
+    memset(&state, 0, sizeof(state));
+    state.callback = callback;
+    state.userdata = userdata;
+    state.rle = briteblox_rle_new(width);
+    stream = briteblox_stream_new(briteblox, packetsPerTransfer, numTransfers);
+    if (state.rle == NULL || stream == NULL)
+    {
+        briteblox_rle_free(state.rle);
+        if (stream)
+            briteblox_stream_destroy(stream);
+        briteblox_error_return(-3, "out of memory for the capture");
+    }
+
+    if (rate > 0)
+        briteblox_stream_set_mode(stream, BITMODE_BITBANG);
+
+    if (briteblox_stream_start(stream, briteblox_capture_cb, &state, 0) < 0)
+    {
+        briteblox_stream_destroy(stream);
+        briteblox_rle_free(state.rle);
+        briteblox_error_return(-4, "starting the capture failed");
+    }
+
+    ret = briteblox_stream_run(stream);
+    briteblox_stream_stop(stream);
+    briteblox_stream_destroy(stream);
+
+    if (state.error || briteblox_rle_flush(state.rle) < 0)
+    {
+        briteblox_rle_free(state.rle);
+        briteblox_error_return(-3, "out of memory for the capture");
+    }
+    briteblox_capture_deliver(&state, NULL);
+    briteblox_rle_free(state.rle);
+
+    if (ret < 0)
+        briteblox_error_return(-5, "capture transfer failed");
+    return ret;
+}
@@ -18,9 +18,29 @@
 
 */
 
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 /* Even on 93xx66 at max 256 bytes are used (AN_121)*/
 #define BRITEBLOX_MAX_EEPROM_SIZE 256
 
+/** Number of preallocated transfer controls, see briteblox_transfer_pool_set_size() */
+#define BRITEBLOX_TRANSFER_POOL_SIZE 32
+
+/** Event handling slice per libusb context when waiting for transfers of several contexts */
+#define BRITEBLOX_WAIT_SLICE_US 1000
+
+/* Set the error string of the context named briteblox and return code */
+#define briteblox_error_return(code, str) do {  \
+        if ( briteblox )                        \
+            briteblox->error_str = str;         \
+        else                               \
+            fprintf(stderr, str);          \
+        return code;                       \
+   } while(0);
+
 /** Max Power adjustment factor. */
 #define MAX_POWER_MILLIAMP_PER_UNIT 2
 
@@ -134,3 +154,204 @@ struct briteblox_eeprom
     int release_number;
 };
 
+
+/* Atomic access to counters shared between the USB completion side
+   and the reading thread */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define briteblox_atomic_load(p)      (_ReadWriteBarrier(), *(volatile unsigned int *)(p))
+#define briteblox_atomic_store(p, v)  do { _ReadWriteBarrier(); *(volatile unsigned int *)(p) = (v); } while (0)
+#define briteblox_atomic_add(p, v)    ((unsigned int)_InterlockedExchangeAdd((volatile long *)(p), (long)(v)) + (v))
+#define briteblox_atomic_cas(p, o, n) (_InterlockedCompareExchange((volatile long *)(p), (long)(n), (long)(o)) == (long)(o))
+#else
+#define briteblox_atomic_load(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define briteblox_atomic_store(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define briteblox_atomic_add(p, v)    __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define briteblox_atomic_cas(p, o, n) __extension__ ({ __typeof__(*(p)) _o = (o); \
+            __atomic_compare_exchange_n((p), &_o, (n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#endif
+
+/**
+    \brief Single-producer/single-consumer ring of received payload bytes
+*/
+struct briteblox_ring
+{
+    /** ring memory */
+    unsigned char *data;
+    /** size of data, always a power of two */
+    unsigned int size;
+    /** size - 1 */
+    unsigned int mask;
+    /** free running write counter, only written by the producer */
+    unsigned int head;
+    /** free running read counter, only written by the consumer */
+    unsigned int tail;
+    /** highest fill level seen since the last reset */
+    unsigned int high_water;
+};
+
+/**
+    \brief Read-ahead state, see briteblox_read_data_set_readahead()
+*/
+struct briteblox_readahead
+{
+    /** number of bulk IN transfers kept in flight */
+    int num_transfers;
+    /** size of a single transfer in bytes, multiple of max_packet_size */
+    int transfer_size;
+    /** maximum number of payload bytes one transfer can deliver */
+    int payload_size;
+    /** the transfers, their buffers are allocated along with them */
+    struct libusb_transfer **transfers;
+    /** per transfer: 1 if it waits for free space in the ring */
+    unsigned int *parked;
+    /** number of parked transfers */
+    unsigned int num_parked;
+    /** submitted transfers not yet returned by libusb */
+    unsigned int in_flight;
+    /** first error reported by a completion, 0 if none */
+    int error;
+    /** number of completions, successful or not */
+    unsigned int completions;
+    /** number of completions that carried no payload */
+    unsigned int idle_completions;
+};
+
+/**
+    \brief Pool of bulk IN transfers shared by briteblox_read_data_submit(),
+    see briteblox_read_data_set_submit_pool()
+*/
+struct briteblox_read_pool
+{
+    /** number of transfers in the pool */
+    int num_transfers;
+    /** size of a single transfer in bytes, multiple of max_packet_size */
+    int transfer_size;
+    /** maximum number of payload bytes one transfer can deliver */
+    int payload_size;
+    /** the transfers, their buffers are allocated along with them */
+    struct libusb_transfer **transfers;
+    /** stack of transfers not submitted */
+    struct libusb_transfer **idle;
+    /** number of entries in idle */
+    int num_idle;
+    /** submitted transfers not yet returned by libusb */
+    int in_flight;
+    /** oldest pending read, filled first */
+    struct briteblox_transfer_control *head;
+    /** newest pending read */
+    struct briteblox_transfer_control *tail;
+    /** bytes still missing in all pending reads */
+    int pending_bytes;
+};
+
+/**
+    \brief Reusable transfer controls and libusb transfers for the
+    async submit functions, see briteblox_transfer_pool_set_size()
+*/
+struct briteblox_transfer_pool
+{
+    /** number of entries */
+    int size;
+    /** the transfer controls */
+    struct briteblox_transfer_control *tcs;
+    /** libusb transfer belonging to each transfer control */
+    struct libusb_transfer **transfers;
+    /** stack of unused entry indices */
+    int *unused;
+    /** number of entries in unused */
+    int num_unused;
+    /** number of times the pool was empty and malloc() had to help out */
+    unsigned int exhausted;
+};
+
+/** Coalescing write buffer, see briteblox_write_data_set_coalescing() */
+struct briteblox_write_coalesce
+{
+    /** buffered bytes not yet sent to the chip */
+    unsigned char *data;
+    /** capacity of data, the write chunk size */
+    unsigned int size;
+    /** number of bytes in data */
+    unsigned int fill;
+    /** flush deadline after the first buffered byte in us, 0 = none */
+    unsigned int deadline_us;
+    /** time the first byte was buffered */
+    struct timeval first;
+    /** number of briteblox_write_data() calls absorbed */
+    unsigned int writes;
+    /** number of USB writes issued by flushing */
+    unsigned int flushes;
+};
+
+/** Shared library context, see briteblox_library_new() */
+struct briteblox_library
+{
+    /** libusb context of all attached briteblox_contexts */
+    struct libusb_context *usb_ctx;
+    /** references held by the application and the attached contexts */
+    unsigned int refs;
+    /** stop request for the event thread, see briteblox_library.c */
+    int quit;
+    /** event thread started */
+    int thread_running;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+    /** hotplug device registry, NULL if not started */
+    struct briteblox_registry *registry;
+    /** string descriptor cache, NULL if not enabled */
+    struct briteblox_string_cache *strings;
+};
+
+struct libusb_device;
+
+/* Registry lookup, see briteblox_library.c. Vendor and product 0 match
+   any, bus -1 any bus and address. Returns 1 and a referenced dev if
+   found, 0 if not, -1 if the registry can't answer the query. */
+int briteblox_registry_lookup(struct briteblox_library *library, int vendor, int product,
+                              const char *description, const char *serial,
+                              int bus, int address, unsigned int index,
+                              struct libusb_device **dev);
+
+/* String descriptor cache, see briteblox_string_cache.c. The mask tells
+   which strings are asked for or given. Lookup returns 1 on a hit, 0 on
+   a miss and -1 if the library has no cache. */
+#define BRITEBLOX_STRING_MANUFACTURER 0x01
+#define BRITEBLOX_STRING_DESCRIPTION  0x02
+#define BRITEBLOX_STRING_SERIAL       0x04
+
+int briteblox_string_cache_lookup(struct briteblox_library *library, struct libusb_device *dev,
+                                  int vendor, int product, int mask,
+                                  char *manufacturer, int mnf_len, char *description, int desc_len,
+                                  char *serial, int serial_len);
+void briteblox_string_cache_store(struct briteblox_library *library, struct libusb_device *dev,
+                                  int vendor, int product, int mask,
+                                  const char *manufacturer, const char *description, const char *serial);
+void briteblox_string_cache_forget(struct briteblox_library *library, struct libusb_device *dev);
+void briteblox_string_cache_free(struct briteblox_library *library);
+
+/* Vector unit the kernels of briteblox_strip.c and briteblox_capture.c use */
+enum briteblox_cpu_level
+{
+    BRITEBLOX_CPU_SCALAR = 1,
+    BRITEBLOX_CPU_SSE2,
+    BRITEBLOX_CPU_AVX2,
+    BRITEBLOX_CPU_NEON
+};
+
+/* Modem status byte removal, see briteblox_strip.c */
+enum briteblox_cpu_level briteblox_cpu_level(void);
+int briteblox_strip_status(unsigned char *dst, const unsigned char *src,
+                           int length, int packet_size, int skip, int max);
+
+/* Payload ring, see briteblox_ring.c */
+int briteblox_ring_alloc(struct briteblox_ring *ring, unsigned int min_size);
+int briteblox_ring_grow(struct briteblox_ring *ring, unsigned int min_size);
+void briteblox_ring_free(struct briteblox_ring *ring);
+unsigned int briteblox_ring_fill(struct briteblox_ring *ring);
+unsigned int briteblox_ring_space(struct briteblox_ring *ring);
+int briteblox_ring_push_stripped(struct briteblox_ring *ring, const unsigned char *src,
+                                 int length, int packet_size, int skip);
+int briteblox_ring_pop(struct briteblox_ring *ring, unsigned char *buf, int size);
+void briteblox_ring_discard(struct briteblox_ring *ring);
@@ -0,0 +1,364 @@
+/***************************************************************************
+                          briteblox_i2c.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * I2C master on the MPSSE.
+ *
+ * Pin usage on the low GPIO byte: ADBUS0 SCL, ADBUS1 SDA out and ADBUS2
+ * SDA in, ADBUS1 and ADBUS2 wired together. 3-phase clocking keeps data
+ * stable on both clock edges as I2C needs it.
+ *
+ * SDA is open drain: a high level is made by switching the pin to input
+ * and letting the pull-up do the work. Only while the master shifts out
+ * a byte the pin is driven, no slave drives SDA then. The FT232H has
+ * real open drain outputs, they are switched on where available. Clock
+ * stretching is not supported.
+ *
+ * A list of messages compiles into one MPSSE command queue. Every
+ * acknowledge bit is read back with the data and checked afterwards.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#define I2C_SCL 0x01
+#define I2C_SDA 0x02
+
+/* GPIO commands per bus state change, stretches the setup and hold times */
+#define I2C_STATE_REPEAT 4
+
+struct briteblox_i2c
+{
+    struct briteblox_context *briteblox;
+    struct briteblox_mpsse_queue *queue;
+
+    /** acknowledge bits of the last transfer, bit 0 low = ACK */
+    unsigned char *acks;
+    /** message index for every entry in acks */
+    int *ack_msg;
+    int num_acks;
+    int acks_size;
+
+    /** actual SCL frequency */
+    int frequency;
+};
+
+/**
+    Queues I2C_STATE_REPEAT GPIO commands for the given line levels.
+    \internal
+*/
+static int briteblox_i2c_lines(struct briteblox_i2c *i2c, int scl, int sda)
+{
+    unsigned char value = (scl ? I2C_SCL : 0) | (sda ? I2C_SDA : 0);
+    unsigned char direction = I2C_SCL | (sda ? 0 : I2C_SDA);
+    int i;
+
+    for (i = 0; i < I2C_STATE_REPEAT; i++)
+        if (briteblox_mpsse_set_gpio(i2c->queue, 0, value, direction) < 0)
+            return -1;
+    return 0;
+}
+
+/**
+    Queues a (repeated) start condition, coming from SCL low or idle.
+    \internal
+*/
+static int briteblox_i2c_start(struct briteblox_i2c *i2c)
+{
+    if (briteblox_i2c_lines(i2c, 0, 1) < 0 ||
+        briteblox_i2c_lines(i2c, 1, 1) < 0 ||
+        briteblox_i2c_lines(i2c, 1, 0) < 0 ||
+        briteblox_i2c_lines(i2c, 0, 0) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+    Queues a stop condition, the bus is idle afterwards.
+    \internal
+*/
+static int briteblox_i2c_stop(struct briteblox_i2c *i2c)
+{
+    if (briteblox_i2c_lines(i2c, 0, 0) < 0 ||
+        briteblox_i2c_lines(i2c, 1, 0) < 0 ||
+        briteblox_i2c_lines(i2c, 1, 1) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+    Queues shifting out a byte and reading its acknowledge bit.
+    \internal
+*/
+static int briteblox_i2c_write_byte(struct briteblox_i2c *i2c, unsigned char byte, int msg)
+{
+    struct briteblox_mpsse_queue *q = i2c->queue;
+
+    // drive SDA for the data, then release it for the slave
+    if (briteblox_mpsse_set_gpio(q, 0, 0, I2C_SCL | I2C_SDA) < 0 ||
+        briteblox_mpsse_clock_out(q, MPSSE_WRITE_NEG, &byte, 1) < 0 ||
+        briteblox_mpsse_set_gpio(q, 0, 0, I2C_SCL) < 0 ||
+        briteblox_mpsse_clock_bits_in(q, 0, &i2c->acks[i2c->num_acks], 1) < 0)
+        return -1;
+
+    i2c->ack_msg[i2c->num_acks++] = msg;
+    return 0;
+}
+
+/**
+    Queues reading a byte and answering with ACK or NACK.
+    \internal
+*/
+static int briteblox_i2c_read_byte(struct briteblox_i2c *i2c, unsigned char *byte, int ack)
+{
+    struct briteblox_mpsse_queue *q = i2c->queue;
+
+    if (briteblox_mpsse_set_gpio(q, 0, 0, I2C_SCL) < 0 ||
+        briteblox_mpsse_clock_in(q, 0, byte, 1) < 0)
+        return -1;
+
+    // ACK drives SDA low, for a NACK it stays released
+    if (ack && briteblox_mpsse_set_gpio(q, 0, 0, I2C_SCL | I2C_SDA) < 0)
+        return -1;
+    return briteblox_mpsse_clock_bits_out(q, MPSSE_WRITE_NEG, ack ? 0x00 : 0x80, 1);
+}
+
+/**
+    Queues the commands of a message list without sending them.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid message
+*/
+static int briteblox_i2c_compile(struct briteblox_i2c *i2c, const struct briteblox_i2c_msg *msgs, int count)
+{
+    int i, j, ret = 0, num_acks = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        const struct briteblox_i2c_msg *m = &msgs[i];
+        int read = (m->flags & BRITEBLOX_I2C_READ) != 0;
+
+        if (m->addr > 0x7f || m->length < 0 || (m->length > 0 && m->buf == NULL) ||
+            (read && m->length == 0))
+            return -2;
+        num_acks += 1 + (read ? 0 : m->length);
+    }
+
+    // the queue keeps pointers into acks, size it before queueing
+    if (num_acks > i2c->acks_size)
+    {
+        unsigned char *acks = (unsigned char *)realloc(i2c->acks, num_acks);
+        int *ack_msg;
+
+        if (acks == NULL)
+            return -1;
+        i2c->acks = acks;
+        ack_msg = (int *)realloc(i2c->ack_msg, num_acks * sizeof(int));
+        if (ack_msg == NULL)
+            return -1;
+        i2c->ack_msg = ack_msg;
+        i2c->acks_size = num_acks;
+    }
+    i2c->num_acks = 0;
+
+    for (i = 0; i < count && ret == 0; i++)
+    {
+        const struct briteblox_i2c_msg *m = &msgs[i];
+        int read = (m->flags & BRITEBLOX_I2C_READ) != 0;
+
+        ret = briteblox_i2c_start(i2c);
+        if (ret == 0)
+            ret = briteblox_i2c_write_byte(i2c, (m->addr << 1) | read, i);
+
+        for (j = 0; j < m->length && ret == 0; j++)
+        {
+            if (read)
+                ret = briteblox_i2c_read_byte(i2c, &m->buf[j], j < m->length - 1);
+            else
+                ret = briteblox_i2c_write_byte(i2c, m->buf[j], i);
+        }
+
+        if (ret == 0 && (i == count - 1 || (m->flags & BRITEBLOX_I2C_STOP)))
+            ret = briteblox_i2c_stop(i2c);
+    }
+    return ret;
+}
+
+/**
+    Finds the first message with a missing acknowledge.
+    \internal
+
+    \retval index of the first message with a NACK, count if there is none
+*/
+static int briteblox_i2c_check_acks(struct briteblox_i2c *i2c, int count)
+{
+    int i;
+
+    for (i = 0; i < i2c->num_acks; i++)
+        if (i2c->acks[i] & 0x01)
+            return i2c->ack_msg[i];
+    return count;
+}
+
+/**
+    Set up the chip as I2C master.
+
+    Switches the chip to MPSSE mode (see briteblox_mpsse_enable()),
+    enables 3-phase clocking and releases SCL and SDA. On the FT232H
+    ADBUS0 and ADBUS1 are switched to open drain.
+
+    \param briteblox pointer to briteblox_context
+    \param frequency Maximum SCL frequency in Hz, e.g. 100000 or 400000
+
+    \retval NULL: invalid arguments, out of memory or USB error, see
+            briteblox_get_error_string()
+    \retval !NULL: the I2C engine
+*/
+struct briteblox_i2c *briteblox_i2c_new(struct briteblox_context *briteblox, unsigned int frequency)
+{
+    struct briteblox_i2c *i2c;
+    unsigned char cmd[3] = { DIS_ADAPTIVE, EN_3_PHASE, LOOPBACK_END };
+    unsigned char open_drain[3] = { DRIVE_OPEN_COLLECTOR, I2C_SCL | I2C_SDA, 0x00 };
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        return NULL;
+
+    i2c = (struct briteblox_i2c *)calloc(1, sizeof(*i2c));
+    if (i2c == NULL)
+        return NULL;
+    i2c->briteblox = briteblox;
+    i2c->queue = briteblox_mpsse_queue_new(briteblox);
+    if (i2c->queue == NULL || briteblox_mpsse_enable(briteblox) < 0)
+    {
+        briteblox_i2c_free(i2c);
+        return NULL;
+    }
+
+    // 3-phase clocking takes three half periods per bit instead of two
+    ret = briteblox_mpsse_set_clock(i2c->queue, frequency + frequency / 2);
+    if (ret > 0)
+    {
+        i2c->frequency = ret * 2 / 3;
+        ret = briteblox_mpsse_command(i2c->queue, cmd, 3, NULL, 0);
+    }
+    if (ret == 0 && briteblox->type == TYPE_232H)
+        ret = briteblox_mpsse_command(i2c->queue, open_drain, 3, NULL, 0);
+    if (ret == 0)
+        ret = briteblox_i2c_lines(i2c, 1, 1);
+    if (ret == 0)
+        ret = briteblox_mpsse_queue_execute(i2c->queue);
+
+    if (ret < 0)
+    {
+        briteblox_i2c_free(i2c);
+        return NULL;
+    }
+    return i2c;
+}
+
+/**
+    Free the I2C engine. The chip stays in MPSSE mode.
+
+    \param i2c I2C engine, may be NULL
+*/
+void briteblox_i2c_free(struct briteblox_i2c *i2c)
+{
+    if (i2c == NULL)
+        return;
+
+    briteblox_mpsse_queue_free(i2c->queue);
+    free(i2c->acks);
+    free(i2c->ack_msg);
+    free(i2c);
+}
+
+/**
+    Get the actual SCL frequency.
+
+    \param i2c I2C engine
+
+    \retval SCL frequency in Hz
+*/
+int briteblox_i2c_get_frequency(struct briteblox_i2c *i2c)
+{
+    return i2c->frequency;
+}
+
+/**
+    Run a list of I2C messages in one USB round trip.
+
+    Every message starts with a (repeated) start condition and the
+    address byte. A stop condition follows the last message and every
+    message with BRITEBLOX_I2C_STOP, so one list can hold transactions
+    with several devices. The last byte of a read is answered with a
+    NACK. A write with length 0 probes the address.
+
+    All commands are sent even if a slave does not acknowledge, the
+    acknowledge bits are checked once the response is in.
+
+    \param i2c I2C engine
+    \param msgs List of messages, read buffers are filled
+    \param count Number of messages
+
+    \retval count: all bytes were acknowledged
+    \retval 0..count-1: index of the first message that got a NACK
+    \retval -5: invalid message in the list
+    \retval <0: error code from briteblox_mpsse_queue_execute()
+*/
+int briteblox_i2c_transfer(struct briteblox_i2c *i2c, const struct briteblox_i2c_msg *msgs, int count)
+{
+    struct briteblox_context *briteblox = i2c->briteblox;
+    int ret;
+
+    ret = briteblox_i2c_compile(i2c, msgs, count);
+    if (ret < 0)
+    {
+        briteblox_mpsse_queue_reset(i2c->queue);
+        if (ret == -2)
+            briteblox_error_return(-5, "invalid I2C message");
+        briteblox_error_return(-1, "out of memory for I2C commands");
+    }
+
+    ret = briteblox_mpsse_queue_execute(i2c->queue);
+    if (ret < 0)
+        return ret;
+
+    return briteblox_i2c_check_acks(i2c, count);
+}
+
+/* Exported for the unit test: compile a message list, return the queue */
+struct briteblox_mpsse_queue *i2c_compile_UT_export(const struct briteblox_i2c_msg *msgs, int count,
+                                                   struct briteblox_i2c **i2c)
+{
+    if (*i2c == NULL)
+    {
+        *i2c = (struct briteblox_i2c *)calloc(1, sizeof(**i2c));
+        (*i2c)->queue = briteblox_mpsse_queue_new(NULL);
+    }
+    return briteblox_i2c_compile(*i2c, msgs, count) < 0 ? NULL : (*i2c)->queue;
+}
+
+/* Exported for the unit test: evaluate the acknowledge bits */
+int i2c_check_acks_UT_export(struct briteblox_i2c *i2c, int count)
+{
+    return briteblox_i2c_check_acks(i2c, count);
+}
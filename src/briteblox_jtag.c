@@ -0,0 +1,1278 @@
+/***************************************************************************
+                          briteblox_jtag.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * JTAG TAP controller on the MPSSE.
+ *
+ * Pin usage on the low GPIO byte: ADBUS0 TCK, ADBUS1 TDI, ADBUS2 TDO,
+ * ADBUS3 TMS. The engine tracks the TAP state as commands are queued,
+ * so any number of scans and state moves can be batched and sent with
+ * briteblox_jtag_execute() in one USB round trip.
+ *
+ * A scan shifts whole bytes with one clock command per 64 KiB, the
+ * remaining bits with a bit command and the last bit together with the
+ * TMS change that leaves the shift state. TDO bits from the bit
+ * commands arrive at the top of their byte; they are recorded as
+ * fixups and moved into place once the response is in.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#define JTAG_TCK 0x01
+#define JTAG_TDI 0x02
+#define JTAG_TDO 0x04
+#define JTAG_TMS 0x08
+
+/* LSB first, TDI/TMS change on the falling edge, TDO sampled on the rising one */
+#define JTAG_MODE (MPSSE_LSB | MPSSE_WRITE_NEG)
+
+#define JTAG_NUM_STATES 16
+
+/* Next state for TMS 0 and TMS 1, indexed by enum briteblox_jtag_state */
+static const unsigned char jtag_next[JTAG_NUM_STATES][2] =
+{
+    { JTAG_RUN_TEST_IDLE, JTAG_TEST_LOGIC_RESET },  /* TEST_LOGIC_RESET */
+    { JTAG_RUN_TEST_IDLE, JTAG_SELECT_DR_SCAN },    /* RUN_TEST_IDLE */
+    { JTAG_CAPTURE_DR, JTAG_SELECT_IR_SCAN },       /* SELECT_DR_SCAN */
+    { JTAG_SHIFT_DR, JTAG_EXIT1_DR },               /* CAPTURE_DR */
+    { JTAG_SHIFT_DR, JTAG_EXIT1_DR },               /* SHIFT_DR */
+    { JTAG_PAUSE_DR, JTAG_UPDATE_DR },              /* EXIT1_DR */
+    { JTAG_PAUSE_DR, JTAG_EXIT2_DR },               /* PAUSE_DR */
+    { JTAG_SHIFT_DR, JTAG_UPDATE_DR },              /* EXIT2_DR */
+    { JTAG_RUN_TEST_IDLE, JTAG_SELECT_DR_SCAN },    /* UPDATE_DR */
+    { JTAG_CAPTURE_IR, JTAG_TEST_LOGIC_RESET },     /* SELECT_IR_SCAN */
+    { JTAG_SHIFT_IR, JTAG_EXIT1_IR },               /* CAPTURE_IR */
+    { JTAG_SHIFT_IR, JTAG_EXIT1_IR },               /* SHIFT_IR */
+    { JTAG_PAUSE_IR, JTAG_UPDATE_IR },              /* EXIT1_IR */
+    { JTAG_PAUSE_IR, JTAG_EXIT2_IR },               /* PAUSE_IR */
+    { JTAG_SHIFT_IR, JTAG_UPDATE_IR },              /* EXIT2_IR */
+    { JTAG_RUN_TEST_IDLE, JTAG_SELECT_DR_SCAN },    /* UPDATE_IR */
+};
+
+/** TDO bits that arrive in the wrong place of a response byte */
+struct briteblox_jtag_fixup
+{
+    /** destination buffer and first bit in it */
+    unsigned char *tdo;
+    int bit;
+    /** number of bits, they are the top bits of raw */
+    int nbits;
+    /** response byte as received */
+    unsigned char raw;
+};
+
+/* Fixups live in blocks that never move, the queue points into them */
+#define JTAG_FIXUPS_PER_BLOCK 64
+
+struct briteblox_jtag_fixup_block
+{
+    struct briteblox_jtag_fixup fixups[JTAG_FIXUPS_PER_BLOCK];
+    int used;
+    struct briteblox_jtag_fixup_block *next;
+};
+
+struct briteblox_jtag
+{
+    struct briteblox_context *briteblox;
+    struct briteblox_mpsse_queue *queue;
+
+    /** TAP state after the queued commands */
+    enum briteblox_jtag_state state;
+
+    struct briteblox_jtag_fixup_block *fixups;
+    struct briteblox_jtag_fixup_block *current;
+
+    /** zero bytes for scans without TDI data */
+    unsigned char *zeros;
+    int zeros_size;
+
+    /** actual TCK frequency */
+    int frequency;
+};
+
+/**
+    Computes the shortest TMS sequence between two TAP states.
+    \internal
+
+    \param from current state
+    \param to target state
+    \param tms receives the TMS bits, the first one in bit 0
+
+    \retval number of TMS bits, at most 7
+*/
+static int briteblox_jtag_tms_path(enum briteblox_jtag_state from, enum briteblox_jtag_state to,
+                                   unsigned int *tms)
+{
+    signed char prev[JTAG_NUM_STATES];
+    unsigned char prev_tms[JTAG_NUM_STATES];
+    unsigned char fifo[JTAG_NUM_STATES];
+    int head = 0, tail = 0, nbits = 0, s;
+
+    memset(prev, -1, sizeof(prev));
+    prev[from] = from;
+    fifo[tail++] = from;
+
+    // breadth first, the graph is tiny
+    while (head < tail && prev[to] < 0)
+    {
+        int cur = fifo[head++], t;
+        for (t = 0; t < 2; t++)
+        {
+            int next = jtag_next[cur][t];
+            if (prev[next] < 0)
+            {
+                prev[next] = cur;
+                prev_tms[next] = t;
+                fifo[tail++] = next;
+            }
+        }
+    }
+
+    *tms = 0;
+    for (s = to; s != (int)from; s = prev[s])
+        *tms = (*tms << 1) | prev_tms[s], nbits++;
+    return nbits;
+}
+
+/**
+    Queues TMS bits with TDI low, seven per command.
+    \internal
+*/
+static int briteblox_jtag_clock_tms(struct briteblox_jtag *jtag, unsigned int tms, int nbits)
+{
+    while (nbits > 0)
+    {
+        int n = nbits > 7 ? 7 : nbits;
+
+        if (briteblox_mpsse_clock_tms(jtag->queue, JTAG_MODE, tms & 0x7f, n, 0, NULL) < 0)
+            return -1;
+        tms >>= n;
+        nbits -= n;
+    }
+    return 0;
+}
+
+/**
+    Returns an unused fixup.
+    \internal
+*/
+static struct briteblox_jtag_fixup *briteblox_jtag_fixup(struct briteblox_jtag *jtag, unsigned char *tdo,
+                                                          int bit, int nbits)
+{
+    struct briteblox_jtag_fixup_block *block = jtag->current;
+    struct briteblox_jtag_fixup *f;
+
+    if (block == NULL || block->used == JTAG_FIXUPS_PER_BLOCK)
+    {
+        struct briteblox_jtag_fixup_block *next = block ? block->next : jtag->fixups;
+
+        if (next == NULL)
+        {
+            next = (struct briteblox_jtag_fixup_block *)calloc(1, sizeof(*next));
+            if (next == NULL)
+                return NULL;
+            if (block)
+                block->next = next;
+            else
+                jtag->fixups = next;
+        }
+        next->used = 0;
+        jtag->current = block = next;
+    }
+
+    f = &block->fixups[block->used++];
+    f->tdo = tdo;
+    f->bit = bit;
+    f->nbits = nbits;
+    return f;
+}
+
+/**
+    Moves the TDO bits of all fixups into place if apply is set and
+    forgets them.
+    \internal
+*/
+static void briteblox_jtag_apply_fixups(struct briteblox_jtag *jtag, int apply)
+{
+    struct briteblox_jtag_fixup_block *block;
+    int i, k;
+
+    for (block = jtag->fixups; block != NULL; block = block->next)
+    {
+        for (i = 0; apply && i < block->used; i++)
+        {
+            struct briteblox_jtag_fixup *f = &block->fixups[i];
+            unsigned char value = f->raw >> (8 - f->nbits);
+
+            for (k = 0; k < f->nbits; k++)
+            {
+                int bit = f->bit + k;
+                if (value & (1 << k))
+                    f->tdo[bit / 8] |= 1 << (bit % 8);
+                else
+                    f->tdo[bit / 8] &= ~(1 << (bit % 8));
+            }
+        }
+        block->used = 0;
+        if (block == jtag->current)
+            break;
+    }
+    jtag->current = jtag->fixups;
+}
+
+/**
+    Queues shifting nbits in the current shift state, the last one
+    together with TMS high to leave for the exit1 state.
+    \internal
+*/
+static int briteblox_jtag_shift(struct briteblox_jtag *jtag, const unsigned char *tdi,
+                                unsigned char *tdo, int nbits)
+{
+    struct briteblox_mpsse_queue *q = jtag->queue;
+    struct briteblox_jtag_fixup *f;
+    int body = nbits - 1;
+    int bytes = body / 8, bits = body % 8;
+    int last = (tdi[body / 8] >> (body % 8)) & 1;
+
+    if (bytes > 0)
+    {
+        if (tdo != NULL)
+        {
+            if (briteblox_mpsse_clock_inout(q, JTAG_MODE, tdi, tdo, bytes) < 0)
+                return -1;
+        }
+        else if (briteblox_mpsse_clock_out(q, JTAG_MODE, tdi, bytes) < 0)
+            return -1;
+    }
+
+    if (bits > 0)
+    {
+        if (tdo != NULL)
+        {
+            f = briteblox_jtag_fixup(jtag, tdo, bytes * 8, bits);
+            if (f == NULL || briteblox_mpsse_clock_bits_inout(q, JTAG_MODE, tdi[bytes], &f->raw, bits) < 0)
+                return -1;
+        }
+        else if (briteblox_mpsse_clock_bits_out(q, JTAG_MODE, tdi[bytes], bits) < 0)
+            return -1;
+    }
+
+    f = NULL;
+    if (tdo != NULL)
+    {
+        f = briteblox_jtag_fixup(jtag, tdo, body, 1);
+        if (f == NULL)
+            return -1;
+    }
+    return briteblox_mpsse_clock_tms(q, JTAG_MODE, 0x01, 1, last, f ? &f->raw : NULL);
+}
+
+/**
+    Set up the chip as JTAG master.
+
+    Switches the chip to MPSSE mode (see briteblox_mpsse_enable()), sets
+    the clock, drives TCK and TDI low and TMS high. The TAP is assumed to
+    be in Test-Logic-Reset, briteblox_jtag_reset() makes sure of it.
+
+    \param briteblox pointer to briteblox_context
+    \param frequency Maximum TCK frequency in Hz
+
+    \retval NULL: invalid arguments, out of memory or USB error, see
+            briteblox_get_error_string()
+    \retval !NULL: the JTAG engine
+*/
+struct briteblox_jtag *briteblox_jtag_new(struct briteblox_context *briteblox, unsigned int frequency)
+{
+    struct briteblox_jtag *jtag;
+    unsigned char cmd[3] = { DIS_ADAPTIVE, DIS_3_PHASE, LOOPBACK_END };
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        return NULL;
+
+    jtag = (struct briteblox_jtag *)calloc(1, sizeof(*jtag));
+    if (jtag == NULL)
+        return NULL;
+    jtag->briteblox = briteblox;
+    jtag->state = JTAG_TEST_LOGIC_RESET;
+    jtag->queue = briteblox_mpsse_queue_new(briteblox);
+    if (jtag->queue == NULL || briteblox_mpsse_enable(briteblox) < 0)
+    {
+        briteblox_jtag_free(jtag);
+        return NULL;
+    }
+
+    ret = briteblox_jtag_set_frequency(jtag, frequency);
+    if (ret > 0)
+        ret = briteblox_mpsse_command(jtag->queue, cmd, 3, NULL, 0);
+    if (ret == 0)
+        ret = briteblox_mpsse_set_gpio(jtag->queue, 0, JTAG_TMS, JTAG_TCK | JTAG_TDI | JTAG_TMS);
+    if (ret == 0)
+        ret = briteblox_jtag_execute(jtag);
+
+    if (ret < 0)
+    {
+        briteblox_jtag_free(jtag);
+        return NULL;
+    }
+    return jtag;
+}
+
+/**
+    Free the JTAG engine. Queued commands are dropped.
+
+    \param jtag JTAG engine, may be NULL
+*/
+void briteblox_jtag_free(struct briteblox_jtag *jtag)
+{
+    struct briteblox_jtag_fixup_block *block, *next;
+
+    if (jtag == NULL)
+        return;
+
+    for (block = jtag->fixups; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    briteblox_mpsse_queue_free(jtag->queue);
+    free(jtag->zeros);
+    free(jtag);
+}
+
+/**
+    Queue setting the TCK frequency.
+
+    \param jtag JTAG engine
+    \param frequency Maximum TCK frequency in Hz
+
+    \retval >0: actual frequency in Hz
+    \retval <0: error code from briteblox_mpsse_set_clock()
+*/
+int briteblox_jtag_set_frequency(struct briteblox_jtag *jtag, unsigned int frequency)
+{
+    int ret = briteblox_mpsse_set_clock(jtag->queue, frequency);
+
+    if (ret > 0)
+        jtag->frequency = ret;
+    return ret;
+}
+
+/**
+    Get the actual TCK frequency.
+
+    \param jtag JTAG engine
+
+    \retval TCK frequency in Hz
+*/
+int briteblox_jtag_get_frequency(struct briteblox_jtag *jtag)
+{
+    return jtag->frequency;
+}
+
+/**
+    Get the TAP state after all queued commands.
+
+    \param jtag JTAG engine
+
+    \retval the TAP state
+*/
+enum briteblox_jtag_state briteblox_jtag_get_state(struct briteblox_jtag *jtag)
+{
+    return jtag->state;
+}
+
+/**
+    Get the number of command bytes waiting for briteblox_jtag_execute().
+
+    \param jtag JTAG engine
+
+    \retval number of queued command bytes
+*/
+int briteblox_jtag_get_pending(struct briteblox_jtag *jtag)
+{
+    int cmd_bytes;
+
+    briteblox_mpsse_queue_get_size(jtag->queue, &cmd_bytes, NULL);
+    return cmd_bytes;
+}
+
+/**
+    Queue five TMS high clocks, the TAP is in Test-Logic-Reset afterwards
+    whatever state it was in.
+
+    \param jtag JTAG engine
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_jtag_reset(struct briteblox_jtag *jtag)
+{
+    if (briteblox_jtag_clock_tms(jtag, 0x1f, 5) < 0)
+        return -1;
+
+    jtag->state = JTAG_TEST_LOGIC_RESET;
+    return 0;
+}
+
+/**
+    Queue moving the TAP to another state on the shortest path.
+
+    \param jtag JTAG engine
+    \param state Target state
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid state
+*/
+int briteblox_jtag_goto_state(struct briteblox_jtag *jtag, enum briteblox_jtag_state state)
+{
+    unsigned int tms;
+    int nbits;
+
+    if ((int)state < 0 || state >= JTAG_NUM_STATES)
+        return -2;
+
+    nbits = briteblox_jtag_tms_path(jtag->state, state, &tms);
+    if (briteblox_jtag_clock_tms(jtag, tms, nbits) < 0)
+        return -1;
+
+    jtag->state = state;
+    return 0;
+}
+
+/**
+    Queue clocking TCK in a stable state, e.g. Run-Test/Idle.
+
+    \param jtag JTAG engine
+    \param cycles Number of TCK cycles
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: the TAP is not in a state that stays put with TMS low
+*/
+int briteblox_jtag_run_test(struct briteblox_jtag *jtag, unsigned int cycles)
+{
+    enum briteblox_chip_type type = jtag->briteblox ? jtag->briteblox->type : TYPE_BM;
+    int hold = (jtag->state == JTAG_TEST_LOGIC_RESET);
+    unsigned char cmd[3];
+
+    if (jtag_next[jtag->state][hold] != jtag->state)
+        return -2;
+
+    // H type chips clock without data, 8 cycles per count, up to 512 Ki cycles a command
+    if (!hold && (type == TYPE_2232H || type == TYPE_4232H || type == TYPE_232H))
+    {
+        while (cycles >= 8)
+        {
+            unsigned int n = cycles / 8 > 0x10000 ? 0x10000 : cycles / 8;
+
+            cmd[0] = CLK_BYTES;
+            cmd[1] = (n - 1) & 0xff;
+            cmd[2] = ((n - 1) >> 8) & 0xff;
+            if (briteblox_mpsse_command(jtag->queue, cmd, 3, NULL, 0) < 0)
+                return -1;
+            cycles -= n * 8;
+        }
+    }
+
+    while (cycles > 0)
+    {
+        int n = cycles > 7 ? 7 : cycles;
+
+        if (briteblox_mpsse_clock_tms(jtag->queue, JTAG_MODE, hold ? 0x7f : 0x00, n, 0, NULL) < 0)
+            return -1;
+        cycles -= n;
+    }
+    return 0;
+}
+
+/**
+    Queue an IR or DR scan.
+
+    Moves to Shift-IR or Shift-DR, shifts nbits and moves on to
+    end_state. Bit i of the scan is bit i % 8 of byte i / 8, bit 0 is
+    shifted first.
+
+    \param jtag JTAG engine
+    \param ir 1 for an instruction register scan, 0 for a data register scan
+    \param tdi Bits to shift in, NULL for zeros
+    \param tdo Buffer for the bits shifted out, NULL to not read. It is
+           filled by briteblox_jtag_execute().
+    \param nbits Number of bits
+    \param end_state State to move to after the scan
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid arguments
+*/
+int briteblox_jtag_scan(struct briteblox_jtag *jtag, int ir, const unsigned char *tdi, unsigned char *tdo,
+                        int nbits, enum briteblox_jtag_state end_state)
+{
+    int bytes = (nbits + 7) / 8;
+
+    if (nbits <= 0 || (int)end_state < 0 || end_state >= JTAG_NUM_STATES)
+        return -2;
+
+    if (tdi == NULL)
+    {
+        if (jtag->zeros_size < bytes)
+        {
+            unsigned char *zeros = (unsigned char *)calloc(1, bytes);
+            if (zeros == NULL)
+                return -1;
+            free(jtag->zeros);
+            jtag->zeros = zeros;
+            jtag->zeros_size = bytes;
+        }
+        tdi = jtag->zeros;
+    }
+
+    if (briteblox_jtag_goto_state(jtag, ir ? JTAG_SHIFT_IR : JTAG_SHIFT_DR) < 0 ||
+        briteblox_jtag_shift(jtag, tdi, tdo, nbits) < 0)
+        return -1;
+
+    jtag->state = ir ? JTAG_EXIT1_IR : JTAG_EXIT1_DR;
+    return briteblox_jtag_goto_state(jtag, end_state);
+}
+
+/**
+    Send all queued JTAG commands in one USB round trip.
+
+    \param jtag JTAG engine
+
+    \retval >=0: number of response bytes received
+    \retval  <0: error code from briteblox_mpsse_queue_execute()
+*/
+int briteblox_jtag_execute(struct briteblox_jtag *jtag)
+{
+    int ret = briteblox_mpsse_queue_execute(jtag->queue);
+
+    // the queue is empty either way, a failed one leaves TDO untouched
+    briteblox_jtag_apply_fixups(jtag, ret >= 0);
+    return ret;
+}
+
+/* SVF player */
+
+/* Send the queue once this many command bytes are waiting */
+#define SVF_FLUSH_BYTES 65536
+
+/** Persistent data of one of HIR, TIR, HDR, TDR, SIR and SDR */
+struct briteblox_svf_pattern
+{
+    int length;
+    unsigned char *tdi;
+    unsigned char *tdo;
+    unsigned char *mask;
+    unsigned char *smask;
+    /** TDO was given, compare it */
+    int check;
+};
+
+/** A scan whose TDO is compared once the queue has been executed */
+struct briteblox_svf_check
+{
+    int line;
+    int nbits;
+    /** TDO read, expected TDO and compare mask, all in one allocation */
+    unsigned char *tdo;
+    unsigned char *expected;
+    unsigned char *mask;
+    struct briteblox_svf_check *next;
+};
+
+enum { SVF_HIR, SVF_TIR, SVF_HDR, SVF_TDR, SVF_SIR, SVF_SDR, SVF_NUM_PATTERNS };
+
+struct briteblox_svf
+{
+    struct briteblox_jtag *jtag;
+    /** 0 to only queue, for the unit test */
+    int execute;
+
+    struct briteblox_svf_pattern patterns[SVF_NUM_PATTERNS];
+    enum briteblox_jtag_state endir;
+    enum briteblox_jtag_state enddr;
+    enum briteblox_jtag_state run_state;
+    enum briteblox_jtag_state run_end_state;
+
+    /** TDI of a whole scan with header and trailer */
+    unsigned char *tdi;
+    int tdi_size;
+
+    struct briteblox_svf_check *checks;
+    struct briteblox_svf_check **checks_tail;
+
+    /** current statement, upper case and without comments */
+    char *stmt;
+    int stmt_size;
+    /** line the current statement starts on */
+    int line;
+};
+
+static const char *svf_state_names[JTAG_NUM_STATES] =
+{
+    "RESET", "IDLE", "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1", "DRPAUSE", "DREXIT2",
+    "DRUPDATE", "IRSELECT", "IRCAPTURE", "IRSHIFT", "IREXIT1", "IRPAUSE", "IREXIT2", "IRUPDATE"
+};
+
+/**
+    Looks up an SVF state name.
+    \internal
+
+    \retval >=0: the state
+    \retval  -1: unknown name or, with stable set, not a stable state
+*/
+static int briteblox_svf_state(const char *name, int stable)
+{
+    int s;
+
+    if (name == NULL)
+        return -1;
+    for (s = 0; s < JTAG_NUM_STATES; s++)
+        if (strcmp(name, svf_state_names[s]) == 0)
+            break;
+    if (s == JTAG_NUM_STATES)
+        return -1;
+    if (stable && s != JTAG_TEST_LOGIC_RESET && s != JTAG_RUN_TEST_IDLE &&
+        s != JTAG_PAUSE_DR && s != JTAG_PAUSE_IR)
+        return -1;
+    return s;
+}
+
+/**
+    Reads the next statement into svf->stmt.
+    \internal
+
+    Comments are dropped and letters upper cased. Parentheses get
+    spaces around them, so the statement splits on single spaces.
+
+    \retval  1: statement read
+    \retval  0: end of file
+    \retval -1: statement not terminated by ';'
+    \retval -3: out of memory
+*/
+static int briteblox_svf_read_statement(struct briteblox_svf *svf, FILE *f, int *line)
+{
+    int len = 0, started = 0, c;
+
+    while ((c = fgetc(f)) != EOF)
+    {
+        if (c == '/')
+        {
+            int next = fgetc(f);
+            if (next == '/')
+                c = '!';
+            else if (next != EOF)
+                ungetc(next, f);
+        }
+        if (c == '!')
+        {
+            while ((c = fgetc(f)) != EOF && c != '\n')
+                ;
+            if (c == EOF)
+                break;
+        }
+
+        if (c == '\n')
+            (*line)++;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        {
+            if (!started)
+                continue;
+            c = ' ';
+        }
+        else if (!started)
+        {
+            started = 1;
+            svf->line = *line;
+        }
+
+        // room for " ( " and the terminator
+        if (len + 4 > svf->stmt_size)
+        {
+            int size = svf->stmt_size ? svf->stmt_size * 2 : 256;
+            char *stmt = (char *)realloc(svf->stmt, size);
+            if (stmt == NULL)
+                return -3;
+            svf->stmt = stmt;
+            svf->stmt_size = size;
+        }
+
+        if (c == ';')
+        {
+            svf->stmt[len] = '\0';
+            return 1;
+        }
+        if (c == '(' || c == ')')
+        {
+            svf->stmt[len++] = ' ';
+            svf->stmt[len++] = c;
+            svf->stmt[len++] = ' ';
+        }
+        else
+            svf->stmt[len++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+    }
+
+    return started ? -1 : 0;
+}
+
+/**
+    Splits off the next word of a statement.
+    \internal
+
+    \retval the word, NULL at the end of the statement
+*/
+static char *briteblox_svf_token(char **p)
+{
+    char *s = *p, *e;
+
+    while (*s == ' ')
+        s++;
+    if (*s == '\0')
+    {
+        *p = s;
+        return NULL;
+    }
+    for (e = s; *e != '\0' && *e != ' '; e++)
+        ;
+    if (*e != '\0')
+        *e++ = '\0';
+    *p = e;
+    return s;
+}
+
+/**
+    Parses "( hex digits )" into nbits bits. The rightmost digit holds
+    bits 0 to 3, white space between the digits is allowed.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: syntax error
+*/
+static int briteblox_svf_hex(char **p, unsigned char *bits, int nbits)
+{
+    char *tok = briteblox_svf_token(p);
+    char *end, *c;
+    int bit = 0, k;
+
+    if (tok == NULL || strcmp(tok, "(") != 0)
+        return -1;
+    end = strchr(*p, ')');
+    if (end == NULL)
+        return -1;
+
+    memset(bits, 0, (nbits + 7) / 8);
+    for (c = end - 1; c >= *p; c--)
+    {
+        int v;
+
+        if (*c == ' ')
+            continue;
+        else if (*c >= '0' && *c <= '9')
+            v = *c - '0';
+        else if (*c >= 'A' && *c <= 'F')
+            v = *c - 'A' + 10;
+        else
+            return -1;
+
+        for (k = 0; k < 4; k++, bit++)
+            if (v & (1 << k))
+            {
+                if (bit >= nbits)
+                    return -1;
+                bits[bit / 8] |= 1 << (bit % 8);
+            }
+    }
+
+    *p = end + 1;
+    return 0;
+}
+
+/**
+    Copies nbits bits from src to bit pos of dst.
+    \internal
+*/
+static void briteblox_svf_copy_bits(unsigned char *dst, int pos, const unsigned char *src, int nbits)
+{
+    int i;
+
+    for (i = 0; i < nbits; i++, pos++)
+    {
+        if (src[i / 8] & (1 << (i % 8)))
+            dst[pos / 8] |= 1 << (pos % 8);
+        else
+            dst[pos / 8] &= ~(1 << (pos % 8));
+    }
+}
+
+/**
+    Handles HIR, TIR, HDR, TDR, SIR and SDR.
+    \internal
+
+    TDI, MASK and SMASK are kept until the length changes, TDO is only
+    compared for the statement it is given in. A scan is the header at
+    bit 0, then the data, then the trailer.
+*/
+static int briteblox_svf_scan(struct briteblox_svf *svf, int which, char **p)
+{
+    struct briteblox_svf_pattern *pat = &svf->patterns[which];
+    struct briteblox_svf_pattern *head, *tail;
+    struct briteblox_svf_check *check = NULL;
+    char *tok = briteblox_svf_token(p), *end;
+    long length;
+    int bytes, total, ir;
+
+    if (tok == NULL)
+        return -1;
+    length = strtol(tok, &end, 10);
+    if (*end != '\0' || length < 0 || length > 0x7fffffff - 16)
+        return -1;
+
+    bytes = (int)(length + 7) / 8;
+    if (length != pat->length || pat->tdi == NULL)
+    {
+        unsigned char **bufs[4] = { &pat->tdi, &pat->tdo, &pat->mask, &pat->smask };
+        int i;
+
+        for (i = 0; i < 4; i++)
+        {
+            unsigned char *buf = (unsigned char *)realloc(*bufs[i], bytes ? bytes : 1);
+            if (buf == NULL)
+                return -3;
+            *bufs[i] = buf;
+        }
+        memset(pat->tdi, 0, bytes);
+        memset(pat->mask, 0xff, bytes);
+        memset(pat->smask, 0xff, bytes);
+        pat->length = (int)length;
+    }
+
+    pat->check = 0;
+    while ((tok = briteblox_svf_token(p)) != NULL)
+    {
+        unsigned char *bits;
+
+        if (strcmp(tok, "TDI") == 0)
+            bits = pat->tdi;
+        else if (strcmp(tok, "TDO") == 0)
+            bits = pat->tdo, pat->check = 1;
+        else if (strcmp(tok, "MASK") == 0)
+            bits = pat->mask;
+        else if (strcmp(tok, "SMASK") == 0)
+            bits = pat->smask;
+        else
+            return -1;
+
+        if (briteblox_svf_hex(p, bits, pat->length) < 0)
+            return -1;
+    }
+
+    if (which != SVF_SIR && which != SVF_SDR)
+        return 0;
+
+    ir = (which == SVF_SIR);
+    head = &svf->patterns[ir ? SVF_HIR : SVF_HDR];
+    tail = &svf->patterns[ir ? SVF_TIR : SVF_TDR];
+    total = head->length + pat->length + tail->length;
+    if (total == 0)
+        return 0;
+    bytes = (total + 7) / 8;
+
+    if (svf->tdi_size < bytes)
+    {
+        unsigned char *tdi = (unsigned char *)realloc(svf->tdi, bytes);
+        if (tdi == NULL)
+            return -3;
+        svf->tdi = tdi;
+        svf->tdi_size = bytes;
+    }
+    memset(svf->tdi, 0, bytes);
+    briteblox_svf_copy_bits(svf->tdi, 0, head->tdi, head->length);
+    briteblox_svf_copy_bits(svf->tdi, head->length, pat->tdi, pat->length);
+    briteblox_svf_copy_bits(svf->tdi, head->length + pat->length, tail->tdi, tail->length);
+
+    if (svf->execute && (head->check || pat->check || tail->check))
+    {
+        struct briteblox_svf_pattern *parts[3] = { head, pat, tail };
+        int i, pos = 0;
+
+        check = (struct briteblox_svf_check *)calloc(1, sizeof(*check) + 3 * bytes);
+        if (check == NULL)
+            return -3;
+        check->line = svf->line;
+        check->nbits = total;
+        check->tdo = (unsigned char *)(check + 1);
+        check->expected = check->tdo + bytes;
+        check->mask = check->expected + bytes;
+
+        // parts without TDO stay masked out
+        for (i = 0; i < 3; pos += parts[i]->length, i++)
+        {
+            if (!parts[i]->check)
+                continue;
+            briteblox_svf_copy_bits(check->expected, pos, parts[i]->tdo, parts[i]->length);
+            briteblox_svf_copy_bits(check->mask, pos, parts[i]->mask, parts[i]->length);
+        }
+        *svf->checks_tail = check;
+        svf->checks_tail = &check->next;
+    }
+
+    if (briteblox_jtag_scan(svf->jtag, ir, svf->tdi, check ? check->tdo : NULL, total,
+                            ir ? svf->endir : svf->enddr) < 0)
+        return -3;
+    return 0;
+}
+
+/**
+    Handles RUNTEST.
+    \internal
+
+    run_count is taken as TCK cycles whether given in TCK or SCK, a
+    min_time is turned into cycles at the current TCK frequency and the
+    longer of the two is clocked. MAXIMUM is ignored.
+*/
+static int briteblox_svf_runtest(struct briteblox_svf *svf, char **p)
+{
+    double value = 0, count = 0, min_time = 0;
+    int have_value = 0, maximum = 0, have_end = 0, s;
+    unsigned long cycles;
+    char *tok;
+
+    while ((tok = briteblox_svf_token(p)) != NULL)
+    {
+        char *end;
+        double v = strtod(tok, &end);
+
+        if (end != tok && *end == '\0')
+        {
+            value = v;
+            have_value = 1;
+        }
+        else if ((strcmp(tok, "TCK") == 0 || strcmp(tok, "SCK") == 0) && have_value)
+        {
+            count = value;
+            have_value = 0;
+        }
+        else if (strcmp(tok, "SEC") == 0 && have_value)
+        {
+            if (!maximum)
+                min_time = value;
+            have_value = 0;
+        }
+        else if (strcmp(tok, "MAXIMUM") == 0)
+            maximum = 1;
+        else if (strcmp(tok, "ENDSTATE") == 0)
+        {
+            if ((s = briteblox_svf_state(briteblox_svf_token(p), 1)) < 0)
+                return -1;
+            svf->run_end_state = (enum briteblox_jtag_state)s;
+            have_end = 1;
+        }
+        else if ((s = briteblox_svf_state(tok, 1)) >= 0)
+        {
+            svf->run_state = (enum briteblox_jtag_state)s;
+            if (!have_end)
+                svf->run_end_state = svf->run_state;
+        }
+        else
+            return -1;
+    }
+    if (have_value || count < 0 || min_time < 0)
+        return -1;
+
+    cycles = (unsigned long)count;
+    if (min_time * briteblox_jtag_get_frequency(svf->jtag) > cycles)
+        cycles = (unsigned long)(min_time * briteblox_jtag_get_frequency(svf->jtag) + 0.999999);
+
+    if (briteblox_jtag_goto_state(svf->jtag, svf->run_state) < 0 ||
+        briteblox_jtag_run_test(svf->jtag, cycles) < 0 ||
+        briteblox_jtag_goto_state(svf->jtag, svf->run_end_state) < 0)
+        return -3;
+    return 0;
+}
+
+/**
+    Handles one statement.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: syntax error or unsupported statement
+    \retval -3: out of memory
+*/
+static int briteblox_svf_statement(struct briteblox_svf *svf)
+{
+    static const char *scans[SVF_NUM_PATTERNS] = { "HIR", "TIR", "HDR", "TDR", "SIR", "SDR" };
+    char *p = svf->stmt;
+    char *cmd = briteblox_svf_token(&p), *tok, *last = NULL;
+    int i, s;
+
+    if (cmd == NULL)
+        return 0;
+
+    for (i = 0; i < SVF_NUM_PATTERNS; i++)
+        if (strcmp(cmd, scans[i]) == 0)
+            return briteblox_svf_scan(svf, i, &p);
+
+    if (strcmp(cmd, "RUNTEST") == 0)
+        return briteblox_svf_runtest(svf, &p);
+
+    if (strcmp(cmd, "ENDIR") == 0 || strcmp(cmd, "ENDDR") == 0)
+    {
+        if ((s = briteblox_svf_state(briteblox_svf_token(&p), 1)) < 0 ||
+            briteblox_svf_token(&p) != NULL)
+            return -1;
+        if (cmd[3] == 'I')
+            svf->endir = (enum briteblox_jtag_state)s;
+        else
+            svf->enddr = (enum briteblox_jtag_state)s;
+        return 0;
+    }
+
+    if (strcmp(cmd, "STATE") == 0)
+    {
+        unsigned int tms = 0;
+        int nbits = 0;
+
+        if ((tok = briteblox_svf_token(&p)) == NULL)
+            return -1;
+        if ((last = briteblox_svf_token(&p)) == NULL)
+        {
+            // a single state: the shortest path
+            if ((s = briteblox_svf_state(tok, 1)) < 0)
+                return -1;
+            if (s == JTAG_TEST_LOGIC_RESET)
+                return briteblox_jtag_reset(svf->jtag) < 0 ? -3 : 0;
+            return briteblox_jtag_goto_state(svf->jtag, (enum briteblox_jtag_state)s) < 0 ? -3 : 0;
+        }
+
+        // an explicit path: every state is one TMS step from the one
+        // before, clocked exactly as listed
+        s = svf->jtag->state;
+        while (tok != NULL)
+        {
+            int to = briteblox_svf_state(tok, last == NULL);
+
+            if (to < 0)
+                return -1;
+            if (jtag_next[s][1] == to)
+                tms |= 1 << nbits;
+            else if (jtag_next[s][0] != to)
+                return -1;
+            if (++nbits == 7)
+            {
+                if (briteblox_jtag_clock_tms(svf->jtag, tms, nbits) < 0)
+                    return -3;
+                tms = 0;
+                nbits = 0;
+            }
+            s = to;
+            tok = last;
+            last = tok ? briteblox_svf_token(&p) : NULL;
+        }
+        if (briteblox_jtag_clock_tms(svf->jtag, tms, nbits) < 0)
+            return -3;
+        svf->jtag->state = (enum briteblox_jtag_state)s;
+        return 0;
+    }
+
+    if (strcmp(cmd, "FREQUENCY") == 0)
+    {
+        double hz;
+        char *end;
+
+        // without a value: full speed, which is what we run at anyway
+        if ((tok = briteblox_svf_token(&p)) == NULL)
+            return 0;
+        hz = strtod(tok, &end);
+        if (*end != '\0' || hz < 1 || (tok = briteblox_svf_token(&p)) == NULL || strcmp(tok, "HZ") != 0)
+            return -1;
+        return briteblox_jtag_set_frequency(svf->jtag, (unsigned int)hz) < 0 ? -1 : 0;
+    }
+
+    // no TRST pin
+    if (strcmp(cmd, "TRST") == 0)
+        return 0;
+
+    return -1;
+}
+
+/**
+    Sends the queue and compares the TDO of the scans in it.
+    \internal
+
+    \retval  0: all fine
+    \retval -2: TDO mismatch, line is set to the statement
+    \retval -4: USB error
+*/
+static int briteblox_svf_execute(struct briteblox_svf *svf, int *line)
+{
+    struct briteblox_svf_check *check, *next;
+    int ret = 0, i;
+
+    if (svf->execute && briteblox_jtag_execute(svf->jtag) < 0)
+        ret = -4;
+
+    for (check = svf->checks; check != NULL; check = next)
+    {
+        next = check->next;
+        for (i = 0; ret == 0 && i < (check->nbits + 7) / 8; i++)
+        {
+            if ((check->tdo[i] ^ check->expected[i]) & check->mask[i])
+            {
+                *line = check->line;
+                ret = -2;
+            }
+        }
+        free(check);
+    }
+    svf->checks = NULL;
+    svf->checks_tail = &svf->checks;
+    return ret;
+}
+
+/**
+    Plays an SVF file.
+    \internal
+*/
+static int briteblox_svf_play(struct briteblox_jtag *jtag, FILE *f, int *line, int execute)
+{
+    struct briteblox_svf svf;
+    int ret, i, current = 1;
+
+    memset(&svf, 0, sizeof(svf));
+    svf.jtag = jtag;
+    svf.execute = execute;
+    svf.endir = svf.enddr = JTAG_RUN_TEST_IDLE;
+    svf.run_state = svf.run_end_state = JTAG_RUN_TEST_IDLE;
+    svf.checks_tail = &svf.checks;
+
+    while ((ret = briteblox_svf_read_statement(&svf, f, &current)) > 0)
+    {
+        ret = briteblox_svf_statement(&svf);
+        if (ret == 0 && briteblox_jtag_get_pending(jtag) >= SVF_FLUSH_BYTES && execute)
+            ret = briteblox_svf_execute(&svf, line);
+        if (ret < 0)
+            break;
+    }
+    if (ret < 0 && ret != -2)
+        *line = svf.line;
+    if (ret == 0 && execute)
+        ret = briteblox_svf_execute(&svf, line);
+
+    // the queue may point into the checks
+    if (ret < 0 && ret != -2 && ret != -4)
+    {
+        briteblox_mpsse_queue_reset(jtag->queue);
+        briteblox_jtag_apply_fixups(jtag, 0);
+    }
+    for (i = 0; i < SVF_NUM_PATTERNS; i++)
+    {
+        free(svf.patterns[i].tdi);
+        free(svf.patterns[i].tdo);
+        free(svf.patterns[i].mask);
+        free(svf.patterns[i].smask);
+    }
+    while (svf.checks != NULL)
+    {
+        struct briteblox_svf_check *next = svf.checks->next;
+        free(svf.checks);
+        svf.checks = next;
+    }
+    free(svf.tdi);
+    free(svf.stmt);
+    return ret;
+}
+
+/**
+    Play an SVF file.
+
+    Statements are queued and sent whenever 64 KiB of MPSSE commands
+    have piled up, TDO is compared after each round trip. Supported are
+    SIR, SDR, HIR, TIR, HDR, TDR, ENDIR, ENDDR, STATE, RUNTEST and
+    FREQUENCY. TRST is ignored, the engine has no TRST pin. RUNTEST
+    clocks TCK for min_time at the current frequency instead of waiting.
+    Commands queued on the engine before are sent along.
+
+    \param jtag JTAG engine
+    \param svf File to play, read up to its end
+    \param line Receives the line of the failing statement, may be NULL
+
+    \retval  0: all fine
+    \retval -1: syntax error or unsupported statement
+    \retval -2: TDO mismatch
+    \retval -3: out of memory
+    \retval -4: USB error, see briteblox_get_error_string()
+*/
+int briteblox_jtag_play_svf(struct briteblox_jtag *jtag, FILE *svf, int *line)
+{
+    struct briteblox_context *briteblox = jtag->briteblox;
+    int dummy;
+    int ret = briteblox_svf_play(jtag, svf, line ? line : &dummy, 1);
+
+    switch (ret)
+    {
+        case -1:
+            briteblox_error_return(-1, "SVF syntax error or unsupported statement");
+        case -2:
+            briteblox_error_return(-2, "SVF TDO mismatch");
+        case -3:
+            briteblox_error_return(-3, "out of memory playing SVF");
+        default:
+            // -4 keeps the error string of the USB layer
+            return ret;
+    }
+}
+
+/* Exported for the unit test: an engine that only queues */
+struct briteblox_jtag *jtag_alloc_UT_export(struct briteblox_context *briteblox)
+{
+    struct briteblox_jtag *jtag = (struct briteblox_jtag *)calloc(1, sizeof(*jtag));
+
+    jtag->briteblox = briteblox;
+    jtag->state = JTAG_TEST_LOGIC_RESET;
+    jtag->queue = briteblox_mpsse_queue_new(briteblox);
+    return jtag;
+}
+
+/* Exported for the unit test: the queue of an engine */
+struct briteblox_mpsse_queue *jtag_queue_UT_export(struct briteblox_jtag *jtag)
+{
+    return jtag->queue;
+}
+
+/* Exported for the unit test: deliver a response as execute would */
+void jtag_apply_fixups_UT_export(struct briteblox_jtag *jtag)
+{
+    briteblox_jtag_apply_fixups(jtag, 1);
+}
+
+/* Exported for the unit test: shortest TMS path */
+int jtag_tms_path_UT_export(int from, int to, unsigned int *tms)
+{
+    return briteblox_jtag_tms_path((enum briteblox_jtag_state)from, (enum briteblox_jtag_state)to, tms);
+}
+
+/* Exported for the unit test: queue an SVF file without sending it */
+int jtag_svf_UT_export(struct briteblox_jtag *jtag, FILE *svf, int *line)
+{
+    return briteblox_svf_play(jtag, svf, line, 0);
+}
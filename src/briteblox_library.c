@@ -0,0 +1,757 @@
+/***************************************************************************
+                          briteblox_library.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Shared library context.
+ *
+ * Every briteblox_context normally owns a libusb context. Contexts
+ * created with briteblox_new_shared() use the libusb context of a
+ * briteblox_library instead, so many channels share one device list and
+ * one event loop. The library is reference counted, every attached
+ * briteblox_context holds a reference.
+ *
+ * The library can also keep a registry of the attached chips, fed by
+ * libusb hotplug events. The libusb callback runs while events are
+ * handled, where no synchronous transfer may be issued, so it only
+ * queues the event. The string descriptors are read when the queue is
+ * worked off by briteblox_registry_poll(), which every registry lookup
+ * does first.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+/* Longest wait of the event thread before it checks for a stop request */
+#define LIBRARY_EVENT_SLICE_US 100000
+
+#ifdef HAVE_PTHREAD
+#define registry_lock(r)    pthread_mutex_lock(&(r)->lock)
+#define registry_unlock(r)  pthread_mutex_unlock(&(r)->lock)
+#else
+#define registry_lock(r)    do { } while (0)
+#define registry_unlock(r)  do { } while (0)
+#endif
+
+/* Hotplug event not yet worked off */
+struct briteblox_registry_pending
+{
+    /** referenced device */
+    struct libusb_device *dev;
+    libusb_hotplug_event event;
+};
+
+struct briteblox_registry
+{
+    /** hotplug filter, 0 matches any */
+    int vendor;
+    int product;
+    libusb_hotplug_callback_handle handle;
+
+    BRITEBLOXRegistryCallback *callback;
+    void *userdata;
+
+    /** known devices, each dev referenced */
+    struct briteblox_registry_device *devices;
+    int num_devices;
+    int devices_size;
+
+    /** queued by the hotplug callback */
+    struct briteblox_registry_pending *pending;
+    int num_pending;
+    int pending_size;
+    /** events dropped for lack of memory */
+    unsigned int lost;
+
+#ifdef HAVE_PTHREAD
+    /** guards devices and pending */
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+/* Event thread: service the completions of all attached contexts */
+static void *
+briteblox_library_event_main(void *arg)
+{
+    struct briteblox_library *library = arg;
+
+    while (!briteblox_atomic_load(&library->quit))
+    {
+        struct timeval timeout = { 0, LIBRARY_EVENT_SLICE_US };
+        int ret = libusb_handle_events_timeout_completed(library->usb_ctx, &timeout, &library->quit);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            break;
+    }
+    return NULL;
+}
+#endif
+
+/**
+    Create a shared library context with its own libusb context.
+
+    \retval NULL: out of memory or libusb_init() failed
+    \retval !NULL: the library context, holding one reference
+*/
+struct briteblox_library *briteblox_library_new(void)
+{
+    struct briteblox_library *library =
+        (struct briteblox_library *)calloc(1, sizeof(struct briteblox_library));
+
+    if (library == NULL)
+        return NULL;
+
+    if (libusb_init(&library->usb_ctx) < 0)
+    {
+        free(library);
+        return NULL;
+    }
+    library->refs = 1;
+    return library;
+}
+
+/**
+    Take another reference to a library context.
+
+    \param library library context
+
+    \retval the library context
+*/
+struct briteblox_library *briteblox_library_ref(struct briteblox_library *library)
+{
+    briteblox_atomic_add(&library->refs, 1);
+    return library;
+}
+
+/**
+    Drop a reference to a library context. The last reference stops
+    the event thread and frees the libusb context.
+
+    \param library library context, may be NULL
+*/
+void briteblox_library_unref(struct briteblox_library *library)
+{
+    if (library == NULL || briteblox_atomic_add(&library->refs, (unsigned int)-1) != 0)
+        return;
+
+    briteblox_library_stop_event_thread(library);
+    briteblox_registry_stop(library);
+    briteblox_string_cache_free(library);
+    libusb_exit(library->usb_ctx);
+    free(library);
+}
+
+/**
+    Start a thread that handles the libusb events of all contexts
+    attached to the library.
+
+    Completions of transfers started with briteblox_write_data_submit()
+    and briteblox_read_data_submit() then run on the event thread.
+    Blocking calls keep working, libusb lets them wait for the events
+    handled by the thread. A briteblox_context must still be used by one
+    thread at a time.
+
+    The submit pool and read-ahead update their queues from the
+    completions without a lock. Setting them up fails while the thread
+    runs, and contexts that already use them get errors from
+    briteblox_read_data_submit() and briteblox_read_data() until the
+    thread is stopped.
+
+    \param library library context
+
+    \retval  0: all fine
+    \retval -1: event thread already running
+    \retval -2: no thread support on this platform
+    \retval -3: can't create the thread
+*/
+int briteblox_library_start_event_thread(struct briteblox_library *library)
+{
+#ifdef HAVE_PTHREAD
+    if (library->thread_running)
+        return -1;
+
+    briteblox_atomic_store(&library->quit, 0);
+    if (pthread_create(&library->thread, NULL, briteblox_library_event_main, library) != 0)
+        return -3;
+    library->thread_running = 1;
+    return 0;
+#else
+    (void)library;
+    return -2;
+#endif
+}
+
+/**
+    Stop the event thread and wait for it to end. Takes up to 100 ms
+    when no USB events wake up the thread.
+
+    \param library library context
+
+    \retval  0: all fine
+    \retval -1: event thread not running
+*/
+int briteblox_library_stop_event_thread(struct briteblox_library *library)
+{
+#ifdef HAVE_PTHREAD
+    if (!library->thread_running)
+        return -1;
+
+    briteblox_atomic_store(&library->quit, 1);
+    pthread_join(library->thread, NULL);
+    library->thread_running = 0;
+    return 0;
+#else
+    (void)library;
+    return -1;
+#endif
+}
+
+/**
+    Get the libusb context of a library context, for applications that
+    also use libusb directly.
+
+    \param library library context
+
+    \retval the libusb context
+*/
+struct libusb_context *briteblox_library_get_usb_context(struct briteblox_library *library)
+{
+    return library->usb_ctx;
+}
+
+/**
+    Queues a hotplug event for briteblox_registry_poll().
+    \internal
+*/
+static int briteblox_registry_queue(struct briteblox_registry *registry,
+                                    struct libusb_device *dev, libusb_hotplug_event event)
+{
+    int ret = 0;
+
+    registry_lock(registry);
+    if (registry->num_pending == registry->pending_size)
+    {
+        int size = registry->pending_size ? registry->pending_size * 2 : 16;
+        struct briteblox_registry_pending *pending = (struct briteblox_registry_pending *)
+            realloc(registry->pending, size * sizeof(*pending));
+        if (pending == NULL)
+        {
+            registry->lost++;
+            ret = -1;
+        }
+        else
+        {
+            registry->pending = pending;
+            registry->pending_size = size;
+        }
+    }
+    if (ret == 0)
+    {
+        registry->pending[registry->num_pending].dev = libusb_ref_device(dev);
+        registry->pending[registry->num_pending].event = event;
+        registry->num_pending++;
+    }
+    registry_unlock(registry);
+    return ret;
+}
+
+static int briteblox_registry_hotplug_cb(struct libusb_context *ctx, struct libusb_device *dev,
+                                        libusb_hotplug_event event, void *userdata)
+{
+    (void)ctx;
+    briteblox_registry_queue((struct briteblox_registry *)userdata, dev, event);
+    return 0;
+}
+
+/**
+    Reads the strings of a registry entry that are still missing, from
+    the string cache or the device. The device may not be accessible
+    yet right after it arrived, e.g. before udev adjusted the permissions.
+    \internal
+*/
+static void briteblox_registry_read_strings(struct briteblox_library *library,
+                                            struct briteblox_registry_device *device)
+{
+    struct libusb_device_descriptor desc;
+    struct libusb_device_handle *handle;
+    int missing = device->strings_missing;
+
+    if (libusb_get_device_descriptor(device->dev, &desc) < 0)
+        return;
+
+    if (briteblox_string_cache_lookup(library, device->dev, desc.idVendor, desc.idProduct,
+                                      BRITEBLOX_STRING_MANUFACTURER | BRITEBLOX_STRING_DESCRIPTION |
+                                      BRITEBLOX_STRING_SERIAL,
+                                      device->manufacturer, sizeof(device->manufacturer),
+                                      device->description, sizeof(device->description),
+                                      device->serial, sizeof(device->serial)) == 1)
+    {
+        device->strings_missing = 0;
+        return;
+    }
+
+    if (libusb_open(device->dev, &handle) < 0)
+        return;
+    if ((missing & BRITEBLOX_STRING_MANUFACTURER) &&
+            (!desc.iManufacturer ||
+             libusb_get_string_descriptor_ascii(handle, desc.iManufacturer, (unsigned char *)device->manufacturer,
+                                                sizeof(device->manufacturer)) >= 0))
+        missing &= ~BRITEBLOX_STRING_MANUFACTURER;
+    if ((missing & BRITEBLOX_STRING_DESCRIPTION) &&
+            (!desc.iProduct ||
+             libusb_get_string_descriptor_ascii(handle, desc.iProduct, (unsigned char *)device->description,
+                                                sizeof(device->description)) >= 0))
+        missing &= ~BRITEBLOX_STRING_DESCRIPTION;
+    if ((missing & BRITEBLOX_STRING_SERIAL) &&
+            (!desc.iSerialNumber ||
+             libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (unsigned char *)device->serial,
+                                                sizeof(device->serial)) >= 0))
+        missing &= ~BRITEBLOX_STRING_SERIAL;
+    libusb_close(handle);
+
+    device->strings_missing = missing;
+    briteblox_string_cache_store(library, device->dev, desc.idVendor, desc.idProduct,
+                                 (BRITEBLOX_STRING_MANUFACTURER | BRITEBLOX_STRING_DESCRIPTION |
+                                  BRITEBLOX_STRING_SERIAL) & ~missing,
+                                 device->manufacturer, device->description, device->serial);
+}
+
+/**
+    Fills in a new registry entry, reading the string descriptors.
+    Strings that can't be read stay empty and are marked missing.
+    \internal
+*/
+static void briteblox_registry_describe(struct briteblox_library *library,
+                                        struct briteblox_registry_device *device, struct libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    int ports;
+
+    memset(device, 0, sizeof(*device));
+    device->dev = dev;
+    device->bus = libusb_get_bus_number(dev);
+    device->address = libusb_get_device_address(dev);
+    ports = libusb_get_port_numbers(dev, device->ports, sizeof(device->ports));
+    device->num_ports = ports > 0 ? ports : 0;
+    device->strings_missing = BRITEBLOX_STRING_MANUFACTURER | BRITEBLOX_STRING_DESCRIPTION |
+                              BRITEBLOX_STRING_SERIAL;
+
+    if (libusb_get_device_descriptor(dev, &desc) < 0)
+        return;
+    device->vendor = desc.idVendor;
+    device->product = desc.idProduct;
+
+    briteblox_registry_read_strings(library, device);
+}
+
+/**
+    Retries reading the missing strings of the registry entries matching
+    vendor and product. The device is accessed without holding the lock.
+    \internal
+*/
+static void briteblox_registry_retry_strings(struct briteblox_library *library, int vendor, int product)
+{
+    struct briteblox_registry *registry = library->registry;
+    int i, j;
+
+    for (i = 0; ; i++)
+    {
+        struct briteblox_registry_device device;
+
+        registry_lock(registry);
+        while (i < registry->num_devices &&
+                (!registry->devices[i].strings_missing ||
+                 (vendor && registry->devices[i].vendor != vendor) ||
+                 (product && registry->devices[i].product != product)))
+            i++;
+        if (i == registry->num_devices)
+        {
+            registry_unlock(registry);
+            return;
+        }
+        device = registry->devices[i];
+        registry_unlock(registry);
+
+        briteblox_registry_read_strings(library, &device);
+
+        registry_lock(registry);
+        for (j = 0; j < registry->num_devices; j++)
+            if (registry->devices[j].dev == device.dev)
+                registry->devices[j] = device;
+        registry_unlock(registry);
+    }
+}
+
+/**
+    Adds a described device to the registry and reports it.
+    \internal
+*/
+static int briteblox_registry_insert(struct briteblox_registry *registry,
+                                     const struct briteblox_registry_device *device)
+{
+    int i;
+
+    registry_lock(registry);
+    for (i = 0; i < registry->num_devices; i++)
+    {
+        // ENUMERATE may race with a real arrival event
+        if (registry->devices[i].dev == device->dev)
+        {
+            registry_unlock(registry);
+            return 0;
+        }
+    }
+    if (registry->num_devices == registry->devices_size)
+    {
+        int size = registry->devices_size ? registry->devices_size * 2 : 16;
+        struct briteblox_registry_device *devices = (struct briteblox_registry_device *)
+            realloc(registry->devices, size * sizeof(*devices));
+        if (devices == NULL)
+        {
+            registry->lost++;
+            registry_unlock(registry);
+            return -1;
+        }
+        registry->devices = devices;
+        registry->devices_size = size;
+    }
+    registry->devices[registry->num_devices] = *device;
+    libusb_ref_device(device->dev);
+    registry->num_devices++;
+    registry_unlock(registry);
+
+    if (registry->callback)
+        registry->callback(device, BRITEBLOX_DEVICE_ARRIVED, registry->userdata);
+    return 1;
+}
+
+/**
+    Removes a device from the registry and reports it.
+    \internal
+*/
+static int briteblox_registry_remove(struct briteblox_registry *registry, struct libusb_device *dev)
+{
+    struct briteblox_registry_device device;
+    int i;
+
+    registry_lock(registry);
+    for (i = 0; i < registry->num_devices; i++)
+        if (registry->devices[i].dev == dev)
+            break;
+    if (i == registry->num_devices)
+    {
+        registry_unlock(registry);
+        return 0;
+    }
+    device = registry->devices[i];
+    memmove(&registry->devices[i], &registry->devices[i + 1],
+            (registry->num_devices - i - 1) * sizeof(*registry->devices));
+    registry->num_devices--;
+    registry_unlock(registry);
+
+    if (registry->callback)
+        registry->callback(&device, BRITEBLOX_DEVICE_LEFT, registry->userdata);
+    libusb_unref_device(device.dev);
+    return 1;
+}
+
+/**
+    Allocates an empty registry.
+    \internal
+*/
+static struct briteblox_registry *briteblox_registry_alloc(int vendor, int product,
+                                                           BRITEBLOXRegistryCallback *callback, void *userdata)
+{
+    struct briteblox_registry *registry = (struct briteblox_registry *)calloc(1, sizeof(*registry));
+
+    if (registry == NULL)
+        return NULL;
+    registry->vendor = vendor;
+    registry->product = product;
+    registry->callback = callback;
+    registry->userdata = userdata;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&registry->lock, NULL);
+#endif
+    return registry;
+}
+
+/**
+    Start the device registry of a library context.
+
+    Registers a libusb hotplug callback for the chips matching vendor
+    and product. The chips already attached are read right away, later
+    arrivals and removals are picked up by briteblox_registry_poll().
+    While the registry runs, briteblox_usb_find_all(),
+    briteblox_usb_open_desc_index() and briteblox_usb_open_string() of
+    the contexts attached to the library look up matching devices in
+    the registry instead of enumerating the bus.
+
+    The callback, if any, reports arrivals and removals. It runs in
+    briteblox_registry_poll() and the lookups, never inside the libusb
+    event handling, and must not start or stop the registry.
+
+    \param library library context
+    \param vendor Vendor ID, 0 for any
+    \param product Product ID, 0 for any
+    \param callback Arrival and removal callback, may be NULL
+    \param userdata passed to the callback
+
+    \retval  0: all fine
+    \retval -1: registry already running
+    \retval -2: libusb has no hotplug support on this platform
+    \retval -3: out of memory
+    \retval -4: libusb_hotplug_register_callback() failed
+*/
+int briteblox_registry_start(struct briteblox_library *library, int vendor, int product,
+                             BRITEBLOXRegistryCallback *callback, void *userdata)
+{
+    struct briteblox_registry *registry;
+
+    if (library->registry != NULL)
+        return -1;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return -2;
+
+    registry = briteblox_registry_alloc(vendor, product, callback, userdata);
+    if (registry == NULL)
+        return -3;
+
+    // the event thread may deliver events as soon as the callback is registered
+    library->registry = registry;
+    if (libusb_hotplug_register_callback(library->usb_ctx,
+                                         LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                         LIBUSB_HOTPLUG_ENUMERATE,
+                                         vendor ? vendor : LIBUSB_HOTPLUG_MATCH_ANY,
+                                         product ? product : LIBUSB_HOTPLUG_MATCH_ANY,
+                                         LIBUSB_HOTPLUG_MATCH_ANY, briteblox_registry_hotplug_cb,
+                                         registry, &registry->handle) != LIBUSB_SUCCESS)
+    {
+        briteblox_registry_stop(library);
+        return -4;
+    }
+
+    briteblox_registry_poll(library);
+    return 0;
+}
+
+/**
+    Stop the device registry. No removal events are reported.
+
+    \param library library context
+*/
+void briteblox_registry_stop(struct briteblox_library *library)
+{
+    struct briteblox_registry *registry = library->registry;
+    int i;
+
+    if (registry == NULL)
+        return;
+
+    if (registry->handle)
+        libusb_hotplug_deregister_callback(library->usb_ctx, registry->handle);
+    library->registry = NULL;
+
+    for (i = 0; i < registry->num_pending; i++)
+        libusb_unref_device(registry->pending[i].dev);
+    for (i = 0; i < registry->num_devices; i++)
+        libusb_unref_device(registry->devices[i].dev);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&registry->lock);
+#endif
+    free(registry->pending);
+    free(registry->devices);
+    free(registry);
+}
+
+/**
+    Work off the queued hotplug events: read the strings of arrived
+    devices, drop removed ones and report both to the registry
+    callback. Handles pending libusb events first unless the event
+    thread of the library runs.
+
+    \param library library context
+
+    \retval >=0: number of events worked off
+    \retval  -1: registry not running
+*/
+int briteblox_registry_poll(struct briteblox_library *library)
+{
+    struct briteblox_registry *registry = library->registry;
+    struct briteblox_registry_pending *pending;
+    int num_pending, i;
+
+    if (registry == NULL)
+        return -1;
+
+    if (!library->thread_running)
+    {
+        struct timeval zero = { 0, 0 };
+        libusb_handle_events_timeout_completed(library->usb_ctx, &zero, NULL);
+    }
+
+    registry_lock(registry);
+    pending = registry->pending;
+    num_pending = registry->num_pending;
+    registry->pending = NULL;
+    registry->num_pending = 0;
+    registry->pending_size = 0;
+    registry_unlock(registry);
+
+    for (i = 0; i < num_pending; i++)
+    {
+        if (pending[i].event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        {
+            struct briteblox_registry_device device;
+
+            briteblox_registry_describe(library, &device, pending[i].dev);
+            briteblox_registry_insert(registry, &device);
+        }
+        else
+        {
+            briteblox_registry_remove(registry, pending[i].dev);
+            briteblox_string_cache_forget(library, pending[i].dev);
+        }
+        libusb_unref_device(pending[i].dev);
+    }
+    free(pending);
+    return num_pending;
+}
+
+/**
+    Get the devices in the registry. The dev members are not
+    referenced, use libusb_ref_device() to keep one beyond the next
+    briteblox_registry_poll().
+
+    \param library library context
+    \param devices Receives up to max devices, may be NULL if max is 0
+    \param max Size of devices
+
+    \retval >=0: number of devices in the registry, may exceed max
+    \retval  -1: registry not running
+*/
+int briteblox_registry_get_devices(struct briteblox_library *library,
+                                   struct briteblox_registry_device *devices, int max)
+{
+    struct briteblox_registry *registry = library->registry;
+    int count;
+
+    if (registry == NULL)
+        return -1;
+
+    registry_lock(registry);
+    count = registry->num_devices;
+    if (max > count)
+        max = count;
+    if (max > 0)
+        memcpy(devices, registry->devices, max * sizeof(*devices));
+    registry_unlock(registry);
+    return count;
+}
+
+/**
+    Get the number of hotplug events that were dropped because memory
+    ran out. The registry may miss devices then.
+
+    \param library library context
+
+    \retval number of dropped events, 0 if the registry is not running
+*/
+unsigned int briteblox_registry_get_lost(struct briteblox_library *library)
+{
+    return library->registry ? library->registry->lost : 0;
+}
+
+/**
+    Look up a device in the registry, see briteblox_i.h.
+    \internal
+*/
+int briteblox_registry_lookup(struct briteblox_library *library, int vendor, int product,
+                              const char *description, const char *serial,
+                              int bus, int address, unsigned int index,
+                              struct libusb_device **dev)
+{
+    struct briteblox_registry *registry;
+    int i, found = 0;
+
+    if (library == NULL || library->registry == NULL)
+        return -1;
+    registry = library->registry;
+
+    // the registry only knows what its hotplug filter lets through
+    if ((registry->vendor && registry->vendor != vendor) ||
+        (registry->product && registry->product != product))
+        return -1;
+
+    briteblox_registry_poll(library);
+    if (description || serial)
+        briteblox_registry_retry_strings(library, vendor, product);
+
+    registry_lock(registry);
+    for (i = 0; i < registry->num_devices; i++)
+    {
+        const struct briteblox_registry_device *device = &registry->devices[i];
+
+        if (vendor && device->vendor != vendor)
+            continue;
+        if (product && device->product != product)
+            continue;
+        if (bus >= 0 && (device->bus != bus || device->address != address))
+            continue;
+        // can't tell whether it matches, let the caller scan the bus
+        if ((description && (device->strings_missing & BRITEBLOX_STRING_DESCRIPTION)) ||
+                (serial && (device->strings_missing & BRITEBLOX_STRING_SERIAL)))
+        {
+            found = -1;
+            break;
+        }
+        if (description && strcmp(device->description, description) != 0)
+            continue;
+        if (serial && strcmp(device->serial, serial) != 0)
+            continue;
+        if (index > 0)
+        {
+            index--;
+            continue;
+        }
+
+        *dev = libusb_ref_device(device->dev);
+        found = 1;
+        break;
+    }
+    registry_unlock(registry);
+    return found;
+}
+
+/* Exported for the unit test: a registry without libusb hotplug support */
+int registry_start_UT_export(struct briteblox_library *library, int vendor, int product,
+                             BRITEBLOXRegistryCallback *callback, void *userdata)
+{
+    library->registry = briteblox_registry_alloc(vendor, product, callback, userdata);
+    return library->registry ? 0 : -3;
+}
+
+/* Exported for the unit test: an arrival with a prepared description or a removal */
+int registry_event_UT_export(struct briteblox_library *library,
+                             const struct briteblox_registry_device *device, int event)
+{
+    if (event == BRITEBLOX_DEVICE_ARRIVED)
+        return briteblox_registry_insert(library->registry, device);
+    return briteblox_registry_remove(library->registry, device->dev);
+}
@@ -0,0 +1,860 @@
+/***************************************************************************
+                          briteblox_mpsse.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * MPSSE command queue.
+ *
+ * Commands are encoded into one buffer and sent with a single bulk
+ * write. The bytes the chip answers with arrive in command order, so
+ * every command that reads remembers where its part of the response
+ * goes. The read is submitted together with the write, the chip never
+ * blocks on a full TX buffer while commands are still coming in.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+/* Longest data length of one clock command */
+#define MPSSE_MAX_CLOCK_BYTES 65536
+
+/* Edge and bit order flags a caller may pass as mode */
+#define MPSSE_MODE_MASK (MPSSE_WRITE_NEG | MPSSE_READ_NEG | MPSSE_LSB)
+
+/** Destination of a part of the response */
+struct briteblox_mpsse_result
+{
+    unsigned char *dst;
+    int length;
+};
+
+struct briteblox_mpsse_queue
+{
+    struct briteblox_context *briteblox;
+
+    /** encoded commands */
+    unsigned char *cmd;
+    int cmd_len;
+    int cmd_size;
+
+    /** response destinations in command order */
+    struct briteblox_mpsse_result *results;
+    int num_results;
+    int results_size;
+
+    /** number of response bytes the queued commands produce */
+    int response_len;
+    /** receive buffer, response_size bytes */
+    unsigned char *response;
+    int response_size;
+
+    /** out of memory while queueing, reported by execute */
+    int error;
+
+    /** transfers an execute gave up on before libusb confirmed the
+        cancellation, with the command or response buffer they use */
+    struct briteblox_transfer_control *stuck[2];
+    unsigned char *stuck_buf[2];
+};
+
+/**
+    Makes room for length more command bytes.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: out of memory, the queue is marked failed
+*/
+static int briteblox_mpsse_reserve(struct briteblox_mpsse_queue *q, int length)
+{
+    unsigned char *cmd;
+    int size = q->cmd_size ? q->cmd_size : 256;
+
+    if (q->error)
+        return -1;
+    if (q->cmd_len + length <= q->cmd_size)
+        return 0;
+
+    while (size < q->cmd_len + length)
+        size *= 2;
+
+    cmd = (unsigned char *)realloc(q->cmd, size);
+    if (cmd == NULL)
+    {
+        q->error = 1;
+        return -1;
+    }
+    q->cmd = cmd;
+    q->cmd_size = size;
+    return 0;
+}
+
+/**
+    Records that the next length response bytes go to dst.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: out of memory, the queue is marked failed
+*/
+static int briteblox_mpsse_expect(struct briteblox_mpsse_queue *q, unsigned char *dst, int length)
+{
+    struct briteblox_mpsse_result *last = q->num_results ? &q->results[q->num_results - 1] : NULL;
+
+    if (q->error)
+        return -1;
+
+    q->response_len += length;
+
+    // consecutive reads into consecutive memory need one entry only
+    if (last != NULL && last->dst + last->length == dst)
+    {
+        last->length += length;
+        return 0;
+    }
+
+    if (q->num_results == q->results_size)
+    {
+        int size = q->results_size ? q->results_size * 2 : 16;
+        struct briteblox_mpsse_result *results =
+            (struct briteblox_mpsse_result *)realloc(q->results, size * sizeof(*results));
+        if (results == NULL)
+        {
+            q->error = 1;
+            return -1;
+        }
+        q->results = results;
+        q->results_size = size;
+    }
+
+    q->results[q->num_results].dst = dst;
+    q->results[q->num_results].length = length;
+    q->num_results++;
+    return 0;
+}
+
+/**
+    Copies the response to the destinations of the queued commands.
+    \internal
+*/
+static void briteblox_mpsse_scatter(struct briteblox_mpsse_queue *q, const unsigned char *response)
+{
+    int i;
+
+    for (i = 0; i < q->num_results; i++)
+    {
+        memcpy(q->results[i].dst, response, q->results[i].length);
+        response += q->results[i].length;
+    }
+}
+
+/**
+    Cancels the given transfers, waiting at most timeout for each. A
+    transfer not confirmed in time keeps its buffer: the queue gets a new
+    one and the transfer is parked in stuck until briteblox_mpsse_reap().
+    \internal
+
+    \retval  0: all transfers are gone
+    \retval -1: some transfer is still pending
+*/
+static int briteblox_mpsse_give_up(struct briteblox_mpsse_queue *q,
+                                   struct briteblox_transfer_control **tcs,
+                                   struct timeval *timeout)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (tcs[i] == NULL || briteblox_transfer_data_cancel(tcs[i], timeout) == 0)
+            continue;
+
+        q->stuck[i] = tcs[i];
+        if (i == 0)
+        {
+            q->stuck_buf[i] = q->cmd;
+            q->cmd = NULL;
+            q->cmd_size = 0;
+        }
+        else
+        {
+            q->stuck_buf[i] = q->response;
+            q->response = NULL;
+            q->response_size = 0;
+        }
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+    Finishes the cancellation of the transfers an earlier execute gave up
+    on and frees their buffers, waiting at most timeout for each.
+    \internal
+
+    \retval  0: nothing pending any more
+    \retval -1: some transfer is still pending
+*/
+static int briteblox_mpsse_reap(struct briteblox_mpsse_queue *q, struct timeval *timeout)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (q->stuck[i] == NULL)
+            continue;
+        if (briteblox_transfer_data_cancel(q->stuck[i], timeout) < 0)
+        {
+            ret = -1;
+            continue;
+        }
+        free(q->stuck_buf[i]);
+        q->stuck[i] = NULL;
+        q->stuck_buf[i] = NULL;
+    }
+    return ret;
+}
+
+/**
+    Allocate a new MPSSE command queue.
+
+    The chip has to be in MPSSE mode, see briteblox_set_bitmode().
+
+    \param briteblox pointer to briteblox_context the commands are sent to
+
+    \retval NULL: out of memory
+    \retval !NULL: the queue
+*/
+struct briteblox_mpsse_queue *briteblox_mpsse_queue_new(struct briteblox_context *briteblox)
+{
+    struct briteblox_mpsse_queue *q;
+
+    q = (struct briteblox_mpsse_queue *)calloc(1, sizeof(*q));
+    if (q == NULL)
+        return NULL;
+
+    q->briteblox = briteblox;
+    return q;
+}
+
+/**
+    Free an MPSSE command queue. Queued commands are dropped.
+
+    Transfers a failed briteblox_mpsse_queue_execute() left pending are
+    cancelled, waiting at most usb_write_timeout. The buffers of those
+    still not gone then are left to them and not freed.
+
+    \param q queue from briteblox_mpsse_queue_new(), may be NULL
+*/
+void briteblox_mpsse_queue_free(struct briteblox_mpsse_queue *q)
+{
+    struct timeval timeout;
+
+    if (q == NULL)
+        return;
+
+    if (q->briteblox != NULL)
+    {
+        timeout.tv_sec = q->briteblox->usb_write_timeout / 1000;
+        timeout.tv_usec = (q->briteblox->usb_write_timeout % 1000) * 1000;
+        briteblox_mpsse_reap(q, &timeout);
+    }
+
+    free(q->cmd);
+    free(q->results);
+    free(q->response);
+    free(q);
+}
+
+/**
+    Drop all queued commands. The buffers are kept for reuse.
+
+    \param q MPSSE command queue
+*/
+void briteblox_mpsse_queue_reset(struct briteblox_mpsse_queue *q)
+{
+    q->cmd_len = 0;
+    q->num_results = 0;
+    q->response_len = 0;
+    q->error = 0;
+}
+
+/**
+    Get the amount of data queued.
+
+    \param q MPSSE command queue
+    \param cmd_bytes Number of command bytes to send, may be NULL
+    \param response_bytes Number of response bytes expected, may be NULL
+
+    \retval  0: all fine
+    \retval -1: an earlier command could not be queued (out of memory)
+*/
+int briteblox_mpsse_queue_get_size(struct briteblox_mpsse_queue *q, int *cmd_bytes, int *response_bytes)
+{
+    if (cmd_bytes)
+        *cmd_bytes = q->cmd_len;
+    if (response_bytes)
+        *response_bytes = q->response_len;
+    return q->error ? -1 : 0;
+}
+
+/**
+    Queue raw command bytes.
+
+    For opcodes without a helper of their own. The caller tells how many
+    response bytes the command produces.
+
+    \param q MPSSE command queue
+    \param cmd Command bytes
+    \param length Number of command bytes
+    \param result Buffer for the response, may be NULL if result_length is 0
+    \param result_length Number of response bytes the command produces
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid arguments
+*/
+int briteblox_mpsse_command(struct briteblox_mpsse_queue *q, const unsigned char *cmd, int length,
+                            unsigned char *result, int result_length)
+{
+    if (length < 0 || result_length < 0 || (result_length > 0 && result == NULL))
+        return -2;
+
+    if (briteblox_mpsse_reserve(q, length) < 0)
+        return -1;
+    memcpy(q->cmd + q->cmd_len, cmd, length);
+    q->cmd_len += length;
+
+    if (result_length > 0)
+        return briteblox_mpsse_expect(q, result, result_length);
+    return 0;
+}
+
+/**
+    Queue byte clocking commands, split at the 64 KiB a command can carry.
+    \internal
+*/
+static int briteblox_mpsse_clock_bytes(struct briteblox_mpsse_queue *q, unsigned char opcode,
+                                       const unsigned char *out, unsigned char *in, int length)
+{
+    if (length <= 0 || ((opcode & MPSSE_DO_WRITE) && out == NULL) ||
+        ((opcode & MPSSE_DO_READ) && in == NULL))
+        return -2;
+
+    while (length > 0)
+    {
+        int n = length > MPSSE_MAX_CLOCK_BYTES ? MPSSE_MAX_CLOCK_BYTES : length;
+        int header = q->cmd_len;
+
+        if (briteblox_mpsse_reserve(q, 3 + (out ? n : 0)) < 0)
+            return -1;
+
+        q->cmd[header] = opcode;
+        q->cmd[header + 1] = (n - 1) & 0xff;
+        q->cmd[header + 2] = ((n - 1) >> 8) & 0xff;
+        q->cmd_len += 3;
+
+        if (out)
+        {
+            memcpy(q->cmd + q->cmd_len, out, n);
+            q->cmd_len += n;
+            out += n;
+        }
+        if (in)
+        {
+            if (briteblox_mpsse_expect(q, in, n) < 0)
+                return -1;
+            in += n;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+    Queue clocking out bytes on TDI/DO.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_WRITE_NEG and MPSSE_LSB
+    \param data Bytes to send, copied into the queue
+    \param length Number of bytes, longer data is split into several commands
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid length or data is NULL
+*/
+int briteblox_mpsse_clock_out(struct briteblox_mpsse_queue *q, unsigned char mode,
+                              const unsigned char *data, int length)
+{
+    return briteblox_mpsse_clock_bytes(q, MPSSE_DO_WRITE | (mode & MPSSE_MODE_MASK),
+                                       data, NULL, length);
+}
+
+/**
+    Queue clocking in bytes from TDO/DI.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_READ_NEG and MPSSE_LSB
+    \param result Buffer for the bytes, filled by briteblox_mpsse_queue_execute()
+    \param length Number of bytes
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid length or result is NULL
+*/
+int briteblox_mpsse_clock_in(struct briteblox_mpsse_queue *q, unsigned char mode,
+                             unsigned char *result, int length)
+{
+    return briteblox_mpsse_clock_bytes(q, MPSSE_DO_READ | (mode & MPSSE_MODE_MASK),
+                                       NULL, result, length);
+}
+
+/**
+    Queue clocking bytes out and in at the same time.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_WRITE_NEG, MPSSE_READ_NEG and MPSSE_LSB
+    \param data Bytes to send, copied into the queue
+    \param result Buffer for the received bytes, filled by briteblox_mpsse_queue_execute()
+    \param length Number of bytes
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid length, data or result is NULL
+*/
+int briteblox_mpsse_clock_inout(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                const unsigned char *data, unsigned char *result, int length)
+{
+    return briteblox_mpsse_clock_bytes(q, MPSSE_DO_WRITE | MPSSE_DO_READ | (mode & MPSSE_MODE_MASK),
+                                       data, result, length);
+}
+
+/**
+    Queue clocking 1 to 8 bits out and/or in.
+    \internal
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_WRITE_NEG, MPSSE_READ_NEG and MPSSE_LSB
+    \param data Bits to send, ignored unless MPSSE_DO_WRITE is in flags
+    \param result Where the received byte goes, NULL to only clock out
+    \param bits Number of bits, 1 to 8
+    \param flags MPSSE_DO_WRITE and/or MPSSE_DO_READ
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid arguments
+*/
+static int briteblox_mpsse_clock_bits(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                      unsigned char data, unsigned char *result, int bits,
+                                      unsigned char flags)
+{
+    if (bits < 1 || bits > 8)
+        return -2;
+
+    if (briteblox_mpsse_reserve(q, 3) < 0)
+        return -1;
+
+    q->cmd[q->cmd_len++] = MPSSE_BITMODE | flags | (mode & MPSSE_MODE_MASK);
+    q->cmd[q->cmd_len++] = bits - 1;
+    if (flags & MPSSE_DO_WRITE)
+        q->cmd[q->cmd_len++] = data;
+
+    if (flags & MPSSE_DO_READ)
+        return briteblox_mpsse_expect(q, result, 1);
+    return 0;
+}
+
+/**
+    Queue clocking out 1 to 8 bits on TDI/DO.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_WRITE_NEG and MPSSE_LSB
+    \param data Bits to send
+    \param bits Number of bits, 1 to 8
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid number of bits
+*/
+int briteblox_mpsse_clock_bits_out(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                   unsigned char data, int bits)
+{
+    return briteblox_mpsse_clock_bits(q, mode, data, NULL, bits, MPSSE_DO_WRITE);
+}
+
+/**
+    Queue clocking in 1 to 8 bits from TDO/DI.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_READ_NEG and MPSSE_LSB
+    \param result Where the received byte goes, see briteblox_mpsse_clock_bits_inout()
+    \param bits Number of bits, 1 to 8
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid arguments
+*/
+int briteblox_mpsse_clock_bits_in(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                  unsigned char *result, int bits)
+{
+    if (result == NULL)
+        return -2;
+    return briteblox_mpsse_clock_bits(q, mode, 0, result, bits, MPSSE_DO_READ);
+}
+
+/**
+    Queue clocking 1 to 8 bits out and in at the same time.
+
+    The received bits are stored as the chip delivers them: shifted in
+    from the LSB end in MSB first mode, from the MSB end with MPSSE_LSB.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_WRITE_NEG, MPSSE_READ_NEG and MPSSE_LSB
+    \param data Bits to send
+    \param result Where the received byte goes
+    \param bits Number of bits, 1 to 8
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid arguments
+*/
+int briteblox_mpsse_clock_bits_inout(struct briteblox_mpsse_queue *q, unsigned char mode,
+                                     unsigned char data, unsigned char *result, int bits)
+{
+    if (result == NULL)
+        return -2;
+    return briteblox_mpsse_clock_bits(q, mode, data, result, bits, MPSSE_DO_WRITE | MPSSE_DO_READ);
+}
+
+/**
+    Queue clocking 1 to 7 bits out on TMS/CS.
+
+    \param q MPSSE command queue
+    \param mode Combination of MPSSE_WRITE_NEG, MPSSE_READ_NEG and MPSSE_LSB
+    \param tms TMS bits, the first one in bit 0
+    \param bits Number of bits, 1 to 7
+    \param tdi Level of TDI/DO held during the command
+    \param result Where the bits read on TDO/DI go, NULL to not read
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid number of bits
+*/
+int briteblox_mpsse_clock_tms(struct briteblox_mpsse_queue *q, unsigned char mode,
+                              unsigned char tms, int bits, int tdi, unsigned char *result)
+{
+    if (bits < 1 || bits > 7)
+        return -2;
+
+    if (briteblox_mpsse_reserve(q, 3) < 0)
+        return -1;
+
+    q->cmd[q->cmd_len++] = MPSSE_WRITE_TMS | MPSSE_BITMODE | (result ? MPSSE_DO_READ : 0) |
+                           (mode & MPSSE_MODE_MASK);
+    q->cmd[q->cmd_len++] = bits - 1;
+    q->cmd[q->cmd_len++] = (tdi ? 0x80 : 0) | (tms & 0x7f);
+
+    if (result)
+        return briteblox_mpsse_expect(q, result, 1);
+    return 0;
+}
+
+/**
+    Queue setting the level and direction of a GPIO byte.
+
+    \param q MPSSE command queue
+    \param high 0 for the low byte (ADBUS), 1 for the high byte (ACBUS)
+    \param value Output levels
+    \param direction 1 bits are outputs
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_mpsse_set_gpio(struct briteblox_mpsse_queue *q, int high,
+                             unsigned char value, unsigned char direction)
+{
+    unsigned char cmd[3];
+
+    cmd[0] = high ? SET_BITS_HIGH : SET_BITS_LOW;
+    cmd[1] = value;
+    cmd[2] = direction;
+    return briteblox_mpsse_command(q, cmd, 3, NULL, 0);
+}
+
+/**
+    Queue reading the levels of a GPIO byte.
+
+    \param q MPSSE command queue
+    \param high 0 for the low byte (ADBUS), 1 for the high byte (ACBUS)
+    \param result Where the levels go, filled by briteblox_mpsse_queue_execute()
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: result is NULL
+*/
+int briteblox_mpsse_get_gpio(struct briteblox_mpsse_queue *q, int high, unsigned char *result)
+{
+    unsigned char cmd = high ? GET_BITS_HIGH : GET_BITS_LOW;
+
+    return briteblox_mpsse_command(q, &cmd, 1, result, 1);
+}
+
+/**
+    Queue waiting for a level on GPIOL1 before the next command runs.
+
+    \param q MPSSE command queue
+    \param level 1 to wait for high, 0 to wait for low
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_mpsse_wait_on(struct briteblox_mpsse_queue *q, int level)
+{
+    unsigned char cmd = level ? WAIT_ON_HIGH : WAIT_ON_LOW;
+
+    return briteblox_mpsse_command(q, &cmd, 1, NULL, 0);
+}
+
+/**
+    Queue setting the clock divisor.
+
+    TCK/SK runs at base / ((1 + divisor) * 2), the base clock being
+    60 MHz on H type chips with the divide by 5 disabled and 12 MHz
+    otherwise.
+
+    \param q MPSSE command queue
+    \param divisor clock divisor
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_mpsse_set_divisor(struct briteblox_mpsse_queue *q, unsigned short divisor)
+{
+    unsigned char cmd[3];
+
+    cmd[0] = TCK_DIVISOR;
+    cmd[1] = divisor & 0xff;
+    cmd[2] = (divisor >> 8) & 0xff;
+    return briteblox_mpsse_command(q, cmd, 3, NULL, 0);
+}
+
+/**
+    Queue setting the clock to at most frequency.
+
+    H type chips run from 60 MHz, the divide by 5 is only switched on
+    for frequencies below what the divisor reaches from there. Older
+    chips run from 12 MHz.
+
+    \param q MPSSE command queue
+    \param frequency TCK/SK frequency in Hz
+
+    \retval  >0: actual frequency in Hz
+    \retval  -1: out of memory
+    \retval  -2: frequency is 0 or too low for the chip
+*/
+int briteblox_mpsse_set_clock(struct briteblox_mpsse_queue *q, unsigned int frequency)
+{
+    enum briteblox_chip_type type = q->briteblox ? q->briteblox->type : TYPE_BM;
+    int high_speed = (type == TYPE_2232H || type == TYPE_4232H || type == TYPE_232H);
+    unsigned int half = high_speed ? 30000000 : 6000000;
+    unsigned int divisor;
+
+    if (frequency == 0)
+        return -2;
+
+    if (high_speed && frequency < half / 0x10000 + 1)
+        half = 6000000;
+
+    // round up so the clock is never faster than requested
+    divisor = (half + frequency - 1) / frequency - 1;
+    if (divisor > 0xffff)
+        return -2;
+
+    if (high_speed)
+    {
+        unsigned char div5 = (half == 6000000) ? EN_DIV_5 : DIS_DIV_5;
+        if (briteblox_mpsse_command(q, &div5, 1, NULL, 0) < 0)
+            return -1;
+    }
+
+    if (briteblox_mpsse_set_divisor(q, divisor) < 0)
+        return -1;
+
+    return half / (divisor + 1);
+}
+
+/**
+    Switch the chip to MPSSE mode and purge its buffers.
+
+    \param briteblox pointer to briteblox_context
+
+    \retval  0: all fine
+    \retval -1: setting the bit mode failed
+    \retval -2: purging the buffers failed
+    \retval -666: USB device unavailable
+*/
+int briteblox_mpsse_enable(struct briteblox_context *briteblox)
+{
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-666, "USB device unavailable");
+
+    if (briteblox_set_bitmode(briteblox, 0, BITMODE_RESET) < 0 ||
+        briteblox_set_bitmode(briteblox, 0, BITMODE_MPSSE) < 0)
+        return -1;
+
+    if (briteblox_usb_purge_buffers(briteblox) < 0)
+        return -2;
+
+    return 0;
+}
+
+/**
+    Send all queued commands and collect their responses.
+
+    The commands go out as one bulk write. If any of them reads,
+    SEND_IMMEDIATE is appended and the response is read in parallel,
+    then copied to the result buffers given when queueing. The queue is
+    empty afterwards, also on errors.
+
+    Waits at most usb_read_timeout for the chip, then at most
+    usb_write_timeout for the cancellation of what is stuck. A transfer
+    whose cancellation is not confirmed in time stays pending with its
+    own buffer; the next execute finishes it first and fails with -3 as
+    long as it is still there. Bytes already sitting in the read buffers
+    of the context would be taken as response, purge them after switching
+    to MPSSE mode.
+
+    \param q MPSSE command queue
+
+    \retval >=0: number of response bytes received
+    \retval   -1: out of memory while queueing
+    \retval   -2: submitting the transfers failed
+    \retval   -3: usb transfer failed or timed out, or a transfer of an
+                  earlier execute is still pending
+    \retval   -4: short response
+    \retval -666: USB device unavailable
+*/
+int briteblox_mpsse_queue_execute(struct briteblox_mpsse_queue *q)
+{
+    struct briteblox_context *briteblox = q->briteblox;
+    struct briteblox_transfer_control *tcs[2] = { NULL, NULL };
+    struct timeval timeout, cancel_timeout;
+    int results[2] = { 0, 0 };
+    int response_len = q->response_len;
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+    {
+        briteblox_mpsse_queue_reset(q);
+        briteblox_error_return(-666, "USB device unavailable");
+    }
+
+    // cancelling waits at most usb_write_timeout for a wedged chip
+    cancel_timeout.tv_sec = briteblox->usb_write_timeout / 1000;
+    cancel_timeout.tv_usec = (briteblox->usb_write_timeout % 1000) * 1000;
+
+    // a late response of an earlier execute would be taken as ours
+    if (briteblox_mpsse_reap(q, &cancel_timeout) < 0)
+    {
+        briteblox_mpsse_queue_reset(q);
+        briteblox_error_return(-3, "earlier MPSSE transfer still pending");
+    }
+
+    if (q->error)
+    {
+        briteblox_mpsse_queue_reset(q);
+        briteblox_error_return(-1, "out of memory while queueing MPSSE commands");
+    }
+
+    if (q->cmd_len == 0)
+        return 0;
+
+    if (response_len > 0)
+    {
+        unsigned char send_immediate = SEND_IMMEDIATE;
+
+        if (briteblox_mpsse_command(q, &send_immediate, 1, NULL, 0) < 0)
+        {
+            briteblox_mpsse_queue_reset(q);
+            briteblox_error_return(-1, "out of memory while queueing MPSSE commands");
+        }
+
+        if (q->response_size < response_len)
+        {
+            unsigned char *response = (unsigned char *)realloc(q->response, response_len);
+            if (response == NULL)
+            {
+                briteblox_mpsse_queue_reset(q);
+                briteblox_error_return(-1, "out of memory for the MPSSE response");
+            }
+            q->response = response;
+            q->response_size = response_len;
+        }
+
+        tcs[1] = briteblox_read_data_submit(briteblox, q->response, response_len);
+        if (tcs[1] == NULL)
+        {
+            briteblox_mpsse_queue_reset(q);
+            briteblox_error_return(-2, "submitting the MPSSE response read failed");
+        }
+    }
+
+    tcs[0] = briteblox_write_data_submit(briteblox, q->cmd, q->cmd_len);
+    if (tcs[0] == NULL)
+    {
+        briteblox_mpsse_give_up(q, tcs, &cancel_timeout);
+        briteblox_mpsse_queue_reset(q);
+        briteblox_error_return(-2, "submitting the MPSSE commands failed");
+    }
+
+    timeout.tv_sec = briteblox->usb_read_timeout / 1000;
+    timeout.tv_usec = (briteblox->usb_read_timeout % 1000) * 1000;
+    ret = briteblox_transfer_data_done_all(tcs, 2, &timeout, results);
+
+    // give up on whatever is stuck
+    if (briteblox_mpsse_give_up(q, tcs, &cancel_timeout) < 0)
+        ret = LIBUSB_ERROR_TIMEOUT;
+
+    if (ret < 0 || results[0] != q->cmd_len || results[1] < 0)
+    {
+        briteblox_mpsse_queue_reset(q);
+        briteblox_error_return(-3, "MPSSE transfer failed or timed out");
+    }
+
+    if (results[1] != response_len)
+    {
+        briteblox_mpsse_queue_reset(q);
+        briteblox_error_return(-4, "short MPSSE response");
+    }
+
+    briteblox_mpsse_scatter(q, q->response);
+    briteblox_mpsse_queue_reset(q);
+    return response_len;
+}
+
+/* Exported for the unit test: the encoded commands so far */
+const unsigned char *mpsse_queue_commands_UT_export(struct briteblox_mpsse_queue *q, int *length)
+{
+    *length = q->cmd_len;
+    return q->cmd;
+}
+
+/* Exported for the unit test: deliver a response as execute would */
+void mpsse_queue_scatter_UT_export(struct briteblox_mpsse_queue *q, const unsigned char *response)
+{
+    briteblox_mpsse_scatter(q, response);
+    briteblox_mpsse_queue_reset(q);
+}
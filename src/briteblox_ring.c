@@ -0,0 +1,207 @@
+/***************************************************************************
+                          briteblox_ring.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Single-producer/single-consumer ring holding received payload bytes.
+ *
+ * The producer (USB completion side) only writes head, the consumer
+ * (briteblox_read_data() and friends) only writes tail. Both are free
+ * running counters, the ring size is a power of two so the index into
+ * the data is counter & mask. No locks are needed as long as there is
+ * exactly one thread on either side.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "briteblox_i.h"
+
+/**
+    Allocate the ring data. Any previous content is lost.
+    \internal
+
+    \param ring pointer to briteblox_ring
+    \param min_size Requested size, rounded up to a power of two
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_ring_alloc(struct briteblox_ring *ring, unsigned int min_size)
+{
+    unsigned int size = 1;
+    unsigned char *data;
+
+    while (size < min_size)
+        size <<= 1;
+
+    data = (unsigned char *)malloc(size);
+    if (data == NULL)
+        return -1;
+
+    free(ring->data);
+    ring->data = data;
+    ring->size = size;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->high_water = 0;
+    return 0;
+}
+
+/**
+    Grow the ring to at least min_size bytes, keeping the content.
+    Must not run concurrently with the producer or the consumer.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_ring_grow(struct briteblox_ring *ring, unsigned int min_size)
+{
+    struct briteblox_ring bigger = { NULL, 0, 0, 0, 0, 0 };
+    unsigned int fill;
+
+    if (min_size <= ring->size)
+        return 0;
+
+    if (ring->data == NULL)
+        return briteblox_ring_alloc(ring, min_size);
+
+    if (briteblox_ring_alloc(&bigger, min_size) < 0)
+        return -1;
+
+    fill = briteblox_ring_pop(ring, bigger.data, bigger.size);
+    free(ring->data);
+
+    ring->data = bigger.data;
+    ring->size = bigger.size;
+    ring->mask = bigger.mask;
+    ring->head = fill;
+    ring->tail = 0;
+    if (ring->high_water < fill)
+        ring->high_water = fill;
+    return 0;
+}
+
+/**
+    Free the ring data.
+    \internal
+*/
+void briteblox_ring_free(struct briteblox_ring *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+    ring->size = 0;
+    ring->mask = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->high_water = 0;
+}
+
+/**
+    Number of bytes waiting in the ring. Safe on either side.
+    \internal
+*/
+unsigned int briteblox_ring_fill(struct briteblox_ring *ring)
+{
+    return briteblox_atomic_load(&ring->head) - briteblox_atomic_load(&ring->tail);
+}
+
+/**
+    Number of bytes the producer can still store. Safe on either side.
+    \internal
+*/
+unsigned int briteblox_ring_space(struct briteblox_ring *ring)
+{
+    return ring->size - briteblox_ring_fill(ring);
+}
+
+/**
+    Producer: strip the status bytes of a raw transfer into the ring.
+    Payload bytes that do not fit are dropped.
+    \internal
+
+    \param ring pointer to briteblox_ring
+    \param src Raw transfer data
+    \param length Number of bytes in src
+    \param packet_size max_packet_size of the device
+    \param skip Number of payload bytes already consumed elsewhere
+
+    \retval Number of payload bytes stored
+*/
+int briteblox_ring_push_stripped(struct briteblox_ring *ring, const unsigned char *src,
+                                 int length, int packet_size, int skip)
+{
+    unsigned int head = ring->head;
+    unsigned int tail = briteblox_atomic_load(&ring->tail);
+    unsigned int space = ring->size - (head - tail);
+    unsigned int index = head & ring->mask;
+    unsigned int contiguous = ring->size - index;
+    int written;
+
+    if (contiguous > space)
+        contiguous = space;
+
+    written = briteblox_strip_status(ring->data + index, src, length, packet_size,
+                                     skip, contiguous);
+    if ((unsigned int)written == contiguous && contiguous < space)
+        written += briteblox_strip_status(ring->data, src, length, packet_size,
+                                          skip + written, space - contiguous);
+
+    head += written;
+    briteblox_atomic_store(&ring->head, head);
+
+    if (head - tail > ring->high_water)
+        briteblox_atomic_store(&ring->high_water, head - tail);
+
+    return written;
+}
+
+/**
+    Consumer: take up to size bytes out of the ring.
+    \internal
+
+    \retval Number of bytes copied to buf
+*/
+int briteblox_ring_pop(struct briteblox_ring *ring, unsigned char *buf, int size)
+{
+    unsigned int tail = ring->tail;
+    unsigned int n = briteblox_atomic_load(&ring->head) - tail;
+    unsigned int index = tail & ring->mask;
+    unsigned int first;
+
+    if (n > (unsigned int)size)
+        n = size;
+
+    first = ring->size - index;
+    if (first > n)
+        first = n;
+
+    memcpy (buf, ring->data + index, first);
+    memcpy (buf + first, ring->data, n - first);
+
+    briteblox_atomic_store(&ring->tail, tail + n);
+    return n;
+}
+
+/**
+    Consumer: drop everything currently in the ring.
+    \internal
+*/
+void briteblox_ring_discard(struct briteblox_ring *ring)
+{
+    briteblox_atomic_store(&ring->tail, briteblox_atomic_load(&ring->head));
+}
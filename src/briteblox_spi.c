@@ -0,0 +1,289 @@
+/***************************************************************************
+                          briteblox_spi.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * SPI master on the MPSSE.
+ *
+ * Pin usage on the low GPIO byte: ADBUS0 SCK, ADBUS1 MOSI, ADBUS2 MISO,
+ * chip selects on any of ADBUS3 to ADBUS7. A list of transfers is
+ * compiled into one MPSSE command queue, so it costs a single USB
+ * write/read pair however many transfers and chip select changes it has.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#define SPI_SCK  0x01
+#define SPI_MOSI 0x02
+#define SPI_MISO 0x04
+
+struct briteblox_spi
+{
+    struct briteblox_context *briteblox;
+    struct briteblox_mpsse_queue *queue;
+
+    /** MPSSE edge flags for clocking out and in */
+    unsigned char write_edge;
+    unsigned char read_edge;
+    /** low GPIO byte with no chip selected */
+    unsigned char idle;
+    /** low GPIO byte directions */
+    unsigned char direction;
+    /** pins used as chip select */
+    unsigned char cs_mask;
+    /** actual SCK frequency */
+    int frequency;
+    int flags;
+};
+
+/**
+    Allocates the engine and derives the pin levels from the mode.
+    \internal
+*/
+static struct briteblox_spi *briteblox_spi_alloc(struct briteblox_context *briteblox, int mode,
+                                                 unsigned char cs_mask, int flags)
+{
+    struct briteblox_spi *spi;
+
+    if (mode < 0 || mode > 3 || (cs_mask & (SPI_SCK | SPI_MOSI | SPI_MISO)))
+        return NULL;
+
+    spi = (struct briteblox_spi *)calloc(1, sizeof(*spi));
+    if (spi == NULL)
+        return NULL;
+
+    spi->queue = briteblox_mpsse_queue_new(briteblox);
+    if (spi->queue == NULL)
+    {
+        free(spi);
+        return NULL;
+    }
+
+    spi->briteblox = briteblox;
+    spi->flags = flags;
+    spi->cs_mask = cs_mask ? cs_mask : 0x08;
+
+    // CPHA 0 samples on the leading edge, so data changes on the trailing one
+    if (mode == 0 || mode == 3)
+    {
+        spi->write_edge = MPSSE_WRITE_NEG;
+        spi->read_edge = 0;
+    }
+    else
+    {
+        spi->write_edge = 0;
+        spi->read_edge = MPSSE_READ_NEG;
+    }
+    if (flags & BRITEBLOX_SPI_LSB_FIRST)
+    {
+        spi->write_edge |= MPSSE_LSB;
+        spi->read_edge |= MPSSE_LSB;
+    }
+
+    spi->idle = (mode >= 2) ? SPI_SCK : 0;
+    if (!(flags & BRITEBLOX_SPI_CS_ACTIVE_HIGH))
+        spi->idle |= spi->cs_mask;
+    spi->direction = SPI_SCK | SPI_MOSI | spi->cs_mask;
+    return spi;
+}
+
+/**
+    Queues the commands of a transfer list without sending them.
+    \internal
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid transfer
+*/
+static int briteblox_spi_compile(struct briteblox_spi *spi, const struct briteblox_spi_transfer *xfers,
+                                 int count)
+{
+    struct briteblox_mpsse_queue *q = spi->queue;
+    unsigned char selected = 0;
+    int i, ret = 0;
+
+    for (i = 0; i < count && ret == 0; i++)
+    {
+        const struct briteblox_spi_transfer *x = &xfers[i];
+        unsigned char cs;
+
+        if (x->cs < 3 || x->cs > 7 || x->length < 0 ||
+            (x->tx == NULL && x->rx == NULL && x->length > 0))
+            return -2;
+        cs = 1 << x->cs;
+        if (!(spi->cs_mask & cs))
+            return -2;
+
+        // another device still held: release it first
+        if (selected && selected != cs)
+            ret = briteblox_mpsse_set_gpio(q, 0, spi->idle, spi->direction);
+        if (ret == 0 && selected != cs)
+            ret = briteblox_mpsse_set_gpio(q, 0, spi->idle ^ cs, spi->direction);
+        selected = cs;
+
+        if (ret == 0 && x->length > 0)
+        {
+            if (x->tx && x->rx)
+                ret = briteblox_mpsse_clock_inout(q, spi->write_edge | spi->read_edge,
+                                                  x->tx, x->rx, x->length);
+            else if (x->tx)
+                ret = briteblox_mpsse_clock_out(q, spi->write_edge, x->tx, x->length);
+            else
+                ret = briteblox_mpsse_clock_in(q, spi->read_edge, x->rx, x->length);
+        }
+
+        if (ret == 0 && !(x->flags & BRITEBLOX_SPI_CS_HOLD))
+        {
+            ret = briteblox_mpsse_set_gpio(q, 0, spi->idle, spi->direction);
+            selected = 0;
+        }
+    }
+
+    if (ret == 0 && selected)
+        ret = briteblox_mpsse_set_gpio(q, 0, spi->idle, spi->direction);
+    return ret;
+}
+
+/**
+    Set up the chip as SPI master.
+
+    Switches the chip to MPSSE mode (see briteblox_mpsse_enable()),
+    sets the clock and puts all pins in their idle state. The chip
+    must be an MPSSE capable type, the clock is calculated from the
+    chip type in the context.
+
+    \param briteblox pointer to briteblox_context
+    \param mode SPI mode 0 to 3 (CPOL << 1 | CPHA)
+    \param frequency Maximum SCK frequency in Hz
+    \param cs_mask ADBUS pins used as chip select, 0 for ADBUS3 only
+    \param flags Combination of enum briteblox_spi_flags
+
+    \retval NULL: invalid arguments, out of memory or USB error, see
+            briteblox_get_error_string()
+    \retval !NULL: the SPI engine
+*/
+struct briteblox_spi *briteblox_spi_new(struct briteblox_context *briteblox, int mode,
+                                        unsigned int frequency, unsigned char cs_mask, int flags)
+{
+    struct briteblox_spi *spi;
+    unsigned char cmd[3] = { DIS_ADAPTIVE, DIS_3_PHASE, LOOPBACK_END };
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        return NULL;
+
+    spi = briteblox_spi_alloc(briteblox, mode, cs_mask, flags);
+    if (spi == NULL)
+        return NULL;
+
+    if (briteblox_mpsse_enable(briteblox) < 0)
+    {
+        briteblox_spi_free(spi);
+        return NULL;
+    }
+
+    ret = briteblox_mpsse_set_clock(spi->queue, frequency);
+    if (ret > 0)
+    {
+        spi->frequency = ret;
+        ret = briteblox_mpsse_command(spi->queue, cmd, 3, NULL, 0);
+    }
+    if (ret == 0)
+        ret = briteblox_mpsse_set_gpio(spi->queue, 0, spi->idle, spi->direction);
+    if (ret == 0)
+        ret = briteblox_mpsse_queue_execute(spi->queue);
+
+    if (ret < 0)
+    {
+        briteblox_spi_free(spi);
+        return NULL;
+    }
+    return spi;
+}
+
+/**
+    Free the SPI engine. The chip stays in MPSSE mode.
+
+    \param spi SPI engine, may be NULL
+*/
+void briteblox_spi_free(struct briteblox_spi *spi)
+{
+    if (spi == NULL)
+        return;
+
+    briteblox_mpsse_queue_free(spi->queue);
+    free(spi);
+}
+
+/**
+    Get the actual SCK frequency.
+
+    \param spi SPI engine
+
+    \retval SCK frequency in Hz
+*/
+int briteblox_spi_get_frequency(struct briteblox_spi *spi)
+{
+    return spi->frequency;
+}
+
+/**
+    Run a list of SPI transfers in one USB round trip.
+
+    Each transfer selects its chip, clocks its bytes and deselects the
+    chip again unless BRITEBLOX_SPI_CS_HOLD is set. Transfers with CS
+    held and the same chip select continue one frame, e.g. a command
+    followed by reading the answer. A transfer with length 0 only
+    changes the chip select.
+
+    \param spi SPI engine
+    \param xfers List of transfers
+    \param count Number of transfers
+
+    \retval >=0: number of bytes received
+    \retval  -5: invalid transfer in the list
+    \retval  <0: error code from briteblox_mpsse_queue_execute()
+*/
+int briteblox_spi_transfer(struct briteblox_spi *spi, const struct briteblox_spi_transfer *xfers, int count)
+{
+    struct briteblox_context *briteblox = spi->briteblox;
+
+    // out of memory is reported by the queue
+    if (briteblox_spi_compile(spi, xfers, count) == -2)
+    {
+        briteblox_mpsse_queue_reset(spi->queue);
+        briteblox_error_return(-5, "invalid SPI transfer");
+    }
+
+    return briteblox_mpsse_queue_execute(spi->queue);
+}
+
+/* Exported for the unit test: set up an engine without touching the chip */
+struct briteblox_spi *spi_alloc_UT_export(struct briteblox_context *briteblox, int mode,
+                                          unsigned char cs_mask, int flags)
+{
+    return briteblox_spi_alloc(briteblox, mode, cs_mask, flags);
+}
+
+/* Exported for the unit test: compile a transfer list, return the queue */
+struct briteblox_mpsse_queue *spi_compile_UT_export(struct briteblox_spi *spi,
+                                                   const struct briteblox_spi_transfer *xfers, int count)
+{
+    return briteblox_spi_compile(spi, xfers, count) < 0 ? NULL : spi->queue;
+}
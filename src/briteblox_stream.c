@@ -41,9 +41,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <libusb.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "briteblox.h"
+#include "briteblox_i.h"
 
 typedef struct
 {
@@ -53,8 +59,52 @@ typedef struct
     int activity;
     int result;
     BRITEBLOXProgressInfo progress;
+    /* briteblox_readstream_batch() only */
+    BRITEBLOXStreamBatchCallback *batch_callback;
+    int flags;
+    struct briteblox_iovec *iov;
+#ifdef HAVE_PTHREAD
+    /* taken for changes of progress while a consumer thread owns it
+       and for reading it from other threads, NULL without one */
+    pthread_mutex_t *progress_lock;
+#endif
 } BRITEBLOXStreamState;
 
+static void
+briteblox_readstream_lock(BRITEBLOXStreamState *state)
+{
+#ifdef HAVE_PTHREAD
+    if (state->progress_lock)
+        pthread_mutex_lock(state->progress_lock);
+#endif
+}
+
+static void
+briteblox_readstream_unlock(BRITEBLOXStreamState *state)
+{
+#ifdef HAVE_PTHREAD
+    if (state->progress_lock)
+        pthread_mutex_unlock(state->progress_lock);
+#endif
+}
+
+/* Resubmit the transfer, or release it if the callback asked to stop */
+static void
+briteblox_readstream_resubmit(BRITEBLOXStreamState *state,
+                              struct libusb_transfer *transfer, int res)
+{
+    if (res)
+    {
+        free(transfer->buffer);
+        libusb_free_transfer(transfer);
+    }
+    else
+    {
+        transfer->status = -1;
+        state->result = libusb_submit_transfer(transfer);
+    }
+}
+
 /* Handle callbacks
  *
  * With Exit request, free memory and release the transfer
@@ -93,18 +143,80 @@ briteblox_readstream_cb(struct libusb_transfer *transfer)
             ptr += packetLen;
             length -= packetLen;
         }
-        if (res)
-        {
-            free(transfer->buffer);
-            libusb_free_transfer(transfer);
-        }
-        else
+        briteblox_readstream_resubmit(state, transfer, res);
+    }
+    else
+    {
+        fprintf(stderr, "unknown status %d\n",transfer->status);
+        state->result = LIBUSB_ERROR_IO;
+    }
+}
+
+/* Hand one completed transfer to a BRITEBLOXStreamBatchCallback, either
+ * compacted in place to one block or as one iovec entry per packet.
+ * Packets without payload get no entry, a transfer without any payload
+ * does not reach the callback.
+ *
+ * Returns the value of the user callback, 0 if it was not called
+ */
+static int
+briteblox_readstream_deliver(BRITEBLOXStreamState *state, uint8_t *ptr, int length)
+{
+    int packet_size = state->packetsize;
+    int iovcnt = 0, total = 0;
+
+    if (state->flags & BRITEBLOX_STREAM_IOVEC)
+    {
+        while (length > 2)
         {
-            transfer->status = -1;
-            state->result = libusb_submit_transfer(transfer);
+            int packetLen = length < packet_size ? length : packet_size;
+
+            if (packetLen > 2)
+            {
+                state->iov[iovcnt].base = ptr + 2;
+                state->iov[iovcnt].len = packetLen - 2;
+                total += packetLen - 2;
+                iovcnt++;
+            }
+
+            ptr += packetLen;
+            length -= packetLen;
         }
     }
     else
+    {
+        total = briteblox_strip_status(ptr, ptr, length, packet_size, 0, INT_MAX);
+        state->iov[0].base = ptr;
+        state->iov[0].len = total;
+        iovcnt = 1;
+    }
+
+    // only modem status, the chip had nothing to send
+    if (total == 0)
+        return 0;
+
+    briteblox_readstream_lock(state);
+    state->progress.current.totalBytes += total;
+    briteblox_readstream_unlock(state);
+    return state->batch_callback(state->iov, iovcnt, NULL, state->userdata);
+}
+
+/* Handle callbacks of briteblox_readstream_batch()
+ *
+ * The whole transfer goes to the user callback in one call
+ */
+static void
+briteblox_readstream_batch_cb(struct libusb_transfer *transfer)
+{
+    BRITEBLOXStreamState *state = transfer->user_data;
+
+    state->activity++;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+        int res = briteblox_readstream_deliver(state, transfer->buffer, transfer->actual_length);
+        briteblox_readstream_resubmit(state, transfer, res);
+    }
+    else
     {
         fprintf(stderr, "unknown status %d\n",transfer->status);
         state->result = LIBUSB_ERROR_IO;
@@ -123,33 +235,74 @@ TimevalDiff(const struct timeval *a, const struct timeval *b)
     return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
 }
 
-/**
-    Streaming reading of data from the device
+/* If enough time has elapsed, update the progress.
+   Returns 1 if it was updated and should be reported. */
+static int
+briteblox_progress_update(BRITEBLOXProgressInfo *progress)
+{
+    const double progressInterval = 1.0;
+    struct timeval now;
 
-    Use asynchronous transfers in libusb-1.0 for high-performance
-    streaming of data from a device interface back to the PC. This
-    function continuously transfers data until either an error occurs
-    or the callback returns a nonzero value. This function returns
-    a libusb error code or the callback's return value.
+    gettimeofday(&now, NULL);
+    if (TimevalDiff(&now, &progress->current.time) < progressInterval)
+        return 0;
 
-    For every contiguous block of received data, the callback will
-    be invoked.
+    progress->current.time = now;
+    progress->totalTime = TimevalDiff(&progress->current.time,
+                                      &progress->first.time);
 
-    \param  briteblox pointer to briteblox_context
-    \param  callback to user supplied function for one block of data
-    \param  userdata
-    \param  packetsPerTransfer number of packets per transfer
-    \param  numTransfers Number of transfers per callback
+    if (progress->prev.totalBytes)
+    {
+        // We have enough information to calculate rates
 
-*/
+        double currentTime;
 
-int
-briteblox_readstream(struct briteblox_context *briteblox,
-                BRITEBLOXStreamCallback *callback, void *userdata,
-                int packetsPerTransfer, int numTransfers)
+        currentTime = TimevalDiff(&progress->current.time,
+                                  &progress->prev.time);
+
+        progress->totalRate =
+            progress->current.totalBytes /progress->totalTime;
+        progress->currentRate =
+            (progress->current.totalBytes -
+             progress->prev.totalBytes) / currentTime;
+    }
+    return 1;
+}
+
+/* Update the progress and report it once a second.
+   Both callback flavours take it. Called from the thread that
+   delivers the data, which is the only one changing progress. */
+static void
+briteblox_readstream_progress(BRITEBLOXStreamState *state)
+{
+    BRITEBLOXProgressInfo  *progress = &state->progress;
+    int report;
+
+    briteblox_readstream_lock(state);
+    report = briteblox_progress_update(progress);
+    briteblox_readstream_unlock(state);
+
+    if (report)
+    {
+        if (state->batch_callback)
+            state->batch_callback(NULL, 0, progress, state->userdata);
+        else
+            state->callback(NULL, 0, progress, state->userdata);
+        briteblox_readstream_lock(state);
+        progress->prev = progress->current;
+        briteblox_readstream_unlock(state);
+    }
+}
+
+/* Set up the transfers and run them until the callback stops or an
+   error occurs. Shared by briteblox_readstream() and
+   briteblox_readstream_batch(). */
+static int
+briteblox_readstream_run(struct briteblox_context *briteblox, BRITEBLOXStreamState *state,
+                         libusb_transfer_cb_fn transfer_cb,
+                         int packetsPerTransfer, int numTransfers)
 {
     struct libusb_transfer **transfers;
-    BRITEBLOXStreamState state = { callback, userdata, briteblox->max_packet_size, 1 };
     int bufferSize = packetsPerTransfer * briteblox->max_packet_size;
     int xferIndex;
     int err = 0;
@@ -200,8 +353,8 @@ briteblox_readstream(struct briteblox_context *briteblox,
 
         libusb_fill_bulk_transfer(transfer, briteblox->usb_dev, briteblox->out_ep,
                                   malloc(bufferSize), bufferSize,
-                                  briteblox_readstream_cb,
-                                  &state, 0);
+                                  transfer_cb,
+                                  state, 0);
 
         if (!transfer->buffer)
         {
@@ -231,57 +384,27 @@ briteblox_readstream(struct briteblox_context *briteblox,
      * Run the transfers, and periodically assess progress.
      */
 
-    gettimeofday(&state.progress.first.time, NULL);
+    gettimeofday(&state->progress.first.time, NULL);
 
     do
     {
-        BRITEBLOXProgressInfo  *progress = &state.progress;
-        const double progressInterval = 1.0;
         struct timeval timeout = { 0, briteblox->usb_read_timeout };
-        struct timeval now;
 
         int err = libusb_handle_events_timeout(briteblox->usb_ctx, &timeout);
         if (err ==  LIBUSB_ERROR_INTERRUPTED)
             /* restart interrupted events */
             err = libusb_handle_events_timeout(briteblox->usb_ctx, &timeout);
-        if (!state.result)
+        if (!state->result)
         {
-            state.result = err;
+            state->result = err;
         }
-        if (state.activity == 0)
-            state.result = 1;
+        if (state->activity == 0)
+            state->result = 1;
         else
-            state.activity = 0;
+            state->activity = 0;
 
-        // If enough time has elapsed, update the progress
-        gettimeofday(&now, NULL);
-        if (TimevalDiff(&now, &progress->current.time) >= progressInterval)
-        {
-            progress->current.time = now;
-            progress->totalTime = TimevalDiff(&progress->current.time,
-                                              &progress->first.time);
-
-            if (progress->prev.totalBytes)
-            {
-                // We have enough information to calculate rates
-
-                double currentTime;
-
-                currentTime = TimevalDiff(&progress->current.time,
-                                          &progress->prev.time);
-
-                progress->totalRate =
-                    progress->current.totalBytes /progress->totalTime;
-                progress->currentRate =
-                    (progress->current.totalBytes -
-                     progress->prev.totalBytes) / currentTime;
-            }
-
-            state.callback(NULL, 0, progress, state.userdata);
-            progress->prev = progress->current;
-
-        }
-    } while (!state.result);
+        briteblox_readstream_progress(state);
+    } while (!state->result);
 
     /*
      * Cancel any outstanding transfers, and free memory.
@@ -294,6 +417,1254 @@ cleanup:
     if (err)
         return err;
     else
-        return state.result;
+        return state->result;
+}
+
+/**
+    Streaming reading of data from the device
+
+    Use asynchronous transfers in libusb-1.0 for high-performance
+    streaming of data from a device interface back to the PC. This
+    function continuously transfers data until either an error occurs
+    or the callback returns a nonzero value. This function returns
+    a libusb error code or the callback's return value.
+
+    For every contiguous block of received data, the callback will
+    be invoked.
+
+    \param  briteblox pointer to briteblox_context
+    \param  callback to user supplied function for one block of data
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers Number of transfers per callback
+
+*/
+
+int
+briteblox_readstream(struct briteblox_context *briteblox,
+                BRITEBLOXStreamCallback *callback, void *userdata,
+                int packetsPerTransfer, int numTransfers)
+{
+    BRITEBLOXStreamState state;
+
+    memset(&state, 0, sizeof(state));
+    state.callback = callback;
+    state.userdata = userdata;
+    state.packetsize = briteblox->max_packet_size;
+    state.activity = 1;
+
+    return briteblox_readstream_run(briteblox, &state, briteblox_readstream_cb,
+                                    packetsPerTransfer, numTransfers);
+}
+
+/**
+    Streaming reading of data from the device, one callback per transfer
+
+    Works like briteblox_readstream(), but the callback is invoked once
+    for every completed transfer instead of once per packet.
+
+    By default the modem status bytes are removed and the payload of
+    the transfer is compacted in place, the callback gets one iovec
+    entry with all of it. With BRITEBLOX_STREAM_IOVEC nothing is copied,
+    the callback gets one entry per packet pointing into the transfer.
+
+    The data is only valid during the callback. For the progress report
+    the callback is invoked with iov NULL and iovcnt 0.
+
+    \param  briteblox pointer to briteblox_context
+    \param  callback to user supplied function for one transfer
+    \param  userdata
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers Number of transfers per callback
+    \param  flags 0 or BRITEBLOX_STREAM_IOVEC
+*/
+
+int
+briteblox_readstream_batch(struct briteblox_context *briteblox,
+                           BRITEBLOXStreamBatchCallback *callback, void *userdata,
+                           int packetsPerTransfer, int numTransfers, int flags)
+{
+    BRITEBLOXStreamState state;
+    int ret;
+
+    memset(&state, 0, sizeof(state));
+    state.userdata = userdata;
+    state.packetsize = briteblox->max_packet_size;
+    state.activity = 1;
+    state.batch_callback = callback;
+    state.flags = flags;
+    state.iov = malloc((flags & BRITEBLOX_STREAM_IOVEC ? packetsPerTransfer : 1) * sizeof *state.iov);
+    if (!state.iov)
+        return LIBUSB_ERROR_NO_MEM;
+
+    ret = briteblox_readstream_run(briteblox, &state, briteblox_readstream_batch_cb,
+                                   packetsPerTransfer, numTransfers);
+    free(state.iov);
+    return ret;
+}
+
+/* Streaming session, see briteblox_stream_new() */
+
+enum briteblox_stream_status
+{
+    STREAM_STOPPED = 0,
+    STREAM_RUNNING,
+    STREAM_PAUSED,
+};
+
+/* Single-producer/single-consumer queue of buffer indices, used to pass
+   buffers between the libusb event handling and the consumer thread */
+struct briteblox_stream_entry
+{
+    int index;
+    int length;
+};
+
+struct briteblox_stream_queue
+{
+    struct briteblox_stream_entry *entries;
+    unsigned int mask;
+    unsigned int head;
+    unsigned int tail;
+};
+
+static unsigned int
+briteblox_stream_queue_fill(struct briteblox_stream_queue *q)
+{
+    return briteblox_atomic_load(&q->head) - briteblox_atomic_load(&q->tail);
+}
+
+static int
+briteblox_stream_queue_push(struct briteblox_stream_queue *q, int index, int length)
+{
+    unsigned int head = q->head;
+
+    if (head - briteblox_atomic_load(&q->tail) > q->mask)
+        return -1;
+
+    q->entries[head & q->mask].index = index;
+    q->entries[head & q->mask].length = length;
+    briteblox_atomic_store(&q->head, head + 1);
+    return 0;
+}
+
+static int
+briteblox_stream_queue_pop(struct briteblox_stream_queue *q, int *index, int *length)
+{
+    unsigned int tail = q->tail;
+
+    if (briteblox_atomic_load(&q->head) == tail)
+        return -1;
+
+    *index = q->entries[tail & q->mask].index;
+    *length = q->entries[tail & q->mask].length;
+    briteblox_atomic_store(&q->tail, tail + 1);
+    return 0;
+}
+
+/* Consumer thread, see briteblox_stream_set_consumer_thread() */
+struct briteblox_stream_consumer
+{
+    /* all buffers, the first num_transfers start out in the transfers */
+    unsigned char **buffers;
+    int num_buffers;
+    /* index of the buffer each transfer currently owns */
+    int *transfer_buffer;
+    /* filled buffers on their way to the consumer thread */
+    struct briteblox_stream_queue full;
+    /* buffers the consumer thread is done with */
+    struct briteblox_stream_queue spare;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+    int thread_running;
+    int quit;
+    /* nonzero return value of the user callback */
+    int result;
+    /* completions that found the queue more than half full */
+    unsigned int backpressure;
+    /* completions dropped because no spare buffer was left */
+    unsigned int drops;
+    /* bytes of the dropped completions, 64 bit so under the lock */
+    uint64_t dropped_bytes;
+};
+
+struct briteblox_stream
+{
+    struct briteblox_context *briteblox;
+    BRITEBLOXStreamState state;
+    /* transfers and their buffers, allocated once */
+    struct libusb_transfer **transfers;
+    int num_transfers;
+    int transfer_size;
+    /* submitted transfers not yet returned by libusb */
+    int in_flight;
+    enum briteblox_stream_status status;
+    /* pause or stop requested while inside the user callback,
+       finished once the transfers returned */
+    enum briteblox_stream_status halt_to;
+    int halt_pending;
+    /* the transfers of the pending halt are cancelled already */
+    int halt_cancelled;
+    int in_callback;
+    /* NULL if the callback runs inside the libusb event handling */
+    struct briteblox_stream_consumer *consumer;
+    /* bitmode while running, see briteblox_stream_set_mode() */
+    unsigned char mode;
+};
+
+/* Pass a completed transfer to the consumer thread and give the transfer
+   a spare buffer, so it can be resubmitted right away. Without a spare
+   buffer the data is dropped and counted. */
+static void
+briteblox_stream_handoff(struct briteblox_stream *stream, struct libusb_transfer *transfer)
+{
+    struct briteblox_stream_consumer *consumer = stream->consumer;
+    int slot, spare, unused;
+
+    for (slot = 0; stream->transfers[slot] != transfer; slot++)
+        ;
+
+    if (briteblox_stream_queue_fill(&consumer->full) * 2 > (unsigned int)(consumer->num_buffers - stream->num_transfers))
+        briteblox_atomic_add(&consumer->backpressure, 1);
+
+    if (briteblox_stream_queue_pop(&consumer->spare, &spare, &unused) < 0)
+    {
+        briteblox_atomic_add(&consumer->drops, 1);
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&consumer->lock);
+#endif
+        consumer->dropped_bytes += transfer->actual_length;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&consumer->lock);
+#endif
+        return;
+    }
+
+    briteblox_stream_queue_push(&consumer->full, consumer->transfer_buffer[slot],
+                                transfer->actual_length);
+    consumer->transfer_buffer[slot] = spare;
+    transfer->buffer = consumer->buffers[spare];
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&consumer->lock);
+    pthread_cond_signal(&consumer->cond);
+    pthread_mutex_unlock(&consumer->lock);
+#endif
+}
+
+static void
+briteblox_stream_cb(struct libusb_transfer *transfer)
+{
+    struct briteblox_stream *stream = transfer->user_data;
+    BRITEBLOXStreamState *state = &stream->state;
+    int res;
+
+    stream->in_flight--;
+    state->activity++;
+
+    switch (transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            // data that made it before the cancel is still delivered
+            if (transfer->actual_length > 2)
+                break;
+            return;
+        default:
+            if (!state->result)
+                state->result = LIBUSB_ERROR_IO;
+            stream->halt_to = STREAM_STOPPED;
+            stream->halt_pending = 1;
+            return;
+    }
+
+    if (stream->consumer)
+    {
+        // idle transfers only carry the modem status, keep their buffer
+        if (transfer->actual_length > 2)
+            briteblox_stream_handoff(stream, transfer);
+        res = briteblox_atomic_load(&stream->consumer->result);
+    }
+    else
+    {
+        stream->in_callback = 1;
+        res = briteblox_readstream_deliver(state, transfer->buffer, transfer->actual_length);
+        stream->in_callback = 0;
+    }
+
+    if (res)
+    {
+        if (!state->result)
+            state->result = res;
+        stream->halt_to = STREAM_STOPPED;
+        stream->halt_pending = 1;
+    }
+
+    if (stream->status != STREAM_RUNNING || stream->halt_pending)
+        return;
+
+    transfer->status = -1;
+    res = libusb_submit_transfer(transfer);
+    if (res < 0)
+    {
+        if (!state->result)
+            state->result = res;
+        stream->halt_to = STREAM_STOPPED;
+        stream->halt_pending = 1;
+        return;
+    }
+    stream->in_flight++;
+}
+
+/* Submit all transfers of the session */
+static int
+briteblox_stream_submit_all(struct briteblox_stream *stream)
+{
+    int i, ret;
+
+    for (i = 0; i < stream->num_transfers; i++)
+    {
+        stream->transfers[i]->status = -1;
+        ret = libusb_submit_transfer(stream->transfers[i]);
+        if (ret < 0)
+            return ret;
+        stream->in_flight++;
+    }
+    return 0;
+}
+
+/* Cancel all transfers and wait until libusb returned them */
+static void
+briteblox_stream_drain(struct briteblox_stream *stream)
+{
+    int i;
+
+    for (i = 0; i < stream->num_transfers; i++)
+        libusb_cancel_transfer(stream->transfers[i]);
+
+    while (stream->in_flight > 0)
+    {
+        int ret = libusb_handle_events(stream->briteblox->usb_ctx);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            break;
+    }
+}
+
+#ifdef HAVE_PTHREAD
+/* Consumer thread: feed the filled buffers to the user callback and
+   give them back as spares. The progress is reported from here too,
+   so the callback only ever runs in this thread. */
+static void *
+briteblox_stream_consumer_main(void *arg)
+{
+    struct briteblox_stream *stream = arg;
+    struct briteblox_stream_consumer *consumer = stream->consumer;
+    int index, length, res;
+
+    while (1)
+    {
+        if (briteblox_stream_queue_pop(&consumer->full, &index, &length) == 0)
+        {
+            if (!briteblox_atomic_load(&consumer->result))
+            {
+                res = briteblox_readstream_deliver(&stream->state, consumer->buffers[index], length);
+                if (res)
+                    briteblox_atomic_cas(&consumer->result, 0, res);
+            }
+            briteblox_stream_queue_push(&consumer->spare, index, 0);
+            briteblox_readstream_progress(&stream->state);
+            continue;
+        }
+
+        // wake up once a second for the progress report
+        pthread_mutex_lock(&consumer->lock);
+        if (briteblox_stream_queue_fill(&consumer->full) == 0 && !consumer->quit)
+        {
+            struct timeval now;
+            struct timespec until;
+
+            gettimeofday(&now, NULL);
+            until.tv_sec = now.tv_sec + 1;
+            until.tv_nsec = now.tv_usec * 1000;
+            pthread_cond_timedwait(&consumer->cond, &consumer->lock, &until);
+        }
+        res = consumer->quit && briteblox_stream_queue_fill(&consumer->full) == 0;
+        pthread_mutex_unlock(&consumer->lock);
+        if (res)
+            break;
+
+        if (!briteblox_atomic_load(&consumer->result))
+            briteblox_readstream_progress(&stream->state);
+    }
+    return NULL;
+}
+#endif
+
+/* Start the consumer thread */
+static int
+briteblox_stream_consumer_start(struct briteblox_stream *stream)
+{
+#ifdef HAVE_PTHREAD
+    struct briteblox_stream_consumer *consumer = stream->consumer;
+
+    consumer->quit = 0;
+    consumer->result = 0;
+    if (pthread_create(&consumer->thread, NULL, briteblox_stream_consumer_main, stream) != 0)
+        return -1;
+    consumer->thread_running = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Let the consumer thread work off the queue and wait for it to end */
+static void
+briteblox_stream_consumer_join(struct briteblox_stream *stream)
+{
+#ifdef HAVE_PTHREAD
+    struct briteblox_stream_consumer *consumer = stream->consumer;
+
+    if (consumer == NULL || !consumer->thread_running)
+        return;
+
+    pthread_mutex_lock(&consumer->lock);
+    consumer->quit = 1;
+    pthread_cond_signal(&consumer->cond);
+    pthread_mutex_unlock(&consumer->lock);
+
+    pthread_join(consumer->thread, NULL);
+    consumer->thread_running = 0;
+
+    if (!stream->state.result)
+        stream->state.result = consumer->result;
+#endif
 }
 
+/* Cancel all transfers once for the pending halt */
+static void
+briteblox_stream_halt_cancel(struct briteblox_stream *stream)
+{
+    int i;
+
+    if (stream->halt_cancelled)
+        return;
+    for (i = 0; i < stream->num_transfers; i++)
+        libusb_cancel_transfer(stream->transfers[i]);
+    stream->halt_cancelled = 1;
+}
+
+/* Enter the paused or stopped state once the transfers are back */
+static int
+briteblox_stream_halt_finish(struct briteblox_stream *stream, enum briteblox_stream_status to)
+{
+    stream->halt_pending = 0;
+    stream->halt_cancelled = 0;
+    stream->status = to;
+
+    if (to == STREAM_STOPPED)
+    {
+        briteblox_stream_consumer_join(stream);
+        if (briteblox_set_bitmode(stream->briteblox, 0xff, BITMODE_RESET) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Bring the session to the paused or stopped state. Inside the user
+   callback the transfers can only be cancelled, the rest is done
+   by briteblox_stream_run() or briteblox_stream_step() */
+static int
+briteblox_stream_halt(struct briteblox_stream *stream, enum briteblox_stream_status to)
+{
+    stream->halt_to = to;
+    stream->halt_pending = 1;
+
+    if (stream->in_callback)
+    {
+        briteblox_stream_halt_cancel(stream);
+        return 0;
+    }
+
+    briteblox_stream_drain(stream);
+    return briteblox_stream_halt_finish(stream, to);
+}
+
+/**
+    Create a streaming session
+
+    A session owns numTransfers bulk IN transfers with buffers of
+    packetsPerTransfer packets each. They are allocated here once and
+    reused by every briteblox_stream_start() until
+    briteblox_stream_destroy().
+
+    Typical use:
+    briteblox_stream_new(), then briteblox_stream_start() and
+    briteblox_stream_run() for every capture, briteblox_stream_destroy()
+    at the end.
+
+    \param  briteblox pointer to briteblox_context, must be open
+    \param  packetsPerTransfer number of packets per transfer
+    \param  numTransfers number of transfers kept in flight
+
+    \retval NULL: invalid arguments or out of memory
+    \retval !NULL: the session
+*/
+struct briteblox_stream *
+briteblox_stream_new(struct briteblox_context *briteblox,
+                     int packetsPerTransfer, int numTransfers)
+{
+    struct briteblox_stream *stream;
+    int i;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL ||
+        packetsPerTransfer <= 0 || numTransfers <= 0 || briteblox->max_packet_size <= 2)
+        return NULL;
+
+    stream = calloc(1, sizeof *stream);
+    if (!stream)
+        return NULL;
+
+    stream->briteblox = briteblox;
+    stream->mode = BITMODE_SYNCFF;
+    stream->num_transfers = numTransfers;
+    stream->transfer_size = packetsPerTransfer * briteblox->max_packet_size;
+    stream->state.packetsize = briteblox->max_packet_size;
+    stream->transfers = calloc(numTransfers, sizeof *stream->transfers);
+    stream->state.iov = malloc(packetsPerTransfer * sizeof *stream->state.iov);
+    if (!stream->transfers || !stream->state.iov)
+    {
+        briteblox_stream_destroy(stream);
+        return NULL;
+    }
+
+    for (i = 0; i < numTransfers; i++)
+    {
+        struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+        unsigned char *buffer = malloc(stream->transfer_size);
+
+        if (!transfer || !buffer)
+        {
+            libusb_free_transfer(transfer);
+            free(buffer);
+            briteblox_stream_destroy(stream);
+            return NULL;
+        }
+
+        libusb_fill_bulk_transfer(transfer, briteblox->usb_dev, briteblox->out_ep,
+                                  buffer, stream->transfer_size,
+                                  briteblox_stream_cb, stream, 0);
+        stream->transfers[i] = transfer;
+    }
+
+    return stream;
+}
+
+/**
+    Start a capture
+
+    Puts the chip into the mode set with briteblox_stream_set_mode(),
+    synchronous FIFO mode by default, and submits all transfers.
+    The data is delivered to the callback while libusb events are
+    handled, see briteblox_stream_run(). The callback works like the
+    one of briteblox_readstream_batch(), returning nonzero stops the
+    session. With briteblox_stream_set_consumer_thread() it runs in the
+    consumer thread instead.
+
+    \param  stream the session
+    \param  callback to user supplied function for one transfer
+    \param  userdata
+    \param  flags 0 or BRITEBLOX_STREAM_IOVEC
+
+    \retval  0: all fine
+    \retval -1: session not stopped
+    \retval -2: device doesn't support the mode
+    \retval -3: can't reset mode or purge buffers
+    \retval -4: can't set the mode
+    \retval -5: can't start the consumer thread
+    \retval <-5: libusb error of libusb_submit_transfer()
+*/
+int
+briteblox_stream_start(struct briteblox_stream *stream,
+                       BRITEBLOXStreamBatchCallback *callback, void *userdata, int flags)
+{
+    struct briteblox_context *briteblox = stream->briteblox;
+    int ret;
+
+    if (stream->status != STREAM_STOPPED)
+        return -1;
+
+    /* Only FT2232H and FT232H know about the synchronous FIFO Mode*/
+    if (stream->mode == BITMODE_SYNCFF &&
+        (briteblox->type != TYPE_2232H) && (briteblox->type != TYPE_232H))
+        return -2;
+
+    /* We don't know in what state we are, switch to reset*/
+    if (briteblox_set_bitmode(briteblox, 0xff, BITMODE_RESET) < 0 ||
+        briteblox_usb_purge_buffers(briteblox) < 0)
+        return -3;
+
+    stream->state.batch_callback = callback;
+    stream->state.userdata = userdata;
+    stream->state.flags = flags;
+    stream->state.result = 0;
+    stream->state.activity = 0;
+    memset(&stream->state.progress, 0, sizeof(stream->state.progress));
+    gettimeofday(&stream->state.progress.first.time, NULL);
+    stream->halt_pending = 0;
+
+    if (stream->consumer && briteblox_stream_consumer_start(stream) < 0)
+        return -5;
+
+    /* Start the transfers only when everything has been set up. */
+    ret = briteblox_stream_submit_all(stream);
+    if (ret < 0)
+    {
+        briteblox_stream_drain(stream);
+        briteblox_stream_consumer_join(stream);
+        return ret;
+    }
+
+    /* In bitbang mode all pins are inputs, the chip samples them */
+    if (briteblox_set_bitmode(briteblox, stream->mode == BITMODE_SYNCFF ? 0xff : 0x00, stream->mode) < 0)
+    {
+        briteblox_stream_drain(stream);
+        briteblox_stream_consumer_join(stream);
+        return -4;
+    }
+
+    stream->status = STREAM_RUNNING;
+    return 0;
+}
+
+/**
+    Pause a running capture
+
+    All transfers are cancelled, data that already arrived is still
+    delivered to the callback. The chip stays in synchronous FIFO mode,
+    so it may drop data while the session is paused.
+
+    May be called from the callback.
+
+    \param  stream the session
+
+    \retval  0: all fine
+    \retval -1: session not running
+*/
+int
+briteblox_stream_pause(struct briteblox_stream *stream)
+{
+    if (stream->status != STREAM_RUNNING)
+        return -1;
+    return briteblox_stream_halt(stream, STREAM_PAUSED);
+}
+
+/**
+    Resume a paused capture
+
+    \param  stream the session
+
+    \retval  0: all fine
+    \retval -1: session not paused
+    \retval <-1: libusb error of libusb_submit_transfer()
+*/
+int
+briteblox_stream_resume(struct briteblox_stream *stream)
+{
+    int ret;
+
+    if (stream->status != STREAM_PAUSED || stream->halt_pending)
+        return -1;
+
+    ret = briteblox_stream_submit_all(stream);
+    if (ret < 0)
+    {
+        briteblox_stream_drain(stream);
+        return ret;
+    }
+
+    stream->status = STREAM_RUNNING;
+    return 0;
+}
+
+/**
+    Stop a capture
+
+    Cancels all transfers, waits until libusb returned them and switches
+    the chip back from synchronous FIFO mode. The session can be started
+    again afterwards.
+
+    May be called from the callback.
+
+    \param  stream the session
+
+    \retval  0: all fine
+    \retval -1: can't reset mode
+*/
+int
+briteblox_stream_stop(struct briteblox_stream *stream)
+{
+    if (stream->status == STREAM_STOPPED)
+        return 0;
+    return briteblox_stream_halt(stream, STREAM_STOPPED);
+}
+
+/**
+    Run a capture until it is paused or stopped
+
+    Handles libusb events and reports the progress once a second, like
+    briteblox_readstream() does. With a consumer thread the progress is
+    reported from that thread, see briteblox_stream_set_consumer_thread().
+
+    \param  stream the session
+
+    \retval  0: paused or stopped by briteblox_stream_pause() or briteblox_stream_stop()
+    \retval <0: libusb error code
+    \retval >0: return value of the callback that stopped the session
+*/
+int
+briteblox_stream_run(struct briteblox_stream *stream)
+{
+    struct briteblox_context *briteblox = stream->briteblox;
+
+    while (stream->status == STREAM_RUNNING && !stream->halt_pending)
+    {
+        struct timeval timeout = { briteblox->usb_read_timeout / 1000,
+                                   (briteblox->usb_read_timeout % 1000) * 1000 };
+
+        int err = libusb_handle_events_timeout(briteblox->usb_ctx, &timeout);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED)
+        {
+            if (!stream->state.result)
+                stream->state.result = err;
+            briteblox_stream_halt(stream, STREAM_STOPPED);
+            break;
+        }
+
+        // with a consumer thread the progress is reported there
+        if (!stream->consumer)
+            briteblox_readstream_progress(&stream->state);
+
+        if (stream->consumer && briteblox_atomic_load(&stream->consumer->result))
+        {
+            stream->halt_to = STREAM_STOPPED;
+            stream->halt_pending = 1;
+        }
+    }
+
+    // finish a pause or stop requested from the callback
+    if (stream->halt_pending)
+        briteblox_stream_halt(stream, stream->halt_to);
+
+    return stream->state.result;
+}
+
+/**
+    Advance a capture without blocking
+
+    For applications with their own event loop: poll the descriptors
+    from briteblox_get_pollfds() with the timeout from
+    briteblox_get_next_timeout() and call this whenever one of them is
+    ready or the timeout expired. The completed transfers are delivered
+    to the callback and resubmitted.
+
+    A pause or stop requested from the callback, or caused by an error,
+    is finished over the following calls: the transfers are cancelled
+    and the calls return 1 until libusb gave all of them back. Only the
+    call finishing a stop blocks, for the control transfer that takes
+    the chip out of the streaming mode. briteblox_stream_pause() and
+    briteblox_stream_stop() called outside the callback still wait for
+    the transfers.
+
+    Unlike briteblox_stream_run() no progress is reported, see
+    briteblox_stream_get_progress().
+
+    \param  stream the session
+
+    \retval  1: session still running, or a pause or stop is in progress
+    \retval  0: session paused or stopped
+    \retval <0: libusb error code, the session was stopped
+*/
+int
+briteblox_stream_step(struct briteblox_stream *stream)
+{
+    struct timeval zero = { 0, 0 };
+    int err;
+
+    if (stream->status == STREAM_RUNNING)
+    {
+        err = libusb_handle_events_timeout_completed(stream->briteblox->usb_ctx, &zero, NULL);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED)
+        {
+            if (!stream->state.result)
+                stream->state.result = err;
+            // like briteblox_stream_drain(), transfers not back yet are given up
+            briteblox_stream_halt_cancel(stream);
+            briteblox_stream_halt_finish(stream, STREAM_STOPPED);
+            return err;
+        }
+    }
+
+    if (stream->status == STREAM_RUNNING && !stream->halt_pending &&
+        stream->consumer && briteblox_atomic_load(&stream->consumer->result))
+    {
+        stream->halt_to = STREAM_STOPPED;
+        stream->halt_pending = 1;
+    }
+
+    // a pause or stop requested from the callback: cancel, then finish
+    // once the transfers and the queued data of a consumer thread are done
+    if (stream->halt_pending)
+    {
+        briteblox_stream_halt_cancel(stream);
+        if (stream->in_flight > 0 ||
+            (stream->consumer && briteblox_stream_queue_fill(&stream->consumer->full) > 0))
+            return 1;
+        briteblox_stream_halt_finish(stream, stream->halt_to);
+    }
+
+    if (stream->state.result < 0)
+        return stream->state.result;
+    return stream->status == STREAM_RUNNING;
+}
+
+/**
+    Get the progress of a capture
+
+    Fills in the byte count and time of the current moment, the rates
+    are calculated against the start of the capture.
+
+    \param  stream the session
+    \param  progress Progress info to fill in
+
+    \retval  0: all fine
+*/
+int
+briteblox_stream_get_progress(struct briteblox_stream *stream, BRITEBLOXProgressInfo *progress)
+{
+    briteblox_readstream_lock(&stream->state);
+    *progress = stream->state.progress;
+    briteblox_readstream_unlock(&stream->state);
+    gettimeofday(&progress->current.time, NULL);
+    progress->totalTime = TimevalDiff(&progress->current.time, &progress->first.time);
+    if (progress->totalTime > 0)
+        progress->totalRate = progress->current.totalBytes / progress->totalTime;
+    return 0;
+}
+
+/* Give the transfers their original buffers back and free the rest */
+static void
+briteblox_stream_consumer_free(struct briteblox_stream *stream)
+{
+    struct briteblox_stream_consumer *consumer = stream->consumer;
+    int i;
+
+    if (consumer == NULL)
+        return;
+
+    if (consumer->buffers)
+    {
+        for (i = 0; i < stream->num_transfers; i++)
+        {
+            stream->transfers[i]->buffer = consumer->buffers[i];
+            consumer->buffers[i] = NULL;
+        }
+        for (i = stream->num_transfers; i < consumer->num_buffers; i++)
+            free(consumer->buffers[i]);
+    }
+
+#ifdef HAVE_PTHREAD
+    stream->state.progress_lock = NULL;
+    pthread_mutex_destroy(&consumer->lock);
+    pthread_cond_destroy(&consumer->cond);
+#endif
+    free(consumer->buffers);
+    free(consumer->transfer_buffer);
+    free(consumer->full.entries);
+    free(consumer->spare.entries);
+    free(consumer);
+    stream->consumer = NULL;
+}
+
+/**
+    Set the mode a capture runs in
+
+    BITMODE_SYNCFF streams whatever the external logic writes into the
+    synchronous FIFO of an FT2232H or FT232H. BITMODE_BITBANG works on
+    all chips: with all pins as inputs the chip sends a sample of them
+    at the bitbang rate, see briteblox_set_bitbang_rate().
+
+    \param  stream the session, must be stopped
+    \param  mode BITMODE_SYNCFF (default) or BITMODE_BITBANG
+
+    \retval  0: all fine
+    \retval -1: session not stopped or unsupported mode
+*/
+int
+briteblox_stream_set_mode(struct briteblox_stream *stream, unsigned char mode)
+{
+    if (stream->status != STREAM_STOPPED ||
+        (mode != BITMODE_SYNCFF && mode != BITMODE_BITBANG))
+        return -1;
+
+    stream->mode = mode;
+    return 0;
+}
+
+/**
+    Run the callback in a consumer thread
+
+    By default the callback runs inside the libusb event handling, a
+    slow callback delays the resubmission of the transfers and the chip
+    overruns. With a consumer thread every completed transfer is queued
+    to the thread and the transfer is resubmitted at once with one of
+    queue_depth spare buffers.
+
+    If the consumer falls behind and no spare buffer is left, the data
+    of the transfer is dropped and counted, see
+    briteblox_stream_get_consumer_stats().
+
+    The callback then only runs in the consumer thread, the progress
+    reports of briteblox_stream_run() included. It must not call other
+    session functions there, it stops the session by returning nonzero.
+    briteblox_stream_get_progress() may be called from any thread.
+
+    \param  stream the session, must be stopped
+    \param  queue_depth Number of spare buffers, 0 disables the thread
+
+    \retval  0: all fine
+    \retval -1: session not stopped or queue_depth negative
+    \retval -2: out of memory
+    \retval -3: no thread support on this platform
+*/
+int
+briteblox_stream_set_consumer_thread(struct briteblox_stream *stream, int queue_depth)
+{
+#ifdef HAVE_PTHREAD
+    struct briteblox_stream_consumer *consumer;
+    unsigned int size = 1;
+    int i;
+#endif
+
+    if (stream->status != STREAM_STOPPED || queue_depth < 0)
+        return -1;
+
+    briteblox_stream_consumer_free(stream);
+    if (queue_depth == 0)
+        return 0;
+
+#ifndef HAVE_PTHREAD
+    return -3;
+#else
+    consumer = calloc(1, sizeof *consumer);
+    if (!consumer)
+        return -2;
+    stream->consumer = consumer;
+    pthread_mutex_init(&consumer->lock, NULL);
+    pthread_cond_init(&consumer->cond, NULL);
+    stream->state.progress_lock = &consumer->lock;
+
+    consumer->num_buffers = stream->num_transfers + queue_depth;
+    while (size < (unsigned int)consumer->num_buffers)
+        size <<= 1;
+
+    consumer->buffers = calloc(consumer->num_buffers, sizeof *consumer->buffers);
+    consumer->transfer_buffer = calloc(stream->num_transfers, sizeof *consumer->transfer_buffer);
+    consumer->full.entries = calloc(size, sizeof *consumer->full.entries);
+    consumer->spare.entries = calloc(size, sizeof *consumer->spare.entries);
+    consumer->full.mask = consumer->spare.mask = size - 1;
+    if (!consumer->buffers || !consumer->transfer_buffer ||
+        !consumer->full.entries || !consumer->spare.entries)
+    {
+        briteblox_stream_consumer_free(stream);
+        return -2;
+    }
+
+    for (i = 0; i < stream->num_transfers; i++)
+    {
+        consumer->buffers[i] = stream->transfers[i]->buffer;
+        consumer->transfer_buffer[i] = i;
+    }
+    for (; i < consumer->num_buffers; i++)
+    {
+        consumer->buffers[i] = malloc(stream->transfer_size);
+        if (!consumer->buffers[i])
+        {
+            briteblox_stream_consumer_free(stream);
+            return -2;
+        }
+        briteblox_stream_queue_push(&consumer->spare, i, 0);
+    }
+
+    return 0;
+#endif
+}
+
+/**
+    Get the consumer thread statistics
+
+    \param  stream the session
+    \param  queued Pointer to store the number of buffers waiting for the consumer in, may be NULL
+    \param  backpressure Pointer to store the number of completions that found
+             the queue more than half full in, may be NULL
+    \param  drops Pointer to store the number of dropped transfers in, may be NULL
+    \param  dropped_bytes Pointer to store the number of dropped bytes in, may be NULL
+
+    \retval  0: all fine
+    \retval -1: no consumer thread configured
+*/
+int
+briteblox_stream_get_consumer_stats(struct briteblox_stream *stream, unsigned int *queued,
+                                    unsigned int *backpressure, unsigned int *drops,
+                                    uint64_t *dropped_bytes)
+{
+    struct briteblox_stream_consumer *consumer = stream->consumer;
+
+    if (consumer == NULL)
+        return -1;
+
+    if (queued)
+        *queued = briteblox_stream_queue_fill(&consumer->full);
+    if (backpressure)
+        *backpressure = briteblox_atomic_load(&consumer->backpressure);
+    if (drops)
+        *drops = briteblox_atomic_load(&consumer->drops);
+    if (dropped_bytes)
+    {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&consumer->lock);
+#endif
+        *dropped_bytes = consumer->dropped_bytes;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&consumer->lock);
+#endif
+    }
+    return 0;
+}
+
+/**
+    Destroy a session
+
+    Stops a running capture and frees all transfers and buffers.
+
+    \param  stream the session, may be NULL
+*/
+void
+briteblox_stream_destroy(struct briteblox_stream *stream)
+{
+    int i;
+
+    if (stream == NULL)
+        return;
+
+    if (stream->status != STREAM_STOPPED)
+        briteblox_stream_stop(stream);
+
+    briteblox_stream_consumer_free(stream);
+
+    if (stream->transfers)
+    {
+        for (i = 0; i < stream->num_transfers; i++)
+        {
+            if (stream->transfers[i])
+            {
+                free(stream->transfers[i]->buffer);
+                libusb_free_transfer(stream->transfers[i]);
+            }
+        }
+    }
+
+    free(stream->transfers);
+    free(stream->state.iov);
+    free(stream);
+}
+
+/* Write streaming */
+
+typedef struct
+{
+    BRITEBLOXWriteStreamCallback *callback;
+    void *userdata;
+    int transfersize;
+    int in_flight;
+    int eof;
+    int result;
+    BRITEBLOXProgressInfo progress;
+} BRITEBLOXWriteStreamState;
+
+/* Let the producer fill the transfer and submit it */
+static void
+briteblox_writestream_refill(BRITEBLOXWriteStreamState *state, struct libusb_transfer *transfer)
+{
+    int n, ret;
+
+    if (state->eof || state->result)
+        return;
+
+    n = state->callback(transfer->buffer, state->transfersize, NULL, state->userdata);
+    if (n <= 0)
+    {
+        if (n < 0)
+            state->result = n;
+        state->eof = 1;
+        return;
+    }
+
+    transfer->length = n > state->transfersize ? state->transfersize : n;
+    ret = libusb_submit_transfer(transfer);
+    if (ret < 0)
+    {
+        state->result = ret;
+        return;
+    }
+    state->in_flight++;
+}
+
+static void
+briteblox_writestream_cb(struct libusb_transfer *transfer)
+{
+    BRITEBLOXWriteStreamState *state = transfer->user_data;
+
+    state->in_flight--;
+    switch (transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            state->progress.current.totalBytes += transfer->actual_length;
+            briteblox_writestream_refill(state, transfer);
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            if (!state->result)
+                state->result = LIBUSB_ERROR_TIMEOUT;
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            if (!state->result)
+                state->result = LIBUSB_ERROR_NO_DEVICE;
+            break;
+        default:
+            if (!state->result)
+                state->result = LIBUSB_ERROR_IO;
+            break;
+    }
+}
+
+/**
+    Streaming writing of data to the device
+
+    Counterpart of briteblox_readstream(). Keeps numTransfers bulk OUT
+    transfers of up to transferSize bytes in flight. Every time a
+    transfer is free, the callback is asked to fill its buffer:
+
+    - return the number of bytes stored in buffer, at most length
+    - return 0 when there is no more data; the function returns once
+      the transfers in flight are done
+    - return a negative value to abort; the transfers in flight are
+      cancelled and the value is returned
+
+    Once a second the callback is invoked with buffer NULL and the
+    progress info.
+
+    The chip mode is not touched, set up bitbang or synchronous FIFO
+    mode before.
+
+    \param  briteblox pointer to briteblox_context
+    \param  callback to user supplied function producing the data
+    \param  userdata
+    \param  transferSize size of one transfer in bytes
+    \param  numTransfers number of transfers kept in flight
+
+    \retval  0: all data written
+    \retval <0: libusb error code or the negative value of the callback
+*/
+int
+briteblox_writestream(struct briteblox_context *briteblox,
+                      BRITEBLOXWriteStreamCallback *callback, void *userdata,
+                      int transferSize, int numTransfers)
+{
+    BRITEBLOXWriteStreamState state;
+    struct libusb_transfer **transfers;
+    int i, err;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL ||
+        transferSize <= 0 || numTransfers <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    /* Coalesced writes go out before the stream */
+    err = briteblox_flush(briteblox);
+    if (err < 0)
+        return err;
+
+    memset(&state, 0, sizeof(state));
+    state.callback = callback;
+    state.userdata = userdata;
+    state.transfersize = transferSize;
+
+    transfers = calloc(numTransfers, sizeof *transfers);
+    if (!transfers)
+        return LIBUSB_ERROR_NO_MEM;
+
+    for (i = 0; i < numTransfers; i++)
+    {
+        unsigned char *buffer = malloc(transferSize);
+
+        transfers[i] = libusb_alloc_transfer(0);
+        if (!transfers[i] || !buffer)
+        {
+            free(buffer);
+            state.result = LIBUSB_ERROR_NO_MEM;
+            break;
+        }
+
+        libusb_fill_bulk_transfer(transfers[i], briteblox->usb_dev, briteblox->in_ep,
+                                  buffer, transferSize, briteblox_writestream_cb,
+                                  &state, briteblox->usb_write_timeout);
+    }
+
+    gettimeofday(&state.progress.first.time, NULL);
+
+    for (i = 0; i < numTransfers && !state.result; i++)
+        briteblox_writestream_refill(&state, transfers[i]);
+
+    while (state.in_flight > 0)
+    {
+        struct timeval timeout = { briteblox->usb_write_timeout / 1000,
+                                   (briteblox->usb_write_timeout % 1000) * 1000 };
+
+        if (state.result)
+        {
+            for (i = 0; i < numTransfers; i++)
+                if (transfers[i])
+                    libusb_cancel_transfer(transfers[i]);
+        }
+
+        // The transfers point at state and their buffers: leaving with
+        // any in flight would free them under libusb. An error only
+        // cancels them, the loop goes on until all came back.
+        err = libusb_handle_events_timeout(briteblox->usb_ctx, &timeout);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED && !state.result)
+            state.result = err;
+
+        if (briteblox_progress_update(&state.progress))
+        {
+            callback(NULL, 0, &state.progress, userdata);
+            state.progress.prev = state.progress.current;
+        }
+    }
+
+    for (i = 0; i < numTransfers; i++)
+    {
+        if (transfers[i])
+        {
+            free(transfers[i]->buffer);
+            libusb_free_transfer(transfers[i]);
+        }
+    }
+    free(transfers);
+
+    return state.result;
+}
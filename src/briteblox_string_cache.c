@@ -0,0 +1,589 @@
+/***************************************************************************
+                          briteblox_string_cache.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * String descriptor cache of a library context.
+ *
+ * Manufacturer, description and serial of a device are kept under its
+ * bus number, port path and device address. A chip plugged in again
+ * gets a new address, so a hit is a chip that stayed attached. Storing
+ * a device drops older entries of the same bus and port path, a
+ * removal reported by the device registry drops the entry itself.
+ *
+ * The cache file holds one device per line:
+ *
+ *   bus port.port.port address vendor product mask<TAB>manufacturer<TAB>description<TAB>serial
+ *
+ * with "-" for a device on a root port and the mask telling which
+ * strings are known, see BRITEBLOX_STRING_MANUFACTURER and friends.
+ * Strings with control characters are not written.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#define STRING_CACHE_HEADER "# libbriteblox string cache 1\n"
+
+/* Longest string a USB string descriptor can hold, plus the NUL */
+#define STRING_CACHE_LEN 128
+
+#ifdef HAVE_PTHREAD
+#define cache_lock(c)    pthread_mutex_lock(&(c)->lock)
+#define cache_unlock(c)  pthread_mutex_unlock(&(c)->lock)
+#else
+#define cache_lock(c)    do { } while (0)
+#define cache_unlock(c)  do { } while (0)
+#endif
+
+struct briteblox_string_key
+{
+    int bus;
+    int address;
+    uint8_t ports[7];
+    int num_ports;
+};
+
+struct briteblox_string_entry
+{
+    struct briteblox_string_key key;
+    int vendor;
+    int product;
+    /** strings known, BRITEBLOX_STRING_* bits */
+    int mask;
+    char manufacturer[STRING_CACHE_LEN];
+    char description[STRING_CACHE_LEN];
+    char serial[STRING_CACHE_LEN];
+};
+
+struct briteblox_string_cache
+{
+    struct briteblox_string_entry *entries;
+    int num_entries;
+    int entries_size;
+
+    /** file to load from and save to, NULL to keep the cache in memory */
+    char *path;
+    /** changed since loaded or saved */
+    int dirty;
+
+    unsigned int hits;
+    unsigned int misses;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+/**
+    Gets the cache key of a device. No USB transfer is needed.
+    \internal
+*/
+static void briteblox_string_key_get(struct briteblox_string_key *key, struct libusb_device *dev)
+{
+    int ports;
+
+    memset(key, 0, sizeof(*key));
+    key->bus = libusb_get_bus_number(dev);
+    key->address = libusb_get_device_address(dev);
+    ports = libusb_get_port_numbers(dev, key->ports, sizeof(key->ports));
+    key->num_ports = ports > 0 ? ports : 0;
+}
+
+/**
+    Compares bus and port path, and the address if with_address is set.
+    \internal
+*/
+static int briteblox_string_key_equal(const struct briteblox_string_key *a,
+                                      const struct briteblox_string_key *b, int with_address)
+{
+    return a->bus == b->bus && a->num_ports == b->num_ports &&
+           memcmp(a->ports, b->ports, a->num_ports) == 0 &&
+           (!with_address || a->address == b->address);
+}
+
+/**
+    Returns the entry of a key, NULL if none. Call with the lock held.
+    \internal
+*/
+static struct briteblox_string_entry *briteblox_string_cache_find(struct briteblox_string_cache *cache,
+                                                                   const struct briteblox_string_key *key)
+{
+    int i;
+
+    for (i = 0; i < cache->num_entries; i++)
+        if (briteblox_string_key_equal(&cache->entries[i].key, key, 1))
+            return &cache->entries[i];
+    return NULL;
+}
+
+/**
+    Drops the entries on the port of key, and with with_address only
+    the one of the key. Call with the lock held.
+    \internal
+*/
+static void briteblox_string_cache_drop(struct briteblox_string_cache *cache,
+                                        const struct briteblox_string_key *key, int with_address)
+{
+    int i, kept = 0;
+
+    for (i = 0; i < cache->num_entries; i++)
+    {
+        if (briteblox_string_key_equal(&cache->entries[i].key, key, with_address))
+        {
+            cache->dirty = 1;
+            continue;
+        }
+        cache->entries[kept++] = cache->entries[i];
+    }
+    cache->num_entries = kept;
+}
+
+/**
+    Appends an entry. Call with the lock held.
+    \internal
+*/
+static struct briteblox_string_entry *briteblox_string_cache_append(struct briteblox_string_cache *cache)
+{
+    struct briteblox_string_entry *entry;
+
+    if (cache->num_entries == cache->entries_size)
+    {
+        int size = cache->entries_size ? cache->entries_size * 2 : 32;
+        struct briteblox_string_entry *entries = (struct briteblox_string_entry *)
+            realloc(cache->entries, size * sizeof(*entries));
+        if (entries == NULL)
+            return NULL;
+        cache->entries = entries;
+        cache->entries_size = size;
+    }
+
+    entry = &cache->entries[cache->num_entries++];
+    memset(entry, 0, sizeof(*entry));
+    cache->dirty = 1;
+    return entry;
+}
+
+/**
+    Copies a string, truncating it to the buffer.
+    \internal
+*/
+static void briteblox_string_copy(char *dst, int len, const char *src)
+{
+    if (dst == NULL || len <= 0)
+        return;
+    strncpy(dst, src, len - 1);
+    dst[len - 1] = 0;
+}
+
+/**
+    Returns nonzero if the string can go into the cache file.
+    \internal
+*/
+static int briteblox_string_printable(const char *s)
+{
+    for (; *s; s++)
+        if ((unsigned char)*s < 0x20 || *s == 0x7f)
+            return 0;
+    return 1;
+}
+
+/**
+    Parses one line of the cache file, returns 0 if it is valid.
+    \internal
+*/
+static int briteblox_string_cache_parse(struct briteblox_string_entry *entry, char *line)
+{
+    char *fields[4], *ports, *p;
+    int i, n, used;
+
+    memset(entry, 0, sizeof(*entry));
+    line[strcspn(line, "\r\n")] = 0;
+    for (i = 0, p = line; i < 4; i++)
+    {
+        fields[i] = p;
+        p = strchr(p, '\t');
+        if (p == NULL && i < 3)
+            return -1;
+        if (p)
+            *p++ = 0;
+    }
+
+    ports = (char *)malloc(strlen(fields[0]) + 1);
+    if (ports == NULL)
+        return -1;
+    n = sscanf(fields[0], "%d %s %d %x %x %x", &entry->key.bus, ports, &entry->key.address,
+               (unsigned int *)&entry->vendor, (unsigned int *)&entry->product,
+               (unsigned int *)&entry->mask);
+    if (n == 6 && strcmp(ports, "-") != 0)
+    {
+        for (p = ports; *p && entry->key.num_ports < (int)sizeof(entry->key.ports); )
+        {
+            unsigned int port;
+
+            if (sscanf(p, "%u%n", &port, &used) != 1 || port > 255)
+                break;
+            entry->key.ports[entry->key.num_ports++] = port;
+            p += used;
+            if (*p == '.')
+                p++;
+        }
+        if (*p)
+            n = 0;
+    }
+    free(ports);
+    if (n != 6)
+        return -1;
+
+    briteblox_string_copy(entry->manufacturer, sizeof(entry->manufacturer), fields[1]);
+    briteblox_string_copy(entry->description, sizeof(entry->description), fields[2]);
+    briteblox_string_copy(entry->serial, sizeof(entry->serial), fields[3]);
+    return 0;
+}
+
+/**
+    Enable the string descriptor cache of a library context.
+
+    briteblox_usb_get_strings(), briteblox_usb_open_desc_index() and the
+    device registry of contexts attached to the library read string
+    descriptors from the cache when they can and put what they read
+    into it.
+
+    With a path the cache starts with the devices of that file and is
+    written back by briteblox_string_cache_save() and when the last
+    reference to the library is dropped. A missing file is fine, it is
+    created on saving.
+
+    \param library library context
+    \param path Cache file, NULL to keep the cache in memory only
+
+    \retval  0: all fine
+    \retval -1: cache already enabled
+    \retval -2: out of memory
+    \retval -3: cache file unreadable or damaged, the cache starts
+                with the lines read so far
+*/
+int briteblox_string_cache_enable(struct briteblox_library *library, const char *path)
+{
+    struct briteblox_string_cache *cache;
+    struct briteblox_string_entry entry;
+    char line[4 * STRING_CACHE_LEN + 64];
+    FILE *file;
+    int ret = 0;
+
+    if (library->strings != NULL)
+        return -1;
+
+    cache = (struct briteblox_string_cache *)calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return -2;
+    if (path != NULL)
+    {
+        cache->path = (char *)malloc(strlen(path) + 1);
+        if (cache->path == NULL)
+        {
+            free(cache);
+            return -2;
+        }
+        strcpy(cache->path, path);
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+    library->strings = cache;
+
+    if (path == NULL || (file = fopen(path, "r")) == NULL)
+        return 0;
+
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, STRING_CACHE_HEADER) != 0)
+        ret = -3;
+    while (ret == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        struct briteblox_string_entry *slot;
+
+        if (briteblox_string_cache_parse(&entry, line) < 0)
+        {
+            ret = -3;
+            break;
+        }
+        slot = briteblox_string_cache_append(cache);
+        if (slot == NULL)
+        {
+            ret = -2;
+            break;
+        }
+        *slot = entry;
+    }
+    fclose(file);
+
+    cache->dirty = 0;
+    return ret;
+}
+
+/**
+    Write the string descriptor cache to its file. The file is replaced
+    by renaming a new one over it.
+
+    \param library library context
+
+    \retval  0: all fine
+    \retval -1: cache not enabled or without a file
+    \retval -2: can't write the file
+*/
+int briteblox_string_cache_save(struct briteblox_library *library)
+{
+    struct briteblox_string_cache *cache = library->strings;
+    char *tmp;
+    FILE *file;
+    int i, j, ret = 0;
+
+    if (cache == NULL || cache->path == NULL)
+        return -1;
+
+    tmp = (char *)malloc(strlen(cache->path) + 5);
+    if (tmp == NULL)
+        return -2;
+    sprintf(tmp, "%s.tmp", cache->path);
+
+    file = fopen(tmp, "w");
+    if (file == NULL)
+    {
+        free(tmp);
+        return -2;
+    }
+
+    cache_lock(cache);
+    fputs(STRING_CACHE_HEADER, file);
+    for (i = 0; i < cache->num_entries; i++)
+    {
+        const struct briteblox_string_entry *entry = &cache->entries[i];
+
+        if (!briteblox_string_printable(entry->manufacturer) ||
+            !briteblox_string_printable(entry->description) ||
+            !briteblox_string_printable(entry->serial))
+            continue;
+
+        fprintf(file, "%d ", entry->key.bus);
+        if (entry->key.num_ports == 0)
+            fputc('-', file);
+        for (j = 0; j < entry->key.num_ports; j++)
+            fprintf(file, j ? ".%u" : "%u", entry->key.ports[j]);
+        fprintf(file, " %d %04x %04x %x\t%s\t%s\t%s\n", entry->key.address, entry->vendor,
+                entry->product, entry->mask, entry->manufacturer, entry->description, entry->serial);
+    }
+    cache->dirty = 0;
+    cache_unlock(cache);
+
+    if (fclose(file) != 0 || rename(tmp, cache->path) != 0)
+    {
+        remove(tmp);
+        ret = -2;
+    }
+    free(tmp);
+    return ret;
+}
+
+/**
+    Empty the string descriptor cache. The file keeps its content until
+    the next briteblox_string_cache_save().
+
+    \param library library context
+*/
+void briteblox_string_cache_clear(struct briteblox_library *library)
+{
+    struct briteblox_string_cache *cache = library->strings;
+
+    if (cache == NULL)
+        return;
+
+    cache_lock(cache);
+    cache->num_entries = 0;
+    cache->dirty = 1;
+    cache_unlock(cache);
+}
+
+/**
+    Get the string descriptor cache statistics.
+
+    \param library library context
+    \param hits Receives the number of lookups served from the cache, may be NULL
+    \param misses Receives the number of lookups that had to ask the device, may be NULL
+
+    \retval  0: all fine
+    \retval -1: cache not enabled
+*/
+int briteblox_string_cache_get_stats(struct briteblox_library *library,
+                                     unsigned int *hits, unsigned int *misses)
+{
+    struct briteblox_string_cache *cache = library->strings;
+
+    if (cache == NULL)
+        return -1;
+
+    cache_lock(cache);
+    if (hits)
+        *hits = cache->hits;
+    if (misses)
+        *misses = cache->misses;
+    cache_unlock(cache);
+    return 0;
+}
+
+/**
+    Look up the strings of a device, see briteblox_i.h.
+    \internal
+*/
+int briteblox_string_cache_lookup(struct briteblox_library *library, struct libusb_device *dev,
+                                  int vendor, int product, int mask,
+                                  char *manufacturer, int mnf_len, char *description, int desc_len,
+                                  char *serial, int serial_len)
+{
+    struct briteblox_string_cache *cache;
+    struct briteblox_string_entry *entry;
+    struct briteblox_string_key key;
+    int found = 0;
+
+    if (library == NULL || library->strings == NULL)
+        return -1;
+    cache = library->strings;
+
+    briteblox_string_key_get(&key, dev);
+    cache_lock(cache);
+    entry = briteblox_string_cache_find(cache, &key);
+    if (entry != NULL && entry->vendor == vendor && entry->product == product &&
+        (entry->mask & mask) == mask)
+    {
+        if (mask & BRITEBLOX_STRING_MANUFACTURER)
+            briteblox_string_copy(manufacturer, mnf_len, entry->manufacturer);
+        if (mask & BRITEBLOX_STRING_DESCRIPTION)
+            briteblox_string_copy(description, desc_len, entry->description);
+        if (mask & BRITEBLOX_STRING_SERIAL)
+            briteblox_string_copy(serial, serial_len, entry->serial);
+        cache->hits++;
+        found = 1;
+    }
+    else
+        cache->misses++;
+    cache_unlock(cache);
+    return found;
+}
+
+/**
+    Store the strings of a device, see briteblox_i.h.
+    \internal
+*/
+void briteblox_string_cache_store(struct briteblox_library *library, struct libusb_device *dev,
+                                  int vendor, int product, int mask,
+                                  const char *manufacturer, const char *description, const char *serial)
+{
+    struct briteblox_string_cache *cache;
+    struct briteblox_string_entry *entry;
+    struct briteblox_string_key key;
+
+    if (library == NULL || library->strings == NULL || mask == 0)
+        return;
+    cache = library->strings;
+
+    briteblox_string_key_get(&key, dev);
+    cache_lock(cache);
+    entry = briteblox_string_cache_find(cache, &key);
+    if (entry != NULL && (entry->vendor != vendor || entry->product != product))
+        entry = NULL;
+    if (entry == NULL)
+    {
+        // a new address on the same port: the old chip is gone
+        briteblox_string_cache_drop(cache, &key, 0);
+        entry = briteblox_string_cache_append(cache);
+        if (entry == NULL)
+        {
+            cache_unlock(cache);
+            return;
+        }
+        entry->key = key;
+        entry->vendor = vendor;
+        entry->product = product;
+    }
+
+    if (mask & BRITEBLOX_STRING_MANUFACTURER)
+        briteblox_string_copy(entry->manufacturer, sizeof(entry->manufacturer), manufacturer);
+    if (mask & BRITEBLOX_STRING_DESCRIPTION)
+        briteblox_string_copy(entry->description, sizeof(entry->description), description);
+    if (mask & BRITEBLOX_STRING_SERIAL)
+        briteblox_string_copy(entry->serial, sizeof(entry->serial), serial);
+    entry->mask |= mask;
+    cache->dirty = 1;
+    cache_unlock(cache);
+}
+
+/**
+    Drop the strings of a removed device, see briteblox_i.h.
+    \internal
+*/
+void briteblox_string_cache_forget(struct briteblox_library *library, struct libusb_device *dev)
+{
+    struct briteblox_string_key key;
+
+    if (library == NULL || library->strings == NULL)
+        return;
+
+    briteblox_string_key_get(&key, dev);
+    cache_lock(library->strings);
+    briteblox_string_cache_drop(library->strings, &key, 1);
+    cache_unlock(library->strings);
+}
+
+/**
+    Save the cache if it has a file and changed, then free it.
+    \internal
+*/
+void briteblox_string_cache_free(struct briteblox_library *library)
+{
+    struct briteblox_string_cache *cache = library->strings;
+
+    if (cache == NULL)
+        return;
+
+    if (cache->path != NULL && cache->dirty)
+        briteblox_string_cache_save(library);
+    library->strings = NULL;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache->entries);
+    free(cache->path);
+    free(cache);
+}
+
+/* Exported for the unit test: store strings as a descriptor read would */
+void string_cache_store_UT_export(struct briteblox_library *library, struct libusb_device *dev,
+                                  int vendor, int product, int mask,
+                                  const char *manufacturer, const char *description, const char *serial)
+{
+    briteblox_string_cache_store(library, dev, vendor, product, mask, manufacturer, description, serial);
+}
+
+/* Exported for the unit test: look up all strings */
+int string_cache_lookup_UT_export(struct briteblox_library *library, struct libusb_device *dev,
+                                  int vendor, int product, int mask,
+                                  char *manufacturer, char *description, char *serial, int len)
+{
+    return briteblox_string_cache_lookup(library, dev, vendor, product, mask,
+                                         manufacturer, len, description, len, serial, len);
+}
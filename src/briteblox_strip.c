@@ -0,0 +1,276 @@
+/***************************************************************************
+                          briteblox_strip.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Removal of the two modem status bytes the chip puts in front of every
+ * max_packet_size packet of a bulk IN transfer.
+ *
+ * The payload of all packets is written in one pass to the destination,
+ * copying the bytes with the widest vector unit the CPU offers. The
+ * implementation is chosen once at runtime.
+ *
+ * All kernels copy front to back and load the last vector of a packet
+ * before storing anything, so the destination may be the start of the
+ * source buffer (in place compaction).
+ */
+
+#include <string.h>
+
+#include "briteblox_i.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BRITEBLOX_STRIP_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BRITEBLOX_STRIP_NEON
+#include <arm_neon.h>
+#endif
+
+typedef int (briteblox_strip_func)(unsigned char *dst, const unsigned char *src,
+                                   int length, int packet_size, int skip, int max);
+
+/* Whole packets of the given payload size, nothing to skip */
+#define STRIP_FULL_PACKETS(COPY, PAYLOAD)                               \
+    while (length >= (PAYLOAD) + 2 && max >= (PAYLOAD))                 \
+    {                                                                   \
+        COPY(dst + written, src + 2, (PAYLOAD));                        \
+        written += (PAYLOAD);                                           \
+        max -= (PAYLOAD);                                               \
+        src += (PAYLOAD) + 2;                                           \
+        length -= (PAYLOAD) + 2;                                        \
+    }
+
+/* Packet loop shared by all kernels. COPY must copy front to back.
+   The usual packet sizes get a loop with a constant copy length. */
+#define STRIP_PACKETS(COPY)                                             \
+    int written = 0;                                                    \
+                                                                        \
+    if (skip == 0 && packet_size == 512)                                \
+        STRIP_FULL_PACKETS(COPY, 510)                                   \
+    else if (skip == 0 && packet_size == 64)                            \
+        STRIP_FULL_PACKETS(COPY, 62)                                    \
+                                                                        \
+    while (length > 2 && max > 0)                                       \
+    {                                                                   \
+        int payload_len = (length < packet_size ? length : packet_size) - 2; \
+                                                                        \
+        if (skip >= payload_len)                                        \
+            skip -= payload_len;                                        \
+        else                                                            \
+        {                                                               \
+            int n = payload_len - skip;                                 \
+            if (n > max)                                                \
+                n = max;                                                \
+            COPY(dst + written, src + 2 + skip, n);                     \
+            written += n;                                               \
+            max -= n;                                                   \
+            skip = 0;                                                   \
+        }                                                               \
+        src += packet_size;                                             \
+        length -= packet_size;                                          \
+    }                                                                   \
+    return written;
+
+static inline void copy_scalar(unsigned char *dst, const unsigned char *src, int n)
+{
+    memmove(dst, src, n);
+}
+
+static int strip_scalar(unsigned char *dst, const unsigned char *src,
+                        int length, int packet_size, int skip, int max)
+{
+    STRIP_PACKETS(copy_scalar)
+}
+
+#ifdef BRITEBLOX_STRIP_X86
+__attribute__((target("sse2")))
+static inline void copy_sse2(unsigned char *dst, const unsigned char *src, int n)
+{
+    if (n >= 16)
+    {
+        /* Load the tail first, it may overlap bytes the loop overwrites */
+        __m128i tail = _mm_loadu_si128((const __m128i *)(src + n - 16));
+
+        while (n > 16)
+        {
+            _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+            src += 16;
+            dst += 16;
+            n -= 16;
+        }
+        _mm_storeu_si128((__m128i *)(dst + n - 16), tail);
+    }
+    else
+    {
+        while (n-- > 0)
+            *dst++ = *src++;
+    }
+}
+
+__attribute__((target("sse2")))
+static int strip_sse2(unsigned char *dst, const unsigned char *src,
+                      int length, int packet_size, int skip, int max)
+{
+    STRIP_PACKETS(copy_sse2)
+}
+
+__attribute__((target("avx2")))
+static inline void copy_avx2(unsigned char *dst, const unsigned char *src, int n)
+{
+    if (n >= 32)
+    {
+        /* Load the tail first, it may overlap bytes the loop overwrites */
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(src + n - 32));
+
+        while (n > 32)
+        {
+            _mm256_storeu_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+            src += 32;
+            dst += 32;
+            n -= 32;
+        }
+        _mm256_storeu_si256((__m256i *)(dst + n - 32), tail);
+    }
+    else if (n >= 16)
+    {
+        __m128i head = _mm_loadu_si128((const __m128i *)src);
+        __m128i tail = _mm_loadu_si128((const __m128i *)(src + n - 16));
+        _mm_storeu_si128((__m128i *)dst, head);
+        _mm_storeu_si128((__m128i *)(dst + n - 16), tail);
+    }
+    else
+    {
+        while (n-- > 0)
+            *dst++ = *src++;
+    }
+}
+
+__attribute__((target("avx2")))
+static int strip_avx2(unsigned char *dst, const unsigned char *src,
+                      int length, int packet_size, int skip, int max)
+{
+    STRIP_PACKETS(copy_avx2)
+}
+#endif /* BRITEBLOX_STRIP_X86 */
+
+#ifdef BRITEBLOX_STRIP_NEON
+static inline void copy_neon(unsigned char *dst, const unsigned char *src, int n)
+{
+    if (n >= 16)
+    {
+        /* Load the tail first, it may overlap bytes the loop overwrites */
+        uint8x16_t tail = vld1q_u8(src + n - 16);
+
+        while (n > 16)
+        {
+            vst1q_u8(dst, vld1q_u8(src));
+            src += 16;
+            dst += 16;
+            n -= 16;
+        }
+        vst1q_u8(dst + n - 16, tail);
+    }
+    else
+    {
+        while (n-- > 0)
+            *dst++ = *src++;
+    }
+}
+
+static int strip_neon(unsigned char *dst, const unsigned char *src,
+                      int length, int packet_size, int skip, int max)
+{
+    STRIP_PACKETS(copy_neon)
+}
+#endif /* BRITEBLOX_STRIP_NEON */
+
+/**
+    Detects the widest vector unit of the CPU the kernels can use.
+
+    The result is cached with atomic accesses, threads racing through
+    the first call detect and store the same level.
+
+    \internal
+*/
+enum briteblox_cpu_level briteblox_cpu_level(void)
+{
+    static unsigned int cached = 0;
+    unsigned int level = briteblox_atomic_load(&cached);
+
+    if (level != 0)
+        return (enum briteblox_cpu_level)level;
+
+    level = BRITEBLOX_CPU_SCALAR;
+#ifdef BRITEBLOX_STRIP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        level = BRITEBLOX_CPU_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        level = BRITEBLOX_CPU_SSE2;
+#elif defined(BRITEBLOX_STRIP_NEON)
+    level = BRITEBLOX_CPU_NEON;
+#endif
+    briteblox_atomic_store(&cached, level);
+    return (enum briteblox_cpu_level)level;
+}
+
+static briteblox_strip_func *strip_select(void)
+{
+    switch (briteblox_cpu_level())
+    {
+#ifdef BRITEBLOX_STRIP_X86
+        case BRITEBLOX_CPU_AVX2:
+            return strip_avx2;
+        case BRITEBLOX_CPU_SSE2:
+            return strip_sse2;
+#elif defined(BRITEBLOX_STRIP_NEON)
+        case BRITEBLOX_CPU_NEON:
+            return strip_neon;
+#endif
+        default:
+            return strip_scalar;
+    }
+}
+
+/**
+    Strip the modem status bytes from a raw bulk IN transfer.
+
+    Copies the payload bytes [skip, skip + max) of the stripped data
+    stream to dst. A trailing packet with no payload is ignored.
+    dst may point to src for in place compaction.
+
+    \internal
+
+    \param dst Destination buffer, at least max bytes
+    \param src Raw transfer data as received from the chip
+    \param length Number of bytes in src
+    \param packet_size max_packet_size of the device
+    \param skip Number of payload bytes to skip
+    \param max Maximum number of payload bytes to write
+
+    \retval Number of payload bytes written to dst
+*/
+int briteblox_strip_status(unsigned char *dst, const unsigned char *src,
+                           int length, int packet_size, int skip, int max)
+{
+    return strip_select()(dst, src, length, packet_size, skip, max);
+}
+
+/* Exported for the unit test and the strip benchmark */
+int strip_status_UT_export(unsigned char *dst, const unsigned char *src,
+                           int length, int packet_size, int skip, int max)
+{
+    return briteblox_strip_status(dst, src, length, packet_size, skip, max);
+}
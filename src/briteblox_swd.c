@@ -0,0 +1,599 @@
+/***************************************************************************
+                          briteblox_swd.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * SWD (Serial Wire Debug) host on the MPSSE of the H type chips.
+ *
+ * Pin usage on the low GPIO byte: ADBUS0 SWCLK, ADBUS1 SWDIO out through
+ * a series resistor and ADBUS2 SWDIO in, both connected to SWDIO. For
+ * the turnaround ADBUS1 is switched to input and the target drives the
+ * line.
+ *
+ * Reads and writes are queued without looking at the ACKs, the whole
+ * queue goes out in one USB round trip and the ACKs and read parities
+ * are checked afterwards. Every transaction is clocked with its data
+ * phase, which only matches what the target does after a WAIT or FAULT
+ * if overrun detection (CTRL/STAT.ORUNDETECT) is enabled. AP reads are posted: the data of an AP read
+ * arrives with the next AP read, or with the RDBUFF read the engine
+ * queues before the next other transaction or at execute.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#define SWD_SWCLK     0x01
+#define SWD_SWDIO_OUT 0x02
+#define SWD_SWDIO_IN  0x04
+
+/* Host drives SWDIO on the falling edge, both sides sample on the rising one */
+#define SWD_MODE (MPSSE_LSB | MPSSE_WRITE_NEG)
+
+#define SWD_ACK_OK    0x1
+#define SWD_ACK_WAIT  0x2
+#define SWD_ACK_FAULT 0x4
+
+/* DP register holding the result of the last posted AP read */
+#define SWD_DP_RDBUFF 0x0c
+
+/** One queued transaction and the raw bits of its response */
+struct briteblox_swd_xfer
+{
+    /** turnaround and ACK bits as received */
+    unsigned char ack;
+    /** read data and its parity and turnaround bits as received */
+    unsigned char data[4];
+    unsigned char parity;
+    int read;
+    /** where the read data goes, NULL to drop it */
+    uint32_t *value;
+    /** number of reads and writes queued before this one */
+    int index;
+};
+
+/* Transactions live in blocks that never move, the queue points into them */
+#define SWD_XFERS_PER_BLOCK 64
+
+struct briteblox_swd_xfer_block
+{
+    struct briteblox_swd_xfer xfers[SWD_XFERS_PER_BLOCK];
+    int used;
+    struct briteblox_swd_xfer_block *next;
+};
+
+struct briteblox_swd
+{
+    struct briteblox_context *briteblox;
+    struct briteblox_mpsse_queue *queue;
+
+    struct briteblox_swd_xfer_block *xfers;
+    struct briteblox_swd_xfer_block *current;
+    /** reads and writes queued since the last execute */
+    int count;
+
+    /** an AP read waits for its data */
+    int posted;
+    uint32_t *posted_value;
+
+    /** actual SWCLK frequency */
+    int frequency;
+};
+
+/**
+    Returns an unused transaction record.
+    \internal
+*/
+static struct briteblox_swd_xfer *briteblox_swd_xfer(struct briteblox_swd *swd)
+{
+    struct briteblox_swd_xfer_block *block = swd->current;
+    struct briteblox_swd_xfer *x;
+
+    if (block == NULL || block->used == SWD_XFERS_PER_BLOCK)
+    {
+        struct briteblox_swd_xfer_block *next = block ? block->next : swd->xfers;
+
+        if (next == NULL)
+        {
+            next = (struct briteblox_swd_xfer_block *)calloc(1, sizeof(*next));
+            if (next == NULL)
+                return NULL;
+            if (block)
+                block->next = next;
+            else
+                swd->xfers = next;
+        }
+        next->used = 0;
+        swd->current = block = next;
+    }
+
+    x = &block->xfers[block->used++];
+    memset(x, 0, sizeof(*x));
+    return x;
+}
+
+/**
+    Queues driving or releasing SWDIO, SWCLK stays low.
+    \internal
+*/
+static int briteblox_swd_drive(struct briteblox_swd *swd, int drive)
+{
+    return briteblox_mpsse_set_gpio(swd->queue, 0, SWD_SWDIO_OUT,
+                                    SWD_SWCLK | (drive ? SWD_SWDIO_OUT : 0));
+}
+
+/**
+    Returns the parity of a word.
+    \internal
+*/
+static int briteblox_swd_parity(uint32_t value)
+{
+    value ^= value >> 16;
+    value ^= value >> 8;
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return value & 1;
+}
+
+/**
+    Queues one transaction.
+    \internal
+
+    A read is: request, turnaround, ACK, 32 data bits, parity,
+    turnaround. A write is: request, turnaround, ACK, turnaround,
+    32 data bits, parity.
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid register address
+*/
+static int briteblox_swd_transact(struct briteblox_swd *swd, int ap, int read, unsigned char reg,
+                                  uint32_t *value, uint32_t wdata, int index)
+{
+    struct briteblox_mpsse_queue *q = swd->queue;
+    struct briteblox_swd_xfer *x;
+    unsigned char request, out[4];
+    int ret;
+
+    if (reg & ~0x0c)
+        return -2;
+
+    x = briteblox_swd_xfer(swd);
+    if (x == NULL)
+        return -1;
+    x->read = read;
+    x->value = value;
+    x->index = index;
+
+    // start, APnDP, RnW, A[2:3], parity, stop, park
+    request = 0x81 | (ap ? 0x02 : 0) | (read ? 0x04 : 0) | ((reg & 0x0c) << 1);
+    request |= briteblox_swd_parity(request & 0x1e) << 5;
+
+    ret = briteblox_mpsse_clock_out(q, SWD_MODE, &request, 1);
+    if (ret == 0)
+        ret = briteblox_swd_drive(swd, 0);
+
+    if (read)
+    {
+        if (ret == 0)
+            ret = briteblox_mpsse_clock_bits_in(q, SWD_MODE, &x->ack, 4);
+        if (ret == 0)
+            ret = briteblox_mpsse_clock_in(q, SWD_MODE, x->data, 4);
+        if (ret == 0)
+            ret = briteblox_mpsse_clock_bits_in(q, SWD_MODE, &x->parity, 2);
+        if (ret == 0)
+            ret = briteblox_swd_drive(swd, 1);
+    }
+    else
+    {
+        out[0] = wdata & 0xff;
+        out[1] = (wdata >> 8) & 0xff;
+        out[2] = (wdata >> 16) & 0xff;
+        out[3] = (wdata >> 24) & 0xff;
+
+        if (ret == 0)
+            ret = briteblox_mpsse_clock_bits_in(q, SWD_MODE, &x->ack, 5);
+        if (ret == 0)
+            ret = briteblox_swd_drive(swd, 1);
+        if (ret == 0)
+            ret = briteblox_mpsse_clock_out(q, SWD_MODE, out, 4);
+        if (ret == 0)
+            ret = briteblox_mpsse_clock_bits_out(q, SWD_MODE, briteblox_swd_parity(wdata), 1);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+    Queues the RDBUFF read that fetches the data of a posted AP read.
+    \internal
+*/
+static int briteblox_swd_flush_posted(struct briteblox_swd *swd)
+{
+    if (!swd->posted)
+        return 0;
+
+    swd->posted = 0;
+    return briteblox_swd_transact(swd, 0, 1, SWD_DP_RDBUFF, swd->posted_value, 0, swd->count);
+}
+
+/**
+    Finishes the queue: fetches a posted AP read and clocks eight idle
+    cycles, so the target completes the last transaction.
+    \internal
+*/
+static int briteblox_swd_finish(struct briteblox_swd *swd)
+{
+    const unsigned char idle = 0x00;
+
+    if (briteblox_swd_flush_posted(swd) < 0)
+        return -1;
+    return briteblox_mpsse_clock_out(swd->queue, SWD_MODE, &idle, 1) < 0 ? -1 : 0;
+}
+
+/**
+    Checks ACKs and parities of the executed queue and stores the read
+    data, then forgets the transactions.
+    \internal
+
+    \retval  0: all fine
+    \retval -5: WAIT
+    \retval -6: FAULT
+    \retval -7: no valid ACK
+    \retval -8: read parity error
+*/
+static int briteblox_swd_check(struct briteblox_swd *swd, int *failed)
+{
+    struct briteblox_swd_xfer_block *block;
+    int i, ret = 0;
+
+    for (block = swd->xfers; block != NULL && ret == 0; block = block->next)
+    {
+        for (i = 0; i < block->used && ret == 0; i++)
+        {
+            struct briteblox_swd_xfer *x = &block->xfers[i];
+            // bit commands deliver at the top of the byte, the first bit is turnaround
+            int ack = (x->ack >> (x->read ? 5 : 4)) & 0x7;
+            uint32_t data;
+
+            if (ack != SWD_ACK_OK)
+                ret = (ack == SWD_ACK_WAIT) ? -5 : (ack == SWD_ACK_FAULT) ? -6 : -7;
+            else if (x->read)
+            {
+                data = x->data[0] | (x->data[1] << 8) | (x->data[2] << 16) | ((uint32_t)x->data[3] << 24);
+                if (briteblox_swd_parity(data) != ((x->parity >> 6) & 1))
+                    ret = -8;
+                else if (x->value != NULL)
+                    *x->value = data;
+            }
+
+            if (ret < 0 && failed != NULL)
+                *failed = x->index;
+        }
+        if (block == swd->current)
+            break;
+    }
+
+    for (block = swd->xfers; block != NULL; block = block->next)
+        block->used = 0;
+    swd->current = swd->xfers;
+    swd->count = 0;
+    return ret;
+}
+
+/**
+    Allocates the engine.
+    \internal
+*/
+static struct briteblox_swd *briteblox_swd_alloc(struct briteblox_context *briteblox)
+{
+    struct briteblox_swd *swd = (struct briteblox_swd *)calloc(1, sizeof(*swd));
+
+    if (swd == NULL)
+        return NULL;
+    swd->briteblox = briteblox;
+    swd->queue = briteblox_mpsse_queue_new(briteblox);
+    if (swd->queue == NULL)
+    {
+        free(swd);
+        return NULL;
+    }
+    return swd;
+}
+
+/**
+    Set up an H type chip as SWD host.
+
+    Switches the chip to MPSSE mode (see briteblox_mpsse_enable()), sets
+    the clock, holds SWCLK low and drives SWDIO high. Call
+    briteblox_swd_jtag_to_swd() or briteblox_swd_line_reset() and read
+    DPIDR before anything else, as the SWD protocol demands. Then set
+    ORUNDETECT (bit 0) in the DP CTRL/STAT register, see
+    briteblox_swd_execute() for why.
+
+    \param briteblox pointer to briteblox_context
+    \param frequency Maximum SWCLK frequency in Hz
+
+    \retval NULL: no H type chip, out of memory or USB error, see
+            briteblox_get_error_string()
+    \retval !NULL: the SWD engine
+*/
+struct briteblox_swd *briteblox_swd_new(struct briteblox_context *briteblox, unsigned int frequency)
+{
+    struct briteblox_swd *swd;
+    unsigned char cmd[3] = { DIS_ADAPTIVE, DIS_3_PHASE, LOOPBACK_END };
+    int ret;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        return NULL;
+    if (briteblox->type != TYPE_2232H && briteblox->type != TYPE_4232H && briteblox->type != TYPE_232H)
+        return NULL;
+
+    swd = briteblox_swd_alloc(briteblox);
+    if (swd == NULL)
+        return NULL;
+
+    if (briteblox_mpsse_enable(briteblox) < 0)
+    {
+        briteblox_swd_free(swd);
+        return NULL;
+    }
+
+    ret = briteblox_mpsse_set_clock(swd->queue, frequency);
+    if (ret > 0)
+    {
+        swd->frequency = ret;
+        ret = briteblox_mpsse_command(swd->queue, cmd, 3, NULL, 0);
+    }
+    if (ret == 0)
+        ret = briteblox_swd_drive(swd, 1);
+    if (ret == 0)
+        ret = briteblox_mpsse_queue_execute(swd->queue);
+
+    if (ret < 0)
+    {
+        briteblox_swd_free(swd);
+        return NULL;
+    }
+    return swd;
+}
+
+/**
+    Free the SWD engine. Queued transactions are dropped.
+
+    \param swd SWD engine, may be NULL
+*/
+void briteblox_swd_free(struct briteblox_swd *swd)
+{
+    struct briteblox_swd_xfer_block *block, *next;
+
+    if (swd == NULL)
+        return;
+
+    for (block = swd->xfers; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    briteblox_mpsse_queue_free(swd->queue);
+    free(swd);
+}
+
+/**
+    Get the actual SWCLK frequency.
+
+    \param swd SWD engine
+
+    \retval SWCLK frequency in Hz
+*/
+int briteblox_swd_get_frequency(struct briteblox_swd *swd)
+{
+    return swd->frequency;
+}
+
+/**
+    Queue a line reset: 56 cycles with SWDIO high and 8 idle cycles.
+
+    \param swd SWD engine
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_swd_line_reset(struct briteblox_swd *swd)
+{
+    const unsigned char reset[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+    if (briteblox_swd_flush_posted(swd) < 0)
+        return -1;
+    return briteblox_mpsse_clock_out(swd->queue, SWD_MODE, reset, 8) < 0 ? -1 : 0;
+}
+
+/**
+    Queue the JTAG to SWD switch sequence: a line reset, the 16 bit
+    select sequence 0xe79e and another line reset.
+
+    \param swd SWD engine
+
+    \retval  0: all fine
+    \retval -1: out of memory
+*/
+int briteblox_swd_jtag_to_swd(struct briteblox_swd *swd)
+{
+    const unsigned char reset[7] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    const unsigned char select[2] = { 0x9e, 0xe7 };
+
+    if (briteblox_swd_flush_posted(swd) < 0 ||
+        briteblox_mpsse_clock_out(swd->queue, SWD_MODE, reset, 7) < 0 ||
+        briteblox_mpsse_clock_out(swd->queue, SWD_MODE, select, 2) < 0)
+        return -1;
+    return briteblox_swd_line_reset(swd);
+}
+
+/**
+    Queue a DP or AP register read.
+
+    The value is stored by briteblox_swd_execute(). AP reads are posted,
+    any number of them in a row costs one transaction each plus one
+    RDBUFF read at the end.
+
+    \param swd SWD engine
+    \param ap 1 for an AP register, 0 for a DP register
+    \param reg Register address 0x0, 0x4, 0x8 or 0xc. For an AP register
+           the bank must be selected with the DP SELECT register.
+    \param value Where the value goes, may be NULL
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid register address
+*/
+int briteblox_swd_read(struct briteblox_swd *swd, int ap, unsigned char reg, uint32_t *value)
+{
+    int ret;
+
+    if (reg & ~0x0c)
+        return -2;
+
+    if (ap)
+    {
+        // this read returns the data of the one before
+        ret = briteblox_swd_transact(swd, 1, 1, reg, swd->posted ? swd->posted_value : NULL, 0, swd->count);
+        if (ret == 0)
+        {
+            swd->posted = 1;
+            swd->posted_value = value;
+        }
+    }
+    else
+    {
+        ret = briteblox_swd_flush_posted(swd);
+        if (ret == 0)
+            ret = briteblox_swd_transact(swd, 0, 1, reg, value, 0, swd->count);
+    }
+
+    if (ret == 0)
+        swd->count++;
+    return ret;
+}
+
+/**
+    Queue a DP or AP register write.
+
+    \param swd SWD engine
+    \param ap 1 for an AP register, 0 for a DP register
+    \param reg Register address 0x0, 0x4, 0x8 or 0xc
+    \param value Value to write
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid register address
+*/
+int briteblox_swd_write(struct briteblox_swd *swd, int ap, unsigned char reg, uint32_t value)
+{
+    int ret;
+
+    if (reg & ~0x0c)
+        return -2;
+
+    ret = briteblox_swd_flush_posted(swd);
+    if (ret == 0)
+        ret = briteblox_swd_transact(swd, ap ? 1 : 0, 0, reg, NULL, value, swd->count);
+    if (ret == 0)
+        swd->count++;
+    return ret;
+}
+
+/**
+    Send all queued transactions in one USB round trip and check them.
+
+    The ACKs are checked in order. Read values from the first
+    transaction not acknowledged with OK on are not stored.
+
+    The queue does not stop at a WAIT or FAULT, the following
+    transactions are clocked out with their data phase anyway. With
+    CTRL/STAT.ORUNDETECT set the target also keeps a data phase after
+    WAIT and FAULT, so the line stays in sync. It sets STICKYORUN and
+    answers the following transactions with FAULT instead of carrying
+    them out. Clear the sticky flags through the ABORT register and
+    queue the failed transactions again. Without ORUNDETECT the target
+    expects a new request right after the ACK and the line is out of
+    sync: queue a line reset and read DPIDR before anything else. The
+    same applies after -7.
+
+    \param swd SWD engine
+    \param failed Receives the number of reads and writes queued before
+           the failing one, may be NULL
+
+    \retval   0: all fine
+    \retval  -5: target answered WAIT
+    \retval  -6: target answered FAULT
+    \retval  -7: no valid ACK, e.g. no target or line out of sync
+    \retval  -8: parity error in read data
+    \retval  <0: error code from briteblox_mpsse_queue_execute()
+*/
+int briteblox_swd_execute(struct briteblox_swd *swd, int *failed)
+{
+    struct briteblox_context *briteblox = swd->briteblox;
+    int ret;
+
+    if (briteblox_swd_finish(swd) < 0)
+    {
+        briteblox_mpsse_queue_reset(swd->queue);
+        briteblox_swd_check(swd, NULL);
+        briteblox_error_return(-1, "out of memory while queueing SWD transactions");
+    }
+
+    ret = briteblox_mpsse_queue_execute(swd->queue);
+    if (ret < 0)
+    {
+        // drop the transactions, the queue is already empty
+        briteblox_swd_check(swd, NULL);
+        return ret;
+    }
+
+    switch (briteblox_swd_check(swd, failed))
+    {
+        case -5:
+            briteblox_error_return(-5, "SWD target answered WAIT");
+        case -6:
+            briteblox_error_return(-6, "SWD target answered FAULT");
+        case -7:
+            briteblox_error_return(-7, "no valid SWD ACK");
+        case -8:
+            briteblox_error_return(-8, "SWD read parity error");
+        default:
+            return 0;
+    }
+}
+
+/* Exported for the unit test: an engine that only queues */
+struct briteblox_swd *swd_alloc_UT_export(struct briteblox_context *briteblox)
+{
+    return briteblox_swd_alloc(briteblox);
+}
+
+/* Exported for the unit test: finish the queue as execute would and return it */
+struct briteblox_mpsse_queue *swd_finish_UT_export(struct briteblox_swd *swd)
+{
+    return briteblox_swd_finish(swd) < 0 ? NULL : swd->queue;
+}
+
+/* Exported for the unit test: check the responses after the queue was scattered */
+int swd_check_UT_export(struct briteblox_swd *swd, int *failed)
+{
+    return briteblox_swd_check(swd, failed);
+}
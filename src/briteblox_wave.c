@@ -0,0 +1,438 @@
+/***************************************************************************
+                          briteblox_wave.c  -  description
+                             -------------------
+    copyright            : (C) 2003-2014 by Intra2net AG and the libbriteblox developers
+    email                : opensource@intra2net.com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ * Bitbang waveforms.
+ *
+ * A waveform is a list of pin edges with time stamps. It is compiled
+ * into one byte per sample at the bitbang rate, an edge lands on the
+ * sample nearest to its time. Playing keeps two writes in flight, so
+ * the chip always has the next chunk before the current one runs out.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <libusb.h>
+
+#include "briteblox.h"
+#include "briteblox_i.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Writes in flight while playing */
+#define WAVE_WRITES_IN_FLIGHT 2
+
+struct briteblox_wave_edge
+{
+    uint64_t time_ns;
+    /** insertion order, keeps edges at the same time in order */
+    int seq;
+    unsigned char mask;
+    unsigned char level;
+};
+
+struct briteblox_wave
+{
+    /** pin levels before the first edge */
+    unsigned char initial;
+
+    struct briteblox_wave_edge *edges;
+    int num_edges;
+    int edges_size;
+
+    /** compiled samples */
+    unsigned char *samples;
+    int num_samples;
+    int samples_size;
+
+    /** transfers a play gave up on before libusb confirmed the
+        cancellation (the writes, then the pin sample read), and the
+        buffers they use */
+    struct briteblox_transfer_control *stuck[WAVE_WRITES_IN_FLIGHT + 1];
+    unsigned char *stuck_samples;
+    unsigned char *stuck_scratch;
+};
+
+/**
+    Orders edges by time, then by insertion.
+    \internal
+*/
+static int briteblox_wave_edge_cmp(const void *a, const void *b)
+{
+    const struct briteblox_wave_edge *ea = (const struct briteblox_wave_edge *)a;
+    const struct briteblox_wave_edge *eb = (const struct briteblox_wave_edge *)b;
+
+    if (ea->time_ns != eb->time_ns)
+        return ea->time_ns < eb->time_ns ? -1 : 1;
+    return ea->seq - eb->seq;
+}
+
+/**
+    Returns the sample nearest to a time, -1 if it is beyond INT_MAX.
+    \internal
+*/
+static long long briteblox_wave_sample(uint64_t time_ns, unsigned int rate)
+{
+    uint64_t sample = (time_ns / NSEC_PER_SEC) * rate +
+                      ((time_ns % NSEC_PER_SEC) * rate + NSEC_PER_SEC / 2) / NSEC_PER_SEC;
+
+    return (time_ns / NSEC_PER_SEC > UINT_MAX || sample >= INT_MAX) ? -1 : (long long)sample;
+}
+
+/**
+    Finishes the cancellation of the transfers an earlier play gave up
+    on, waiting at most usb_write_timeout for each, and frees their
+    buffers once all are gone.
+    \internal
+
+    \retval  0: nothing pending any more
+    \retval -1: some transfer is still pending
+*/
+static int briteblox_wave_reap(struct briteblox_wave *wave)
+{
+    struct timeval timeout;
+    int i, ret = 0;
+
+    for (i = 0; i < WAVE_WRITES_IN_FLIGHT + 1; i++)
+    {
+        struct briteblox_transfer_control *tc = wave->stuck[i];
+
+        if (tc == NULL)
+            continue;
+        timeout.tv_sec = tc->briteblox->usb_write_timeout / 1000;
+        timeout.tv_usec = (tc->briteblox->usb_write_timeout % 1000) * 1000;
+        if (briteblox_transfer_data_cancel(tc, &timeout) < 0)
+            ret = -1;
+        else
+            wave->stuck[i] = NULL;
+    }
+    if (ret < 0)
+        return ret;
+
+    free(wave->stuck_samples);
+    free(wave->stuck_scratch);
+    wave->stuck_samples = wave->stuck_scratch = NULL;
+    return 0;
+}
+
+/**
+    Create an empty waveform.
+
+    \param initial Pin levels at the start, bit n for pin n
+
+    \retval NULL: out of memory
+    \retval !NULL: the waveform
+*/
+struct briteblox_wave *briteblox_wave_new(unsigned char initial)
+{
+    struct briteblox_wave *wave = (struct briteblox_wave *)calloc(1, sizeof(*wave));
+
+    if (wave == NULL)
+        return NULL;
+    wave->initial = initial;
+    return wave;
+}
+
+/**
+    Free a waveform.
+
+    Transfers a failed briteblox_wave_play() left pending are cancelled,
+    waiting at most usb_write_timeout. The buffers of those still not
+    gone then are left to them and not freed.
+
+    \param wave waveform, may be NULL
+*/
+void briteblox_wave_free(struct briteblox_wave *wave)
+{
+    if (wave == NULL)
+        return;
+
+    briteblox_wave_reap(wave);
+
+    free(wave->edges);
+    free(wave->samples);
+    free(wave);
+}
+
+/**
+    Add an edge. Edges may be added in any order, edges with the same
+    time are applied in the order they were added.
+
+    \param wave waveform
+    \param pin Pin number 0 to 7
+    \param level New level of the pin, 0 or 1
+    \param time_ns Time of the edge in nanoseconds from the start
+
+    \retval  0: all fine
+    \retval -1: out of memory
+    \retval -2: invalid pin
+*/
+int briteblox_wave_add_edge(struct briteblox_wave *wave, int pin, int level, uint64_t time_ns)
+{
+    struct briteblox_wave_edge *edge;
+
+    if (pin < 0 || pin > 7)
+        return -2;
+
+    if (wave->num_edges == wave->edges_size)
+    {
+        int size = wave->edges_size ? wave->edges_size * 2 : 64;
+        struct briteblox_wave_edge *edges =
+            (struct briteblox_wave_edge *)realloc(wave->edges, size * sizeof(*edges));
+        if (edges == NULL)
+            return -1;
+        wave->edges = edges;
+        wave->edges_size = size;
+    }
+
+    edge = &wave->edges[wave->num_edges];
+    edge->time_ns = time_ns;
+    edge->seq = wave->num_edges++;
+    edge->mask = 1 << pin;
+    edge->level = level ? edge->mask : 0;
+    return 0;
+}
+
+/**
+    Compile the waveform into samples at a bitbang rate.
+
+    Every edge moves to the sample nearest to its time, a pulse shorter
+    than half a sample may vanish. The last sample holds the levels
+    after the last edge.
+
+    \param wave waveform
+    \param rate Samples per second, see briteblox_set_bitbang_rate()
+
+    \retval >0: number of samples
+    \retval -1: out of memory
+    \retval -2: invalid rate
+    \retval -3: waveform too long for the rate
+*/
+int briteblox_wave_compile(struct briteblox_wave *wave, unsigned int rate)
+{
+    unsigned char state = wave->initial;
+    long long last;
+    int i, pos = 0;
+
+    if (rate == 0)
+        return -2;
+
+    qsort(wave->edges, wave->num_edges, sizeof(*wave->edges), briteblox_wave_edge_cmp);
+    for (i = 0; i < wave->num_edges; i++)
+        wave->edges[i].seq = i;
+
+    last = wave->num_edges ? briteblox_wave_sample(wave->edges[wave->num_edges - 1].time_ns, rate) : 0;
+    if (last < 0)
+        return -3;
+
+    if (wave->samples_size < last + 1)
+    {
+        unsigned char *samples = (unsigned char *)realloc(wave->samples, last + 1);
+        if (samples == NULL)
+            return -1;
+        wave->samples = samples;
+        wave->samples_size = (int)last + 1;
+    }
+
+    for (i = 0; i < wave->num_edges; i++)
+    {
+        const struct briteblox_wave_edge *edge = &wave->edges[i];
+        int sample = (int)briteblox_wave_sample(edge->time_ns, rate);
+
+        while (pos < sample)
+            wave->samples[pos++] = state;
+        state = (state & ~edge->mask) | edge->level;
+    }
+    wave->samples[pos++] = state;
+
+    wave->num_samples = pos;
+    return pos;
+}
+
+/**
+    Get the samples of the last briteblox_wave_compile().
+
+    \param wave waveform
+    \param length Receives the number of samples
+
+    \retval the samples, NULL if not compiled yet
+*/
+const unsigned char *briteblox_wave_get_samples(struct briteblox_wave *wave, int *length)
+{
+    *length = wave->num_samples;
+    return wave->num_samples ? wave->samples : NULL;
+}
+
+/**
+    Play a waveform on the bitbang pins.
+
+    Sets the bitbang rate (see briteblox_set_bitbang_rate()), compiles
+    the waveform at the rate actually set and streams the samples with
+    two writes of the write chunk size in flight. The chip must be in
+    BITMODE_BITBANG or BITMODE_SYNCBB with the pins set as outputs.
+
+    In BITMODE_SYNCBB the chip samples the pins for every byte written
+    and stalls when nobody reads them, so the pin samples are read
+    along. Old data in the read buffer would shift them, purge it
+    before.
+
+    On errors the transfers in flight are cancelled, waiting at most
+    usb_write_timeout. One not confirmed in time stays pending, the next
+    play finishes it first and fails with -4 as long as it is still
+    there. A capture buffer must stay valid until then.
+
+    \param briteblox pointer to briteblox_context
+    \param wave waveform
+    \param rate Samples per second
+    \param capture BITMODE_SYNCBB only: receives one pin sample per
+           output sample, may be NULL
+
+    \retval  >0: actual samples per second
+    \retval  -1: compiling failed, see briteblox_wave_compile()
+    \retval  -2: chip not in an asynchronous or synchronous bitbang mode
+    \retval  -3: setting the rate failed
+    \retval  -4: USB transfer failed or timed out, or a transfer of an
+                 earlier play is still pending
+    \retval -666: USB device unavailable
+*/
+int briteblox_wave_play(struct briteblox_context *briteblox, struct briteblox_wave *wave,
+                        unsigned int rate, unsigned char *capture)
+{
+    struct briteblox_transfer_control *tcs[WAVE_WRITES_IN_FLIGHT] = { NULL };
+    struct briteblox_transfer_control *reader = NULL;
+    unsigned char *scratch = NULL;
+    struct timeval timeout;
+    int actual, length, offset = 0, chunk, i, ret = 0;
+
+    if (briteblox == NULL || briteblox->usb_dev == NULL)
+        briteblox_error_return(-666, "USB device unavailable");
+
+    // late pin samples of an earlier play would be taken as ours
+    if (briteblox_wave_reap(wave) < 0)
+        briteblox_error_return(-4, "transfer of an earlier play still pending");
+
+    if (!briteblox->bitbang_enabled ||
+        (briteblox->bitbang_mode != BITMODE_BITBANG && briteblox->bitbang_mode != BITMODE_SYNCBB))
+        briteblox_error_return(-2, "not in an asynchronous or synchronous bitbang mode");
+
+    actual = briteblox_set_bitbang_rate(briteblox, rate > INT_MAX ? INT_MAX : (int)rate);
+    if (actual < 0)
+        return -3;
+
+    length = briteblox_wave_compile(wave, actual);
+    if (length < 0)
+        briteblox_error_return(-1, "compiling the waveform failed");
+
+    if (briteblox->bitbang_mode == BITMODE_SYNCBB)
+    {
+        if (capture == NULL)
+        {
+            capture = scratch = (unsigned char *)malloc(length);
+            if (scratch == NULL)
+                briteblox_error_return(-1, "out of memory for the pin samples");
+        }
+        reader = briteblox_read_data_submit(briteblox, capture, length);
+        if (reader == NULL)
+        {
+            free(scratch);
+            briteblox_error_return(-4, "submitting the pin sample read failed");
+        }
+    }
+
+    chunk = briteblox->writebuffer_chunksize;
+    for (i = 0; i < WAVE_WRITES_IN_FLIGHT && offset < length; i++)
+    {
+        int size = length - offset < chunk ? length - offset : chunk;
+
+        tcs[i] = briteblox_write_data_submit(briteblox, wave->samples + offset, size);
+        if (tcs[i] == NULL)
+        {
+            ret = -4;
+            break;
+        }
+        offset += size;
+    }
+
+    // wait for the oldest write and refill it, the other one keeps the chip busy
+    for (i = 0; ret == 0 && tcs[i] != NULL; i = (i + 1) % WAVE_WRITES_IN_FLIGHT)
+    {
+        int done = briteblox_transfer_data_done(tcs[i]);
+
+        tcs[i] = NULL;
+        if (done < 0)
+        {
+            ret = -4;
+            break;
+        }
+
+        if (offset < length)
+        {
+            int size = length - offset < chunk ? length - offset : chunk;
+
+            tcs[i] = briteblox_write_data_submit(briteblox, wave->samples + offset, size);
+            if (tcs[i] == NULL)
+            {
+                ret = -4;
+                break;
+            }
+            offset += size;
+        }
+    }
+
+    // cancelling waits at most usb_write_timeout for a wedged chip
+    timeout.tv_sec = briteblox->usb_write_timeout / 1000;
+    timeout.tv_usec = (briteblox->usb_write_timeout % 1000) * 1000;
+
+    for (i = 0; i < WAVE_WRITES_IN_FLIGHT; i++)
+        if (tcs[i] != NULL && briteblox_transfer_data_cancel(tcs[i], &timeout) < 0)
+            wave->stuck[i] = tcs[i];
+
+    if (reader != NULL)
+    {
+        struct timeval read_timeout;
+        int result = 0;
+
+        read_timeout.tv_sec = briteblox->usb_read_timeout / 1000;
+        read_timeout.tv_usec = (briteblox->usb_read_timeout % 1000) * 1000;
+        if (ret == 0 && (briteblox_transfer_data_done_all(&reader, 1, &read_timeout, &result) < 0 || result != length))
+            ret = -4;
+        if (reader != NULL && briteblox_transfer_data_cancel(reader, &timeout) < 0)
+            wave->stuck[WAVE_WRITES_IN_FLIGHT] = reader;
+    }
+
+    // what is still pending keeps its buffers until briteblox_wave_reap()
+    for (i = 0; i < WAVE_WRITES_IN_FLIGHT; i++)
+        if (wave->stuck[i] != NULL)
+        {
+            wave->stuck_samples = wave->samples;
+            wave->samples = NULL;
+            wave->samples_size = wave->num_samples = 0;
+            ret = -4;
+            break;
+        }
+    if (wave->stuck[WAVE_WRITES_IN_FLIGHT] != NULL)
+    {
+        wave->stuck_scratch = scratch;
+        scratch = NULL;
+        ret = -4;
+    }
+    free(scratch);
+
+    if (ret < 0)
+        briteblox_error_return(-4, "playing the waveform failed");
+    return actual;
+}
@@ -18,6 +18,14 @@
 
 #include <briteblox.h>
 
+#include <string.h>
+#include <vector>
+
+extern "C" int writev_next_UT_export(const struct briteblox_iovec *iov, int iovcnt, int *i, int *pos,
+                                     int chunk, unsigned char *staging, unsigned char **data);
+extern "C" int write_data_cb_UT_export(struct briteblox_transfer_control *tc, int cancelled,
+                                       int actual_length);
+
 BOOST_AUTO_TEST_SUITE(Basic)
 
 BOOST_AUTO_TEST_CASE(SimpleInit)
@@ -30,4 +38,228 @@ BOOST_AUTO_TEST_CASE(SimpleInit)
     briteblox_deinit(&briteblox);
 }
 
+BOOST_AUTO_TEST_CASE(TransferPool)
+{
+    briteblox_context briteblox;
+    unsigned int size, in_use, exhausted;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_transfer_pool_get_stats(&briteblox, &size, &in_use, &exhausted));
+    BOOST_CHECK_EQUAL(32U, size);
+    BOOST_CHECK_EQUAL(0U, in_use);
+    BOOST_CHECK_EQUAL(0U, exhausted);
+
+    BOOST_CHECK_EQUAL(0, briteblox_transfer_pool_set_size(&briteblox, 4));
+    BOOST_REQUIRE_EQUAL(0, briteblox_transfer_pool_get_stats(&briteblox, &size, NULL, NULL));
+    BOOST_CHECK_EQUAL(4U, size);
+
+    BOOST_CHECK_EQUAL(-1, briteblox_transfer_pool_set_size(&briteblox, -1));
+
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(WriteCoalescing)
+{
+    briteblox_context briteblox;
+    unsigned int writes, flushes, pending;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+
+    BOOST_CHECK_EQUAL(-1, briteblox_write_data_get_coalescing_stats(&briteblox, NULL, NULL, NULL));
+    BOOST_CHECK_EQUAL(0, briteblox_flush(&briteblox));
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_write_data_set_coalescing(&briteblox, 1, 500));
+    BOOST_REQUIRE_EQUAL(0, briteblox_write_data_get_coalescing_stats(&briteblox, &writes, &flushes, &pending));
+    BOOST_CHECK_EQUAL(0U, writes);
+    BOOST_CHECK_EQUAL(0U, flushes);
+    BOOST_CHECK_EQUAL(0U, pending);
+
+    // an empty buffer needs no device
+    BOOST_CHECK_EQUAL(0, briteblox_flush(&briteblox));
+    BOOST_CHECK_EQUAL(0, briteblox_write_data_set_chunksize(&briteblox, 64));
+
+    BOOST_CHECK_EQUAL(0, briteblox_write_data_set_coalescing(&briteblox, 0, 0));
+    BOOST_CHECK_EQUAL(-1, briteblox_write_data_get_coalescing_stats(&briteblox, NULL, NULL, NULL));
+
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(WritevPieces)
+{
+    unsigned char header[3] = { 1, 2, 3 };
+    unsigned char payload[20];
+    unsigned char crc[2] = { 0xc0, 0xc1 };
+    unsigned char trailer[1] = { 0xee };
+    unsigned char staging[8];
+    std::vector<unsigned char> expected, sent;
+    int i = 0, pos = 0;
+
+    for (int k = 0; k < 20; k++)
+        payload[k] = 0x40 + k;
+
+    briteblox_iovec iov[] = { { header, 3 }, { payload, 20 }, { NULL, 0 }, { crc, 2 }, { trailer, 1 } };
+    for (unsigned k = 0; k < sizeof(iov) / sizeof(iov[0]); k++)
+        expected.insert(expected.end(), iov[k].base, iov[k].base + iov[k].len);
+
+    // header alone, two zero-copy chunks of the payload, then its tail packed with crc and trailer
+    const int lengths[] = { 3, 8, 8, 7 };
+    unsigned char *const starts[] = { staging, payload, payload + 8, staging };
+    for (int k = 0; k < 4; k++)
+    {
+        unsigned char *data = NULL;
+        int length = writev_next_UT_export(iov, 5, &i, &pos, 8, staging, &data);
+
+        BOOST_REQUIRE_EQUAL(lengths[k], length);
+        BOOST_CHECK(data == starts[k]);
+        sent.insert(sent.end(), data, data + length);
+    }
+
+    unsigned char *data;
+    BOOST_CHECK_EQUAL(0, writev_next_UT_export(iov, 5, &i, &pos, 8, staging, &data));
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected.begin(), expected.end(), sent.begin(), sent.end());
+
+    // small buffers fill whole chunks
+    unsigned char small[5][3];
+    briteblox_iovec many[5];
+    for (int k = 0; k < 5; k++)
+    {
+        memset(small[k], k, 3);
+        many[k].base = small[k];
+        many[k].len = 3;
+    }
+    i = pos = 0;
+    BOOST_CHECK_EQUAL(8, writev_next_UT_export(many, 5, &i, &pos, 8, staging, &data));
+    BOOST_CHECK_EQUAL(2, staging[7]);
+    BOOST_CHECK_EQUAL(7, writev_next_UT_export(many, 5, &i, &pos, 8, staging, &data));
+    BOOST_CHECK_EQUAL(2, staging[0]);
+    BOOST_CHECK_EQUAL(4, staging[6]);
+    BOOST_CHECK_EQUAL(0, writev_next_UT_export(many, 5, &i, &pos, 8, staging, &data));
+}
+
+BOOST_AUTO_TEST_CASE(WriteCallbackCancel)
+{
+    briteblox_context briteblox;
+    briteblox_transfer_control tc;
+    unsigned char buf[1024];
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    BOOST_REQUIRE_EQUAL(0, briteblox_write_data_set_chunksize(&briteblox, 256));
+
+    memset(&tc, 0, sizeof(tc));
+    tc.briteblox = &briteblox;
+    tc.buf = buf;
+    tc.size = sizeof(buf);
+
+    // a completed partial write goes on with the next chunk
+    BOOST_CHECK_EQUAL(1, write_data_cb_UT_export(&tc, 0, 256));
+    BOOST_CHECK_EQUAL(256, tc.offset);
+
+    // a cancelled partial write completes with what was sent
+    tc.completed = 0;
+    BOOST_CHECK_EQUAL(0, write_data_cb_UT_export(&tc, 1, 100));
+    BOOST_CHECK_EQUAL(1, tc.completed);
+    BOOST_CHECK_EQUAL(356, tc.offset);
+
+    // also when nothing was sent at all
+    tc.completed = 0;
+    tc.offset = 0;
+    BOOST_CHECK_EQUAL(0, write_data_cb_UT_export(&tc, 1, 0));
+    BOOST_CHECK_EQUAL(1, tc.completed);
+    BOOST_CHECK_EQUAL(0, tc.offset);
+
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(OpenFlags)
+{
+    briteblox_context briteblox;
+    briteblox_config_snapshot snapshot;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+
+    // nothing has been configured yet
+    BOOST_REQUIRE_EQUAL(0, briteblox_get_config_snapshot(&briteblox, &snapshot));
+    BOOST_CHECK_EQUAL(0U, snapshot.valid);
+    BOOST_CHECK_EQUAL(-1, briteblox_get_config_snapshot(&briteblox, NULL));
+
+    BOOST_CHECK_EQUAL(0, briteblox_set_open_flags(&briteblox, BRITEBLOX_OPEN_NO_RESET | BRITEBLOX_OPEN_NO_BAUDRATE, NULL));
+    BOOST_CHECK_EQUAL(BRITEBLOX_OPEN_NO_RESET | BRITEBLOX_OPEN_NO_BAUDRATE, briteblox.open_flags);
+
+    // restoring needs something to restore
+    BOOST_CHECK_EQUAL(-1, briteblox_set_open_flags(&briteblox, BRITEBLOX_OPEN_RESTORE, NULL));
+
+    snapshot.valid = BRITEBLOX_CONFIG_LATENCY;
+    snapshot.latency = 2;
+    snapshot.max_packet_size = 512;
+    BOOST_CHECK_EQUAL(0, briteblox_set_open_flags(&briteblox, BRITEBLOX_OPEN_RESTORE | BRITEBLOX_OPEN_NO_PACKET_PROBE, &snapshot));
+    BOOST_CHECK_EQUAL(512U, briteblox.open_snapshot.max_packet_size);
+    BOOST_CHECK_EQUAL(2, briteblox.open_snapshot.latency);
+
+    BOOST_CHECK_EQUAL(0, briteblox_set_open_flags(&briteblox, 0, NULL));
+    BOOST_CHECK_EQUAL(0U, briteblox.open_snapshot.valid);
+
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(ShadowRegisters)
+{
+    briteblox_context briteblox;
+    briteblox_config_snapshot snapshot;
+    unsigned int checked, skipped;
+    int dummy;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+
+    // pretend these values were programmed, so the setters never reach the device
+    briteblox_set_usbdev(&briteblox, (struct libusb_device_handle *)&dummy);
+    briteblox.config.valid = BRITEBLOX_CONFIG_LATENCY | BRITEBLOX_CONFIG_DTR | BRITEBLOX_CONFIG_RTS
+                             | BRITEBLOX_CONFIG_BITMODE | BRITEBLOX_CONFIG_EVENT_CHAR;
+    briteblox.config.latency = 16;
+    briteblox.config.dtr = 1;
+    briteblox.config.rts = 0;
+    briteblox.config.bitmask = 0xfb;
+    briteblox.config.bitmode = BITMODE_MPSSE;
+    briteblox.config.event_char = 0x17e;
+
+    BOOST_CHECK_EQUAL(0, briteblox_set_latency_timer(&briteblox, 16));
+    BOOST_CHECK_EQUAL(0, briteblox_setdtr_rts(&briteblox, 5, 0));
+    BOOST_CHECK_EQUAL(0, briteblox_setdtr(&briteblox, 1));
+    BOOST_CHECK_EQUAL(0, briteblox_set_bitmode(&briteblox, 0xfb, BITMODE_MPSSE));
+    BOOST_CHECK_EQUAL(0, briteblox_set_event_char(&briteblox, 0x7e, 1));
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_shadow_get_stats(&briteblox, &checked, &skipped));
+    BOOST_CHECK_EQUAL(5U, checked);
+    BOOST_CHECK_EQUAL(5U, skipped);
+
+    BOOST_CHECK_EQUAL(0, briteblox_shadow_set_force(&briteblox, 1));
+    BOOST_CHECK_EQUAL(1, briteblox.shadow_force);
+    BOOST_CHECK_EQUAL(0, briteblox_shadow_set_force(&briteblox, 0));
+
+    briteblox_shadow_invalidate(&briteblox);
+    BOOST_REQUIRE_EQUAL(0, briteblox_get_config_snapshot(&briteblox, &snapshot));
+    BOOST_CHECK_EQUAL(0U, snapshot.valid);
+
+    BOOST_CHECK_EQUAL(-1, briteblox_shadow_get_stats(NULL, NULL, NULL));
+    BOOST_CHECK_EQUAL(-1, briteblox_shadow_set_force(NULL, 1));
+
+    briteblox_set_usbdev(&briteblox, NULL);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(TransferWaitEmpty)
+{
+    struct briteblox_transfer_control *tcs[3] = { NULL, NULL, NULL };
+    struct timeval timeout = { 0, 1000 };
+    int results[3];
+
+    // LIBUSB_ERROR_INVALID_PARAM
+    BOOST_CHECK_EQUAL(-2, briteblox_transfer_data_done_any(NULL, 1, &timeout, NULL));
+    BOOST_CHECK_EQUAL(-2, briteblox_transfer_data_done_all(tcs, 0, &timeout, results));
+
+    // LIBUSB_ERROR_NOT_FOUND, nothing left to wait for
+    BOOST_CHECK_EQUAL(-5, briteblox_transfer_data_done_any(tcs, 3, &timeout, NULL));
+    BOOST_CHECK_EQUAL(0, briteblox_transfer_data_done_all(tcs, 3, NULL, results));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
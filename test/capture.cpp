@@ -0,0 +1,162 @@
+/**@file
+@brief Test run-length encoding of pin samples
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+/* Expands all records back into sample bytes */
+static std::vector<unsigned char> decode_all(const unsigned char *data, int length, int width)
+{
+    std::vector<unsigned char> samples;
+    int pos = 0;
+
+    while (pos < length)
+    {
+        unsigned int value;
+        uint64_t count;
+        int used = briteblox_rle_decode(data + pos, length - pos, width, &value, &count);
+
+        BOOST_REQUIRE(used > 0);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            samples.push_back(value & 0xff);
+            if (width == 2)
+                samples.push_back(value >> 8);
+        }
+        pos += used;
+    }
+    return samples;
+}
+
+BOOST_AUTO_TEST_SUITE(Capture)
+
+BOOST_AUTO_TEST_CASE(Encode8)
+{
+    struct briteblox_rle *rle = briteblox_rle_new(1);
+    BOOST_REQUIRE(rle != NULL);
+
+    // long idle stretches with glitches at various offsets, run across calls
+    std::vector<unsigned char> input(1000, 0x5a);
+    input[0] = 0x00;
+    input[17] = 0x01;
+    input[64] = 0x01;
+    input[65] = 0x01;
+    input[999] = 0xff;
+
+    BOOST_CHECK(briteblox_rle_encode(rle, &input[0], 300) >= 0);
+    BOOST_CHECK(briteblox_rle_encode(rle, &input[300], 0) >= 0);
+    BOOST_CHECK(briteblox_rle_encode(rle, &input[300], 700) >= 0);
+    BOOST_CHECK(briteblox_rle_flush(rle) > 0);
+
+    int length;
+    const unsigned char *out = briteblox_rle_get_output(rle, &length);
+    std::vector<unsigned char> decoded = decode_all(out, length, 1);
+    BOOST_CHECK_EQUAL_COLLECTIONS(input.begin(), input.end(), decoded.begin(), decoded.end());
+
+    uint64_t samples, runs;
+    BOOST_CHECK_EQUAL(0, briteblox_rle_get_stats(rle, &samples, &runs));
+    BOOST_CHECK_EQUAL(1000U, samples);
+    BOOST_CHECK_EQUAL(7U, runs);
+
+    briteblox_rle_clear_output(rle);
+    briteblox_rle_get_output(rle, &length);
+    BOOST_CHECK_EQUAL(0, length);
+
+    briteblox_rle_free(rle);
+}
+
+BOOST_AUTO_TEST_CASE(Encode16)
+{
+    struct briteblox_rle *rle = briteblox_rle_new(2);
+    BOOST_REQUIRE(rle != NULL);
+
+    // low and high byte differ, so a byte compare alone would be wrong
+    std::vector<unsigned char> input;
+    for (int i = 0; i < 100; i++)
+    {
+        input.push_back(0x34);
+        input.push_back(i == 40 ? 0x13 : 0x12);
+    }
+
+    // odd split leaves half a sample for the next call
+    BOOST_CHECK(briteblox_rle_encode(rle, &input[0], 33) >= 0);
+    BOOST_CHECK(briteblox_rle_encode(rle, &input[33], input.size() - 33) >= 0);
+    BOOST_CHECK(briteblox_rle_flush(rle) > 0);
+
+    int length;
+    const unsigned char *out = briteblox_rle_get_output(rle, &length);
+    const unsigned char expected[] = { 0x34, 0x12, 40, 0x34, 0x13, 1, 0x34, 0x12, 59 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), out, out + length);
+
+    briteblox_rle_free(rle);
+    BOOST_CHECK(briteblox_rle_new(3) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(LongRun)
+{
+    struct briteblox_rle *rle = briteblox_rle_new(1);
+    BOOST_REQUIRE(rle != NULL);
+
+    std::vector<unsigned char> input(100000, 0xaa);
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(briteblox_rle_encode(rle, &input[0], input.size()) >= 0);
+    BOOST_CHECK(briteblox_rle_flush(rle) > 0);
+
+    // 300000 = 0x493e0 takes three varint bytes
+    int length;
+    const unsigned char *out = briteblox_rle_get_output(rle, &length);
+    const unsigned char expected[] = { 0xaa, 0xe0, 0xa7, 0x12 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), out, out + length);
+
+    briteblox_rle_free(rle);
+}
+
+BOOST_AUTO_TEST_CASE(Decode)
+{
+    unsigned int value;
+    uint64_t count;
+
+    const unsigned char run[] = { 0x34, 0x12, 0x81, 0x01 };
+    BOOST_CHECK_EQUAL(4, briteblox_rle_decode(run, sizeof(run), 2, &value, &count));
+    BOOST_CHECK_EQUAL(0x1234U, value);
+    BOOST_CHECK_EQUAL(129U, count);
+
+    // incomplete record
+    BOOST_CHECK_EQUAL(0, briteblox_rle_decode(run, 3, 2, &value, &count));
+    BOOST_CHECK_EQUAL(0, briteblox_rle_decode(run, 1, 1, &value, &count));
+
+    // empty run, overlong count and bad width are invalid
+    const unsigned char empty[] = { 0x00, 0x00 };
+    BOOST_CHECK_EQUAL(-1, briteblox_rle_decode(empty, sizeof(empty), 1, &value, &count));
+    std::vector<unsigned char> overlong(12, 0xff);
+    BOOST_CHECK_EQUAL(-1, briteblox_rle_decode(&overlong[0], overlong.size(), 1, &value, &count));
+    BOOST_CHECK_EQUAL(-1, briteblox_rle_decode(run, sizeof(run), 3, &value, &count));
+}
+
+BOOST_AUTO_TEST_CASE(NoDevice)
+{
+    struct briteblox_context *briteblox = briteblox_new();
+    BOOST_REQUIRE(briteblox != NULL);
+
+    BOOST_CHECK_EQUAL(-1, briteblox_capture(briteblox, 1, 1000000, NULL, NULL, 8, 4));
+    BOOST_CHECK_EQUAL(-1, briteblox_capture(NULL, 1, 0, NULL, NULL, 8, 4));
+
+    briteblox_free(briteblox);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,115 @@
+/**@file
+@brief Test compiling I2C message lists into MPSSE commands
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <string.h>
+
+using namespace std;
+
+extern "C" const unsigned char *mpsse_queue_commands_UT_export(struct briteblox_mpsse_queue *q, int *length);
+extern "C" void mpsse_queue_scatter_UT_export(struct briteblox_mpsse_queue *q, const unsigned char *response);
+extern "C" struct briteblox_mpsse_queue *i2c_compile_UT_export(const struct briteblox_i2c_msg *msgs, int count,
+                                                              struct briteblox_i2c **i2c);
+extern "C" int i2c_check_acks_UT_export(struct briteblox_i2c *i2c, int count);
+
+/// Count the occurrences of a command sequence in the queue
+static int count_sequence(const unsigned char *cmd, int length, const unsigned char *seq, int seq_len)
+{
+    int n = 0;
+    for (int i = 0; i + seq_len <= length; i++)
+        if (memcmp(cmd + i, seq, seq_len) == 0)
+            n++;
+    return n;
+}
+
+BOOST_AUTO_TEST_SUITE(I2C)
+
+BOOST_AUTO_TEST_CASE(RegisterRead)
+{
+    struct briteblox_i2c *i2c = NULL;
+    unsigned char reg = 0x0f;
+    unsigned char value[2] = { 0, 0 };
+    struct briteblox_i2c_msg msgs[2] = {
+        { 0x48, 0, &reg, 1 },
+        { 0x48, BRITEBLOX_I2C_READ, value, 2 },
+    };
+
+    struct briteblox_mpsse_queue *q = i2c_compile_UT_export(msgs, 2, &i2c);
+    BOOST_REQUIRE(q != NULL);
+
+    int cmd_bytes, response_bytes, length;
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_queue_get_size(q, &cmd_bytes, &response_bytes));
+    // three acknowledge bits plus two data bytes
+    BOOST_CHECK_EQUAL(5, response_bytes);
+
+    const unsigned char *cmd = mpsse_queue_commands_UT_export(q, &length);
+    const unsigned char addr_write[] = { MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0x00, 0x00, 0x90 };
+    const unsigned char addr_read[] = { MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0x00, 0x00, 0x91 };
+    const unsigned char ack_in[] = { MPSSE_DO_READ | MPSSE_BITMODE, 0x00 };
+    const unsigned char ack_out[] = { MPSSE_DO_WRITE | MPSSE_BITMODE | MPSSE_WRITE_NEG, 0x00, 0x00 };
+    const unsigned char nack_out[] = { MPSSE_DO_WRITE | MPSSE_BITMODE | MPSSE_WRITE_NEG, 0x00, 0x80 };
+    const unsigned char stop[] = { SET_BITS_LOW, 0x03, 0x01 };
+
+    BOOST_CHECK_EQUAL(1, count_sequence(cmd, length, addr_write, sizeof(addr_write)));
+    BOOST_CHECK_EQUAL(1, count_sequence(cmd, length, addr_read, sizeof(addr_read)));
+    BOOST_CHECK_EQUAL(3, count_sequence(cmd, length, ack_in, sizeof(ack_in)));
+    BOOST_CHECK_EQUAL(1, count_sequence(cmd, length, ack_out, sizeof(ack_out)));
+    BOOST_CHECK_EQUAL(1, count_sequence(cmd, length, nack_out, sizeof(nack_out)));
+    // bus released in both starts and the single stop at the very end
+    BOOST_CHECK_EQUAL(3 * 4, count_sequence(cmd, length, stop, sizeof(stop)));
+    BOOST_CHECK(memcmp(cmd + length - sizeof(stop), stop, sizeof(stop)) == 0);
+
+    // address, register and read address acknowledged, then the data
+    const unsigned char response[] = { 0x00, 0x00, 0x00, 0x12, 0x34 };
+    mpsse_queue_scatter_UT_export(q, response);
+    BOOST_CHECK_EQUAL(2, i2c_check_acks_UT_export(i2c, 2));
+    BOOST_CHECK_EQUAL(0x12, value[0]);
+    BOOST_CHECK_EQUAL(0x34, value[1]);
+
+    briteblox_i2c_free(i2c);
+}
+
+BOOST_AUTO_TEST_CASE(Nack)
+{
+    struct briteblox_i2c *i2c = NULL;
+    unsigned char data[2] = { 0x01, 0x02 };
+    struct briteblox_i2c_msg msgs[2] = {
+        { 0x20, BRITEBLOX_I2C_STOP, data, 2 },
+        { 0x21, 0, data, 0 },
+    };
+
+    struct briteblox_mpsse_queue *q = i2c_compile_UT_export(msgs, 2, &i2c);
+    BOOST_REQUIRE(q != NULL);
+
+    // the probe of the second device is not acknowledged
+    const unsigned char response[] = { 0x00, 0x00, 0x00, 0x01 };
+    mpsse_queue_scatter_UT_export(q, response);
+    BOOST_CHECK_EQUAL(1, i2c_check_acks_UT_export(i2c, 2));
+
+    // invalid: address out of range, read of nothing
+    msgs[0].addr = 0x80;
+    BOOST_CHECK(i2c_compile_UT_export(msgs, 1, &i2c) == NULL);
+    msgs[0].addr = 0x20;
+    msgs[0].flags = BRITEBLOX_I2C_READ;
+    msgs[0].length = 0;
+    BOOST_CHECK(i2c_compile_UT_export(msgs, 1, &i2c) == NULL);
+
+    briteblox_i2c_free(i2c);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,265 @@
+/**@file
+@brief Test the JTAG TAP engine and the SVF player
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+extern "C" const unsigned char *mpsse_queue_commands_UT_export(struct briteblox_mpsse_queue *q, int *length);
+extern "C" void mpsse_queue_scatter_UT_export(struct briteblox_mpsse_queue *q, const unsigned char *response);
+extern "C" struct briteblox_jtag *jtag_alloc_UT_export(struct briteblox_context *briteblox);
+extern "C" struct briteblox_mpsse_queue *jtag_queue_UT_export(struct briteblox_jtag *jtag);
+extern "C" void jtag_apply_fixups_UT_export(struct briteblox_jtag *jtag);
+extern "C" int jtag_tms_path_UT_export(int from, int to, unsigned int *tms);
+extern "C" int jtag_svf_UT_export(struct briteblox_jtag *jtag, FILE *svf, int *line);
+
+static vector<unsigned char> commands(struct briteblox_jtag *jtag)
+{
+    int length;
+    const unsigned char *cmd = mpsse_queue_commands_UT_export(jtag_queue_UT_export(jtag), &length);
+    return vector<unsigned char>(cmd, cmd + length);
+}
+
+/// Play an SVF text without sending anything
+static int play(struct briteblox_jtag *jtag, const char *text, int *line)
+{
+    FILE *f = tmpfile();
+    BOOST_REQUIRE(f != NULL);
+    fputs(text, f);
+    rewind(f);
+    int ret = jtag_svf_UT_export(jtag, f, line);
+    fclose(f);
+    return ret;
+}
+
+BOOST_AUTO_TEST_SUITE(JTAG)
+
+BOOST_AUTO_TEST_CASE(TmsPath)
+{
+    unsigned int tms;
+
+    BOOST_CHECK_EQUAL(1, jtag_tms_path_UT_export(JTAG_TEST_LOGIC_RESET, JTAG_RUN_TEST_IDLE, &tms));
+    BOOST_CHECK_EQUAL(0x0U, tms);
+    BOOST_CHECK_EQUAL(3, jtag_tms_path_UT_export(JTAG_RUN_TEST_IDLE, JTAG_SHIFT_DR, &tms));
+    BOOST_CHECK_EQUAL(0x1U, tms);
+    BOOST_CHECK_EQUAL(4, jtag_tms_path_UT_export(JTAG_RUN_TEST_IDLE, JTAG_SHIFT_IR, &tms));
+    BOOST_CHECK_EQUAL(0x3U, tms);
+    BOOST_CHECK_EQUAL(2, jtag_tms_path_UT_export(JTAG_EXIT1_DR, JTAG_RUN_TEST_IDLE, &tms));
+    BOOST_CHECK_EQUAL(0x1U, tms);
+    BOOST_CHECK_EQUAL(5, jtag_tms_path_UT_export(JTAG_SHIFT_IR, JTAG_TEST_LOGIC_RESET, &tms));
+    BOOST_CHECK_EQUAL(0x1fU, tms);
+    BOOST_CHECK_EQUAL(0, jtag_tms_path_UT_export(JTAG_PAUSE_DR, JTAG_PAUSE_DR, &tms));
+}
+
+BOOST_AUTO_TEST_CASE(Scan)
+{
+    struct briteblox_jtag *jtag = jtag_alloc_UT_export(NULL);
+    const unsigned char tdi[2] = { 0xa5, 0x03 };
+    unsigned char tdo[2] = { 0, 0 };
+
+    BOOST_REQUIRE(jtag != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_scan(jtag, 0, tdi, tdo, 10, JTAG_RUN_TEST_IDLE));
+    BOOST_CHECK_EQUAL(JTAG_RUN_TEST_IDLE, briteblox_jtag_get_state(jtag));
+
+    const unsigned char mode = MPSSE_LSB | MPSSE_WRITE_NEG;
+    const unsigned char expected[] = {
+        // Test-Logic-Reset to Shift-DR
+        MPSSE_WRITE_TMS | MPSSE_BITMODE | mode, 0x03, 0x02,
+        // eight bits as a byte, one as a bit
+        MPSSE_DO_WRITE | MPSSE_DO_READ | mode, 0x00, 0x00, 0xa5,
+        MPSSE_DO_WRITE | MPSSE_DO_READ | MPSSE_BITMODE | mode, 0x00, 0x03,
+        // last bit with TMS high, TDI in bit 7
+        MPSSE_WRITE_TMS | MPSSE_DO_READ | MPSSE_BITMODE | mode, 0x00, 0x81,
+        // Exit1-DR to Run-Test/Idle
+        MPSSE_WRITE_TMS | MPSSE_BITMODE | mode, 0x01, 0x01,
+    };
+    vector<unsigned char> cmd = commands(jtag);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+
+    // bit commands deliver their bits at the top of the byte
+    const unsigned char response[] = { 0x3c, 0x80, 0x7f };
+    mpsse_queue_scatter_UT_export(jtag_queue_UT_export(jtag), response);
+    jtag_apply_fixups_UT_export(jtag);
+    BOOST_CHECK_EQUAL(0x3c, tdo[0]);
+    BOOST_CHECK_EQUAL(0x01, tdo[1]);
+
+    BOOST_CHECK_EQUAL(-2, briteblox_jtag_scan(jtag, 1, NULL, NULL, 0, JTAG_RUN_TEST_IDLE));
+    briteblox_jtag_free(jtag);
+}
+
+BOOST_AUTO_TEST_CASE(LongScan)
+{
+    struct briteblox_jtag *jtag = jtag_alloc_UT_export(NULL);
+    vector<unsigned char> tdi(70001, 0xff);
+
+    BOOST_REQUIRE(jtag != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_goto_state(jtag, JTAG_RUN_TEST_IDLE));
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_scan(jtag, 1, &tdi[0], NULL, 70000 * 8 + 1, JTAG_PAUSE_IR));
+
+    // no bit command, the body splits at 64 KiB
+    vector<unsigned char> cmd = commands(jtag);
+    BOOST_REQUIRE_EQUAL((size_t)(3 + 3 + 3 + 65536 + 3 + 4464 + 3 + 3), cmd.size());
+    BOOST_CHECK_EQUAL(MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_WRITE_NEG, cmd[6]);
+    BOOST_CHECK_EQUAL(0xff, cmd[7]);
+    BOOST_CHECK_EQUAL(0xff, cmd[8]);
+    BOOST_CHECK_EQUAL(MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_WRITE_NEG, cmd[9 + 65536]);
+    BOOST_CHECK_EQUAL(0x81, cmd[cmd.size() - 4]);
+    BOOST_CHECK_EQUAL(JTAG_PAUSE_IR, briteblox_jtag_get_state(jtag));
+
+    briteblox_jtag_free(jtag);
+}
+
+BOOST_AUTO_TEST_CASE(RunTest)
+{
+    briteblox_context briteblox;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    briteblox.type = TYPE_232H;
+    struct briteblox_jtag *jtag = jtag_alloc_UT_export(&briteblox);
+    BOOST_REQUIRE(jtag != NULL);
+
+    // Test-Logic-Reset holds with TMS high
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_run_test(jtag, 3));
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_goto_state(jtag, JTAG_RUN_TEST_IDLE));
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_run_test(jtag, 20));
+
+    const unsigned char mode = MPSSE_WRITE_TMS | MPSSE_BITMODE | MPSSE_LSB | MPSSE_WRITE_NEG;
+    const unsigned char expected[] = {
+        mode, 0x02, 0x7f,
+        mode, 0x00, 0x00,
+        // H type chips clock without data
+        CLK_BYTES, 0x01, 0x00,
+        mode, 0x03, 0x00,
+    };
+    vector<unsigned char> cmd = commands(jtag);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+
+    BOOST_CHECK_EQUAL(0, briteblox_jtag_goto_state(jtag, JTAG_EXIT1_DR));
+    BOOST_CHECK_EQUAL(-2, briteblox_jtag_run_test(jtag, 1));
+
+    briteblox_jtag_free(jtag);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(Svf)
+{
+    struct briteblox_jtag *jtag = jtag_alloc_UT_export(NULL);
+    int line = 0;
+
+    BOOST_REQUIRE(jtag != NULL);
+    BOOST_CHECK_EQUAL(0, play(jtag,
+                              "! a comment\n"
+                              "STATE RESET;\n"
+                              "ENDIR IRPAUSE; // another one\n"
+                              "SIR 4 TDI (a);\n"
+                              "SDR 12 TDI (0\n"
+                              "  3f) SMASK (fff);\n"
+                              "runtest idle 2 TCK endstate reset;\n", &line));
+    BOOST_CHECK_EQUAL(JTAG_TEST_LOGIC_RESET, briteblox_jtag_get_state(jtag));
+
+    const unsigned char mode = MPSSE_LSB | MPSSE_WRITE_NEG;
+    const unsigned char tms = MPSSE_WRITE_TMS | MPSSE_BITMODE | mode;
+    const unsigned char expected[] = {
+        tms, 0x04, 0x1f,
+        // to Shift-IR, three bits 0xa, last bit with TMS, on to Pause-IR
+        tms, 0x04, 0x06,
+        MPSSE_DO_WRITE | MPSSE_BITMODE | mode, 0x02, 0x0a,
+        tms, 0x00, 0x81,
+        tms, 0x00, 0x00,
+        // Pause-IR to Shift-DR, 11 bits 0x03f, back to Run-Test/Idle
+        tms, 0x04, 0x07,
+        MPSSE_DO_WRITE | mode, 0x00, 0x00, 0x3f,
+        MPSSE_DO_WRITE | MPSSE_BITMODE | mode, 0x02, 0x00,
+        tms, 0x00, 0x01,
+        tms, 0x01, 0x01,
+        tms, 0x01, 0x00,
+        tms, 0x02, 0x07,
+    };
+    vector<unsigned char> cmd = commands(jtag);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+    briteblox_mpsse_queue_reset(jtag_queue_UT_export(jtag));
+
+    // data wider than the scan
+    BOOST_CHECK_EQUAL(-1, play(jtag, "STATE RESET;\n\nSDR 4 TDI (1f);\n", &line));
+    BOOST_CHECK_EQUAL(3, line);
+    BOOST_CHECK_EQUAL(-1, play(jtag, "PIO (HL);", &line));
+    BOOST_CHECK_EQUAL(1, line);
+    BOOST_CHECK_EQUAL(-1, play(jtag, "\nSIR 4 TDI (1)", &line));
+    BOOST_CHECK_EQUAL(2, line);
+
+    briteblox_jtag_free(jtag);
+}
+
+BOOST_AUTO_TEST_CASE(SvfStatePath)
+{
+    struct briteblox_jtag *jtag = jtag_alloc_UT_export(NULL);
+    int line = 0;
+
+    BOOST_REQUIRE(jtag != NULL);
+    // passes Shift-IR, which the shortest path to Run-Test/Idle skips
+    BOOST_CHECK_EQUAL(0, play(jtag,
+                              "STATE RESET;\n"
+                              "STATE IDLE DRSELECT IRSELECT IRCAPTURE IREXIT1 IRPAUSE\n"
+                              "  IREXIT2 IRSHIFT IREXIT1 IRUPDATE IDLE;\n", &line));
+    BOOST_CHECK_EQUAL(JTAG_RUN_TEST_IDLE, briteblox_jtag_get_state(jtag));
+
+    const unsigned char tms = MPSSE_WRITE_TMS | MPSSE_BITMODE | MPSSE_LSB | MPSSE_WRITE_NEG;
+    const unsigned char expected[] = {
+        tms, 0x04, 0x1f,
+        // TMS 0 1 1 0 1 0 1, then 0 1 1 0
+        tms, 0x06, 0x56,
+        tms, 0x03, 0x06,
+    };
+    vector<unsigned char> cmd = commands(jtag);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+    briteblox_mpsse_queue_reset(jtag_queue_UT_export(jtag));
+
+    // Shift-IR is no single step from Run-Test/Idle or Select-DR-Scan
+    BOOST_CHECK_EQUAL(-1, play(jtag, "STATE IDLE IRSHIFT IREXIT1 IRPAUSE;", &line));
+    BOOST_CHECK_EQUAL(-1, play(jtag, "STATE DRSELECT IRSHIFT IREXIT1 IRPAUSE;", &line));
+    // the path has to end in a stable state
+    BOOST_CHECK_EQUAL(-1, play(jtag, "STATE DRSELECT;", &line));
+    BOOST_CHECK_EQUAL(-1, play(jtag, "STATE IDLE DRSELECT;", &line));
+    BOOST_CHECK_EQUAL(JTAG_RUN_TEST_IDLE, briteblox_jtag_get_state(jtag));
+
+    briteblox_jtag_free(jtag);
+}
+
+BOOST_AUTO_TEST_CASE(SvfNoDevice)
+{
+    briteblox_context briteblox;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    struct briteblox_jtag *jtag = jtag_alloc_UT_export(&briteblox);
+    BOOST_REQUIRE(jtag != NULL);
+
+    FILE *f = tmpfile();
+    BOOST_REQUIRE(f != NULL);
+    fputs("SDR 8 TDI (00) TDO (55);\n", f);
+    rewind(f);
+    int line = 0;
+    BOOST_CHECK_EQUAL(-4, briteblox_jtag_play_svf(jtag, f, &line));
+    fclose(f);
+
+    briteblox_jtag_free(jtag);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
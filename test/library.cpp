@@ -0,0 +1,352 @@
+/**@file
+@brief Test shared library contexts
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C" int registry_start_UT_export(struct briteblox_library *library, int vendor, int product,
+                                        BRITEBLOXRegistryCallback *callback, void *userdata);
+extern "C" int registry_event_UT_export(struct briteblox_library *library,
+                                        const struct briteblox_registry_device *device, int event);
+extern "C" void string_cache_store_UT_export(struct briteblox_library *library, struct libusb_device *dev,
+                                             int vendor, int product, int mask,
+                                             const char *manufacturer, const char *description, const char *serial);
+extern "C" int string_cache_lookup_UT_export(struct briteblox_library *library, struct libusb_device *dev,
+                                             int vendor, int product, int mask,
+                                             char *manufacturer, char *description, char *serial, int len);
+
+// BRITEBLOX_STRING_* of briteblox_i.h
+#define STRING_ALL 0x07
+#define STRING_SERIAL 0x04
+
+BOOST_AUTO_TEST_SUITE(Library)
+
+BOOST_AUTO_TEST_CASE(SharedContext)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+
+    struct briteblox_context *a = briteblox_new_shared(library);
+    struct briteblox_context *b = briteblox_new_shared(library);
+    BOOST_REQUIRE(a != NULL);
+    BOOST_REQUIRE(b != NULL);
+
+    BOOST_CHECK(a->library == library);
+    BOOST_CHECK(a->usb_ctx == briteblox_library_get_usb_context(library));
+    BOOST_CHECK(a->usb_ctx == b->usb_ctx);
+
+    // the contexts keep the library alive after the application let go
+    briteblox_library_unref(library);
+    briteblox_free(a);
+    BOOST_CHECK(b->usb_ctx == briteblox_library_get_usb_context(library));
+    briteblox_free(b);
+
+    BOOST_CHECK(briteblox_new_shared(NULL) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(InitShared)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    struct briteblox_context ctx;
+    BOOST_REQUIRE(library != NULL);
+
+    BOOST_CHECK_EQUAL(0, briteblox_init_shared(&ctx, library));
+    BOOST_CHECK(ctx.library == library);
+    briteblox_deinit(&ctx);
+    BOOST_CHECK(ctx.library == NULL);
+    BOOST_CHECK(ctx.usb_ctx == NULL);
+
+    BOOST_CHECK(briteblox_library_ref(library) == library);
+    briteblox_library_unref(library);
+    briteblox_library_unref(library);
+}
+
+BOOST_AUTO_TEST_CASE(EventThread)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+
+    BOOST_CHECK_EQUAL(-1, briteblox_library_stop_event_thread(library));
+    int ret = briteblox_library_start_event_thread(library);
+    if (ret == -2)
+    {
+        // built without thread support
+        briteblox_library_unref(library);
+        return;
+    }
+    BOOST_CHECK_EQUAL(0, ret);
+    BOOST_CHECK_EQUAL(-1, briteblox_library_start_event_thread(library));
+    BOOST_CHECK_EQUAL(0, briteblox_library_stop_event_thread(library));
+
+    // the last reference stops a running thread
+    BOOST_CHECK_EQUAL(0, briteblox_library_start_event_thread(library));
+    briteblox_library_unref(library);
+}
+
+BOOST_AUTO_TEST_CASE(EventThreadRefusesPools)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+
+    if (briteblox_library_start_event_thread(library) != 0)
+    {
+        briteblox_library_unref(library);
+        return;
+    }
+
+    struct briteblox_context *ctx = briteblox_new_shared(library);
+    BOOST_REQUIRE(ctx != NULL);
+    int dummy;
+
+    // refused before anything reaches the device
+    briteblox_set_usbdev(ctx, (struct libusb_device_handle *)&dummy);
+    BOOST_CHECK_EQUAL(-5, briteblox_read_data_set_submit_pool(ctx, 4, 0));
+    BOOST_CHECK_EQUAL(-5, briteblox_read_data_set_readahead(ctx, 4, 0));
+    briteblox_set_usbdev(ctx, NULL);
+
+    briteblox_free(ctx);
+    briteblox_library_unref(library);
+}
+
+static void count_events(const struct briteblox_registry_device *device,
+                         enum briteblox_registry_event event, void *userdata)
+{
+    int *counts = (int *)userdata;
+    (void)device;
+    counts[event == BRITEBLOX_DEVICE_ARRIVED ? 0 : 1]++;
+}
+
+static struct briteblox_registry_device make_device(void *dev, int product, int address, const char *serial)
+{
+    struct briteblox_registry_device device;
+
+    memset(&device, 0, sizeof(device));
+    device.dev = (struct libusb_device *)dev;
+    device.vendor = 0x403;
+    device.product = product;
+    device.bus = 1;
+    device.address = address;
+    strcpy(device.description, "BriteBlox");
+    strcpy(device.serial, serial);
+    return device;
+}
+
+BOOST_AUTO_TEST_CASE(Registry)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    struct briteblox_context *briteblox = briteblox_new_shared(library);
+    BOOST_REQUIRE(briteblox != NULL);
+
+    BOOST_CHECK_EQUAL(-1, briteblox_registry_poll(library));
+    BOOST_CHECK_EQUAL(-1, briteblox_registry_get_devices(library, NULL, 0));
+
+    int counts[2] = { 0, 0 };
+    BOOST_REQUIRE_EQUAL(0, registry_start_UT_export(library, 0x403, 0, count_events, counts));
+    BOOST_CHECK_EQUAL(-1, briteblox_registry_start(library, 0x403, 0, NULL, NULL));
+
+    int devs[3];
+    struct briteblox_registry_device a = make_device(&devs[0], 0x7ad0, 5, "A1");
+    struct briteblox_registry_device b = make_device(&devs[1], 0x7ad0, 6, "B2");
+    struct briteblox_registry_device c = make_device(&devs[2], 0x6010, 7, "C3");
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &a, BRITEBLOX_DEVICE_ARRIVED));
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &b, BRITEBLOX_DEVICE_ARRIVED));
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &c, BRITEBLOX_DEVICE_ARRIVED));
+    // a second arrival of the same device is ignored
+    BOOST_CHECK_EQUAL(0, registry_event_UT_export(library, &a, BRITEBLOX_DEVICE_ARRIVED));
+    BOOST_CHECK_EQUAL(3, counts[0]);
+
+    struct briteblox_registry_device list[2];
+    BOOST_CHECK_EQUAL(3, briteblox_registry_get_devices(library, list, 2));
+    BOOST_CHECK_EQUAL("B2", list[1].serial);
+
+    struct briteblox_device_list *devlist;
+    BOOST_CHECK_EQUAL(2, briteblox_usb_find_all(briteblox, &devlist, 0, 0));
+    BOOST_CHECK(devlist->dev == (struct libusb_device *)&devs[0]);
+    BOOST_CHECK(devlist->next->dev == (struct libusb_device *)&devs[1]);
+    briteblox_list_free(&devlist);
+    BOOST_CHECK_EQUAL(1, briteblox_usb_find_all(briteblox, &devlist, 0x403, 0x6010));
+    briteblox_list_free(&devlist);
+
+    // found in the registry, the stub libusb can't open it
+    BOOST_CHECK_EQUAL(-4, briteblox_usb_open_desc(briteblox, 0x403, 0x7ad0, NULL, "B2"));
+    BOOST_CHECK_EQUAL(-4, briteblox_usb_open_desc_index(briteblox, 0x403, 0x7ad0, "BriteBlox", NULL, 1));
+    BOOST_CHECK_EQUAL(-3, briteblox_usb_open_desc_index(briteblox, 0x403, 0x7ad0, "BriteBlox", NULL, 2));
+    BOOST_CHECK_EQUAL(-3, briteblox_usb_open_desc(briteblox, 0x403, 0x7ad0, NULL, "C3"));
+    BOOST_CHECK_EQUAL(-4, briteblox_usb_open_string(briteblox, "s:0x403:0x6010:C3"));
+
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &a, BRITEBLOX_DEVICE_LEFT));
+    BOOST_CHECK_EQUAL(0, registry_event_UT_export(library, &a, BRITEBLOX_DEVICE_LEFT));
+    BOOST_CHECK_EQUAL(1, counts[1]);
+    BOOST_CHECK_EQUAL(-3, briteblox_usb_open_desc(briteblox, 0x403, 0x7ad0, NULL, "A1"));
+    BOOST_CHECK_EQUAL(0, briteblox_registry_poll(library));
+
+    briteblox_free(briteblox);
+    briteblox_library_unref(library);
+}
+
+BOOST_AUTO_TEST_CASE(RegistryMissingStrings)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    struct briteblox_context *briteblox = briteblox_new_shared(library);
+    BOOST_REQUIRE(briteblox != NULL);
+
+    BOOST_REQUIRE_EQUAL(0, registry_start_UT_export(library, 0x403, 0, NULL, NULL));
+    int devs[2];
+    struct briteblox_registry_device a = make_device(&devs[0], 0x7ad0, 5, "A1");
+    struct briteblox_registry_device b = make_device(&devs[1], 0x7ad0, 6, "");
+    // the device could not be opened when it arrived
+    b.description[0] = '\0';
+    b.strings_missing = 7;
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &b, BRITEBLOX_DEVICE_ARRIVED));
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &a, BRITEBLOX_DEVICE_ARRIVED));
+
+    // the stub libusb can't read them either: found without strings,
+    // by serial the registry gives up and the (empty) bus scan runs
+    struct briteblox_device_list *devlist;
+    BOOST_CHECK_EQUAL(2, briteblox_usb_find_all(briteblox, &devlist, 0x403, 0x7ad0));
+    briteblox_list_free(&devlist);
+    BOOST_CHECK_EQUAL(-3, briteblox_usb_open_desc(briteblox, 0x403, 0x7ad0, NULL, "A1"));
+
+    // once it left, the registry answers again
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &b, BRITEBLOX_DEVICE_LEFT));
+    BOOST_CHECK_EQUAL(-4, briteblox_usb_open_desc(briteblox, 0x403, 0x7ad0, NULL, "A1"));
+
+    briteblox_free(briteblox);
+    briteblox_library_unref(library);
+}
+
+BOOST_AUTO_TEST_CASE(RegistryAnyDevice)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    struct briteblox_context *briteblox = briteblox_new_shared(library);
+    BOOST_REQUIRE(briteblox != NULL);
+
+    BOOST_REQUIRE_EQUAL(0, registry_start_UT_export(library, 0, 0, NULL, NULL));
+    int dev;
+    struct briteblox_registry_device a = make_device(&dev, 0x7ad0, 5, "A1");
+    BOOST_CHECK_EQUAL(1, registry_event_UT_export(library, &a, BRITEBLOX_DEVICE_ARRIVED));
+
+    // bus and address lookups need a registry that sees every device
+    BOOST_CHECK_EQUAL(-4, briteblox_usb_open_string(briteblox, "d:1/5"));
+    BOOST_CHECK_EQUAL(-3, briteblox_usb_open_string(briteblox, "d:1/6"));
+
+    briteblox_registry_stop(library);
+    BOOST_CHECK_EQUAL(-1, briteblox_registry_poll(library));
+
+    briteblox_free(briteblox);
+    briteblox_library_unref(library);
+}
+
+BOOST_AUTO_TEST_CASE(StringCache)
+{
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    int dev;
+    struct libusb_device *usbdev = (struct libusb_device *)&dev;
+    char manufacturer[64], description[64], serial[64];
+
+    BOOST_CHECK_EQUAL(-1, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_SERIAL,
+                                                        manufacturer, description, serial, sizeof(serial)));
+    BOOST_CHECK_EQUAL(-1, briteblox_string_cache_get_stats(library, NULL, NULL));
+    BOOST_CHECK_EQUAL(0, briteblox_string_cache_enable(library, NULL));
+    BOOST_CHECK_EQUAL(-1, briteblox_string_cache_enable(library, NULL));
+    BOOST_CHECK_EQUAL(-1, briteblox_string_cache_save(library));
+
+    string_cache_store_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_SERIAL, NULL, NULL, "BB123456");
+    BOOST_CHECK_EQUAL(1, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_SERIAL,
+                                                       NULL, NULL, serial, 8));
+    // truncated to the buffer
+    BOOST_CHECK_EQUAL("BB12345", serial);
+
+    // other strings aren't known yet, another chip isn't this one
+    BOOST_CHECK_EQUAL(0, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_ALL,
+                                                       manufacturer, description, serial, sizeof(serial)));
+    BOOST_CHECK_EQUAL(0, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x6010, STRING_SERIAL,
+                                                       NULL, NULL, serial, sizeof(serial)));
+
+    string_cache_store_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_ALL & ~STRING_SERIAL,
+                                 "Intra2net", "BriteBlox", NULL);
+    BOOST_CHECK_EQUAL(1, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_ALL,
+                                                       manufacturer, description, serial, sizeof(serial)));
+    BOOST_CHECK_EQUAL("Intra2net", manufacturer);
+    BOOST_CHECK_EQUAL("BriteBlox", description);
+
+    unsigned int hits, misses;
+    BOOST_CHECK_EQUAL(0, briteblox_string_cache_get_stats(library, &hits, &misses));
+    BOOST_CHECK_EQUAL(2U, hits);
+    BOOST_CHECK_EQUAL(2U, misses);
+
+    briteblox_string_cache_clear(library);
+    BOOST_CHECK_EQUAL(0, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_SERIAL,
+                                                       NULL, NULL, serial, sizeof(serial)));
+    briteblox_library_unref(library);
+}
+
+BOOST_AUTO_TEST_CASE(StringCacheFile)
+{
+    const char *path = "string_cache_test.txt";
+    int dev;
+    struct libusb_device *usbdev = (struct libusb_device *)&dev;
+    char manufacturer[64], description[64], serial[64];
+
+    remove(path);
+    struct briteblox_library *library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    // a missing file is fine
+    BOOST_CHECK_EQUAL(0, briteblox_string_cache_enable(library, path));
+    string_cache_store_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_ALL, "Intra2net", "Brite Blox", "BB42");
+    // saved when the last reference goes away
+    briteblox_library_unref(library);
+
+    library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_string_cache_enable(library, path));
+    BOOST_CHECK_EQUAL(1, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_ALL,
+                                                       manufacturer, description, serial, sizeof(serial)));
+    BOOST_CHECK_EQUAL("Intra2net", manufacturer);
+    BOOST_CHECK_EQUAL("Brite Blox", description);
+    BOOST_CHECK_EQUAL("BB42", serial);
+
+    // control characters don't make it into the file
+    string_cache_store_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_SERIAL, NULL, NULL, "BB\t42");
+    BOOST_CHECK_EQUAL(0, briteblox_string_cache_save(library));
+    briteblox_library_unref(library);
+
+    library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_string_cache_enable(library, path));
+    BOOST_CHECK_EQUAL(0, string_cache_lookup_UT_export(library, usbdev, 0x403, 0x7ad0, STRING_SERIAL,
+                                                       NULL, NULL, serial, sizeof(serial)));
+    briteblox_library_unref(library);
+
+    FILE *file = fopen(path, "w");
+    BOOST_REQUIRE(file != NULL);
+    fputs("not a cache\n", file);
+    fclose(file);
+    library = briteblox_library_new();
+    BOOST_REQUIRE(library != NULL);
+    BOOST_CHECK_EQUAL(-3, briteblox_string_cache_enable(library, path));
+    briteblox_library_unref(library);
+    remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,164 @@
+/**@file
+@brief Test encoding of the MPSSE command queue
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+using namespace std;
+
+extern "C" const unsigned char *mpsse_queue_commands_UT_export(struct briteblox_mpsse_queue *q, int *length);
+extern "C" void mpsse_queue_scatter_UT_export(struct briteblox_mpsse_queue *q, const unsigned char *response);
+
+static vector<unsigned char> commands(struct briteblox_mpsse_queue *q)
+{
+    int length;
+    const unsigned char *cmd = mpsse_queue_commands_UT_export(q, &length);
+    return vector<unsigned char>(cmd, cmd + length);
+}
+
+BOOST_AUTO_TEST_SUITE(MPSSE)
+
+BOOST_AUTO_TEST_CASE(Encoding)
+{
+    struct briteblox_mpsse_queue *q = briteblox_mpsse_queue_new(NULL);
+    const unsigned char out[2] = { 0x12, 0x34 };
+    unsigned char in[2], pins, bits;
+    int cmd_bytes, response_bytes;
+
+    BOOST_REQUIRE(q != NULL);
+
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_set_gpio(q, 0, 0x08, 0x0b));
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_clock_out(q, MPSSE_WRITE_NEG, out, 2));
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_clock_in(q, 0, in, 2));
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_clock_bits_inout(q, MPSSE_LSB, 0x05, &bits, 3));
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_get_gpio(q, 1, &pins));
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_clock_tms(q, MPSSE_WRITE_NEG, 0x03, 2, 1, NULL));
+
+    const unsigned char expected[] = {
+        SET_BITS_LOW, 0x08, 0x0b,
+        MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0x01, 0x00, 0x12, 0x34,
+        MPSSE_DO_READ, 0x01, 0x00,
+        MPSSE_DO_WRITE | MPSSE_DO_READ | MPSSE_BITMODE | MPSSE_LSB, 0x02, 0x05,
+        GET_BITS_HIGH,
+        MPSSE_WRITE_TMS | MPSSE_BITMODE | MPSSE_WRITE_NEG, 0x01, 0x83,
+    };
+    vector<unsigned char> cmd = commands(q);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_queue_get_size(q, &cmd_bytes, &response_bytes));
+    BOOST_CHECK_EQUAL((int)sizeof(expected), cmd_bytes);
+    BOOST_CHECK_EQUAL(4, response_bytes);
+
+    // the response comes back in command order
+    const unsigned char response[] = { 0xaa, 0xbb, 0xcc, 0xdd };
+    mpsse_queue_scatter_UT_export(q, response);
+    BOOST_CHECK_EQUAL(0xaa, in[0]);
+    BOOST_CHECK_EQUAL(0xbb, in[1]);
+    BOOST_CHECK_EQUAL(0xcc, bits);
+    BOOST_CHECK_EQUAL(0xdd, pins);
+
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_queue_get_size(q, &cmd_bytes, &response_bytes));
+    BOOST_CHECK_EQUAL(0, cmd_bytes);
+    BOOST_CHECK_EQUAL(0, response_bytes);
+
+    briteblox_mpsse_queue_free(q);
+}
+
+BOOST_AUTO_TEST_CASE(LongTransfer)
+{
+    struct briteblox_mpsse_queue *q = briteblox_mpsse_queue_new(NULL);
+    vector<unsigned char> out(70000, 0x5a), in(70000);
+    int cmd_bytes, response_bytes;
+
+    BOOST_REQUIRE(q != NULL);
+
+    // split at 64 KiB per command
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_clock_inout(q, 0, &out[0], &in[0], (int)out.size()));
+    vector<unsigned char> cmd = commands(q);
+    BOOST_REQUIRE_EQUAL((size_t)(3 + 65536 + 3 + 4464), cmd.size());
+    BOOST_CHECK_EQUAL(0xff, cmd[1]);
+    BOOST_CHECK_EQUAL(0xff, cmd[2]);
+    BOOST_CHECK_EQUAL(4463 & 0xff, cmd[3 + 65536 + 1]);
+    BOOST_CHECK_EQUAL(4463 >> 8, cmd[3 + 65536 + 2]);
+
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_queue_get_size(q, &cmd_bytes, &response_bytes));
+    BOOST_CHECK_EQUAL(70000, response_bytes);
+
+    BOOST_CHECK_EQUAL(-2, briteblox_mpsse_clock_in(q, 0, NULL, 1));
+    BOOST_CHECK_EQUAL(-2, briteblox_mpsse_clock_bits_out(q, 0, 0, 9));
+
+    briteblox_mpsse_queue_free(q);
+}
+
+BOOST_AUTO_TEST_CASE(Clock)
+{
+    briteblox_context briteblox;
+    struct briteblox_mpsse_queue *q;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    q = briteblox_mpsse_queue_new(&briteblox);
+    BOOST_REQUIRE(q != NULL);
+
+    // H type: 60 MHz base, divide by 5 off
+    briteblox.type = TYPE_232H;
+    BOOST_CHECK_EQUAL(30000000, briteblox_mpsse_set_clock(q, 30000000));
+    BOOST_CHECK_EQUAL(6000000, briteblox_mpsse_set_clock(q, 7000000));
+    const unsigned char expected_h[] = { DIS_DIV_5, TCK_DIVISOR, 0x00, 0x00,
+                                         DIS_DIV_5, TCK_DIVISOR, 0x04, 0x00 };
+    vector<unsigned char> cmd = commands(q);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected_h, expected_h + sizeof(expected_h), cmd.begin(), cmd.end());
+    briteblox_mpsse_queue_reset(q);
+
+    // too slow for 60 MHz: divide by 5 on
+    BOOST_CHECK_EQUAL(100, briteblox_mpsse_set_clock(q, 100));
+    cmd = commands(q);
+    BOOST_REQUIRE_EQUAL(4U, cmd.size());
+    BOOST_CHECK_EQUAL(EN_DIV_5, cmd[0]);
+    BOOST_CHECK_EQUAL(59999 & 0xff, cmd[2]);
+    BOOST_CHECK_EQUAL(59999 >> 8, cmd[3]);
+    briteblox_mpsse_queue_reset(q);
+
+    // 2232C: 12 MHz base, no divide by 5 command
+    briteblox.type = TYPE_2232C;
+    BOOST_CHECK_EQUAL(1000000, briteblox_mpsse_set_clock(q, 1000000));
+    cmd = commands(q);
+    BOOST_REQUIRE_EQUAL(3U, cmd.size());
+    BOOST_CHECK_EQUAL(TCK_DIVISOR, cmd[0]);
+    BOOST_CHECK_EQUAL(5, cmd[1]);
+    BOOST_CHECK_EQUAL(-2, briteblox_mpsse_set_clock(q, 50));
+
+    briteblox_mpsse_queue_free(q);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_CASE(NoDevice)
+{
+    briteblox_context briteblox;
+    unsigned char pins;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    struct briteblox_mpsse_queue *q = briteblox_mpsse_queue_new(&briteblox);
+    BOOST_REQUIRE(q != NULL);
+
+    BOOST_CHECK_EQUAL(0, briteblox_mpsse_get_gpio(q, 0, &pins));
+    BOOST_CHECK_EQUAL(-666, briteblox_mpsse_queue_execute(q));
+
+    briteblox_mpsse_queue_free(q);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,111 @@
+/**@file
+@brief Test the read ring holding received payload bytes
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+extern "C" {
+#include "briteblox_i.h"
+}
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/// Raw transfer of 64 byte packets, payload bytes count up from first
+static vector<unsigned char> make_transfer(int packets, unsigned char first)
+{
+    vector<unsigned char> raw(packets * 64);
+
+    for (int i = 0; i < (int)raw.size(); i++)
+        raw[i] = (i % 64 < 2) ? 0x01 : first++;
+    return raw;
+}
+
+BOOST_AUTO_TEST_SUITE(Ring)
+
+BOOST_AUTO_TEST_CASE(PowerOfTwo)
+{
+    struct briteblox_ring ring = { NULL, 0, 0, 0, 0, 0 };
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_ring_alloc(&ring, 1000));
+    BOOST_CHECK_EQUAL(1024U, ring.size);
+    BOOST_CHECK_EQUAL(0U, briteblox_ring_fill(&ring));
+    BOOST_CHECK_EQUAL(1024U, briteblox_ring_space(&ring));
+
+    briteblox_ring_free(&ring);
+}
+
+BOOST_AUTO_TEST_CASE(WrapAround)
+{
+    struct briteblox_ring ring = { NULL, 0, 0, 0, 0, 0 };
+    unsigned char expected = 0;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_ring_alloc(&ring, 256));
+
+    // 3 packets = 186 payload bytes per push, pops of 100 walk the
+    // indices across the end of the ring many times
+    for (int round = 0; round < 50; round++)
+    {
+        vector<unsigned char> raw = make_transfer(3, (unsigned char)(round * 186));
+        unsigned char out[100];
+
+        if (briteblox_ring_space(&ring) >= 186)
+            BOOST_REQUIRE_EQUAL(186, briteblox_ring_push_stripped(&ring, &raw[0], raw.size(), 64, 0));
+        else
+            round--;
+
+        int n = briteblox_ring_pop(&ring, out, sizeof(out));
+        for (int i = 0; i < n; i++)
+            BOOST_REQUIRE_EQUAL(expected++, out[i]);
+    }
+
+    briteblox_ring_free(&ring);
+}
+
+BOOST_AUTO_TEST_CASE(OverflowAndHighWater)
+{
+    struct briteblox_ring ring = { NULL, 0, 0, 0, 0, 0 };
+    vector<unsigned char> raw = make_transfer(4, 0);
+    unsigned char out[256];
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_ring_alloc(&ring, 128));
+
+    // 248 payload bytes, only 128 fit. Skip the first 10.
+    BOOST_CHECK_EQUAL(128, briteblox_ring_push_stripped(&ring, &raw[0], raw.size(), 64, 10));
+    BOOST_CHECK_EQUAL(128U, ring.high_water);
+    BOOST_CHECK_EQUAL(0, briteblox_ring_push_stripped(&ring, &raw[0], raw.size(), 64, 0));
+
+    BOOST_REQUIRE_EQUAL(128, briteblox_ring_pop(&ring, out, sizeof(out)));
+    for (int i = 0; i < 128; i++)
+        BOOST_REQUIRE_EQUAL(10 + i, out[i]);
+
+    // grow keeps the content
+    BOOST_CHECK_EQUAL(62, briteblox_ring_push_stripped(&ring, &raw[0], 64, 64, 0));
+    BOOST_REQUIRE_EQUAL(0, briteblox_ring_grow(&ring, 1000));
+    BOOST_CHECK_EQUAL(1024U, ring.size);
+    BOOST_REQUIRE_EQUAL(62, briteblox_ring_pop(&ring, out, sizeof(out)));
+    BOOST_CHECK_EQUAL(0, out[0]);
+    BOOST_CHECK_EQUAL(61, out[61]);
+
+    briteblox_ring_discard(&ring);
+    BOOST_CHECK_EQUAL(0U, briteblox_ring_fill(&ring));
+    BOOST_CHECK_EQUAL(128U, ring.high_water);
+
+    briteblox_ring_free(&ring);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,106 @@
+/**@file
+@brief Test compiling SPI transfer lists into MPSSE commands
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+using namespace std;
+
+extern "C" const unsigned char *mpsse_queue_commands_UT_export(struct briteblox_mpsse_queue *q, int *length);
+extern "C" struct briteblox_spi *spi_alloc_UT_export(struct briteblox_context *briteblox, int mode,
+                                                     unsigned char cs_mask, int flags);
+extern "C" struct briteblox_mpsse_queue *spi_compile_UT_export(struct briteblox_spi *spi,
+                                                              const struct briteblox_spi_transfer *xfers,
+                                                              int count);
+
+static vector<unsigned char> compile(struct briteblox_spi *spi, const struct briteblox_spi_transfer *xfers,
+                                     int count)
+{
+    int length;
+    struct briteblox_mpsse_queue *q = spi_compile_UT_export(spi, xfers, count);
+
+    BOOST_REQUIRE(q != NULL);
+    const unsigned char *cmd = mpsse_queue_commands_UT_export(q, &length);
+    vector<unsigned char> result(cmd, cmd + length);
+    briteblox_mpsse_queue_reset(q);
+    return result;
+}
+
+BOOST_AUTO_TEST_SUITE(SPI)
+
+BOOST_AUTO_TEST_CASE(Mode0CommandThenRead)
+{
+    struct briteblox_spi *spi = spi_alloc_UT_export(NULL, 0, 0, 0);
+    const unsigned char cmd[1] = { 0x9f };
+    unsigned char id[3];
+    struct briteblox_spi_transfer xfers[2] = {
+        { cmd, NULL, 1, 3, BRITEBLOX_SPI_CS_HOLD },
+        { NULL, id, 3, 3, 0 },
+    };
+
+    BOOST_REQUIRE(spi != NULL);
+
+    const unsigned char expected[] = {
+        SET_BITS_LOW, 0x00, 0x0b,                      // select, SCK idles low
+        MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0x00, 0x00, 0x9f,
+        MPSSE_DO_READ, 0x02, 0x00,
+        SET_BITS_LOW, 0x08, 0x0b,                      // deselect
+    };
+    vector<unsigned char> result = compile(spi, xfers, 2);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), result.begin(), result.end());
+
+    briteblox_spi_free(spi);
+}
+
+BOOST_AUTO_TEST_CASE(Mode3TwoDevices)
+{
+    struct briteblox_spi *spi = spi_alloc_UT_export(NULL, 3, 0x18, 0);
+    const unsigned char out[1] = { 0x55 };
+    unsigned char in[1];
+    struct briteblox_spi_transfer xfers[2] = {
+        { out, in, 1, 3, BRITEBLOX_SPI_CS_HOLD },
+        { out, NULL, 1, 4, 0 },
+    };
+
+    BOOST_REQUIRE(spi != NULL);
+
+    const unsigned char expected[] = {
+        SET_BITS_LOW, 0x11, 0x1b,                      // select CS3, SCK idles high
+        MPSSE_DO_WRITE | MPSSE_DO_READ | MPSSE_WRITE_NEG, 0x00, 0x00, 0x55,
+        SET_BITS_LOW, 0x19, 0x1b,                      // CS3 released for CS4
+        SET_BITS_LOW, 0x09, 0x1b,
+        MPSSE_DO_WRITE | MPSSE_WRITE_NEG, 0x00, 0x00, 0x55,
+        SET_BITS_LOW, 0x19, 0x1b,
+    };
+    vector<unsigned char> result = compile(spi, xfers, 2);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), result.begin(), result.end());
+
+    // CS5 is not one of the chip selects
+    xfers[1].cs = 5;
+    BOOST_CHECK(spi_compile_UT_export(spi, xfers, 2) == NULL);
+
+    briteblox_spi_free(spi);
+}
+
+BOOST_AUTO_TEST_CASE(InvalidSetup)
+{
+    BOOST_CHECK(spi_alloc_UT_export(NULL, 4, 0, 0) == NULL);
+    BOOST_CHECK(spi_alloc_UT_export(NULL, 0, 0x04, 0) == NULL);
+    BOOST_CHECK(briteblox_spi_new(NULL, 0, 1000000, 0, 0) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
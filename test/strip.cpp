@@ -0,0 +1,113 @@
+/**@file
+@brief Test removal of the modem status bytes from bulk IN transfers
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <algorithm>
+#include <limits.h>
+
+using namespace std;
+
+extern "C" int strip_status_UT_export(unsigned char *dst, const unsigned char *src,
+                                      int length, int packet_size, int skip, int max);
+
+/// Build a raw transfer: every packet starts with two status bytes 0xff 0xfe
+static vector<unsigned char> make_transfer(int length, int packet_size, vector<unsigned char> &payload)
+{
+    vector<unsigned char> raw(length);
+    unsigned char next = 0;
+
+    payload.clear();
+    for (int i = 0; i < length; i++)
+    {
+        if (i % packet_size < 2)
+            raw[i] = (i % packet_size == 0) ? 0xff : 0xfe;
+        else
+        {
+            raw[i] = next++;
+            payload.push_back(raw[i]);
+        }
+    }
+    // A trailing packet with only status bytes carries no payload
+    return raw;
+}
+
+BOOST_AUTO_TEST_SUITE(Strip)
+
+BOOST_AUTO_TEST_CASE(FullTransfer)
+{
+    const int packet_sizes[] = { 64, 512 };
+
+    for (int p = 0; p < 2; p++)
+    {
+        int packet_size = packet_sizes[p];
+        for (int length = 0; length <= 4 * packet_size + 3; length += 7)
+        {
+            vector<unsigned char> payload;
+            vector<unsigned char> raw = make_transfer(length, packet_size, payload);
+            vector<unsigned char> out(length + 1, 0xaa);
+
+            int written = strip_status_UT_export(&out[0], raw.empty() ? NULL : &raw[0],
+                                                 length, packet_size, 0, INT_MAX);
+
+            BOOST_REQUIRE_EQUAL((int)payload.size(), written);
+            BOOST_CHECK(equal(payload.begin(), payload.end(), out.begin()));
+            BOOST_CHECK_EQUAL(0xaa, out[written]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(SkipAndMax)
+{
+    const int packet_size = 64;
+    const int length = 5 * packet_size + 40;
+    vector<unsigned char> payload;
+    vector<unsigned char> raw = make_transfer(length, packet_size, payload);
+
+    for (int skip = 0; skip < (int)payload.size(); skip += 13)
+    {
+        for (int max = 1; max < 200; max += 31)
+        {
+            vector<unsigned char> out(max, 0);
+            int expected = min(max, (int)payload.size() - skip);
+
+            int written = strip_status_UT_export(&out[0], &raw[0], length, packet_size, skip, max);
+
+            BOOST_REQUIRE_EQUAL(expected, written);
+            BOOST_CHECK(equal(payload.begin() + skip, payload.begin() + skip + written, out.begin()));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InPlace)
+{
+    const int packet_size = 512;
+    const int length = 8 * packet_size - 100;
+
+    for (int skip = 0; skip < 3000; skip += 509)
+    {
+        vector<unsigned char> payload;
+        vector<unsigned char> raw = make_transfer(length, packet_size, payload);
+
+        int written = strip_status_UT_export(&raw[0], &raw[0], length, packet_size, skip, INT_MAX);
+
+        BOOST_REQUIRE_EQUAL((int)payload.size() - skip, written);
+        BOOST_CHECK(equal(payload.begin() + skip, payload.end(), raw.begin()));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
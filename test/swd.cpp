@@ -0,0 +1,179 @@
+/**@file
+@brief Test queueing SWD transactions into MPSSE commands
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+using namespace std;
+
+extern "C" const unsigned char *mpsse_queue_commands_UT_export(struct briteblox_mpsse_queue *q, int *length);
+extern "C" void mpsse_queue_scatter_UT_export(struct briteblox_mpsse_queue *q, const unsigned char *response);
+extern "C" struct briteblox_swd *swd_alloc_UT_export(struct briteblox_context *briteblox);
+extern "C" struct briteblox_mpsse_queue *swd_finish_UT_export(struct briteblox_swd *swd);
+extern "C" int swd_check_UT_export(struct briteblox_swd *swd, int *failed);
+
+static const unsigned char OUT = MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_WRITE_NEG;
+static const unsigned char IN = MPSSE_DO_READ | MPSSE_LSB | MPSSE_WRITE_NEG;
+
+static vector<unsigned char> commands(struct briteblox_mpsse_queue *q)
+{
+    int length;
+    const unsigned char *cmd = mpsse_queue_commands_UT_export(q, &length);
+    return vector<unsigned char>(cmd, cmd + length);
+}
+
+/// Response of a read acknowledged with OK
+static void read_response(vector<unsigned char> &response, uint32_t value, int parity)
+{
+    response.push_back(0x20);
+    for (int i = 0; i < 4; i++)
+        response.push_back((value >> (8 * i)) & 0xff);
+    response.push_back(parity << 6);
+}
+
+BOOST_AUTO_TEST_SUITE(SWD)
+
+BOOST_AUTO_TEST_CASE(DpRead)
+{
+    struct briteblox_swd *swd = swd_alloc_UT_export(NULL);
+    uint32_t idr = 0;
+
+    BOOST_REQUIRE(swd != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_swd_read(swd, 0, 0x0, &idr));
+    BOOST_CHECK_EQUAL(-2, briteblox_swd_read(swd, 0, 0x2, &idr));
+
+    struct briteblox_mpsse_queue *q = swd_finish_UT_export(swd);
+    BOOST_REQUIRE(q != NULL);
+    const unsigned char expected[] = {
+        OUT, 0x00, 0x00, 0xa5,
+        // turnaround, ACK, data, parity, turnaround
+        SET_BITS_LOW, 0x02, 0x01,
+        IN | MPSSE_BITMODE, 0x03,
+        IN, 0x03, 0x00,
+        IN | MPSSE_BITMODE, 0x01,
+        SET_BITS_LOW, 0x02, 0x03,
+        // idle cycles
+        OUT, 0x00, 0x00, 0x00,
+    };
+    vector<unsigned char> cmd = commands(q);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+
+    vector<unsigned char> response;
+    read_response(response, 0x2ba01477, 0);
+    mpsse_queue_scatter_UT_export(q, &response[0]);
+    BOOST_CHECK_EQUAL(0, swd_check_UT_export(swd, NULL));
+    BOOST_CHECK_EQUAL(0x2ba01477U, idr);
+
+    briteblox_swd_free(swd);
+}
+
+BOOST_AUTO_TEST_CASE(Write)
+{
+    struct briteblox_swd *swd = swd_alloc_UT_export(NULL);
+
+    BOOST_REQUIRE(swd != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_swd_write(swd, 0, 0x0, 0x1e));
+
+    struct briteblox_mpsse_queue *q = swd_finish_UT_export(swd);
+    BOOST_REQUIRE(q != NULL);
+    const unsigned char expected[] = {
+        OUT, 0x00, 0x00, 0x81,
+        // turnaround, ACK, turnaround
+        SET_BITS_LOW, 0x02, 0x01,
+        IN | MPSSE_BITMODE, 0x04,
+        SET_BITS_LOW, 0x02, 0x03,
+        OUT, 0x03, 0x00, 0x1e, 0x00, 0x00, 0x00,
+        OUT | MPSSE_BITMODE, 0x00, 0x00,
+        OUT, 0x00, 0x00, 0x00,
+    };
+    vector<unsigned char> cmd = commands(q);
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), cmd.begin(), cmd.end());
+
+    // WAIT
+    const unsigned char response[] = { 0x20 };
+    mpsse_queue_scatter_UT_export(q, response);
+    int failed = -1;
+    BOOST_CHECK_EQUAL(-5, swd_check_UT_export(swd, &failed));
+    BOOST_CHECK_EQUAL(0, failed);
+
+    briteblox_swd_free(swd);
+}
+
+BOOST_AUTO_TEST_CASE(PostedApReads)
+{
+    struct briteblox_swd *swd = swd_alloc_UT_export(NULL);
+    uint32_t values[3] = { 0, 0, 0 };
+
+    BOOST_REQUIRE(swd != NULL);
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK_EQUAL(0, briteblox_swd_read(swd, 1, 0xc, &values[i]));
+
+    // three AP reads of DRW and the RDBUFF read for the last result
+    struct briteblox_mpsse_queue *q = swd_finish_UT_export(swd);
+    BOOST_REQUIRE(q != NULL);
+    vector<unsigned char> cmd = commands(q);
+    vector<unsigned char> requests;
+    for (size_t i = 0; i + 3 < cmd.size(); i++)
+        if (cmd[i] == OUT && cmd[i + 1] == 0 && cmd[i + 2] == 0 && cmd[i + 3] != 0)
+            requests.push_back(cmd[i + 3]);
+    const unsigned char expected[] = { 0x9f, 0x9f, 0x9f, 0xbd };
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), requests.begin(), requests.end());
+
+    vector<unsigned char> response;
+    read_response(response, 0xdeadbeef, 0);
+    read_response(response, 0x11111111, 0);
+    read_response(response, 0x22222222, 0);
+    read_response(response, 0x33333333, 0);
+    mpsse_queue_scatter_UT_export(q, &response[0]);
+    BOOST_CHECK_EQUAL(0, swd_check_UT_export(swd, NULL));
+    BOOST_CHECK_EQUAL(0x11111111U, values[0]);
+    BOOST_CHECK_EQUAL(0x22222222U, values[1]);
+    BOOST_CHECK_EQUAL(0x33333333U, values[2]);
+
+    // a parity error in the RDBUFF read is reported after both AP reads
+    for (int i = 0; i < 2; i++)
+        BOOST_CHECK_EQUAL(0, briteblox_swd_read(swd, 1, 0xc, &values[i]));
+    q = swd_finish_UT_export(swd);
+    response.clear();
+    read_response(response, 0, 0);
+    read_response(response, 1, 1);
+    read_response(response, 2, 0);
+    mpsse_queue_scatter_UT_export(q, &response[0]);
+    int failed = -1;
+    BOOST_CHECK_EQUAL(-8, swd_check_UT_export(swd, &failed));
+    BOOST_CHECK_EQUAL(2, failed);
+
+    briteblox_swd_free(swd);
+}
+
+BOOST_AUTO_TEST_CASE(NoDevice)
+{
+    briteblox_context briteblox;
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    BOOST_CHECK(briteblox_swd_new(&briteblox, 1000000) == NULL);
+
+    struct briteblox_swd *swd = swd_alloc_UT_export(&briteblox);
+    BOOST_REQUIRE(swd != NULL);
+    BOOST_CHECK_EQUAL(0, briteblox_swd_jtag_to_swd(swd));
+    BOOST_CHECK_EQUAL(-666, briteblox_swd_execute(swd, NULL));
+
+    briteblox_swd_free(swd);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
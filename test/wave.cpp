@@ -0,0 +1,88 @@
+/**@file
+@brief Test compiling bitbang waveforms
+
+@author libbriteblox developers
+*/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License           *
+ *   version 2.1 as published by the Free Software Foundation;             *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <briteblox.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(Wave)
+
+BOOST_AUTO_TEST_CASE(Compile)
+{
+    struct briteblox_wave *wave = briteblox_wave_new(0x80);
+    int length;
+
+    BOOST_REQUIRE(wave != NULL);
+    BOOST_CHECK(briteblox_wave_get_samples(wave, &length) == NULL);
+
+    // 1 MHz: one sample per microsecond, edges added out of order
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 0, 0, 3000));
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 0, 1, 1000));
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 7, 0, 2400));
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 1, 1, 5600));
+    BOOST_CHECK_EQUAL(-2, briteblox_wave_add_edge(wave, 8, 1, 0));
+
+    BOOST_CHECK_EQUAL(7, briteblox_wave_compile(wave, 1000000));
+    const unsigned char *samples = briteblox_wave_get_samples(wave, &length);
+    const unsigned char expected[] = { 0x80, 0x81, 0x01, 0x00, 0x00, 0x00, 0x02 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected, expected + sizeof(expected), samples, samples + length);
+
+    // half the rate: pin 0 rises on the sample pin 7 falls on
+    BOOST_CHECK_EQUAL(4, briteblox_wave_compile(wave, 500000));
+    samples = briteblox_wave_get_samples(wave, &length);
+    const unsigned char expected_half[] = { 0x80, 0x01, 0x00, 0x02 };
+    BOOST_CHECK_EQUAL_COLLECTIONS(expected_half, expected_half + sizeof(expected_half), samples, samples + length);
+
+    BOOST_CHECK_EQUAL(-2, briteblox_wave_compile(wave, 0));
+    briteblox_wave_free(wave);
+}
+
+BOOST_AUTO_TEST_CASE(SameTime)
+{
+    struct briteblox_wave *wave = briteblox_wave_new(0x00);
+    int length;
+
+    BOOST_REQUIRE(wave != NULL);
+    BOOST_CHECK_EQUAL(1, briteblox_wave_compile(wave, 1000));
+
+    // edges at the same time apply in the order they were added
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 2, 1, 0));
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 2, 0, 0));
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 3, 1, 0));
+    BOOST_CHECK_EQUAL(1, briteblox_wave_compile(wave, 1000));
+    const unsigned char *samples = briteblox_wave_get_samples(wave, &length);
+    BOOST_CHECK_EQUAL(0x08, samples[0]);
+
+    // beyond INT_MAX samples
+    BOOST_CHECK_EQUAL(0, briteblox_wave_add_edge(wave, 0, 1, 3000000000ULL * 1000000000ULL));
+    BOOST_CHECK_EQUAL(-3, briteblox_wave_compile(wave, 1000));
+
+    briteblox_wave_free(wave);
+}
+
+BOOST_AUTO_TEST_CASE(NoDevice)
+{
+    briteblox_context briteblox;
+    struct briteblox_wave *wave = briteblox_wave_new(0x00);
+
+    BOOST_REQUIRE_EQUAL(0, briteblox_init(&briteblox));
+    BOOST_CHECK_EQUAL(-666, briteblox_wave_play(&briteblox, wave, 1000000, NULL));
+    BOOST_CHECK_EQUAL(-3, briteblox_set_bitbang_rate(&briteblox, 1000000));
+
+    briteblox_wave_free(wave);
+    briteblox_deinit(&briteblox);
+}
+
+BOOST_AUTO_TEST_SUITE_END()